@@ -254,6 +254,8 @@ struct ngx_connection_s {
     unsigned            reusable:1;
     // ־λΪ1ʾӹر
     unsigned            close:1;
+    // ־λΪ1ʾʹûҲҪlast_bufsend_chainHTTP/2END_STREAM
+    unsigned            need_last_buf:1;
 
     // ־λΪ1ʾڽļеݷӵһ
     unsigned            sendfile:1;
@@ -23,6 +23,9 @@ typedef struct ngx_event_s       ngx_event_t;
 typedef struct ngx_event_aio_s   ngx_event_aio_t;
 typedef struct ngx_connection_s  ngx_connection_t;
 
+typedef struct ngx_thread_pool_s  ngx_thread_pool_t;
+typedef struct ngx_thread_task_s  ngx_thread_task_t;
+
 typedef void (*ngx_event_handler_pt)(ngx_event_t *ev);
 typedef void (*ngx_connection_handler_pt)(ngx_connection_t *c);
 
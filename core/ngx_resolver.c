@@ -422,6 +422,7 @@ ngx_resolve_name_locked(ngx_resolver_t *r, ngx_resolver_ctx_t *ctx)
                     ctx->naddrs = naddrs;
                     ctx->addrs = (naddrs == 1) ? &ctx->addr : addrs;
                     ctx->addr = addr;
+                    ctx->valid = rn->valid;
                     next = ctx->next;
 
                     ctx->handler(ctx);
@@ -1120,6 +1121,7 @@ ngx_resolver_process_a(ngx_resolver_t *r, u_char *buf, size_t last,
     u_char               *cname;
     size_t                len;
     uint32_t              hash;
+    time_t                ttl;
     in_addr_t             addr, *addrs;
     ngx_str_t             name;
     ngx_uint_t            qtype, qident, naddrs, a, i, n, start;
@@ -1189,6 +1191,7 @@ ngx_resolver_process_a(ngx_resolver_t *r, u_char *buf, size_t last,
     addrs = NULL;
     cname = NULL;
     qtype = 0;
+    ttl = r->valid;
 
     for (a = 0; a < nan; a++) {
 
@@ -1242,6 +1245,20 @@ ngx_resolver_process_a(ngx_resolver_t *r, u_char *buf, size_t last,
 
             naddrs++;
 
+            /* the answer is cached for the least TTL, up to r->valid */
+
+            if (an->ttl[0] & 0x80) {
+                ttl = 0;
+
+            } else {
+                n = (an->ttl[0] << 24) + (an->ttl[1] << 16)
+                    + (an->ttl[2] << 8) + an->ttl[3];
+
+                if ((time_t) n < ttl) {
+                    ttl = (time_t) n;
+                }
+            }
+
             i += len;
 
         } else if (qtype == NGX_RESOLVE_CNAME) {
@@ -1327,7 +1344,7 @@ ngx_resolver_process_a(ngx_resolver_t *r, u_char *buf, size_t last,
 
         ngx_queue_remove(&rn->queue);
 
-        rn->valid = ngx_time() + r->valid;
+        rn->valid = ngx_time() + ttl;
         rn->expire = ngx_time() + r->expire;
 
         ngx_queue_insert_head(&r->name_expire_queue, &rn->queue);
@@ -1343,6 +1360,7 @@ ngx_resolver_process_a(ngx_resolver_t *r, u_char *buf, size_t last,
              ctx->naddrs = naddrs;
              ctx->addrs = (naddrs == 1) ? &ctx->addr : addrs;
              ctx->addr = addr;
+             ctx->valid = rn->valid;
              next = ctx->next;
 
              ctx->handler(ctx);
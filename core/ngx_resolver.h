@@ -122,6 +122,7 @@ struct ngx_resolver_ctx_s {
     ngx_uint_t                naddrs;
     in_addr_t                *addrs;
     in_addr_t                 addr;
+    time_t                    valid;
 
     /* TODO: DNS peers balancer ctx */
 
@@ -0,0 +1,776 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_thread_pool.h>
+
+
+#if (NGX_THREADS)
+
+
+typedef struct {
+    ngx_array_t               pools;
+} ngx_thread_pool_conf_t;
+
+
+typedef struct {
+    ngx_thread_task_t        *first;
+    ngx_thread_task_t       **last;
+} ngx_thread_pool_queue_t;
+
+#define ngx_thread_pool_queue_init(q)                                         \
+    (q)->first = NULL;                                                        \
+    (q)->last = &(q)->first
+
+
+struct ngx_thread_pool_s {
+    ngx_thread_mutex_t        mtx;
+    ngx_thread_sem_t          sem;
+    ngx_thread_pool_queue_t   queue;
+    ngx_int_t                 waiting;
+
+    ngx_log_t                *log;
+
+    ngx_str_t                 name;
+    ngx_uint_t                threads;
+    ngx_int_t                 max_queue;
+
+    u_char                   *file;
+    ngx_uint_t                line;
+};
+
+
+static ngx_int_t ngx_thread_pool_init(ngx_thread_pool_t *tp, ngx_log_t *log);
+static void ngx_thread_pool_destroy(ngx_thread_pool_t *tp);
+static ngx_int_t ngx_thread_pool_init_notify(ngx_log_t *log);
+static void ngx_thread_pool_notify(ngx_log_t *log);
+
+#if (NGX_WIN32)
+static ngx_thread_value_t __stdcall ngx_thread_pool_cycle(void *data);
+#else
+static ngx_thread_value_t ngx_thread_pool_cycle(void *data);
+#endif
+static void ngx_thread_pool_handler(ngx_event_t *ev);
+
+static char *ngx_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+static void *ngx_thread_pool_create_conf(ngx_cycle_t *cycle);
+static char *ngx_thread_pool_init_conf(ngx_cycle_t *cycle, void *conf);
+
+static ngx_int_t ngx_thread_pool_init_worker(ngx_cycle_t *cycle);
+static void ngx_thread_pool_exit_worker(ngx_cycle_t *cycle);
+
+
+static ngx_command_t  ngx_thread_pool_commands[] = {
+
+    { ngx_string("thread_pool"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE23,
+      ngx_thread_pool,
+      0,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_core_module_t  ngx_thread_pool_module_ctx = {
+    ngx_string("thread_pool"),
+    ngx_thread_pool_create_conf,
+    ngx_thread_pool_init_conf
+};
+
+
+ngx_module_t  ngx_thread_pool_module = {
+    NGX_MODULE_V1,
+    &ngx_thread_pool_module_ctx,           /* module context */
+    ngx_thread_pool_commands,              /* module directives */
+    NGX_CORE_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_thread_pool_init_worker,           /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    ngx_thread_pool_exit_worker,           /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_str_t  ngx_thread_pool_default = ngx_string("default");
+
+static ngx_uint_t               ngx_thread_pool_task_id;
+static ngx_thread_mutex_t       ngx_thread_pool_done_mtx;
+static ngx_thread_pool_queue_t  ngx_thread_pool_done;
+
+/*
+ * a thread which completes a task sends a datagram to the notification
+ * socket of the worker, unless one is already pending, and the worker
+ * runs the completion handlers when the socket becomes readable
+ */
+
+static ngx_connection_t        *ngx_thread_pool_notify_conn;
+static struct sockaddr_in       ngx_thread_pool_notify_addr;
+static ngx_uint_t               ngx_thread_pool_notified;
+
+
+static ngx_int_t
+ngx_thread_pool_init(ngx_thread_pool_t *tp, ngx_log_t *log)
+{
+    ngx_err_t       err;
+    ngx_uint_t      n;
+#if (NGX_WIN32)
+    ngx_tid_t       tid;
+#else
+    pthread_t       tid;
+    pthread_attr_t  attr;
+#endif
+
+    ngx_thread_pool_queue_init(&tp->queue);
+
+    if (ngx_thread_mutex_create(&tp->mtx, log) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_thread_sem_create(&tp->sem, log) != NGX_OK) {
+        ngx_thread_mutex_destroy(&tp->mtx);
+        return NGX_ERROR;
+    }
+
+    tp->log = log;
+
+#if (NGX_WIN32)
+
+    for (n = 0; n < tp->threads; n++) {
+        err = ngx_create_thread(&tid, ngx_thread_pool_cycle, tp, log);
+        if (err) {
+            return NGX_ERROR;
+        }
+    }
+
+#else
+
+    /* the worker threads of "worker_threads" are not used for the pools */
+
+    err = pthread_attr_init(&attr);
+    if (err) {
+        ngx_log_error(NGX_LOG_ALERT, log, err, "pthread_attr_init() failed");
+        return NGX_ERROR;
+    }
+
+    err = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (err) {
+        ngx_log_error(NGX_LOG_ALERT, log, err,
+                      "pthread_attr_setdetachstate() failed");
+        return NGX_ERROR;
+    }
+
+    for (n = 0; n < tp->threads; n++) {
+        err = pthread_create(&tid, &attr, ngx_thread_pool_cycle, tp);
+        if (err) {
+            ngx_log_error(NGX_LOG_ALERT, log, err,
+                          "pthread_create() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    (void) pthread_attr_destroy(&attr);
+
+#endif
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_thread_pool_destroy(ngx_thread_pool_t *tp)
+{
+    ngx_uint_t  n;
+
+    /*
+     * a thread exits when it is woken up and finds the queue empty,
+     * the tasks still queued are done before
+     */
+
+    for (n = 0; n < tp->threads; n++) {
+        (void) ngx_thread_sem_post(&tp->sem, tp->log);
+    }
+}
+
+
+ngx_thread_task_t *
+ngx_thread_task_alloc(ngx_pool_t *pool, size_t size)
+{
+    ngx_thread_task_t  *task;
+
+    task = ngx_pcalloc(pool, sizeof(ngx_thread_task_t) + size);
+    if (task == NULL) {
+        return NULL;
+    }
+
+    task->ctx = task + 1;
+
+    return task;
+}
+
+
+ngx_int_t
+ngx_thread_task_post(ngx_thread_pool_t *tp, ngx_thread_task_t *task)
+{
+    if (task->event.active) {
+        ngx_log_error(NGX_LOG_ALERT, tp->log, 0,
+                      "task #%ui already active", task->id);
+        return NGX_ERROR;
+    }
+
+    /*
+     * the notification socket is created on the first task, as the pools
+     * are initialized before the connections of the worker
+     */
+
+    if (ngx_thread_pool_notify_conn == NULL
+        && ngx_thread_pool_init_notify(tp->log) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_thread_mutex_lock(&tp->mtx);
+
+    if (tp->waiting >= tp->max_queue) {
+        ngx_thread_mutex_unlock(&tp->mtx);
+
+        ngx_log_error(NGX_LOG_ERR, tp->log, 0,
+                      "thread pool \"%V\" queue overflow: %i tasks waiting",
+                      &tp->name, tp->waiting);
+        return NGX_ERROR;
+    }
+
+    task->event.active = 1;
+
+    task->id = ngx_thread_pool_task_id++;
+    task->next = NULL;
+
+    *tp->queue.last = task;
+    tp->queue.last = &task->next;
+
+    tp->waiting++;
+
+    ngx_thread_mutex_unlock(&tp->mtx);
+
+    if (ngx_thread_sem_post(&tp->sem, tp->log) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, tp->log, 0,
+                   "task #%ui added to thread pool \"%V\"",
+                   task->id, &tp->name);
+
+    return NGX_OK;
+}
+
+
+#if (NGX_WIN32)
+static ngx_thread_value_t __stdcall
+#else
+static ngx_thread_value_t
+#endif
+ngx_thread_pool_cycle(void *data)
+{
+    ngx_thread_pool_t *tp = data;
+
+    ngx_thread_task_t  *task;
+
+#if !(NGX_WIN32)
+    sigset_t            set;
+
+    /* the signals are handled by the worker */
+
+    sigfillset(&set);
+
+    sigdelset(&set, SIGILL);
+    sigdelset(&set, SIGFPE);
+    sigdelset(&set, SIGSEGV);
+    sigdelset(&set, SIGBUS);
+
+    (void) pthread_sigmask(SIG_BLOCK, &set, NULL);
+#endif
+
+    for ( ;; ) {
+
+        if (ngx_thread_sem_wait(&tp->sem, tp->log) != NGX_OK) {
+            return 0;
+        }
+
+        ngx_thread_mutex_lock(&tp->mtx);
+
+        task = tp->queue.first;
+
+        if (task) {
+            tp->waiting--;
+
+            tp->queue.first = task->next;
+
+            if (tp->queue.first == NULL) {
+                tp->queue.last = &tp->queue.first;
+            }
+        }
+
+        ngx_thread_mutex_unlock(&tp->mtx);
+
+        if (task == NULL) {
+            return 0;
+        }
+
+        task->handler(task->ctx, tp->log);
+
+        task->next = NULL;
+
+        ngx_thread_mutex_lock(&ngx_thread_pool_done_mtx);
+
+        *ngx_thread_pool_done.last = task;
+        ngx_thread_pool_done.last = &task->next;
+
+        /* the socket is closed under the lock when the worker exits */
+
+        if (!ngx_thread_pool_notified && ngx_thread_pool_notify_conn) {
+            ngx_thread_pool_notified = 1;
+            ngx_thread_pool_notify(tp->log);
+        }
+
+        ngx_thread_mutex_unlock(&ngx_thread_pool_done_mtx);
+    }
+}
+
+
+static void
+ngx_thread_pool_notify(ngx_log_t *log)
+{
+    ssize_t  n;
+
+    n = sendto(ngx_thread_pool_notify_conn->fd, "", 1, 0,
+               (struct sockaddr *) &ngx_thread_pool_notify_addr,
+               sizeof(struct sockaddr_in));
+
+    if (n == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_socket_errno,
+                      "sendto() to thread pool notification socket failed");
+    }
+}
+
+
+static void
+ngx_thread_pool_handler(ngx_event_t *ev)
+{
+    u_char              buf[16];
+    ssize_t             n;
+    ngx_err_t           err;
+    ngx_event_t        *event;
+    ngx_connection_t   *c;
+    ngx_thread_task_t  *task;
+
+    c = ev->data;
+
+    /*
+     * the notifications are read before the completed tasks are taken,
+     * so a task completed meanwhile is notified once again
+     */
+
+    for ( ;; ) {
+        n = recv(c->fd, (char *) buf, sizeof(buf), 0);
+
+        if (n >= 0) {
+            continue;
+        }
+
+        err = ngx_socket_errno;
+
+        if (err != NGX_EAGAIN) {
+            ngx_log_error(NGX_LOG_ALERT, ev->log, err,
+                          "recv() from thread pool notification socket failed");
+        }
+
+        break;
+    }
+
+    ev->ready = 0;
+
+    if (ngx_handle_read_event(ev, 0) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ALERT, ev->log, 0,
+                      "could not add thread pool notification event");
+    }
+
+    ngx_thread_mutex_lock(&ngx_thread_pool_done_mtx);
+
+    task = ngx_thread_pool_done.first;
+    ngx_thread_pool_queue_init(&ngx_thread_pool_done);
+
+    ngx_thread_pool_notified = 0;
+
+    ngx_thread_mutex_unlock(&ngx_thread_pool_done_mtx);
+
+    while (task) {
+        ngx_log_debug1(NGX_LOG_DEBUG_CORE, ev->log, 0,
+                       "run completion handler for task #%ui", task->id);
+
+        event = &task->event;
+        task = task->next;
+
+        event->complete = 1;
+        event->active = 0;
+
+        event->handler(event);
+    }
+}
+
+
+static ngx_int_t
+ngx_thread_pool_init_notify(ngx_log_t *log)
+{
+    socklen_t          len;
+    ngx_int_t          event;
+    ngx_socket_t       s;
+    ngx_event_t       *rev;
+    ngx_connection_t  *c;
+
+    s = ngx_socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (s == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_socket_errno,
+                      ngx_socket_n " failed");
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(&ngx_thread_pool_notify_addr, sizeof(struct sockaddr_in));
+
+    ngx_thread_pool_notify_addr.sin_family = AF_INET;
+    ngx_thread_pool_notify_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    len = sizeof(struct sockaddr_in);
+
+    if (bind(s, (struct sockaddr *) &ngx_thread_pool_notify_addr, len) == -1
+        || getsockname(s, (struct sockaddr *) &ngx_thread_pool_notify_addr,
+                       &len)
+           == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_socket_errno,
+                      "bind() of thread pool notification socket failed");
+        goto failed;
+    }
+
+    if (ngx_nonblocking(s) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_socket_errno,
+                      ngx_nonblocking_n " failed");
+        goto failed;
+    }
+
+    c = ngx_get_connection(s, log);
+
+    if (c == NULL) {
+        goto failed;
+    }
+
+    rev = c->read;
+
+    rev->handler = ngx_thread_pool_handler;
+    rev->log = log;
+
+    rev->lock = &c->lock;
+    rev->own_lock = &c->lock;
+
+    c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+
+    event = (ngx_event_flags & NGX_USE_CLEAR_EVENT) ?
+                /* kqueue, epoll */                 NGX_CLEAR_EVENT:
+                /* select, poll, /dev/poll */       NGX_LEVEL_EVENT;
+
+    if (ngx_add_event(rev, NGX_READ_EVENT, event) != NGX_OK) {
+        ngx_free_connection(c);
+        goto failed;
+    }
+
+    ngx_thread_pool_notify_conn = c;
+
+    return NGX_OK;
+
+failed:
+
+    if (ngx_close_socket(s) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_socket_errno,
+                      ngx_close_socket_n " failed");
+    }
+
+    return NGX_ERROR;
+}
+
+
+static void *
+ngx_thread_pool_create_conf(ngx_cycle_t *cycle)
+{
+    ngx_thread_pool_conf_t  *tcf;
+
+    tcf = ngx_pcalloc(cycle->pool, sizeof(ngx_thread_pool_conf_t));
+    if (tcf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&tcf->pools, cycle->pool, 4,
+                       sizeof(ngx_thread_pool_t *))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return tcf;
+}
+
+
+static char *
+ngx_thread_pool_init_conf(ngx_cycle_t *cycle, void *conf)
+{
+    ngx_thread_pool_conf_t *tcf = conf;
+
+    ngx_uint_t           i;
+    ngx_thread_pool_t  **tpp;
+
+    tpp = tcf->pools.elts;
+
+    for (i = 0; i < tcf->pools.nelts; i++) {
+
+        if (tpp[i]->threads) {
+            continue;
+        }
+
+        if (tpp[i]->name.len == ngx_thread_pool_default.len
+            && ngx_strncmp(tpp[i]->name.data, ngx_thread_pool_default.data,
+                           ngx_thread_pool_default.len)
+               == 0)
+        {
+            tpp[i]->threads = 32;
+            tpp[i]->max_queue = 65536;
+            continue;
+        }
+
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "unknown thread pool \"%V\" in %s:%ui",
+                      &tpp[i]->name, tpp[i]->file, tpp[i]->line);
+
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_str_t          *value;
+    ngx_uint_t          i;
+    ngx_thread_pool_t  *tp;
+
+    value = cf->args->elts;
+
+    tp = ngx_thread_pool_add(cf, &value[1]);
+
+    if (tp == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (tp->threads) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate thread pool \"%V\"", &tp->name);
+        return NGX_CONF_ERROR;
+    }
+
+    tp->max_queue = 65536;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "threads=", 8) == 0) {
+
+            tp->threads = ngx_atoi(value[i].data + 8, value[i].len - 8);
+
+            if (tp->threads == (ngx_uint_t) NGX_ERROR || tp->threads == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid threads value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "max_queue=", 10) == 0) {
+
+            tp->max_queue = ngx_atoi(value[i].data + 10, value[i].len - 10);
+
+            if (tp->max_queue == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid max_queue value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (tp->threads == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"threads\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+ngx_thread_pool_t *
+ngx_thread_pool_add(ngx_conf_t *cf, ngx_str_t *name)
+{
+    ngx_thread_pool_t       *tp, **tpp;
+    ngx_thread_pool_conf_t  *tcf;
+
+    if (name == NULL) {
+        name = &ngx_thread_pool_default;
+    }
+
+    tp = ngx_thread_pool_get(cf->cycle, name);
+
+    if (tp) {
+        return tp;
+    }
+
+    tp = ngx_pcalloc(cf->pool, sizeof(ngx_thread_pool_t));
+    if (tp == NULL) {
+        return NULL;
+    }
+
+    tp->name = *name;
+    tp->file = cf->conf_file->file.name.data;
+    tp->line = cf->conf_file->line;
+
+    tcf = (ngx_thread_pool_conf_t *) ngx_get_conf(cf->cycle->conf_ctx,
+                                                  ngx_thread_pool_module);
+
+    tpp = ngx_array_push(&tcf->pools);
+    if (tpp == NULL) {
+        return NULL;
+    }
+
+    *tpp = tp;
+
+    return tp;
+}
+
+
+ngx_thread_pool_t *
+ngx_thread_pool_get(ngx_cycle_t *cycle, ngx_str_t *name)
+{
+    ngx_uint_t                i;
+    ngx_thread_pool_t       **tpp;
+    ngx_thread_pool_conf_t   *tcf;
+
+    tcf = (ngx_thread_pool_conf_t *) ngx_get_conf(cycle->conf_ctx,
+                                                  ngx_thread_pool_module);
+
+    tpp = tcf->pools.elts;
+
+    for (i = 0; i < tcf->pools.nelts; i++) {
+
+        if (tpp[i]->name.len == name->len
+            && ngx_strncmp(tpp[i]->name.data, name->data, name->len) == 0)
+        {
+            return tpp[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+static ngx_int_t
+ngx_thread_pool_init_worker(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                i;
+    ngx_thread_pool_t       **tpp;
+    ngx_thread_pool_conf_t   *tcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    tcf = (ngx_thread_pool_conf_t *) ngx_get_conf(cycle->conf_ctx,
+                                                  ngx_thread_pool_module);
+
+    if (tcf == NULL || tcf->pools.nelts == 0) {
+        return NGX_OK;
+    }
+
+    ngx_thread_pool_queue_init(&ngx_thread_pool_done);
+
+    if (ngx_thread_mutex_create(&ngx_thread_pool_done_mtx, cycle->log)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    tpp = tcf->pools.elts;
+
+    for (i = 0; i < tcf->pools.nelts; i++) {
+        if (ngx_thread_pool_init(tpp[i], cycle->log) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_thread_pool_exit_worker(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                i;
+    ngx_thread_pool_t       **tpp;
+    ngx_thread_pool_conf_t   *tcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return;
+    }
+
+    tcf = (ngx_thread_pool_conf_t *) ngx_get_conf(cycle->conf_ctx,
+                                                  ngx_thread_pool_module);
+
+    if (tcf == NULL) {
+        return;
+    }
+
+    tpp = tcf->pools.elts;
+
+    for (i = 0; i < tcf->pools.nelts; i++) {
+        ngx_thread_pool_destroy(tpp[i]);
+    }
+
+    if (ngx_thread_pool_notify_conn) {
+        ngx_thread_mutex_lock(&ngx_thread_pool_done_mtx);
+
+        ngx_close_connection(ngx_thread_pool_notify_conn);
+        ngx_thread_pool_notify_conn = NULL;
+
+        ngx_thread_mutex_unlock(&ngx_thread_pool_done_mtx);
+    }
+}
+
+
+#endif
@@ -93,6 +93,9 @@ struct ngx_event_s {
     // ־λΪ1ʾ¼ڶʱ
     unsigned         timer_set:1;
 
+    /* the exiting worker does not wait for the timer */
+    unsigned         cancelable:1;
+
     // ־λdelayedΪ1ʾҪӳٴ¼ٹ
     unsigned         delayed:1;
 
@@ -600,6 +603,7 @@ extern ngx_atomic_t  *ngx_stat_requests;
 extern ngx_atomic_t  *ngx_stat_active;
 extern ngx_atomic_t  *ngx_stat_reading;
 extern ngx_atomic_t  *ngx_stat_writing;
+extern ngx_atomic_t  *ngx_stat_tunnels;
 
 #endif
 
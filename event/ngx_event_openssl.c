@@ -7,19 +7,52 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_event.h>
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif
+
+
+#ifdef OPENSSL_NO_SHA256
+#define ngx_ssl_session_ticket_md  EVP_sha1
+#else
+#define ngx_ssl_session_ticket_md  EVP_sha256
+#endif
+
 
+#if (NGX_THREADS)
 
 typedef struct {
-    ngx_uint_t  engine;   /* unsigned  engine:1; */
-} ngx_openssl_conf_t;
+    ngx_ssl_conn_t             *ssl;
+    int                         n;
+    int                         sslerr;
+    ngx_err_t                   err;
+    u_long                      error;
+    ngx_msec_t                  start;
+    ngx_uint_t                  done;    /* unsigned  done:1; */
+} ngx_ssl_handshake_ctx_t;
+
+#endif
 
 
 static int ngx_http_ssl_verify_callback(int ok, X509_STORE_CTX *x509_store);
 static void ngx_ssl_info_callback(const ngx_ssl_conn_t *ssl_conn, int where,
     int ret);
+static ngx_int_t ngx_ssl_handshake_result(ngx_connection_t *c, int n,
+    int sslerr, ngx_err_t err);
+#if (NGX_THREADS)
+static ngx_int_t ngx_ssl_init_locks(ngx_log_t *log);
+static void ngx_ssl_locking_callback(int mode, int n, const char *file,
+    int line);
+static ngx_int_t ngx_ssl_thread_handshake(ngx_connection_t *c);
+static void ngx_ssl_handshake_thread_handler(void *data, ngx_log_t *log);
+static void ngx_ssl_handshake_thread_event_handler(ngx_event_t *ev);
+#endif
 static void ngx_ssl_handshake_handler(ngx_event_t *ev);
 static ngx_int_t ngx_ssl_handle_recv(ngx_connection_t *c, int n);
 static void ngx_ssl_write_handler(ngx_event_t *wev);
+static void ngx_ssl_grow_record_size(ngx_connection_t *c);
+static ngx_int_t ngx_ssl_bulk_init(ngx_connection_t *c);
+static ngx_int_t ngx_ssl_flush(ngx_connection_t *c);
 static void ngx_ssl_read_handler(ngx_event_t *rev);
 static void ngx_ssl_shutdown_handler(ngx_event_t *ev);
 static void ngx_ssl_connection_error(ngx_connection_t *c, int sslerr,
@@ -33,10 +66,15 @@ static int ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn,
 static ngx_ssl_session_t *ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
     u_char *id, int len, int *copy);
 static void ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess);
-static void ngx_ssl_expire_sessions(ngx_ssl_session_cache_t *cache,
-    ngx_slab_pool_t *shpool, ngx_uint_t n);
+static void ngx_ssl_expire_sessions(ngx_ssl_session_shard_t *shard,
+    ngx_uint_t n);
 static void ngx_ssl_session_rbtree_insert_value(ngx_rbtree_node_t *temp,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+#ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
+static int ngx_ssl_session_ticket_key_callback(ngx_ssl_conn_t *ssl_conn,
+    unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ectx,
+    HMAC_CTX *hctx, int enc);
+#endif
 
 static void *ngx_openssl_create_conf(ngx_cycle_t *cycle);
 static char *ngx_openssl_engine(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
@@ -70,7 +108,7 @@ ngx_module_t  ngx_openssl_module = {
     NGX_CORE_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_ssl_stapling_init_process,         /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -94,6 +132,18 @@ static long  ngx_ssl_protocols[] = {
 int  ngx_ssl_connection_index;
 int  ngx_ssl_server_conf_index;
 int  ngx_ssl_session_cache_index;
+int  ngx_ssl_ticket_keys_index;
+int  ngx_ssl_stapling_index;
+
+
+#if (NGX_THREADS)
+
+static ngx_thread_mutex_t  *ngx_ssl_locks;
+
+/* the handshakes of the worker posted to the thread pools */
+static ngx_uint_t           ngx_ssl_handshake_tasks;
+
+#endif
 
 
 ngx_int_t
@@ -131,10 +181,76 @@ ngx_ssl_init(ngx_log_t *log)
         return NGX_ERROR;
     }
 
+    ngx_ssl_ticket_keys_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL,
+                                                         NULL);
+    if (ngx_ssl_ticket_keys_index == -1) {
+        ngx_ssl_error(NGX_LOG_ALERT, log, 0,
+                      "SSL_CTX_get_ex_new_index() failed");
+        return NGX_ERROR;
+    }
+
+    ngx_ssl_stapling_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL,
+                                                      NULL);
+    if (ngx_ssl_stapling_index == -1) {
+        ngx_ssl_error(NGX_LOG_ALERT, log, 0,
+                      "SSL_CTX_get_ex_new_index() failed");
+        return NGX_ERROR;
+    }
+
+#if (NGX_THREADS)
+
+    if (ngx_ssl_init_locks(log) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+#endif
+
+    return NGX_OK;
+}
+
+
+#if (NGX_THREADS)
+
+/* OpenSSL is called from the thread pools for the asynchronous handshakes */
+
+static ngx_int_t
+ngx_ssl_init_locks(ngx_log_t *log)
+{
+    int  i, n;
+
+    n = CRYPTO_num_locks();
+
+    ngx_ssl_locks = ngx_alloc(n * sizeof(ngx_thread_mutex_t), log);
+    if (ngx_ssl_locks == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (ngx_thread_mutex_create(&ngx_ssl_locks[i], log) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    CRYPTO_set_locking_callback(ngx_ssl_locking_callback);
+
     return NGX_OK;
 }
 
 
+static void
+ngx_ssl_locking_callback(int mode, int n, const char *file, int line)
+{
+    if (mode & CRYPTO_LOCK) {
+        ngx_thread_mutex_lock(&ngx_ssl_locks[n]);
+
+    } else {
+        ngx_thread_mutex_unlock(&ngx_ssl_locks[n]);
+    }
+}
+
+#endif
+
+
 ngx_int_t
 ngx_ssl_create(ngx_ssl_t *ssl, ngx_uint_t protocols, void *data)
 {
@@ -178,6 +294,18 @@ ngx_ssl_create(ngx_ssl_t *ssl, ngx_uint_t protocols, void *data)
 
     SSL_CTX_set_read_ahead(ssl->ctx, 1);
 
+#ifdef SSL_MODE_RELEASE_BUFFERS
+
+    /*
+     * OpenSSL frees its read and write buffers as soon as they are empty,
+     * so an idle keepalive connection does not hold them: about 34K are
+     * allocated, and about 15K of them are resident after a small response
+     */
+
+    SSL_CTX_set_mode(ssl->ctx, SSL_MODE_RELEASE_BUFFERS);
+
+#endif
+
     SSL_CTX_set_info_callback(ssl->ctx, ngx_ssl_info_callback);
 
     return NGX_OK;
@@ -441,7 +569,12 @@ ngx_ssl_dhparam(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *file)
         return NGX_OK;
     }
 
-    if (ngx_conf_full_name(cf->cycle, file, 1) != NGX_OK) {
+    /*
+     * cf is NULL for the contexts created at run time for the certificates
+     * loaded on demand, the name has been already made full then
+     */
+
+    if (cf && ngx_conf_full_name(cf->cycle, file, 1) != NGX_OK) {
         return NGX_ERROR;
     }
 
@@ -519,6 +652,7 @@ ngx_ssl_create_connection(ngx_ssl_t *ssl, ngx_connection_t *c, ngx_uint_t flags)
     }
 
     sc->buffer = ((flags & NGX_SSL_BUFFER) != 0);
+    sc->buffer_size = ssl->buffer_size ? ssl->buffer_size : NGX_SSL_BUFSIZE;
 
     sc->connection = SSL_new(ssl->ctx);
 
@@ -537,6 +671,13 @@ ngx_ssl_create_connection(ngx_ssl_t *ssl, ngx_connection_t *c, ngx_uint_t flags)
 
     } else {
         SSL_set_accept_state(sc->connection);
+
+        sc->record_start_size = ssl->record_start_size;
+        sc->record_idle_timeout = ssl->record_idle_timeout;
+
+#if (NGX_THREADS)
+        sc->thread_pool = ssl->thread_pool;
+#endif
     }
 
     if (SSL_set_ex_data(sc->connection, ngx_ssl_connection_index, c) == 0) {
@@ -572,10 +713,33 @@ ngx_ssl_handshake(ngx_connection_t *c)
 
     ngx_ssl_clear_error(c->log);
 
+#if (NGX_THREADS)
+
+    if (c->ssl->thread_pool) {
+        return ngx_ssl_thread_handshake(c);
+    }
+
+#endif
+
     n = SSL_do_handshake(c->ssl->connection);
 
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_do_handshake: %d", n);
 
+    sslerr = (n == 1) ? 0 : SSL_get_error(c->ssl->connection, n);
+
+    err = (sslerr == SSL_ERROR_SYSCALL) ? ngx_errno : 0;
+
+    return ngx_ssl_handshake_result(c, n, sslerr, err);
+}
+
+
+static ngx_int_t
+ngx_ssl_handshake_result(ngx_connection_t *c, int n, int sslerr,
+    ngx_err_t err)
+{
+    ngx_shm_zone_t           *shm_zone;
+    ngx_ssl_session_cache_t  *cache;
+
     if (n == 1) {
 
         if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
@@ -635,6 +799,18 @@ ngx_ssl_handshake(ngx_connection_t *c)
 
         c->ssl->handshaked = 1;
 
+        shm_zone = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(c->ssl->connection),
+                                       ngx_ssl_session_cache_index);
+        if (shm_zone) {
+            cache = shm_zone->data;
+
+            (void) ngx_atomic_fetch_add(&cache->handshakes, 1);
+
+            if (SSL_session_reused(c->ssl->connection)) {
+                (void) ngx_atomic_fetch_add(&cache->reused, 1);
+            }
+        }
+
         c->recv = ngx_ssl_recv;
         c->send = ngx_ssl_write;
         c->recv_chain = ngx_ssl_recv_chain;
@@ -648,8 +824,6 @@ ngx_ssl_handshake(ngx_connection_t *c)
         return NGX_OK;
     }
 
-    sslerr = SSL_get_error(c->ssl->connection, n);
-
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_get_error: %d", sslerr);
 
     if (sslerr == SSL_ERROR_WANT_READ) {
@@ -676,8 +850,6 @@ ngx_ssl_handshake(ngx_connection_t *c)
         return NGX_AGAIN;
     }
 
-    err = (sslerr == SSL_ERROR_SYSCALL) ? ngx_errno : 0;
-
     c->ssl->no_wait_shutdown = 1;
     c->ssl->no_send_shutdown = 1;
     c->read->eof = 1;
@@ -697,6 +869,135 @@ ngx_ssl_handshake(ngx_connection_t *c)
 }
 
 
+#if (NGX_THREADS)
+
+/*
+ * the asynchronous handshake: SSL_do_handshake() with its private key
+ * operations is run in a thread of the pool, the connection events are
+ * disabled meanwhile, and the result is handled in the event loop
+ * as if SSL_do_handshake() was just called there
+ */
+
+static ngx_int_t
+ngx_ssl_thread_handshake(ngx_connection_t *c)
+{
+    ngx_thread_task_t        *task;
+    ngx_ssl_handshake_ctx_t  *ctx;
+
+    task = c->ssl->handshake_task;
+
+    if (task == NULL) {
+        task = ngx_thread_task_alloc(c->pool, sizeof(ngx_ssl_handshake_ctx_t));
+        if (task == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx = task->ctx;
+        ctx->ssl = c->ssl->connection;
+
+        task->handler = ngx_ssl_handshake_thread_handler;
+        task->event.data = c;
+        task->event.handler = ngx_ssl_handshake_thread_event_handler;
+        task->event.log = c->log;
+
+        c->ssl->handshake_task = task;
+    }
+
+    ctx = task->ctx;
+
+    if (task->event.active) {
+        return NGX_AGAIN;
+    }
+
+    if (ctx->done) {
+        ctx->done = 0;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "SSL_do_handshake: %d in thread", ctx->n);
+
+        if (ctx->error) {
+            /* the error queue of OpenSSL is per thread */
+            ERR_put_error(ERR_GET_LIB(ctx->error), ERR_GET_FUNC(ctx->error),
+                          ERR_GET_REASON(ctx->error), __FILE__, __LINE__);
+        }
+
+        return ngx_ssl_handshake_result(c, ctx->n, ctx->sslerr, ctx->err);
+    }
+
+    if (c->read->active) {
+        if (ngx_del_event(c->read, NGX_READ_EVENT, 0) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (c->write->active) {
+        if (ngx_del_event(c->write, NGX_WRITE_EVENT, 0) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    c->read->handler = ngx_ssl_handshake_handler;
+    c->write->handler = ngx_ssl_handshake_handler;
+
+    ctx->start = ngx_current_msec;
+
+    if (ngx_thread_task_post(c->ssl->thread_pool, task) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_ssl_handshake_tasks++;
+
+    return NGX_AGAIN;
+}
+
+
+static void
+ngx_ssl_handshake_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_ssl_handshake_ctx_t  *ctx = data;
+
+    ERR_clear_error();
+
+    ctx->n = SSL_do_handshake(ctx->ssl);
+
+    ctx->sslerr = (ctx->n == 1) ? 0 : SSL_get_error(ctx->ssl, ctx->n);
+    ctx->err = (ctx->sslerr == SSL_ERROR_SYSCALL) ? ngx_errno : 0;
+    ctx->error = ERR_peek_error();
+
+    ERR_clear_error();
+
+    ctx->done = 1;
+}
+
+
+static void
+ngx_ssl_handshake_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_connection_t         *c;
+    ngx_ssl_handshake_ctx_t  *ctx;
+
+    c = ev->data;
+    ctx = c->ssl->handshake_task->ctx;
+
+    ngx_ssl_handshake_tasks--;
+
+    c->ssl->handshake_time += ngx_current_msec - ctx->start;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "SSL handshake thread done: %M",
+                   ngx_current_msec - ctx->start);
+
+    /*
+     * the read handler is either ngx_ssl_handshake_handler(), or
+     * ngx_ssl_shutdown_handler() if the connection was closed meanwhile
+     */
+
+    c->read->handler(c->read);
+}
+
+#endif
+
+
 static void
 ngx_ssl_handshake_handler(ngx_event_t *ev)
 {
@@ -708,6 +1009,14 @@ ngx_ssl_handshake_handler(ngx_event_t *ev)
                    "SSL handshake handler: %d", ev->write);
 
     if (ev->timedout) {
+
+#if (NGX_THREADS)
+        if (c->ssl->handshake_task && c->ssl->handshake_task->event.active) {
+            /* the timeout is handled when the thread is done */
+            return;
+        }
+#endif
+
         c->ssl->handler(c);
         return;
     }
@@ -952,10 +1261,39 @@ ngx_chain_t *
 ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 {
     int          n;
+    u_char      *end;
     ngx_uint_t   flush;
     ssize_t      send, size;
     ngx_buf_t   *buf;
 
+    /*
+     * the first records of a response and the records after an idle
+     * period are small enough to fit in the first TCP segments, so
+     * the client may decrypt them at once, every next record is twice
+     * bigger up to the full NGX_SSL_BUFSIZE record for the bulk transfer
+     */
+
+    if (c->ssl->record_start_size
+        && (c->ssl->record_size == 0
+            || ngx_current_msec - c->ssl->record_time
+               > c->ssl->record_idle_timeout))
+    {
+        c->ssl->record_size = c->ssl->record_start_size;
+    }
+
+    /* the records encrypted by the previous call are sent first */
+
+    if (c->ssl->bulk) {
+        switch (ngx_ssl_flush(c)) {
+
+        case NGX_ERROR:
+            return NGX_CHAIN_ERROR;
+
+        case NGX_AGAIN:
+            return in;
+        }
+    }
+
     if (!c->ssl->buffer) {
 
         while (in) {
@@ -964,7 +1302,13 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
                 continue;
             }
 
-            n = ngx_ssl_write(c, in->buf->pos, in->buf->last - in->buf->pos);
+            size = in->buf->last - in->buf->pos;
+
+            if (c->ssl->record_size && size > (ssize_t) c->ssl->record_size) {
+                size = c->ssl->record_size;
+            }
+
+            n = ngx_ssl_write(c, in->buf->pos, size);
 
             if (n == NGX_ERROR) {
                 return NGX_CHAIN_ERROR;
@@ -977,6 +1321,8 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 
             in->buf->pos += n;
 
+            ngx_ssl_grow_record_size(c);
+
             if (in->buf->pos == in->buf->last) {
                 in = in->next;
             }
@@ -995,7 +1341,7 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
     buf = c->ssl->buf;
 
     if (buf == NULL) {
-        buf = ngx_create_temp_buf(c->pool, NGX_SSL_BUFSIZE);
+        buf = ngx_create_temp_buf(c->pool, c->ssl->buffer_size);
         if (buf == NULL) {
             return NGX_CHAIN_ERROR;
         }
@@ -1004,14 +1350,20 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
     }
 
     if (buf->start == NULL) {
-        buf->start = ngx_palloc(c->pool, NGX_SSL_BUFSIZE);
+        buf->start = ngx_palloc(c->pool, c->ssl->buffer_size);
         if (buf->start == NULL) {
             return NGX_CHAIN_ERROR;
         }
 
         buf->pos = buf->start;
         buf->last = buf->start;
-        buf->end = buf->start + NGX_SSL_BUFSIZE;
+        buf->end = buf->start + c->ssl->buffer_size;
+    }
+
+    if (c->ssl->buffer_size > NGX_SSL_BUFSIZE && !c->ssl->bulk) {
+        if (ngx_ssl_bulk_init(c) != NGX_OK) {
+            return NGX_CHAIN_ERROR;
+        }
     }
 
     send = 0;
@@ -1019,7 +1371,16 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 
     for ( ;; ) {
 
-        while (in && buf->last < buf->end && send < limit) {
+        end = buf->end;
+
+        if (c->ssl->record_size
+            && c->ssl->record_size < NGX_SSL_BUFSIZE
+            && end - buf->pos > (ssize_t) c->ssl->record_size)
+        {
+            end = buf->pos + c->ssl->record_size;
+        }
+
+        while (in && buf->last < end && send < limit) {
             if (in->buf->last_buf || in->buf->flush) {
                 flush = 1;
             }
@@ -1031,8 +1392,8 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 
             size = in->buf->last - in->buf->pos;
 
-            if (size > buf->end - buf->last) {
-                size = buf->end - buf->last;
+            if (size > end - buf->last) {
+                size = end - buf->last;
             }
 
             if (send + size > limit) {
@@ -1056,7 +1417,18 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 
         size = buf->last - buf->pos;
 
-        if (!flush && buf->last < buf->end && c->ssl->buffer) {
+        if (size == 0) {
+
+            /*
+             * nothing to encrypt, the records collected by the buffering
+             * BIO were already flushed above
+             */
+
+            c->buffered &= ~NGX_SSL_BUFFERED;
+            return in;
+        }
+
+        if (!flush && buf->last < end && c->ssl->buffer) {
             break;
         }
 
@@ -1074,6 +1446,8 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
         buf->pos += n;
         c->sent += n;
 
+        ngx_ssl_grow_record_size(c);
+
         if (n < size) {
             break;
         }
@@ -1088,7 +1462,9 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
         }
     }
 
-    if (buf->pos < buf->last) {
+    if (buf->pos < buf->last
+        || (c->ssl->bulk && BIO_wpending(SSL_get_wbio(c->ssl->connection))))
+    {
         c->buffered |= NGX_SSL_BUFFERED;
 
     } else {
@@ -1099,45 +1475,153 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 }
 
 
-ssize_t
-ngx_ssl_write(ngx_connection_t *c, u_char *data, size_t size)
+/*
+ * with the send buffer bigger than a record SSL_write() encrypts several
+ * records at once, a buffering BIO collects them to send with one syscall
+ * instead of one per record; the socket BIO is shared with the read side,
+ * the buffering BIO is removed with the send buffer on an idle connection
+ */
+
+static ngx_int_t
+ngx_ssl_bulk_init(ngx_connection_t *c)
 {
-    int        n, sslerr;
-    ngx_err_t  err;
+    BIO     *bio, *sbio;
+    size_t   size;
 
-    ngx_ssl_clear_error(c->log);
+    sbio = SSL_get_wbio(c->ssl->connection);
 
-    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL to write: %d", size);
+    bio = BIO_new(BIO_f_buffer());
+    if (bio == NULL) {
+        ngx_ssl_error(NGX_LOG_ALERT, c->log, 0, "BIO_new() failed");
+        return NGX_ERROR;
+    }
 
-    n = SSL_write(c->ssl->connection, data, size);
+    /* the encrypted records of the whole buffer fit in */
 
-    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_write: %d", n);
+    size = (c->ssl->buffer_size / NGX_SSL_BUFSIZE + 1)
+           * SSL3_RT_MAX_PACKET_SIZE;
 
-    if (n > 0) {
+    if (BIO_set_write_buffer_size(bio, size) <= 0) {
+        ngx_ssl_error(NGX_LOG_ALERT, c->log, 0,
+                      "BIO_set_write_buffer_size() failed");
+        BIO_free(bio);
+        return NGX_ERROR;
+    }
 
-        if (c->ssl->saved_read_handler) {
+    CRYPTO_add(&sbio->references, 1, CRYPTO_LOCK_BIO);
 
-            c->read->handler = c->ssl->saved_read_handler;
-            c->ssl->saved_read_handler = NULL;
-            c->read->ready = 1;
+    BIO_push(bio, sbio);
 
-            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
-                return NGX_ERROR;
-            }
+    SSL_set_bio(c->ssl->connection, SSL_get_rbio(c->ssl->connection), bio);
 
-            ngx_post_event(c->read, &ngx_posted_events);
-        }
+    c->ssl->bulk = 1;
 
-        return n;
-    }
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "SSL bulk buffer: %uz", size);
 
-    sslerr = SSL_get_error(c->ssl->connection, n);
+    return NGX_OK;
+}
 
-    err = (sslerr == SSL_ERROR_SYSCALL) ? ngx_errno : 0;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_get_error: %d", sslerr);
+static ngx_int_t
+ngx_ssl_flush(ngx_connection_t *c)
+{
+    int   n;
+    BIO  *bio;
 
-    if (sslerr == SSL_ERROR_WANT_WRITE) {
+    bio = SSL_get_wbio(c->ssl->connection);
+
+    if (BIO_wpending(bio) == 0) {
+        return NGX_OK;
+    }
+
+    ngx_set_socket_errno(0);
+
+    n = BIO_flush(bio);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL BIO_flush: %d", n);
+
+    if (n > 0) {
+        return NGX_OK;
+    }
+
+    if (BIO_should_retry(bio)) {
+        c->write->ready = 0;
+        c->buffered |= NGX_SSL_BUFFERED;
+        return NGX_AGAIN;
+    }
+
+    c->ssl->no_wait_shutdown = 1;
+    c->ssl->no_send_shutdown = 1;
+    c->write->error = 1;
+
+    ngx_connection_error(c, ngx_socket_errno, "BIO_flush() failed");
+
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_ssl_grow_record_size(ngx_connection_t *c)
+{
+    if (c->ssl->record_size == 0) {
+        return;
+    }
+
+    c->ssl->record_time = ngx_current_msec;
+
+    if (c->ssl->record_size < NGX_SSL_BUFSIZE) {
+        c->ssl->record_size = ngx_min(2 * c->ssl->record_size,
+                                      NGX_SSL_BUFSIZE);
+    }
+}
+
+
+ssize_t
+ngx_ssl_write(ngx_connection_t *c, u_char *data, size_t size)
+{
+    int        n, sslerr;
+    ngx_err_t  err;
+
+    ngx_ssl_clear_error(c->log);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL to write: %d", size);
+
+    n = SSL_write(c->ssl->connection, data, size);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_write: %d", n);
+
+    if (n > 0) {
+
+        /* the written records are sent later if the socket is not ready */
+
+        if (c->ssl->bulk && ngx_ssl_flush(c) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (c->ssl->saved_read_handler) {
+
+            c->read->handler = c->ssl->saved_read_handler;
+            c->ssl->saved_read_handler = NULL;
+            c->read->ready = 1;
+
+            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            ngx_post_event(c->read, &ngx_posted_events);
+        }
+
+        return n;
+    }
+
+    sslerr = SSL_get_error(c->ssl->connection, n);
+
+    err = (sslerr == SSL_ERROR_SYSCALL) ? ngx_errno : 0;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_get_error: %d", sslerr);
+
+    if (sslerr == SSL_ERROR_WANT_WRITE) {
         c->write->ready = 0;
         return NGX_AGAIN;
     }
@@ -1187,14 +1671,33 @@ ngx_ssl_read_handler(ngx_event_t *rev)
 }
 
 
+/*
+ * the buffer is allocated again by ngx_ssl_send_chain() on the next write
+ */
+
 void
 ngx_ssl_free_buffer(ngx_connection_t *c)
 {
+    BIO  *bio;
+
     if (c->ssl->buf && c->ssl->buf->start) {
         if (ngx_pfree(c->pool, c->ssl->buf->start) == NGX_OK) {
+
+            ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "SSL buffer free: %p", c->ssl->buf->start);
+
             c->ssl->buf->start = NULL;
         }
     }
+
+    if (c->ssl->bulk && BIO_wpending(SSL_get_wbio(c->ssl->connection)) == 0) {
+        bio = SSL_get_rbio(c->ssl->connection);
+
+        /* frees the buffering BIO only, the socket BIO is referenced twice */
+        SSL_set_bio(c->ssl->connection, bio, bio);
+
+        c->ssl->bulk = 0;
+    }
 }
 
 
@@ -1204,6 +1707,20 @@ ngx_ssl_shutdown(ngx_connection_t *c)
     int        n, sslerr, mode;
     ngx_err_t  err;
 
+#if (NGX_THREADS)
+
+    if (c->ssl->handshake_task && c->ssl->handshake_task->event.active) {
+
+        /* the thread still uses the connection, shut it down later */
+
+        c->read->handler = ngx_ssl_shutdown_handler;
+        c->write->handler = ngx_ssl_shutdown_handler;
+
+        return NGX_AGAIN;
+    }
+
+#endif
+
     if (c->timedout) {
         mode = SSL_RECEIVED_SHUTDOWN|SSL_SENT_SHUTDOWN;
 
@@ -1227,6 +1744,11 @@ ngx_ssl_shutdown(ngx_connection_t *c)
 
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_shutdown: %d", n);
 
+    if (c->ssl->bulk && !(mode & SSL_SENT_SHUTDOWN)) {
+        /* the "close notify" alert is left in the buffering BIO */
+        (void) BIO_flush(SSL_get_wbio(c->ssl->connection));
+    }
+
     sslerr = 0;
 
     /* SSL_shutdown() never returns -1, on error it returns 0 */
@@ -1524,11 +2046,291 @@ ngx_ssl_session_cache(ngx_ssl_t *ssl, ngx_str_t *sess_ctx,
 }
 
 
+/*
+ * the ticket keys are either read from the files, the first key encrypts
+ * the new tickets and all keys decrypt the old ones, or are generated
+ * in the shared session cache zone and are rotated there by the first
+ * worker, which notices that the current key is older than "rotate";
+ * the previous key is still accepted, but the ticket is renewed
+ */
+
+ngx_int_t
+ngx_ssl_session_ticket_keys(ngx_conf_t *cf, ngx_ssl_t *ssl,
+    ngx_array_t *paths, time_t rotate)
+{
+#ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
+
+    u_char                 *p;
+    ssize_t                 n;
+    ngx_str_t              *path;
+    ngx_file_t              file;
+    ngx_uint_t              i;
+    ngx_file_info_t         fi;
+    ngx_ssl_ticket_key_t   *key;
+    ngx_ssl_ticket_keys_t  *tk;
+    u_char                  buf[48];
+
+    if (paths == NULL) {
+
+        if (rotate == 0
+            || SSL_CTX_get_ex_data(ssl->ctx, ngx_ssl_session_cache_index)
+               == NULL)
+        {
+            /* OpenSSL's own key of the process is used */
+            return NGX_OK;
+        }
+    }
+
+    tk = ngx_palloc(cf->pool, sizeof(ngx_ssl_ticket_keys_t));
+    if (tk == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_array_init(&tk->keys, cf->pool, paths ? paths->nelts : 1,
+                       sizeof(ngx_ssl_ticket_key_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    tk->rotate = rotate;
+
+    path = paths ? paths->elts : NULL;
+
+    for (i = 0; paths && i < paths->nelts; i++) {
+
+        if (ngx_conf_full_name(cf->cycle, &path[i], 1) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ngx_memzero(&file, sizeof(ngx_file_t));
+        file.name = path[i];
+        file.log = cf->log;
+
+        file.fd = ngx_open_file(file.name.data, NGX_FILE_RDONLY,
+                                NGX_FILE_OPEN, 0);
+        if (file.fd == NGX_INVALID_FILE) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                               ngx_open_file_n " \"%V\" failed", &file.name);
+            return NGX_ERROR;
+        }
+
+        if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+            ngx_conf_log_error(NGX_LOG_CRIT, cf, ngx_errno,
+                               ngx_fd_info_n " \"%V\" failed", &file.name);
+            goto failed;
+        }
+
+        if (ngx_file_size(&fi) != 48) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"%V\" must be 48 bytes", &file.name);
+            goto failed;
+        }
+
+        n = ngx_read_file(&file, buf, 48, 0);
+
+        if (n == NGX_ERROR) {
+            goto failed;
+        }
+
+        if (n != 48) {
+            ngx_conf_log_error(NGX_LOG_CRIT, cf, 0,
+                               ngx_read_file_n " \"%V\" returned only "
+                               "%z bytes instead of 48", &file.name, n);
+            goto failed;
+        }
+
+        key = ngx_array_push(&tk->keys);
+        if (key == NULL) {
+            goto failed;
+        }
+
+        p = buf;
+        ngx_memcpy(key->name, p, 16);
+        p += 16;
+        ngx_memcpy(key->aes_key, p, 16);
+        p += 16;
+        ngx_memcpy(key->hmac_key, p, 16);
+
+        if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_ALERT, cf->log, ngx_errno,
+                          ngx_close_file_n " \"%V\" failed", &file.name);
+        }
+    }
+
+    ngx_memzero(buf, 48);
+
+    if (SSL_CTX_set_ex_data(ssl->ctx, ngx_ssl_ticket_keys_index, tk) == 0) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "SSL_CTX_set_ex_data() failed");
+        return NGX_ERROR;
+    }
+
+    if (SSL_CTX_set_tlsext_ticket_key_cb(ssl->ctx,
+                                         ngx_ssl_session_ticket_key_callback)
+        == 0)
+    {
+        ngx_log_error(NGX_LOG_WARN, cf->log, 0,
+                      "nginx was built with session tickets support, "
+                      "however, now it is linked dynamically to "
+                      "an OpenSSL library which has no tlsext support, "
+                      "therefore the ticket keys are not used");
+    }
+
+    return NGX_OK;
+
+failed:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, cf->log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &file.name);
+    }
+
+    ngx_memzero(buf, 48);
+
+    return NGX_ERROR;
+
+#else
+
+    if (paths) {
+        ngx_log_error(NGX_LOG_WARN, ssl->log, 0,
+                      "\"ssl_session_ticket_key\" ignored, not supported");
+    }
+
+    return NGX_OK;
+
+#endif
+}
+
+
+#ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
+
+static int
+ngx_ssl_session_ticket_key_callback(ngx_ssl_conn_t *ssl_conn,
+    unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ectx,
+    HMAC_CTX *hctx, int enc)
+{
+    time_t                    now;
+    SSL_CTX                  *ssl_ctx;
+    ngx_uint_t                i, n;
+    ngx_shm_zone_t           *shm_zone;
+    ngx_slab_pool_t          *shpool;
+    ngx_connection_t         *c;
+    ngx_ssl_ticket_key_t     *key, keys[2], fresh;
+    ngx_ssl_ticket_keys_t    *tk;
+    ngx_ssl_session_cache_t  *cache;
+
+    c = ngx_ssl_get_connection(ssl_conn);
+    ssl_ctx = SSL_get_SSL_CTX(ssl_conn);
+
+    tk = SSL_CTX_get_ex_data(ssl_ctx, ngx_ssl_ticket_keys_index);
+    shm_zone = SSL_CTX_get_ex_data(ssl_ctx, ngx_ssl_session_cache_index);
+
+    cache = shm_zone ? shm_zone->data : NULL;
+
+    if (tk->keys.nelts) {
+        key = tk->keys.elts;
+        n = tk->keys.nelts;
+
+    } else {
+        shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+        now = ngx_time();
+
+        /* the new key is generated outside the lock, it is rarely needed */
+
+        if (now - cache->ticket_key_time >= tk->rotate
+            && RAND_bytes((u_char *) &fresh, sizeof(ngx_ssl_ticket_key_t))
+               == 1)
+        {
+            ngx_shmtx_lock(&shpool->mutex);
+
+            if (now - cache->ticket_key_time >= tk->rotate) {
+                cache->ticket_keys[1] = cache->ticket_keys[0];
+                cache->ticket_keys[0] = fresh;
+                cache->ticket_key_time = now;
+
+                ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                               "ssl session ticket key rotated");
+            }
+
+            ngx_memcpy(keys, cache->ticket_keys, sizeof(keys));
+
+            ngx_shmtx_unlock(&shpool->mutex);
+
+            ngx_memzero(&fresh, sizeof(ngx_ssl_ticket_key_t));
+
+        } else {
+            ngx_shmtx_lock(&shpool->mutex);
+            ngx_memcpy(keys, cache->ticket_keys, sizeof(keys));
+            ngx_shmtx_unlock(&shpool->mutex);
+        }
+
+        key = keys;
+        n = 2;
+    }
+
+    if (enc == 1) {
+        /* encrypt session ticket */
+
+        ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "ssl session ticket encrypt");
+
+        RAND_pseudo_bytes(iv, 16);
+        EVP_EncryptInit_ex(ectx, EVP_aes_128_cbc(), NULL, key[0].aes_key, iv);
+        HMAC_Init_ex(hctx, key[0].hmac_key, 16, ngx_ssl_session_ticket_md(),
+                     NULL);
+        ngx_memcpy(name, key[0].name, 16);
+
+        ngx_memzero(keys, sizeof(keys));
+
+        return 1;
+    }
+
+    /* decrypt session ticket */
+
+    for (i = 0; i < n; i++) {
+        if (ngx_memcmp(name, key[i].name, 16) == 0) {
+            goto found;
+        }
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "ssl session ticket decrypt, key not found");
+
+    ngx_memzero(keys, sizeof(keys));
+
+    return 0;
+
+found:
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "ssl session ticket decrypt, key number %ui", i);
+
+    HMAC_Init_ex(hctx, key[i].hmac_key, 16, ngx_ssl_session_ticket_md(),
+                 NULL);
+    EVP_DecryptInit_ex(ectx, EVP_aes_128_cbc(), NULL, key[i].aes_key, iv);
+
+    ngx_memzero(keys, sizeof(keys));
+
+    if (cache) {
+        (void) ngx_atomic_fetch_add(&cache->ticket_hits, 1);
+    }
+
+    /* the ticket encrypted with an old key is renewed */
+
+    return (i == 0) ? 1 : 2;
+}
+
+#endif
+
+
 static ngx_int_t
 ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 {
-    size_t                    len;
-    ngx_slab_pool_t          *shpool;
+    size_t                    len, size;
+    ngx_uint_t                i, n;
+    ngx_slab_pool_t          *shpool, *sp;
+    ngx_ssl_session_shard_t  *shard;
     ngx_ssl_session_cache_t  *cache;
 
     if (data) {
@@ -1548,14 +2350,11 @@ ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
         return NGX_ERROR;
     }
 
+    ngx_memzero(cache, sizeof(ngx_ssl_session_cache_t));
+
     shpool->data = cache;
     shm_zone->data = cache;
 
-    ngx_rbtree_init(&cache->session_rbtree, &cache->sentinel,
-                    ngx_ssl_session_rbtree_insert_value);
-
-    ngx_queue_init(&cache->expire_queue);
-
     len = sizeof(" in SSL session shared cache \"\"") + shm_zone->shm.name.len;
 
     shpool->log_ctx = ngx_slab_alloc(shpool, len);
@@ -1566,6 +2365,75 @@ ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
     ngx_sprintf(shpool->log_ctx, " in SSL session shared cache \"%V\"%Z",
                 &shm_zone->shm.name);
 
+    /*
+     * the zone is split into the shards with their own slab pools
+     * and mutexes, the shard is chosen by the session id hash, so
+     * the handshakes with the different sessions do not wait each other;
+     * the mutex of the zone itself protects the ticket keys only
+     */
+
+    n = 1;
+    size = 0;
+
+#if (NGX_HAVE_ATOMIC_OPS)
+
+    size = shm_zone->shm.size / (NGX_SSL_SESSION_CACHE_SHARDS + 1);
+    size &= ~(ngx_pagesize - 1);
+
+    if (size >= 8 * ngx_pagesize) {
+        n = NGX_SSL_SESSION_CACHE_SHARDS;
+    }
+
+#endif
+
+    for (i = 0; i < n; i++) {
+        shard = &cache->shards[i];
+
+        if (n == 1) {
+            shard->shpool = shpool;
+
+        } else {
+            sp = ngx_slab_alloc(shpool, size);
+            if (sp == NULL) {
+                return NGX_ERROR;
+            }
+
+            ngx_memzero(sp, sizeof(ngx_slab_pool_t));
+
+            sp->end = (u_char *) sp + size;
+            sp->min_shift = 3;
+            sp->addr = sp;
+            sp->log_ctx = shpool->log_ctx;
+
+            if (ngx_shmtx_create(&sp->mutex, (void *) &sp->lock, NULL)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            ngx_slab_init(sp);
+
+            shard->shpool = sp;
+        }
+
+        ngx_rbtree_init(&shard->session_rbtree, &shard->sentinel,
+                        ngx_ssl_session_rbtree_insert_value);
+
+        ngx_queue_init(&shard->expire_queue);
+    }
+
+    cache->nshards = n;
+
+    if (RAND_bytes((u_char *) cache->ticket_keys, sizeof(cache->ticket_keys))
+        != 1)
+    {
+        ngx_ssl_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                      "RAND_bytes() failed");
+        return NGX_ERROR;
+    }
+
+    cache->ticket_key_time = ngx_time();
+
     return NGX_OK;
 }
 
@@ -1584,7 +2452,7 @@ ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
  * and an ASN1 representation, they take accordingly 128 and 128 bytes.
  *
  * OpenSSL's i2d_SSL_SESSION() and d2i_SSL_SESSION are slow,
- * so they are outside the code locked by shared pool mutex
+ * so they are outside the code locked by shard pool mutex
  */
 
 static int
@@ -1598,6 +2466,7 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
     ngx_connection_t         *c;
     ngx_slab_pool_t          *shpool;
     ngx_ssl_sess_id_t        *sess_id;
+    ngx_ssl_session_shard_t  *shard;
     ngx_ssl_session_cache_t  *cache;
     u_char                    buf[NGX_SSL_MAX_SESSION_SIZE];
 
@@ -1618,12 +2487,16 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
     shm_zone = SSL_CTX_get_ex_data(ssl_ctx, ngx_ssl_session_cache_index);
 
     cache = shm_zone->data;
-    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    hash = ngx_crc32_short(sess->session_id, sess->session_id_length);
+
+    shard = &cache->shards[hash % cache->nshards];
+    shpool = shard->shpool;
 
     ngx_shmtx_lock(&shpool->mutex);
 
     /* drop one or two expired sessions */
-    ngx_ssl_expire_sessions(cache, shpool, 1);
+    ngx_ssl_expire_sessions(shard, 1);
 
     cached_sess = ngx_slab_alloc_locked(shpool, len);
 
@@ -1631,7 +2504,7 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
 
         /* drop the oldest non-expired session and try once more */
 
-        ngx_ssl_expire_sessions(cache, shpool, 0);
+        ngx_ssl_expire_sessions(shard, 0);
 
         cached_sess = ngx_slab_alloc_locked(shpool, len);
 
@@ -1663,11 +2536,10 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
 
     ngx_memcpy(id, sess->session_id, sess->session_id_length);
 
-    hash = ngx_crc32_short(sess->session_id, sess->session_id_length);
-
-    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                   "ssl new session: %08XD:%d:%d",
-                   hash, sess->session_id_length, len);
+    ngx_log_debug4(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "ssl new session: %08XD:%d:%d, shard %ui",
+                   hash, sess->session_id_length, len,
+                   hash % cache->nshards);
 
     sess_id->node.key = hash;
     sess_id->node.data = (u_char) sess->session_id_length;
@@ -1677,9 +2549,9 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
 
     sess_id->expire = ngx_time() + SSL_CTX_get_timeout(ssl_ctx);
 
-    ngx_queue_insert_head(&cache->expire_queue, &sess_id->queue);
+    ngx_queue_insert_head(&shard->expire_queue, &sess_id->queue);
 
-    ngx_rbtree_insert(&cache->session_rbtree, &sess_id->node);
+    ngx_rbtree_insert(&shard->session_rbtree, &sess_id->node);
 
     ngx_shmtx_unlock(&shpool->mutex);
 
@@ -1719,6 +2591,7 @@ ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn, u_char *id, int len,
     ngx_rbtree_node_t        *node, *sentinel;
     ngx_ssl_session_t        *sess;
     ngx_ssl_sess_id_t        *sess_id;
+    ngx_ssl_session_shard_t  *shard;
     ngx_ssl_session_cache_t  *cache;
     u_char                    buf[NGX_SSL_MAX_SESSION_SIZE];
 #if (NGX_DEBUG)
@@ -1742,12 +2615,13 @@ ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn, u_char *id, int len,
 
     sess = NULL;
 
-    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    shard = &cache->shards[hash % cache->nshards];
+    shpool = shard->shpool;
 
     ngx_shmtx_lock(&shpool->mutex);
 
-    node = cache->session_rbtree.root;
-    sentinel = cache->session_rbtree.sentinel;
+    node = shard->session_rbtree.root;
+    sentinel = shard->session_rbtree.sentinel;
 
     while (node != sentinel) {
 
@@ -1775,6 +2649,8 @@ ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn, u_char *id, int len,
 
                     ngx_shmtx_unlock(&shpool->mutex);
 
+                    (void) ngx_atomic_fetch_add(&cache->hits, 1);
+
                     p = buf;
                     sess = d2i_SSL_SESSION(NULL, &p, sess_id->len);
 
@@ -1783,7 +2659,7 @@ ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn, u_char *id, int len,
 
                 ngx_queue_remove(&sess_id->queue);
 
-                ngx_rbtree_delete(&cache->session_rbtree, node);
+                ngx_rbtree_delete(&shard->session_rbtree, node);
 
                 ngx_slab_free_locked(shpool, sess_id->session);
 #if (NGX_PTR_SIZE == 4)
@@ -1807,6 +2683,8 @@ done:
 
     ngx_shmtx_unlock(&shpool->mutex);
 
+    (void) ngx_atomic_fetch_add(&cache->misses, 1);
+
     return sess;
 }
 
@@ -1831,6 +2709,7 @@ ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess)
     ngx_slab_pool_t          *shpool;
     ngx_rbtree_node_t        *node, *sentinel;
     ngx_ssl_sess_id_t        *sess_id;
+    ngx_ssl_session_shard_t  *shard;
     ngx_ssl_session_cache_t  *cache;
 
     shm_zone = SSL_CTX_get_ex_data(ssl, ngx_ssl_session_cache_index);
@@ -1849,12 +2728,13 @@ ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess)
     ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
                    "ssl remove session: %08XD:%uz", hash, len);
 
-    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    shard = &cache->shards[hash % cache->nshards];
+    shpool = shard->shpool;
 
     ngx_shmtx_lock(&shpool->mutex);
 
-    node = cache->session_rbtree.root;
-    sentinel = cache->session_rbtree.sentinel;
+    node = shard->session_rbtree.root;
+    sentinel = shard->session_rbtree.sentinel;
 
     while (node != sentinel) {
 
@@ -1879,7 +2759,7 @@ ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess)
 
                 ngx_queue_remove(&sess_id->queue);
 
-                ngx_rbtree_delete(&cache->session_rbtree, node);
+                ngx_rbtree_delete(&shard->session_rbtree, node);
 
                 ngx_slab_free_locked(shpool, sess_id->session);
 #if (NGX_PTR_SIZE == 4)
@@ -1904,22 +2784,23 @@ done:
 
 
 static void
-ngx_ssl_expire_sessions(ngx_ssl_session_cache_t *cache,
-    ngx_slab_pool_t *shpool, ngx_uint_t n)
+ngx_ssl_expire_sessions(ngx_ssl_session_shard_t *shard, ngx_uint_t n)
 {
     time_t              now;
     ngx_queue_t        *q;
+    ngx_slab_pool_t    *shpool;
     ngx_ssl_sess_id_t  *sess_id;
 
     now = ngx_time();
+    shpool = shard->shpool;
 
     while (n < 3) {
 
-        if (ngx_queue_empty(&cache->expire_queue)) {
+        if (ngx_queue_empty(&shard->expire_queue)) {
             return;
         }
 
-        q = ngx_queue_last(&cache->expire_queue);
+        q = ngx_queue_last(&shard->expire_queue);
 
         sess_id = ngx_queue_data(q, ngx_ssl_sess_id_t, queue);
 
@@ -1932,7 +2813,7 @@ ngx_ssl_expire_sessions(ngx_ssl_session_cache_t *cache,
         ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
                        "expire session: %08Xi", sess_id->node.key);
 
-        ngx_rbtree_delete(&cache->session_rbtree, &sess_id->node);
+        ngx_rbtree_delete(&shard->session_rbtree, &sess_id->node);
 
         ngx_slab_free_locked(shpool, sess_id->session);
 #if (NGX_PTR_SIZE == 4)
@@ -1943,6 +2824,256 @@ ngx_ssl_expire_sessions(ngx_ssl_session_cache_t *cache,
 }
 
 
+/*
+ * the client session cache is used by the upstream connections:
+ * a session saved by one worker is resumed by the others, while
+ * the connections themselves are still local to a worker
+ */
+
+ngx_int_t
+ngx_ssl_client_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    size_t                           len;
+    ngx_slab_pool_t                 *shpool;
+    ngx_ssl_client_session_cache_t  *cache;
+
+    if (data) {
+        shm_zone->data = data;
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
+    }
+
+    cache = ngx_slab_alloc(shpool, sizeof(ngx_ssl_client_session_cache_t));
+    if (cache == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(cache, sizeof(ngx_ssl_client_session_cache_t));
+
+    ngx_rbtree_init(&cache->rbtree, &cache->sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    ngx_queue_init(&cache->queue);
+
+    shpool->data = cache;
+    shm_zone->data = cache;
+
+    len = sizeof(" in SSL client session cache \"\"")
+          + shm_zone->shm.name.len;
+
+    shpool->log_ctx = ngx_slab_alloc(shpool, len);
+    if (shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(shpool->log_ctx, " in SSL client session cache \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_ssl_set_cached_session(ngx_connection_t *c, ngx_shm_zone_t *shm_zone,
+    ngx_str_t *key)
+{
+    size_t                           len;
+    u_char                          *p;
+    uint32_t                         hash;
+    ngx_int_t                        rc;
+    ngx_slab_pool_t                 *shpool;
+    ngx_ssl_session_t               *sess;
+    ngx_ssl_client_session_t        *cs;
+    ngx_ssl_client_session_cache_t  *cache;
+    u_char                           buf[NGX_SSL_MAX_SESSION_SIZE];
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    cache = shm_zone->data;
+
+    hash = ngx_crc32_short(key->data, key->len);
+
+    len = 0;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    cs = (ngx_ssl_client_session_t *)
+             ngx_str_rbtree_lookup(&cache->rbtree, key, hash);
+
+    if (cs) {
+        if (cs->expire > ngx_time()) {
+            len = cs->len;
+            ngx_memcpy(buf, cs->session, len);
+
+        } else {
+            ngx_queue_remove(&cs->queue);
+            ngx_rbtree_delete(&cache->rbtree, &cs->sn.node);
+
+            ngx_slab_free_locked(shpool, cs->session);
+            ngx_slab_free_locked(shpool, cs);
+        }
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "ssl get cached session: \"%V\" %uz", key, len);
+
+    if (len == 0) {
+        (void) ngx_atomic_fetch_add(&cache->misses, 1);
+        return NGX_OK;
+    }
+
+    (void) ngx_atomic_fetch_add(&cache->hits, 1);
+
+    p = buf;
+    sess = d2i_SSL_SESSION(NULL, (const unsigned char **) &p, len);
+
+    if (sess == NULL) {
+        return NGX_OK;
+    }
+
+    rc = ngx_ssl_set_session(c, sess);
+
+    ngx_ssl_free_session(sess);
+
+    return rc;
+}
+
+
+/*
+ * the session is saved after a full handshake only,
+ * a resumed session is already in the cache
+ */
+
+void
+ngx_ssl_save_cached_session(ngx_connection_t *c, ngx_shm_zone_t *shm_zone,
+    ngx_str_t *key)
+{
+    int                              len;
+    u_char                          *p, *session;
+    time_t                           expire;
+    uint32_t                         hash;
+    ngx_uint_t                       n;
+    ngx_queue_t                     *q;
+    ngx_slab_pool_t                 *shpool;
+    ngx_ssl_session_t               *sess;
+    ngx_ssl_client_session_t        *cs;
+    ngx_ssl_client_session_cache_t  *cache;
+    u_char                           buf[NGX_SSL_MAX_SESSION_SIZE];
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    cache = shm_zone->data;
+
+    if (SSL_session_reused(c->ssl->connection)) {
+        (void) ngx_atomic_fetch_add(&cache->resumed, 1);
+        return;
+    }
+
+    (void) ngx_atomic_fetch_add(&cache->full, 1);
+
+    sess = ngx_ssl_get_session(c);
+
+    if (sess == NULL) {
+        return;
+    }
+
+    len = i2d_SSL_SESSION(sess, NULL);
+
+    /* do not cache too big session */
+
+    if (len > NGX_SSL_MAX_SESSION_SIZE) {
+        ngx_ssl_free_session(sess);
+        return;
+    }
+
+    p = buf;
+    i2d_SSL_SESSION(sess, &p);
+
+    expire = SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess);
+
+    ngx_ssl_free_session(sess);
+
+    hash = ngx_crc32_short(key->data, key->len);
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    cs = (ngx_ssl_client_session_t *)
+             ngx_str_rbtree_lookup(&cache->rbtree, key, hash);
+
+    if (cs) {
+        ngx_queue_remove(&cs->queue);
+        ngx_rbtree_delete(&cache->rbtree, &cs->sn.node);
+
+        ngx_slab_free_locked(shpool, cs->session);
+        ngx_slab_free_locked(shpool, cs);
+    }
+
+    /* the oldest sessions are removed if the cache is full */
+
+    for (n = 0; /* void */; n++) {
+
+        cs = ngx_slab_alloc_locked(shpool,
+                                   sizeof(ngx_ssl_client_session_t) + key->len);
+        session = ngx_slab_alloc_locked(shpool, len);
+
+        if (cs && session) {
+            break;
+        }
+
+        if (cs) {
+            ngx_slab_free_locked(shpool, cs);
+        }
+
+        if (session) {
+            ngx_slab_free_locked(shpool, session);
+        }
+
+        if (n == 3 || ngx_queue_empty(&cache->queue)) {
+            ngx_shmtx_unlock(&shpool->mutex);
+
+            ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                          "could not allocate new session%s", shpool->log_ctx);
+            return;
+        }
+
+        q = ngx_queue_last(&cache->queue);
+        ngx_queue_remove(q);
+
+        cs = ngx_queue_data(q, ngx_ssl_client_session_t, queue);
+
+        ngx_rbtree_delete(&cache->rbtree, &cs->sn.node);
+
+        ngx_slab_free_locked(shpool, cs->session);
+        ngx_slab_free_locked(shpool, cs);
+    }
+
+    cs->sn.node.key = hash;
+    cs->sn.str.len = key->len;
+    cs->sn.str.data = (u_char *) cs + sizeof(ngx_ssl_client_session_t);
+    ngx_memcpy(cs->sn.str.data, key->data, key->len);
+
+    ngx_memcpy(session, buf, len);
+
+    cs->session = session;
+    cs->len = len;
+    cs->expire = expire;
+
+    ngx_rbtree_insert(&cache->rbtree, &cs->sn.node);
+    ngx_queue_insert_head(&cache->queue, &cs->queue);
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "ssl save cached session: \"%V\" %d", key, len);
+}
+
+
 static void
 ngx_ssl_session_rbtree_insert_value(ngx_rbtree_node_t *temp,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
@@ -2044,6 +3175,56 @@ ngx_ssl_get_session_id(ngx_connection_t *c, ngx_pool_t *pool, ngx_str_t *s)
 }
 
 
+ngx_int_t
+ngx_ssl_get_session_reused(ngx_connection_t *c, ngx_pool_t *pool,
+    ngx_str_t *s)
+{
+    if (SSL_session_reused(c->ssl->connection)) {
+        ngx_str_set(s, "r");
+
+    } else {
+        ngx_str_set(s, ".");
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_ssl_get_session_stats(ngx_connection_t *c, ngx_pool_t *pool,
+    ngx_str_t *s)
+{
+    u_char                   *p;
+    ngx_shm_zone_t           *shm_zone;
+    ngx_ssl_session_cache_t  *cache;
+
+    shm_zone = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(c->ssl->connection),
+                                   ngx_ssl_session_cache_index);
+    if (shm_zone == NULL) {
+        s->len = 0;
+        return NGX_OK;
+    }
+
+    cache = shm_zone->data;
+
+    p = ngx_pnalloc(pool, sizeof("handshakes= reused= hits= misses= tickets=")
+                          - 1 + 5 * NGX_ATOMIC_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    s->data = p;
+
+    p = ngx_sprintf(p, "handshakes=%uA reused=%uA hits=%uA misses=%uA "
+                    "tickets=%uA", cache->handshakes, cache->reused,
+                    cache->hits, cache->misses, cache->ticket_hits);
+
+    s->len = p - s->data;
+
+    return NGX_OK;
+}
+
+
 ngx_int_t
 ngx_ssl_get_raw_certificate(ngx_connection_t *c, ngx_pool_t *pool, ngx_str_t *s)
 {
@@ -2286,6 +3467,55 @@ ngx_ssl_get_client_verify(ngx_connection_t *c, ngx_pool_t *pool, ngx_str_t *s)
 }
 
 
+ngx_int_t
+ngx_ssl_get_handshake_time(ngx_connection_t *c, ngx_pool_t *pool, ngx_str_t *s)
+{
+    s->len = 0;
+
+#if (NGX_THREADS)
+
+    if (c->ssl->handshake_task) {
+        s->data = ngx_pnalloc(pool, NGX_INT64_LEN + 4);
+        if (s->data == NULL) {
+            return NGX_ERROR;
+        }
+
+        s->len = ngx_sprintf(s->data, "%M.%03M",
+                             c->ssl->handshake_time / 1000,
+                             c->ssl->handshake_time % 1000)
+                 - s->data;
+    }
+
+#endif
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_ssl_get_handshake_queue(ngx_connection_t *c, ngx_pool_t *pool,
+    ngx_str_t *s)
+{
+    s->len = 0;
+
+#if (NGX_THREADS)
+
+    if (c->ssl->thread_pool) {
+        s->data = ngx_pnalloc(pool, NGX_INT_T_LEN);
+        if (s->data == NULL) {
+            return NGX_ERROR;
+        }
+
+        s->len = ngx_sprintf(s->data, "%ui", ngx_ssl_handshake_tasks)
+                 - s->data;
+    }
+
+#endif
+
+    return NGX_OK;
+}
+
+
 static void *
 ngx_openssl_create_conf(ngx_cycle_t *cycle)
 {
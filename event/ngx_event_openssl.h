@@ -16,6 +16,8 @@
 #include <openssl/conf.h>
 #include <openssl/engine.h>
 #include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
 
 #define NGX_SSL_NAME     "OpenSSL"
 
@@ -24,9 +26,21 @@
 #define ngx_ssl_conn_t          SSL
 
 
+typedef struct {
+    ngx_uint_t                  engine;   /* unsigned  engine:1; */
+    ngx_array_t                *staplings;
+} ngx_openssl_conf_t;
+
+
 typedef struct {
     SSL_CTX                    *ctx;
     ngx_log_t                  *log;
+    size_t                      record_start_size;
+    ngx_msec_t                  record_idle_timeout;
+    size_t                      buffer_size;
+#if (NGX_THREADS)
+    ngx_thread_pool_t          *thread_pool;
+#endif
 } ngx_ssl_t;
 
 
@@ -41,11 +55,27 @@ typedef struct {
     ngx_event_handler_pt        saved_read_handler;
     ngx_event_handler_pt        saved_write_handler;
 
+    /* the dynamic record size, 0 if the records are always full */
+    size_t                      record_start_size;
+    size_t                      record_size;
+    ngx_msec_t                  record_idle_timeout;
+    ngx_msec_t                  record_time;
+
+    /* the send buffer size, several records are encrypted at once if bigger */
+    size_t                      buffer_size;
+
+#if (NGX_THREADS)
+    ngx_thread_pool_t          *thread_pool;
+    ngx_thread_task_t          *handshake_task;
+    ngx_msec_t                  handshake_time;
+#endif
+
     unsigned                    handshaked:1;
     unsigned                    renegotiation:1;
     unsigned                    buffer:1;
     unsigned                    no_wait_shutdown:1;
     unsigned                    no_send_shutdown:1;
+    unsigned                    bulk:1;
 } ngx_ssl_connection_t;
 
 
@@ -73,13 +103,72 @@ struct ngx_ssl_sess_id_s {
 };
 
 
+#define NGX_SSL_SESSION_CACHE_SHARDS  8
+
+
 typedef struct {
+    ngx_slab_pool_t            *shpool;
     ngx_rbtree_t                session_rbtree;
     ngx_rbtree_node_t           sentinel;
     ngx_queue_t                 expire_queue;
+} ngx_ssl_session_shard_t;
+
+
+typedef struct {
+    u_char                      name[16];
+    u_char                      aes_key[16];
+    u_char                      hmac_key[16];
+} ngx_ssl_ticket_key_t;
+
+
+typedef struct {
+    ngx_uint_t                  nshards;
+    ngx_ssl_session_shard_t     shards[NGX_SSL_SESSION_CACHE_SHARDS];
+
+    /* the ticket keys rotated by the workers, the new one is the first */
+    ngx_ssl_ticket_key_t        ticket_keys[2];
+    time_t                      ticket_key_time;
+
+    ngx_atomic_t                handshakes;
+    ngx_atomic_t                reused;
+    ngx_atomic_t                hits;
+    ngx_atomic_t                misses;
+    ngx_atomic_t                ticket_hits;
 } ngx_ssl_session_cache_t;
 
 
+typedef struct {
+    ngx_array_t                 keys;       /* of ngx_ssl_ticket_key_t */
+    time_t                      rotate;
+} ngx_ssl_ticket_keys_t;
+
+
+/*
+ * the client sessions shared among the workers,
+ * the key is chosen by the caller, e.g., the peer address and the SNI name
+ */
+
+typedef struct {
+    ngx_str_node_t              sn;
+    ngx_queue_t                 queue;
+    time_t                      expire;
+    size_t                      len;
+    u_char                     *session;
+} ngx_ssl_client_session_t;
+
+
+typedef struct {
+    ngx_rbtree_t                rbtree;
+    ngx_rbtree_node_t           sentinel;
+    ngx_queue_t                 queue;
+
+    ngx_atomic_t                full;
+    ngx_atomic_t                resumed;
+    ngx_atomic_t                hits;
+    ngx_atomic_t                misses;
+} ngx_ssl_client_session_cache_t;
+
+
 
 #define NGX_SSL_SSLv2    2
 #define NGX_SSL_SSLv3    4
@@ -104,11 +193,22 @@ ngx_int_t ngx_ssl_dhparam(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *file);
 ngx_int_t ngx_ssl_ecdh_curve(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *name);
 ngx_int_t ngx_ssl_session_cache(ngx_ssl_t *ssl, ngx_str_t *sess_ctx,
     ssize_t builtin_session_cache, ngx_shm_zone_t *shm_zone, time_t timeout);
+ngx_int_t ngx_ssl_session_ticket_keys(ngx_conf_t *cf, ngx_ssl_t *ssl,
+    ngx_array_t *paths, time_t rotate);
+ngx_int_t ngx_ssl_stapling(ngx_conf_t *cf, ngx_ssl_t *ssl,
+    ngx_str_t *responder, ngx_uint_t verify);
+ngx_int_t ngx_ssl_stapling_init_process(ngx_cycle_t *cycle);
 ngx_int_t ngx_ssl_create_connection(ngx_ssl_t *ssl, ngx_connection_t *c,
     ngx_uint_t flags);
 
 void ngx_ssl_remove_cached_session(SSL_CTX *ssl, ngx_ssl_session_t *sess);
 ngx_int_t ngx_ssl_set_session(ngx_connection_t *c, ngx_ssl_session_t *session);
+ngx_int_t ngx_ssl_client_session_cache_init(ngx_shm_zone_t *shm_zone,
+    void *data);
+ngx_int_t ngx_ssl_set_cached_session(ngx_connection_t *c,
+    ngx_shm_zone_t *shm_zone, ngx_str_t *key);
+void ngx_ssl_save_cached_session(ngx_connection_t *c, ngx_shm_zone_t *shm_zone,
+    ngx_str_t *key);
 #define ngx_ssl_get_session(c)      SSL_get1_session(c->ssl->connection)
 #define ngx_ssl_free_session        SSL_SESSION_free
 #define ngx_ssl_get_connection(ssl_conn)                                      \
@@ -135,6 +235,16 @@ ngx_int_t ngx_ssl_get_serial_number(ngx_connection_t *c, ngx_pool_t *pool,
     ngx_str_t *s);
 ngx_int_t ngx_ssl_get_client_verify(ngx_connection_t *c, ngx_pool_t *pool,
     ngx_str_t *s);
+ngx_int_t ngx_ssl_get_session_reused(ngx_connection_t *c, ngx_pool_t *pool,
+    ngx_str_t *s);
+ngx_int_t ngx_ssl_get_session_stats(ngx_connection_t *c, ngx_pool_t *pool,
+    ngx_str_t *s);
+ngx_int_t ngx_ssl_get_stapling_stats(ngx_connection_t *c, ngx_pool_t *pool,
+    ngx_str_t *s);
+ngx_int_t ngx_ssl_get_handshake_time(ngx_connection_t *c, ngx_pool_t *pool,
+    ngx_str_t *s);
+ngx_int_t ngx_ssl_get_handshake_queue(ngx_connection_t *c, ngx_pool_t *pool,
+    ngx_str_t *s);
 
 
 ngx_int_t ngx_ssl_handshake(ngx_connection_t *c);
@@ -153,6 +263,11 @@ void ngx_ssl_cleanup_ctx(void *data);
 extern int  ngx_ssl_connection_index;
 extern int  ngx_ssl_server_conf_index;
 extern int  ngx_ssl_session_cache_index;
+extern int  ngx_ssl_ticket_keys_index;
+extern int  ngx_ssl_stapling_index;
+
+
+extern ngx_module_t  ngx_openssl_module;
 
 
 #endif /* _NGX_EVENT_OPENSSL_H_INCLUDED_ */
@@ -0,0 +1,1208 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_event_connect.h>
+
+#include <openssl/ocsp.h>
+
+
+#define NGX_SSL_STAPLING_CACHE_SIZE  (256 * 1024)
+#define NGX_SSL_STAPLING_BUFSIZE     16384
+#define NGX_SSL_STAPLING_TIMEOUT     30000
+
+/* the intervals of the update in seconds */
+#define NGX_SSL_STAPLING_REFRESH     3600
+#define NGX_SSL_STAPLING_RETRY       300
+#define NGX_SSL_STAPLING_WAIT        5
+
+
+typedef struct {
+    ngx_str_node_t                sn;
+
+    u_char                       *response;
+    size_t                        len;
+
+    time_t                        valid;
+    time_t                        refresh;
+
+    /* the time till which some worker is fetching the response */
+    time_t                        updating;
+} ngx_ssl_stapling_node_t;
+
+
+typedef struct {
+    ngx_rbtree_t                  rbtree;
+    ngx_rbtree_node_t             sentinel;
+
+    ngx_atomic_t                  stapled;
+    ngx_atomic_t                  not_stapled;
+} ngx_ssl_stapling_cache_t;
+
+
+typedef struct {
+    ngx_str_t                     id;           /* DER of OCSP_CERTID */
+    uint32_t                      hash;
+
+    SSL_CTX                      *ssl_ctx;
+    X509                         *cert;
+    X509                         *issuer;
+
+    ngx_str_t                     host;
+    ngx_str_t                     uri;
+    ngx_addr_t                   *addrs;
+    ngx_uint_t                    naddrs;
+
+    ngx_shm_zone_t               *shm_zone;
+    ngx_ssl_stapling_node_t      *node;
+
+    ngx_event_t                   event;
+    ngx_peer_connection_t         pc;
+    ngx_pool_t                   *pool;
+    ngx_buf_t                    *request;
+    ngx_buf_t                    *response;
+
+    ngx_uint_t                    verify;     /* unsigned  verify:1; */
+} ngx_ssl_stapling_t;
+
+
+static ngx_int_t ngx_ssl_stapling_issuer(ngx_conf_t *cf, ngx_ssl_t *ssl,
+    ngx_ssl_stapling_t *staple);
+static ngx_int_t ngx_ssl_stapling_responder(ngx_conf_t *cf, ngx_ssl_t *ssl,
+    ngx_ssl_stapling_t *staple, ngx_str_t *responder);
+static ngx_int_t ngx_ssl_stapling_cache_init(ngx_shm_zone_t *shm_zone,
+    void *data);
+static ngx_ssl_stapling_node_t *ngx_ssl_stapling_lookup(
+    ngx_ssl_stapling_t *staple, ngx_uint_t create);
+static int ngx_ssl_certificate_status_callback(ngx_ssl_conn_t *ssl_conn,
+    void *data);
+
+static void ngx_ssl_stapling_update(ngx_event_t *ev);
+static ngx_int_t ngx_ssl_stapling_create_request(ngx_ssl_stapling_t *staple);
+static void ngx_ssl_stapling_send_handler(ngx_event_t *wev);
+static void ngx_ssl_stapling_recv_handler(ngx_event_t *rev);
+static ngx_int_t ngx_ssl_stapling_process(ngx_ssl_stapling_t *staple);
+static void ngx_ssl_stapling_finalize(ngx_ssl_stapling_t *staple,
+    u_char *response, size_t len, time_t valid);
+static time_t ngx_ssl_stapling_time(ASN1_GENERALIZEDTIME *asn1time);
+
+
+static ngx_str_t  ngx_ssl_stapling_zone_name = ngx_string("ssl_stapling");
+
+
+ngx_int_t
+ngx_ssl_stapling(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *responder,
+    ngx_uint_t verify)
+{
+#ifdef SSL_CTRL_SET_TLSEXT_STATUS_REQ_CB
+
+    int                   len;
+    u_char               *p;
+    SSL                  *s;
+    ngx_int_t             rc;
+    OCSP_CERTID          *id;
+    ngx_ssl_stapling_t   *staple, **stp;
+    ngx_openssl_conf_t   *oscf;
+
+    staple = ngx_pcalloc(cf->pool, sizeof(ngx_ssl_stapling_t));
+    if (staple == NULL) {
+        return NGX_ERROR;
+    }
+
+    staple->ssl_ctx = ssl->ctx;
+    staple->verify = verify;
+
+    /* there is no way to get the certificate of the context itself */
+
+    s = SSL_new(ssl->ctx);
+    if (s == NULL) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0, "SSL_new() failed");
+        return NGX_ERROR;
+    }
+
+    staple->cert = SSL_get_certificate(s);
+
+    if (staple->cert) {
+        CRYPTO_add(&staple->cert->references, 1, CRYPTO_LOCK_X509);
+    }
+
+    SSL_free(s);
+
+    if (staple->cert == NULL) {
+        ngx_log_error(NGX_LOG_WARN, ssl->log, 0,
+                      "\"ssl_stapling\" ignored, no certificate");
+        return NGX_OK;
+    }
+
+    rc = ngx_ssl_stapling_issuer(cf, ssl, staple);
+
+    if (rc == NGX_DECLINED) {
+        return NGX_OK;
+    }
+
+    if (rc != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_ssl_stapling_responder(cf, ssl, staple, responder) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (staple->addrs == NULL) {
+        return NGX_OK;
+    }
+
+    id = OCSP_cert_to_id(NULL, staple->cert, staple->issuer);
+    if (id == NULL) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "OCSP_cert_to_id() failed");
+        return NGX_ERROR;
+    }
+
+    len = i2d_OCSP_CERTID(id, NULL);
+
+    staple->id.data = ngx_pnalloc(cf->pool, len);
+    if (staple->id.data == NULL) {
+        OCSP_CERTID_free(id);
+        return NGX_ERROR;
+    }
+
+    p = staple->id.data;
+    staple->id.len = i2d_OCSP_CERTID(id, &p);
+
+    OCSP_CERTID_free(id);
+
+    staple->hash = ngx_crc32_short(staple->id.data, staple->id.len);
+
+    /* the responses of all servers are kept in the same zone */
+
+    staple->shm_zone = ngx_shared_memory_add(cf, &ngx_ssl_stapling_zone_name,
+                                             NGX_SSL_STAPLING_CACHE_SIZE,
+                                             &ngx_openssl_module);
+    if (staple->shm_zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    staple->shm_zone->init = ngx_ssl_stapling_cache_init;
+
+    staple->event.handler = ngx_ssl_stapling_update;
+    staple->event.data = staple;
+    staple->event.log = &cf->cycle->new_log;
+
+    oscf = (ngx_openssl_conf_t *) ngx_get_conf(cf->cycle->conf_ctx,
+                                               ngx_openssl_module);
+
+    if (oscf->staplings == NULL) {
+        oscf->staplings = ngx_array_create(cf->pool, 4, sizeof(void *));
+        if (oscf->staplings == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    stp = ngx_array_push(oscf->staplings);
+    if (stp == NULL) {
+        return NGX_ERROR;
+    }
+
+    *stp = staple;
+
+    if (SSL_CTX_set_ex_data(ssl->ctx, ngx_ssl_stapling_index, staple) == 0) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "SSL_CTX_set_ex_data() failed");
+        return NGX_ERROR;
+    }
+
+    SSL_CTX_set_tlsext_status_cb(ssl->ctx,
+                                 ngx_ssl_certificate_status_callback);
+    SSL_CTX_set_tlsext_status_arg(ssl->ctx, staple);
+
+    return NGX_OK;
+
+#else
+
+    ngx_log_error(NGX_LOG_WARN, ssl->log, 0,
+                  "\"ssl_stapling\" ignored, not supported");
+
+    return NGX_OK;
+
+#endif
+}
+
+
+#ifdef SSL_CTRL_SET_TLSEXT_STATUS_REQ_CB
+
+static ngx_int_t
+ngx_ssl_stapling_issuer(ngx_conf_t *cf, ngx_ssl_t *ssl,
+    ngx_ssl_stapling_t *staple)
+{
+    int              i, n, rc;
+    X509            *issuer;
+    X509_STORE      *store;
+    STACK_OF(X509)  *chain;
+    X509_STORE_CTX  *store_ctx;
+
+    /* the chain loaded by ngx_ssl_certificate() is searched first */
+
+    chain = ssl->ctx->extra_certs;
+    n = chain ? sk_X509_num(chain) : 0;
+
+    for (i = 0; i < n; i++) {
+        issuer = sk_X509_value(chain, i);
+
+        if (X509_check_issued(issuer, staple->cert) == X509_V_OK) {
+            CRYPTO_add(&issuer->references, 1, CRYPTO_LOCK_X509);
+            staple->issuer = issuer;
+            return NGX_OK;
+        }
+    }
+
+    store = SSL_CTX_get_cert_store(ssl->ctx);
+    if (store == NULL) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "SSL_CTX_get_cert_store() failed");
+        return NGX_ERROR;
+    }
+
+    store_ctx = X509_STORE_CTX_new();
+    if (store_ctx == NULL) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "X509_STORE_CTX_new() failed");
+        return NGX_ERROR;
+    }
+
+    if (X509_STORE_CTX_init(store_ctx, store, NULL, NULL) == 0) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "X509_STORE_CTX_init() failed");
+        X509_STORE_CTX_free(store_ctx);
+        return NGX_ERROR;
+    }
+
+    rc = X509_STORE_CTX_get1_issuer(&issuer, store_ctx, staple->cert);
+
+    X509_STORE_CTX_free(store_ctx);
+
+    if (rc != 1) {
+        ngx_log_error(NGX_LOG_WARN, ssl->log, 0,
+                      "\"ssl_stapling\" ignored, issuer certificate not found");
+        return NGX_DECLINED;
+    }
+
+    staple->issuer = issuer;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_ssl_stapling_responder(ngx_conf_t *cf, ngx_ssl_t *ssl,
+    ngx_ssl_stapling_t *staple, ngx_str_t *responder)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L
+    STACK_OF(OPENSSL_STRING)  *aia;
+#else
+    STACK                     *aia;
+#endif
+    ngx_url_t                  u;
+    ngx_str_t                  s;
+
+    if (responder->len == 0) {
+
+        /* the responder from the "Authority Information Access" extension */
+
+        aia = X509_get1_ocsp(staple->cert);
+        if (aia == NULL) {
+            ngx_log_error(NGX_LOG_WARN, ssl->log, 0,
+                          "\"ssl_stapling\" ignored, "
+                          "no OCSP responder URL in the certificate");
+            return NGX_OK;
+        }
+
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L
+        s.data = (u_char *) sk_OPENSSL_STRING_value(aia, 0);
+#else
+        s.data = (u_char *) sk_value(aia, 0);
+#endif
+        s.len = s.data ? ngx_strlen(s.data) : 0;
+
+        if (s.len == 0) {
+            X509_email_free(aia);
+
+            ngx_log_error(NGX_LOG_WARN, ssl->log, 0,
+                          "\"ssl_stapling\" ignored, "
+                          "no OCSP responder URL in the certificate");
+            return NGX_OK;
+        }
+
+        responder->data = ngx_pnalloc(cf->pool, s.len);
+        if (responder->data == NULL) {
+            X509_email_free(aia);
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(responder->data, s.data, s.len);
+        responder->len = s.len;
+
+        X509_email_free(aia);
+    }
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url = *responder;
+    u.default_port = 80;
+    u.uri_part = 1;
+
+    if (u.url.len > 7
+        && ngx_strncasecmp(u.url.data, (u_char *) "http://", 7) == 0)
+    {
+        u.url.len -= 7;
+        u.url.data += 7;
+
+    } else {
+        ngx_log_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "invalid URL prefix in OCSP responder \"%V\"",
+                      responder);
+        return NGX_ERROR;
+    }
+
+    if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+        if (u.err) {
+            ngx_log_error(NGX_LOG_EMERG, ssl->log, 0,
+                          "%s in OCSP responder \"%V\"", u.err, responder);
+        }
+
+        return NGX_ERROR;
+    }
+
+    staple->addrs = u.addrs;
+    staple->naddrs = u.naddrs;
+    staple->host = u.host;
+
+    if (u.uri.len) {
+        staple->uri = u.uri;
+
+    } else {
+        ngx_str_set(&staple->uri, "/");
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_ssl_stapling_cache_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    size_t                     len;
+    ngx_slab_pool_t           *shpool;
+    ngx_ssl_stapling_cache_t  *cache;
+
+    if (data) {
+        shm_zone->data = data;
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
+    }
+
+    cache = ngx_slab_alloc(shpool, sizeof(ngx_ssl_stapling_cache_t));
+    if (cache == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(cache, sizeof(ngx_ssl_stapling_cache_t));
+
+    shpool->data = cache;
+    shm_zone->data = cache;
+
+    ngx_rbtree_init(&cache->rbtree, &cache->sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    len = sizeof(" in OCSP stapling cache \"\"") + shm_zone->shm.name.len;
+
+    shpool->log_ctx = ngx_slab_alloc(shpool, len);
+    if (shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(shpool->log_ctx, " in OCSP stapling cache \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+
+/*
+ * the nodes are never removed, so the worker keeps the pointer
+ * to the node of its certificate after the first lookup
+ */
+
+static ngx_ssl_stapling_node_t *
+ngx_ssl_stapling_lookup(ngx_ssl_stapling_t *staple, ngx_uint_t create)
+{
+    ngx_str_node_t            *sn;
+    ngx_slab_pool_t           *shpool;
+    ngx_ssl_stapling_node_t   *node;
+    ngx_ssl_stapling_cache_t  *cache;
+
+    if (staple->node) {
+        return staple->node;
+    }
+
+    cache = staple->shm_zone->data;
+    shpool = (ngx_slab_pool_t *) staple->shm_zone->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    sn = ngx_str_rbtree_lookup(&cache->rbtree, &staple->id, staple->hash);
+
+    if (sn) {
+        node = (ngx_ssl_stapling_node_t *) sn;
+        goto done;
+    }
+
+    if (!create) {
+        node = NULL;
+        goto done;
+    }
+
+    node = ngx_slab_alloc_locked(shpool,
+                                 sizeof(ngx_ssl_stapling_node_t)
+                                 + staple->id.len);
+    if (node == NULL) {
+        goto done;
+    }
+
+    ngx_memzero(node, sizeof(ngx_ssl_stapling_node_t));
+
+    node->sn.node.key = staple->hash;
+    node->sn.str.len = staple->id.len;
+    node->sn.str.data = (u_char *) node + sizeof(ngx_ssl_stapling_node_t);
+    ngx_memcpy(node->sn.str.data, staple->id.data, staple->id.len);
+
+    ngx_rbtree_insert(&cache->rbtree, &node->sn.node);
+
+done:
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    staple->node = node;
+
+    return node;
+}
+
+
+static int
+ngx_ssl_certificate_status_callback(ngx_ssl_conn_t *ssl_conn, void *data)
+{
+    ngx_ssl_stapling_t *staple = data;
+
+    u_char                    *p;
+    size_t                     len;
+    ngx_slab_pool_t           *shpool;
+    ngx_connection_t          *c;
+    ngx_ssl_stapling_node_t   *node;
+    ngx_ssl_stapling_cache_t  *cache;
+
+    c = ngx_ssl_get_connection(ssl_conn);
+
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "SSL certificate status callback");
+
+    cache = staple->shm_zone->data;
+    shpool = (ngx_slab_pool_t *) staple->shm_zone->shm.addr;
+
+    /*
+     * the callback may run in a handshake thread, so the node is
+     * only looked up here, the updates are done by the worker timer
+     */
+
+    node = ngx_ssl_stapling_lookup(staple, 0);
+
+    p = NULL;
+    len = 0;
+
+    if (node) {
+        ngx_shmtx_lock(&shpool->mutex);
+
+        if (node->len && node->valid > ngx_time()) {
+
+            /* the response is freed by OpenSSL */
+
+            p = OPENSSL_malloc(node->len);
+
+            if (p) {
+                ngx_memcpy(p, node->response, node->len);
+                len = node->len;
+            }
+        }
+
+        ngx_shmtx_unlock(&shpool->mutex);
+    }
+
+    if (p == NULL) {
+        (void) ngx_atomic_fetch_add(&cache->not_stapled, 1);
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+
+    SSL_set_tlsext_status_ocsp_resp(ssl_conn, p, (long) len);
+
+    (void) ngx_atomic_fetch_add(&cache->stapled, 1);
+
+    return SSL_TLSEXT_ERR_OK;
+}
+
+#endif
+
+
+ngx_int_t
+ngx_ssl_stapling_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t            i;
+    ngx_openssl_conf_t   *oscf;
+    ngx_ssl_stapling_t  **staple;
+
+    oscf = (ngx_openssl_conf_t *) ngx_get_conf(cycle->conf_ctx,
+                                               ngx_openssl_module);
+
+    if (oscf->staplings == NULL) {
+        return NGX_OK;
+    }
+
+    staple = oscf->staplings->elts;
+
+    for (i = 0; i < oscf->staplings->nelts; i++) {
+
+        /* the workers start at random moments, the first one fetches */
+
+        ngx_add_timer(&staple[i]->event, (ngx_msec_t) ngx_random() % 1000);
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * every worker checks the shared response by its own timer, the worker
+ * which finds it missing or due for refresh marks the node as updating
+ * and fetches the new response, the others wait for it
+ */
+
+static void
+ngx_ssl_stapling_update(ngx_event_t *ev)
+{
+    ngx_ssl_stapling_t *staple = ev->data;
+
+    time_t                    now;
+    ngx_int_t                 rc;
+    ngx_msec_t                delay;
+    ngx_connection_t         *c;
+    ngx_slab_pool_t          *shpool;
+    ngx_ssl_stapling_node_t  *node;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    node = ngx_ssl_stapling_lookup(staple, 1);
+
+    if (node == NULL) {
+        ngx_log_error(NGX_LOG_CRIT, ev->log, 0,
+                      "could not allocate node in OCSP stapling cache");
+        ngx_add_timer(ev, NGX_SSL_STAPLING_RETRY * 1000);
+        return;
+    }
+
+    shpool = (ngx_slab_pool_t *) staple->shm_zone->shm.addr;
+    now = ngx_time();
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    if (node->refresh > now) {
+        delay = (ngx_msec_t) (node->refresh - now) * 1000;
+        ngx_shmtx_unlock(&shpool->mutex);
+
+        ngx_add_timer(ev, delay + (ngx_msec_t) ngx_random() % 1000);
+        return;
+    }
+
+    if (node->updating > now) {
+        ngx_shmtx_unlock(&shpool->mutex);
+
+        ngx_add_timer(ev, NGX_SSL_STAPLING_WAIT * 1000);
+        return;
+    }
+
+    node->updating = now + NGX_SSL_STAPLING_TIMEOUT / 1000
+                     + NGX_SSL_STAPLING_WAIT;
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "ssl ocsp request to %V", &staple->addrs[0].name);
+
+    staple->pool = ngx_create_pool(NGX_SSL_STAPLING_BUFSIZE + 1024, ev->log);
+    if (staple->pool == NULL) {
+        ngx_ssl_stapling_finalize(staple, NULL, 0, 0);
+        return;
+    }
+
+    if (ngx_ssl_stapling_create_request(staple) != NGX_OK) {
+        ngx_ssl_stapling_finalize(staple, NULL, 0, 0);
+        return;
+    }
+
+    ngx_memzero(&staple->pc, sizeof(ngx_peer_connection_t));
+
+    staple->pc.sockaddr = staple->addrs[0].sockaddr;
+    staple->pc.socklen = staple->addrs[0].socklen;
+    staple->pc.name = &staple->addrs[0].name;
+    staple->pc.get = ngx_event_get_peer;
+    staple->pc.log = ev->log;
+    staple->pc.log_error = NGX_ERROR_ERR;
+
+    rc = ngx_event_connect_peer(&staple->pc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_ssl_stapling_finalize(staple, NULL, 0, 0);
+        return;
+    }
+
+    c = staple->pc.connection;
+
+    c->data = staple;
+    c->pool = staple->pool;
+    c->log = ev->log;
+    c->read->log = ev->log;
+    c->write->log = ev->log;
+
+    c->write->handler = ngx_ssl_stapling_send_handler;
+    c->read->handler = ngx_ssl_stapling_recv_handler;
+
+    /* the timeout covers the whole request */
+
+    ngx_add_timer(c->read, NGX_SSL_STAPLING_TIMEOUT);
+
+    if (rc == NGX_OK) {
+        ngx_ssl_stapling_send_handler(c->write);
+    }
+}
+
+
+static ngx_int_t
+ngx_ssl_stapling_create_request(ngx_ssl_stapling_t *staple)
+{
+    int            len;
+    u_char        *p;
+    ngx_buf_t     *b;
+    OCSP_CERTID   *id;
+    OCSP_REQUEST  *ocsp;
+#if OPENSSL_VERSION_NUMBER >= 0x0090707fL
+    const
+#endif
+    u_char        *d;
+
+    ocsp = OCSP_REQUEST_new();
+    if (ocsp == NULL) {
+        ngx_ssl_error(NGX_LOG_CRIT, staple->event.log, 0,
+                      "OCSP_REQUEST_new() failed");
+        return NGX_ERROR;
+    }
+
+    d = staple->id.data;
+
+    id = d2i_OCSP_CERTID(NULL, &d, staple->id.len);
+    if (id == NULL) {
+        ngx_ssl_error(NGX_LOG_CRIT, staple->event.log, 0,
+                      "d2i_OCSP_CERTID() failed");
+        goto failed;
+    }
+
+    if (OCSP_request_add0_id(ocsp, id) == NULL) {
+        ngx_ssl_error(NGX_LOG_CRIT, staple->event.log, 0,
+                      "OCSP_request_add0_id() failed");
+        OCSP_CERTID_free(id);
+        goto failed;
+    }
+
+    len = i2d_OCSP_REQUEST(ocsp, NULL);
+
+    b = ngx_create_temp_buf(staple->pool,
+                            sizeof("POST  HTTP/1.0" CRLF) - 1
+                            + staple->uri.len
+                            + sizeof("Host: " CRLF) - 1 + staple->host.len
+                            + sizeof("Content-Type: application/ocsp-request"
+                                     CRLF) - 1
+                            + sizeof("Content-Length: " CRLF CRLF) - 1
+                            + NGX_INT_T_LEN + len);
+    if (b == NULL) {
+        goto failed;
+    }
+
+    p = b->last;
+
+    p = ngx_sprintf(p, "POST %V HTTP/1.0" CRLF, &staple->uri);
+    p = ngx_sprintf(p, "Host: %V" CRLF, &staple->host);
+    p = ngx_cpymem(p, "Content-Type: application/ocsp-request" CRLF,
+                   sizeof("Content-Type: application/ocsp-request" CRLF) - 1);
+    p = ngx_sprintf(p, "Content-Length: %d" CRLF CRLF, len);
+
+    i2d_OCSP_REQUEST(ocsp, &p);
+
+    b->last = p;
+
+    OCSP_REQUEST_free(ocsp);
+
+    staple->request = b;
+
+    staple->response = ngx_create_temp_buf(staple->pool,
+                                           NGX_SSL_STAPLING_BUFSIZE);
+    if (staple->response == NULL) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+
+failed:
+
+    OCSP_REQUEST_free(ocsp);
+
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_ssl_stapling_send_handler(ngx_event_t *wev)
+{
+    ssize_t              n;
+    ngx_buf_t           *b;
+    ngx_connection_t    *c;
+    ngx_ssl_stapling_t  *staple;
+
+    c = wev->data;
+    staple = c->data;
+    b = staple->request;
+
+    while (b->pos < b->last) {
+
+        n = c->send(c, b->pos, b->last - b->pos);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+                ngx_ssl_stapling_finalize(staple, NULL, 0, 0);
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR) {
+            ngx_ssl_stapling_finalize(staple, NULL, 0, 0);
+            return;
+        }
+
+        b->pos += n;
+    }
+
+    if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+        ngx_ssl_stapling_finalize(staple, NULL, 0, 0);
+        return;
+    }
+
+    if (c->read->ready) {
+        ngx_ssl_stapling_recv_handler(c->read);
+    }
+}
+
+
+static void
+ngx_ssl_stapling_recv_handler(ngx_event_t *rev)
+{
+    ssize_t              n;
+    ngx_buf_t           *b;
+    ngx_connection_t    *c;
+    ngx_ssl_stapling_t  *staple;
+
+    c = rev->data;
+    staple = c->data;
+    b = staple->response;
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "OCSP responder %V timed out", staple->pc.name);
+        ngx_ssl_stapling_finalize(staple, NULL, 0, 0);
+        return;
+    }
+
+    if (staple->request->pos < staple->request->last) {
+        ngx_ssl_stapling_send_handler(c->write);
+        return;
+    }
+
+    /* the HTTP/1.0 response ends when the responder closes connection */
+
+    for ( ;; ) {
+
+        if (b->last == b->end) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "OCSP responder %V sent too big response",
+                          staple->pc.name);
+            ngx_ssl_stapling_finalize(staple, NULL, 0, 0);
+            return;
+        }
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                ngx_ssl_stapling_finalize(staple, NULL, 0, 0);
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR) {
+            ngx_ssl_stapling_finalize(staple, NULL, 0, 0);
+            return;
+        }
+
+        if (n == 0) {
+            break;
+        }
+
+        b->last += n;
+    }
+
+    if (ngx_ssl_stapling_process(staple) != NGX_OK) {
+        ngx_ssl_stapling_finalize(staple, NULL, 0, 0);
+    }
+}
+
+
+static ngx_int_t
+ngx_ssl_stapling_process(ngx_ssl_stapling_t *staple)
+{
+    int                    n;
+    u_char                *p, *last;
+    size_t                 len;
+    time_t                 valid;
+    ngx_int_t              status;
+    ngx_log_t             *log;
+    X509_STORE            *store;
+    OCSP_CERTID           *id;
+    OCSP_RESPONSE         *ocsp;
+    OCSP_BASICRESP        *basic;
+    STACK_OF(X509)        *chain;
+    ASN1_GENERALIZEDTIME  *thisupdate, *nextupdate;
+#if OPENSSL_VERSION_NUMBER >= 0x0090707fL
+    const
+#endif
+    u_char                *d;
+
+    log = staple->event.log;
+    p = staple->response->pos;
+    last = staple->response->last;
+
+    if (last - p < (ssize_t) sizeof("HTTP/1.x 200") - 1
+        || ngx_strncmp(p, "HTTP/1.", sizeof("HTTP/1.") - 1) != 0
+        || p[8] != ' ')
+    {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "OCSP responder %V sent invalid response status line",
+                      staple->pc.name);
+        return NGX_ERROR;
+    }
+
+    status = ngx_atoi(p + 9, 3);
+
+    if (status != 200) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "OCSP responder %V sent unexpected status %*s",
+                      staple->pc.name, (size_t) 3, p + 9);
+        return NGX_ERROR;
+    }
+
+    p = ngx_strnstr(p, CRLF CRLF, last - p);
+
+    if (p == NULL) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "OCSP responder %V sent truncated response",
+                      staple->pc.name);
+        return NGX_ERROR;
+    }
+
+    p += sizeof(CRLF CRLF) - 1;
+    len = last - p;
+
+    d = p;
+
+    ocsp = d2i_OCSP_RESPONSE(NULL, &d, len);
+    if (ocsp == NULL) {
+        ngx_ssl_error(NGX_LOG_ERR, log, 0,
+                      "d2i_OCSP_RESPONSE() failed");
+        return NGX_ERROR;
+    }
+
+    id = NULL;
+    basic = NULL;
+
+    n = OCSP_response_status(ocsp);
+
+    if (n != OCSP_RESPONSE_STATUS_SUCCESSFUL) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "OCSP response not successful (%d: %s)",
+                      n, OCSP_response_status_str(n));
+        goto error;
+    }
+
+    basic = OCSP_response_get1_basic(ocsp);
+    if (basic == NULL) {
+        ngx_ssl_error(NGX_LOG_ERR, log, 0,
+                      "OCSP_response_get1_basic() failed");
+        goto error;
+    }
+
+    /* the issuer from the chain may sign the response itself */
+
+    chain = staple->ssl_ctx->extra_certs;
+    store = SSL_CTX_get_cert_store(staple->ssl_ctx);
+
+    if (OCSP_basic_verify(basic, chain, store,
+                          staple->verify ? OCSP_TRUSTOTHER : OCSP_NOVERIFY)
+        != 1)
+    {
+        ngx_ssl_error(NGX_LOG_ERR, log, 0,
+                      "OCSP_basic_verify() failed");
+        goto error;
+    }
+
+    d = staple->id.data;
+
+    id = d2i_OCSP_CERTID(NULL, &d, staple->id.len);
+    if (id == NULL) {
+        ngx_ssl_error(NGX_LOG_CRIT, log, 0,
+                      "d2i_OCSP_CERTID() failed");
+        goto error;
+    }
+
+    if (OCSP_resp_find_status(basic, id, &n, NULL, NULL,
+                              &thisupdate, &nextupdate)
+        != 1)
+    {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "certificate status not found in the OCSP response");
+        goto error;
+    }
+
+    if (n != V_OCSP_CERTSTATUS_GOOD) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "certificate status \"%s\" in the OCSP response",
+                      OCSP_cert_status_str(n));
+        goto error;
+    }
+
+    if (OCSP_check_validity(thisupdate, nextupdate, 300, -1) != 1) {
+        ngx_ssl_error(NGX_LOG_ERR, log, 0,
+                      "OCSP_check_validity() failed");
+        goto error;
+    }
+
+    if (nextupdate) {
+        valid = ngx_ssl_stapling_time(nextupdate);
+        if (valid == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "invalid nextUpdate time in the OCSP response");
+            goto error;
+        }
+
+    } else {
+        valid = ngx_time() + NGX_SSL_STAPLING_REFRESH;
+    }
+
+    OCSP_CERTID_free(id);
+    OCSP_BASICRESP_free(basic);
+    OCSP_RESPONSE_free(ocsp);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "ssl ocsp response, valid till %T", valid);
+
+    ngx_ssl_stapling_finalize(staple, p, len, valid);
+
+    return NGX_OK;
+
+error:
+
+    if (id) {
+        OCSP_CERTID_free(id);
+    }
+
+    if (basic) {
+        OCSP_BASICRESP_free(basic);
+    }
+
+    OCSP_RESPONSE_free(ocsp);
+
+    return NGX_ERROR;
+}
+
+
+/*
+ * the response is refreshed in the middle of its validity period,
+ * but at least hourly, the failed fetch is retried in 5 minutes
+ * while the old response stays until it expires
+ */
+
+static void
+ngx_ssl_stapling_finalize(ngx_ssl_stapling_t *staple, u_char *response,
+    size_t len, time_t valid)
+{
+    time_t                    now, refresh;
+    u_char                   *p;
+    ngx_slab_pool_t          *shpool;
+    ngx_ssl_stapling_node_t  *node;
+
+    now = ngx_time();
+    node = staple->node;
+    shpool = (ngx_slab_pool_t *) staple->shm_zone->shm.addr;
+
+    if (response) {
+        refresh = now + ngx_min(NGX_SSL_STAPLING_REFRESH, (valid - now) / 2);
+        refresh = ngx_max(refresh, now + NGX_SSL_STAPLING_WAIT);
+
+    } else {
+        refresh = now + NGX_SSL_STAPLING_RETRY;
+    }
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    if (response) {
+        p = ngx_slab_alloc_locked(shpool, len);
+
+        if (p) {
+            if (node->response) {
+                ngx_slab_free_locked(shpool, node->response);
+            }
+
+            ngx_memcpy(p, response, len);
+
+            node->response = p;
+            node->len = len;
+            node->valid = valid;
+
+        } else {
+            ngx_log_error(NGX_LOG_CRIT, staple->event.log, 0,
+                          "could not store response in OCSP stapling cache");
+            refresh = now + NGX_SSL_STAPLING_RETRY;
+        }
+    }
+
+    node->refresh = refresh;
+    node->updating = 0;
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    if (staple->pc.connection) {
+        ngx_close_connection(staple->pc.connection);
+        staple->pc.connection = NULL;
+    }
+
+    if (staple->pool) {
+        ngx_destroy_pool(staple->pool);
+        staple->pool = NULL;
+    }
+
+    if (!ngx_exiting) {
+        ngx_add_timer(&staple->event, (ngx_msec_t) (refresh - now) * 1000);
+    }
+}
+
+
+static time_t
+ngx_ssl_stapling_time(ASN1_GENERALIZEDTIME *asn1time)
+{
+    u_char     *p;
+    uint64_t    time;
+    ngx_int_t   i, n[6];
+
+    /* "YYYYMMDDHHMMSSZ" */
+
+    if (asn1time->length < 15) {
+        return NGX_ERROR;
+    }
+
+    p = asn1time->data;
+
+    n[0] = ngx_atoi(p, 4);
+
+    for (i = 1; i < 6; i++) {
+        n[i] = ngx_atoi(p + 2 + 2 * i, 2);
+    }
+
+    for (i = 0; i < 6; i++) {
+        if (n[i] == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
+    /* shift new year to March 1 for Gauss' formula, as in http time */
+
+    if ((n[1] -= 2) <= 0) {
+        n[1] += 12;
+        n[0] -= 1;
+    }
+
+    time = (uint64_t) (365 * n[0] + n[0] / 4 - n[0] / 100 + n[0] / 400
+                       + 367 * n[1] / 12 - 30 + n[2] - 1
+                       - 719527 + 31 + 28) * 86400
+           + n[3] * 3600 + n[4] * 60 + n[5];
+
+#if (NGX_TIME_T_SIZE <= 4)
+
+    if (time > 0x7fffffff) {
+        return NGX_ERROR;
+    }
+
+#endif
+
+    return (time_t) time;
+}
+
+
+ngx_int_t
+ngx_ssl_get_stapling_stats(ngx_connection_t *c, ngx_pool_t *pool,
+    ngx_str_t *s)
+{
+    u_char                    *p;
+    ngx_ssl_stapling_t        *staple;
+    ngx_ssl_stapling_cache_t  *cache;
+
+    staple = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(c->ssl->connection),
+                                 ngx_ssl_stapling_index);
+    if (staple == NULL) {
+        s->len = 0;
+        return NGX_OK;
+    }
+
+    cache = staple->shm_zone->data;
+
+    p = ngx_pnalloc(pool, sizeof("stapled= not_stapled=") - 1
+                          + 2 * NGX_ATOMIC_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    s->data = p;
+
+    p = ngx_sprintf(p, "stapled=%uA not_stapled=%uA",
+                    cache->stapled, cache->not_stapled);
+
+    s->len = p - s->data;
+
+    return NGX_OK;
+}
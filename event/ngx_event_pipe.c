@@ -338,6 +338,34 @@ ngx_event_pipe_read_upstream(ngx_event_pipe_t *p)
         }
     }
 
+    /*
+     * the input filter may know how much data is still expected,
+     * then a partially filled buf is passed to it once it has enough,
+     * as the upstream keeping the connection does not send more
+     */
+
+    if (p->free_raw_bufs && p->length != -1) {
+        cl = p->free_raw_bufs;
+
+        if (cl->buf->last - cl->buf->pos >= p->length) {
+
+            p->free_raw_bufs = cl->next;
+
+            /* STUB */ cl->buf->num = p->num++;
+
+            if (p->input_filter(p, cl->buf) == NGX_ERROR) {
+                return NGX_ABORT;
+            }
+
+            ngx_free_chain(p->pool, cl);
+        }
+    }
+
+    if (p->length == 0) {
+        p->upstream_done = 1;
+        p->read = 1;
+    }
+
 #if (NGX_DEBUG)
 
     for (cl = p->busy; cl; cl = cl->next) {
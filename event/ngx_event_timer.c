@@ -17,6 +17,10 @@ ngx_mutex_t  *ngx_event_timer_mutex = NULL;
 ngx_thread_volatile ngx_rbtree_t  ngx_event_timer_rbtree;
 static ngx_rbtree_node_t          ngx_event_timer_sentinel;
 
+
+static ngx_int_t ngx_event_cancelable_timers(ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel);
+
 /*
  * the event timer rbtree may contain the duplicate keys, however,
  * it should not be a problem, because we use the rbtree to find
@@ -156,3 +160,52 @@ ngx_event_expire_timers(void)
 
     ngx_mutex_unlock(ngx_event_timer_mutex);
 }
+
+
+/*
+ * the exiting worker does not wait for the cancelable timers,
+ * such as the periodic ones that only rearm themselves
+ */
+
+ngx_int_t
+ngx_event_no_timers_left(void)
+{
+    ngx_int_t  rc;
+
+    if (ngx_event_timer_rbtree.root == ngx_event_timer_rbtree.sentinel) {
+        return NGX_OK;
+    }
+
+    ngx_mutex_lock(ngx_event_timer_mutex);
+
+    rc = ngx_event_cancelable_timers(ngx_event_timer_rbtree.root,
+                                     ngx_event_timer_rbtree.sentinel);
+
+    ngx_mutex_unlock(ngx_event_timer_mutex);
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_event_cancelable_timers(ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel)
+{
+    ngx_event_t  *ev;
+
+    if (node == sentinel) {
+        return NGX_OK;
+    }
+
+    ev = (ngx_event_t *) ((char *) node - offsetof(ngx_event_t, timer));
+
+    if (!ev->cancelable) {
+        return NGX_AGAIN;
+    }
+
+    if (ngx_event_cancelable_timers(node->left, sentinel) != NGX_OK) {
+        return NGX_AGAIN;
+    }
+
+    return ngx_event_cancelable_timers(node->right, sentinel);
+}
@@ -0,0 +1,233 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+typedef struct {
+    ngx_http_file_cache_t  *cache;
+    ngx_str_t               method;
+} ngx_http_cache_purge_loc_conf_t;
+
+
+static ngx_int_t ngx_http_cache_purge_handler(ngx_http_request_t *r);
+static void *ngx_http_cache_purge_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_cache_purge_merge_loc_conf(ngx_conf_t *cf,
+    void *parent, void *child);
+static char *ngx_http_cache_purge_tag(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_http_cache_purge_commands[] = {
+
+    { ngx_string("cache_purge_tag"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_cache_purge_tag,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("cache_purge_method"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_cache_purge_loc_conf_t, method),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_cache_purge_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_cache_purge_create_loc_conf,  /* create location configuration */
+    ngx_http_cache_purge_merge_loc_conf    /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_cache_purge_module = {
+    NGX_MODULE_V1,
+    &ngx_http_cache_purge_module_ctx,      /* module context */
+    ngx_http_cache_purge_commands,         /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+/*
+ * "DELETE /purge?tag=KEY" invalidates all entries stored with the surrogate
+ * key KEY, the response is "200 OK" with the number of the purged entries
+ * or "404 Not Found" if the key is unknown; the method is set by the
+ * "cache_purge_method" directive, other methods are not allowed
+ */
+
+static ngx_int_t
+ngx_http_cache_purge_handler(ngx_http_request_t *r)
+{
+    u_char                           *dst, *src;
+    size_t                            len;
+    ngx_int_t                         rc;
+    ngx_str_t                         tag, value;
+    ngx_buf_t                        *b;
+    ngx_uint_t                        purged;
+    ngx_chain_t                       out;
+    ngx_http_cache_purge_loc_conf_t  *plcf;
+
+    plcf = ngx_http_get_module_loc_conf(r, ngx_http_cache_purge_module);
+
+    if (r->method_name.len != plcf->method.len
+        || ngx_strncmp(r->method_name.data, plcf->method.data,
+                       plcf->method.len) != 0)
+    {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "tag", 3, &value) != NGX_OK
+        || value.len == 0)
+    {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "cache purge request without the \"tag\" argument");
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    tag.data = ngx_pnalloc(r->pool, value.len);
+    if (tag.data == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    dst = tag.data;
+    src = value.data;
+
+    ngx_unescape_uri(&dst, &src, value.len, NGX_UNESCAPE_URI);
+
+    tag.len = dst - tag.data;
+
+    rc = ngx_http_file_cache_purge_tag(plcf->cache, &tag, r->pool, &purged);
+
+    if (rc == NGX_DECLINED) {
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    if (rc == NGX_ERROR) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                  "cache purge: %ui entries of the \"%V\" tag", purged, &tag);
+
+    len = sizeof("purged: \n") - 1 + NGX_INT_T_LEN;
+
+    b = ngx_create_temp_buf(r->pool, len);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->last = ngx_sprintf(b->last, "purged: %ui\n", purged);
+    b->last_buf = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static void *
+ngx_http_cache_purge_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_cache_purge_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_cache_purge_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->cache = NULL;
+     *     conf->method = { 0, NULL };
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_http_cache_purge_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_cache_purge_loc_conf_t *prev = parent;
+    ngx_http_cache_purge_loc_conf_t *conf = child;
+
+    ngx_conf_merge_str_value(conf->method, prev->method, "DELETE");
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_cache_purge_tag(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_cache_purge_loc_conf_t *plcf = conf;
+
+    ngx_str_t                 *value;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    if (plcf->cache) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    plcf->cache = ngx_http_file_cache_zone(cf, &value[1]);
+
+    if (plcf->cache == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "unknown cache zone \"%V\", the zone should be "
+                           "defined before by a *_cache_path directive",
+                           &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_cache_purge_handler;
+
+    return NGX_CONF_OK;
+}
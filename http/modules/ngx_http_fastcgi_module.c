@@ -20,6 +20,8 @@ typedef struct {
     ngx_array_t                   *params_source;
     ngx_array_t                   *catch_stderr;
 
+    ngx_flag_t                     keep_conn;
+
     ngx_array_t                   *fastcgi_lengths;
     ngx_array_t                   *fastcgi_values;
 
@@ -46,6 +48,7 @@ typedef enum {
     ngx_http_fastcgi_st_content_length_lo,
     ngx_http_fastcgi_st_padding_length,
     ngx_http_fastcgi_st_reserved,
+    ngx_http_fastcgi_st_skip,
     ngx_http_fastcgi_st_data,
     ngx_http_fastcgi_st_padding
 } ngx_http_fastcgi_state_e;
@@ -65,6 +68,9 @@ typedef struct {
     size_t                         length;
     size_t                         padding;
 
+    ngx_uint_t                     id;
+    ngx_uint_t                     request_id;
+
     unsigned                       fastcgi_stdout:1;
     unsigned                       large_stderr:1;
 
@@ -77,6 +83,8 @@ typedef struct {
 
 #define NGX_HTTP_FASTCGI_RESPONDER      1
 
+#define NGX_HTTP_FASTCGI_KEEP_CONN      1
+
 #define NGX_HTTP_FASTCGI_BEGIN_REQUEST  1
 #define NGX_HTTP_FASTCGI_ABORT_REQUEST  2
 #define NGX_HTTP_FASTCGI_END_REQUEST    3
@@ -130,6 +138,7 @@ static ngx_int_t ngx_http_fastcgi_create_key(ngx_http_request_t *r);
 static ngx_int_t ngx_http_fastcgi_create_request(ngx_http_request_t *r);
 static ngx_int_t ngx_http_fastcgi_reinit_request(ngx_http_request_t *r);
 static ngx_int_t ngx_http_fastcgi_process_header(ngx_http_request_t *r);
+static ngx_int_t ngx_http_fastcgi_input_filter_init(void *data);
 static ngx_int_t ngx_http_fastcgi_input_filter(ngx_event_pipe_t *p,
     ngx_buf_t *buf);
 static ngx_int_t ngx_http_fastcgi_process_record(ngx_http_request_t *r,
@@ -372,6 +381,13 @@ static ngx_command_t  ngx_http_fastcgi_commands[] = {
       offsetof(ngx_http_fastcgi_loc_conf_t, upstream.cache_methods),
       &ngx_http_upstream_cache_method_mask },
 
+    { ngx_string("fastcgi_cache_read_while_write"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fastcgi_loc_conf_t, upstream.cache_read_while_write),
+      NULL },
+
 #endif
 
     { ngx_string("fastcgi_temp_path"),
@@ -437,6 +453,13 @@ static ngx_command_t  ngx_http_fastcgi_commands[] = {
       offsetof(ngx_http_fastcgi_loc_conf_t, catch_stderr),
       NULL },
 
+    { ngx_string("fastcgi_keep_conn"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fastcgi_loc_conf_t, keep_conn),
+      NULL },
+
       ngx_null_command
 };
 
@@ -484,7 +507,7 @@ static ngx_http_fastcgi_request_start_t  ngx_http_fastcgi_request_start = {
 
     { 0,                                               /* role_hi */
       NGX_HTTP_FASTCGI_RESPONDER,                      /* role_lo */
-      0, /* NGX_HTTP_FASTCGI_KEEP_CONN */              /* flags */
+      0,                                               /* flags */
       { 0, 0, 0, 0, 0 } },                             /* reserved[5] */
 
     { 1,                                               /* version */
@@ -495,6 +518,9 @@ static ngx_http_fastcgi_request_start_t  ngx_http_fastcgi_request_start = {
 };
 
 
+static ngx_uint_t  ngx_http_fastcgi_request_id;
+
+
 static ngx_http_variable_t  ngx_http_fastcgi_vars[] = {
 
     { ngx_string("fastcgi_script_name"), NULL,
@@ -516,6 +542,7 @@ static ngx_str_t  ngx_http_fastcgi_hide_headers[] = {
     ngx_string("X-Accel-Limit-Rate"),
     ngx_string("X-Accel-Buffering"),
     ngx_string("X-Accel-Charset"),
+    ngx_string("Surrogate-Key"),
     ngx_null_string
 };
 
@@ -600,6 +627,8 @@ ngx_http_fastcgi_handler(ngx_http_request_t *r)
     u->pipe->input_filter = ngx_http_fastcgi_input_filter;
     u->pipe->input_ctx = r;
 
+    u->input_filter_init = ngx_http_fastcgi_input_filter_init;
+
     rc = ngx_http_read_client_request_body(r, ngx_http_upstream_init);
 
     if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
@@ -698,6 +727,7 @@ ngx_http_fastcgi_create_request(ngx_http_request_t *r)
     ngx_table_elt_t              *header, **ignored;
     ngx_http_script_code_pt       code;
     ngx_http_script_engine_t      e, le;
+    ngx_http_fastcgi_ctx_t       *f;
     ngx_http_fastcgi_header_t    *h;
     ngx_http_fastcgi_loc_conf_t  *flcf;
     ngx_http_script_len_code_pt   lcode;
@@ -706,8 +736,25 @@ ngx_http_fastcgi_create_request(ngx_http_request_t *r)
     header_params = 0;
     ignored = NULL;
 
+    f = ngx_http_get_module_ctx(r, ngx_http_fastcgi_module);
     flcf = ngx_http_get_module_loc_conf(r, ngx_http_fastcgi_module);
 
+    /*
+     * the requests on a kept connection get the distinct ids, so the records
+     * left from another request are recognized and skipped
+     */
+
+    if (flcf->keep_conn) {
+        if (++ngx_http_fastcgi_request_id > 0xffff) {
+            ngx_http_fastcgi_request_id = 1;
+        }
+
+        f->id = ngx_http_fastcgi_request_id;
+
+    } else {
+        f->id = 1;
+    }
+
     if (flcf->params_len) {
         ngx_memzero(&le, sizeof(ngx_http_script_engine_t));
 
@@ -836,10 +883,22 @@ ngx_http_fastcgi_create_request(ngx_http_request_t *r)
     ngx_memcpy(b->pos, &ngx_http_fastcgi_request_start,
                sizeof(ngx_http_fastcgi_request_start_t));
 
+    h = (ngx_http_fastcgi_header_t *) b->pos;
+
+    h->request_id_hi = (u_char) (f->id >> 8);
+    h->request_id_lo = (u_char) (f->id & 0xff);
+
+    if (flcf->keep_conn) {
+        ((ngx_http_fastcgi_begin_request_t *) (h + 1))->flags =
+                                                   NGX_HTTP_FASTCGI_KEEP_CONN;
+    }
+
     h = (ngx_http_fastcgi_header_t *)
              (b->pos + sizeof(ngx_http_fastcgi_header_t)
                      + sizeof(ngx_http_fastcgi_begin_request_t));
 
+    h->request_id_hi = (u_char) (f->id >> 8);
+    h->request_id_lo = (u_char) (f->id & 0xff);
     h->content_length_hi = (u_char) ((len >> 8) & 0xff);
     h->content_length_lo = (u_char) (len & 0xff);
     h->padding_length = (u_char) padding;
@@ -982,8 +1041,8 @@ ngx_http_fastcgi_create_request(ngx_http_request_t *r)
 
     h->version = 1;
     h->type = NGX_HTTP_FASTCGI_PARAMS;
-    h->request_id_hi = 0;
-    h->request_id_lo = 1;
+    h->request_id_hi = (u_char) (f->id >> 8);
+    h->request_id_lo = (u_char) (f->id & 0xff);
     h->content_length_hi = 0;
     h->content_length_lo = 0;
     h->padding_length = 0;
@@ -1050,8 +1109,8 @@ ngx_http_fastcgi_create_request(ngx_http_request_t *r)
 
                 h->version = 1;
                 h->type = NGX_HTTP_FASTCGI_STDIN;
-                h->request_id_hi = 0;
-                h->request_id_lo = 1;
+                h->request_id_hi = (u_char) (f->id >> 8);
+                h->request_id_lo = (u_char) (f->id & 0xff);
                 h->content_length_hi = (u_char) ((len >> 8) & 0xff);
                 h->content_length_lo = (u_char) (len & 0xff);
                 h->padding_length = (u_char) padding;
@@ -1099,8 +1158,8 @@ ngx_http_fastcgi_create_request(ngx_http_request_t *r)
 
     h->version = 1;
     h->type = NGX_HTTP_FASTCGI_STDIN;
-    h->request_id_hi = 0;
-    h->request_id_lo = 1;
+    h->request_id_hi = (u_char) (f->id >> 8);
+    h->request_id_lo = (u_char) (f->id & 0xff);
     h->content_length_hi = 0;
     h->content_length_lo = 0;
     h->padding_length = 0;
@@ -1318,8 +1377,8 @@ ngx_http_fastcgi_process_header(ngx_http_request_t *r)
                 fh = (ngx_http_fastcgi_header_t *) start;
                 fh->version = 1;
                 fh->type = NGX_HTTP_FASTCGI_STDERR;
-                fh->request_id_hi = 0;
-                fh->request_id_lo = 1;
+                fh->request_id_hi = (u_char) (f->id >> 8);
+                fh->request_id_lo = (u_char) (f->id & 0xff);
                 fh->content_length_hi = (u_char) ((len >> 8) & 0xff);
                 fh->content_length_lo = (u_char) (len & 0xff);
                 fh->padding_length = 0;
@@ -1565,15 +1624,38 @@ ngx_http_fastcgi_process_header(ngx_http_request_t *r)
 }
 
 
+static ngx_int_t
+ngx_http_fastcgi_input_filter_init(void *data)
+{
+    ngx_http_request_t  *r = data;
+
+    ngx_http_fastcgi_loc_conf_t  *flcf;
+
+    flcf = ngx_http_get_module_loc_conf(r, ngx_http_fastcgi_module);
+
+    /*
+     * a kept connection is not closed after the response, so the pipe
+     * must pass a partially filled buffer to the filter as soon as it
+     * holds the next record header
+     */
+
+    r->upstream->pipe->length = flcf->keep_conn ?
+                                (off_t) sizeof(ngx_http_fastcgi_header_t) : -1;
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_fastcgi_input_filter(ngx_event_pipe_t *p, ngx_buf_t *buf)
 {
-    u_char                  *m, *msg;
-    ngx_int_t                rc;
-    ngx_buf_t               *b, **prev;
-    ngx_chain_t             *cl;
-    ngx_http_request_t      *r;
-    ngx_http_fastcgi_ctx_t  *f;
+    u_char                       *m, *msg;
+    ngx_int_t                     rc;
+    ngx_buf_t                    *b, **prev;
+    ngx_chain_t                  *cl;
+    ngx_http_request_t           *r;
+    ngx_http_fastcgi_ctx_t       *f;
+    ngx_http_fastcgi_loc_conf_t  *flcf;
 
     if (buf->pos == buf->last) {
         return NGX_OK;
@@ -1581,6 +1663,7 @@ ngx_http_fastcgi_input_filter(ngx_event_pipe_t *p, ngx_buf_t *buf)
 
     r = p->input_ctx;
     f = ngx_http_get_module_ctx(r, ngx_http_fastcgi_module);
+    flcf = ngx_http_get_module_loc_conf(r, ngx_http_fastcgi_module);
 
     b = NULL;
     prev = &buf->shadow;
@@ -1602,22 +1685,36 @@ ngx_http_fastcgi_input_filter(ngx_event_pipe_t *p, ngx_buf_t *buf)
             }
 
             if (f->type == NGX_HTTP_FASTCGI_STDOUT && f->length == 0) {
-                f->state = ngx_http_fastcgi_st_version;
-                p->upstream_done = 1;
 
                 ngx_log_debug0(NGX_LOG_DEBUG_HTTP, p->log, 0,
                                "http fastcgi closed stdout");
 
+                if (flcf->keep_conn) {
+
+                    /* the end request record is read before the connection */
+
+                    f->state = ngx_http_fastcgi_st_padding;
+                    continue;
+                }
+
+                f->state = ngx_http_fastcgi_st_version;
+                p->upstream_done = 1;
+
                 continue;
             }
 
             if (f->type == NGX_HTTP_FASTCGI_END_REQUEST) {
-                f->state = ngx_http_fastcgi_st_version;
-                p->upstream_done = 1;
 
                 ngx_log_debug0(NGX_LOG_DEBUG_HTTP, p->log, 0,
                                "http fastcgi sent end request");
 
+                if (flcf->keep_conn) {
+                    continue;
+                }
+
+                f->state = ngx_http_fastcgi_st_version;
+                p->upstream_done = 1;
+
                 break;
             }
         }
@@ -1625,6 +1722,29 @@ ngx_http_fastcgi_input_filter(ngx_event_pipe_t *p, ngx_buf_t *buf)
 
         if (f->state == ngx_http_fastcgi_st_padding) {
 
+            if (f->type == NGX_HTTP_FASTCGI_END_REQUEST) {
+
+                /*
+                 * the connection is kept only if nothing follows
+                 * the end request record
+                 */
+
+                if (f->pos + f->padding < f->last) {
+                    p->upstream_done = 1;
+                    break;
+                }
+
+                if (f->pos + f->padding == f->last) {
+                    p->upstream_done = 1;
+                    r->upstream->keepalive = 1;
+                    break;
+                }
+
+                f->padding -= f->last - f->pos;
+
+                break;
+            }
+
             if (f->pos + f->padding < f->last) {
                 f->state = ngx_http_fastcgi_st_version;
                 f->pos += f->padding;
@@ -1687,6 +1807,20 @@ ngx_http_fastcgi_input_filter(ngx_event_pipe_t *p, ngx_buf_t *buf)
             continue;
         }
 
+        if (f->type == NGX_HTTP_FASTCGI_END_REQUEST) {
+
+            if (f->pos + f->length <= f->last) {
+                f->state = ngx_http_fastcgi_st_padding;
+                f->pos += f->length;
+
+                continue;
+            }
+
+            f->length -= f->last - f->pos;
+
+            break;
+        }
+
 
         /* f->type == NGX_HTTP_FASTCGI_STDOUT */
 
@@ -1773,6 +1907,23 @@ ngx_http_fastcgi_input_filter(ngx_event_pipe_t *p, ngx_buf_t *buf)
 
     }
 
+    if (flcf->keep_conn) {
+
+        /* the minimal amount of data the next call needs */
+
+        if (f->state < ngx_http_fastcgi_st_data) {
+            p->length = 1;
+
+        } else if (f->state == ngx_http_fastcgi_st_padding) {
+            p->length = f->padding;
+
+        } else {
+            /* ngx_http_fastcgi_st_data */
+
+            p->length = f->length;
+        }
+    }
+
     if (b) {
         b->shadow = buf;
         b->last_shadow = 1;
@@ -1797,8 +1948,10 @@ static ngx_int_t
 ngx_http_fastcgi_process_record(ngx_http_request_t *r,
     ngx_http_fastcgi_ctx_t *f)
 {
-    u_char                     ch, *p;
-    ngx_http_fastcgi_state_e   state;
+    u_char                        ch, *p;
+    size_t                        n;
+    ngx_http_fastcgi_state_e      state;
+    ngx_http_fastcgi_loc_conf_t  *flcf;
 
     state = f->state;
 
@@ -1838,25 +1991,30 @@ ngx_http_fastcgi_process_record(ngx_http_request_t *r,
             state = ngx_http_fastcgi_st_request_id_hi;
             break;
 
-        /* we support the single request per connection */
+        /*
+         * we support the single request per connection at a time,
+         * the records of the other requests are skipped on a kept connection
+         */
 
         case ngx_http_fastcgi_st_request_id_hi:
-            if (ch != 0) {
-                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                              "upstream sent unexpected FastCGI "
-                              "request id high byte: %d", ch);
-                return NGX_ERROR;
-            }
+            f->request_id = ch << 8;
             state = ngx_http_fastcgi_st_request_id_lo;
             break;
 
         case ngx_http_fastcgi_st_request_id_lo:
-            if (ch != 1) {
+            f->request_id |= (ngx_uint_t) ch;
+
+            flcf = ngx_http_get_module_loc_conf(r, ngx_http_fastcgi_module);
+
+            /* a cached response keeps the id of the request that stored it */
+
+            if (f->request_id != f->id && !flcf->keep_conn && !r->cached) {
                 ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
                               "upstream sent unexpected FastCGI "
-                              "request id low byte: %d", ch);
+                              "request id: %ui", f->request_id);
                 return NGX_ERROR;
             }
+
             state = ngx_http_fastcgi_st_content_length_hi;
             break;
 
@@ -1876,6 +2034,20 @@ ngx_http_fastcgi_process_record(ngx_http_request_t *r,
             break;
 
         case ngx_http_fastcgi_st_reserved:
+
+            if (f->request_id != f->id && !r->cached) {
+
+                ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                               "http fastcgi skip record: %ui %z",
+                               f->request_id, f->length + f->padding);
+
+                f->length += f->padding;
+
+                state = f->length ? ngx_http_fastcgi_st_skip
+                                  : ngx_http_fastcgi_st_version;
+                break;
+            }
+
             state = ngx_http_fastcgi_st_data;
 
             ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
@@ -1886,6 +2058,18 @@ ngx_http_fastcgi_process_record(ngx_http_request_t *r,
 
             return NGX_OK;
 
+        case ngx_http_fastcgi_st_skip:
+            n = ngx_min(f->length, (size_t) (f->last - p));
+
+            f->length -= n;
+            p += n - 1;
+
+            if (f->length == 0) {
+                state = ngx_http_fastcgi_st_version;
+            }
+
+            break;
+
         /* suppress warning */
         case ngx_http_fastcgi_st_data:
         case ngx_http_fastcgi_st_padding:
@@ -1893,6 +2077,7 @@ ngx_http_fastcgi_process_record(ngx_http_request_t *r,
         }
     }
 
+    f->pos = p;
     f->state = state;
 
     return NGX_AGAIN;
@@ -1988,6 +2173,7 @@ ngx_http_fastcgi_create_loc_conf(ngx_conf_t *cf)
 #if (NGX_HTTP_CACHE)
     conf->upstream.cache = NGX_CONF_UNSET_PTR;
     conf->upstream.cache_min_uses = NGX_CONF_UNSET_UINT;
+    conf->upstream.cache_read_while_write = NGX_CONF_UNSET;
     conf->upstream.cache_bypass = NGX_CONF_UNSET_PTR;
     conf->upstream.no_cache = NGX_CONF_UNSET_PTR;
     conf->upstream.cache_valid = NGX_CONF_UNSET_PTR;
@@ -2003,6 +2189,8 @@ ngx_http_fastcgi_create_loc_conf(ngx_conf_t *cf)
 
     conf->catch_stderr = NGX_CONF_UNSET_PTR;
 
+    conf->keep_conn = NGX_CONF_UNSET;
+
     return conf;
 }
 
@@ -2213,6 +2401,9 @@ ngx_http_fastcgi_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 
     conf->upstream.cache_methods |= NGX_HTTP_GET|NGX_HTTP_HEAD;
 
+    ngx_conf_merge_value(conf->upstream.cache_read_while_write,
+                         prev->upstream.cache_read_while_write, 0);
+
     ngx_conf_merge_ptr_value(conf->upstream.cache_bypass,
                              prev->upstream.cache_bypass, NULL);
 
@@ -2244,6 +2435,8 @@ ngx_http_fastcgi_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_ptr_value(conf->catch_stderr, prev->catch_stderr, NULL);
 
+    ngx_conf_merge_value(conf->keep_conn, prev->keep_conn, 0);
+
 
     ngx_conf_merge_str_value(conf->index, prev->index, "");
 
@@ -13,6 +13,8 @@
 typedef struct {
     ngx_http_upstream_conf_t   upstream;
     ngx_int_t                  index;
+    ngx_flag_t                 binary;
+    ngx_flag_t                 batch;
 } ngx_http_memcached_loc_conf_t;
 
 
@@ -20,14 +22,27 @@ typedef struct {
     size_t                     rest;
     ngx_http_request_t        *request;
     ngx_str_t                  key;
+
+    /* the batch mode state */
+    ngx_uint_t                 state;
+    off_t                      size;
+    u_char                    *line;
+    size_t                     line_len;
 } ngx_http_memcached_ctx_t;
 
 
 static ngx_int_t ngx_http_memcached_create_request(ngx_http_request_t *r);
+static ngx_int_t ngx_http_memcached_create_binary_request(
+    ngx_http_request_t *r, ngx_http_variable_value_t *vv);
 static ngx_int_t ngx_http_memcached_reinit_request(ngx_http_request_t *r);
 static ngx_int_t ngx_http_memcached_process_header(ngx_http_request_t *r);
+static ngx_int_t ngx_http_memcached_process_binary_header(
+    ngx_http_request_t *r);
 static ngx_int_t ngx_http_memcached_filter_init(void *data);
 static ngx_int_t ngx_http_memcached_filter(void *data, ssize_t bytes);
+static ngx_int_t ngx_http_memcached_binary_filter(void *data, ssize_t bytes);
+static ngx_int_t ngx_http_memcached_batch_filter(void *data, ssize_t bytes);
+static ngx_int_t ngx_http_memcached_parse_value(ngx_http_memcached_ctx_t *ctx);
 static void ngx_http_memcached_abort_request(ngx_http_request_t *r);
 static void ngx_http_memcached_finalize_request(ngx_http_request_t *r,
     ngx_int_t rc);
@@ -101,6 +116,20 @@ static ngx_command_t  ngx_http_memcached_commands[] = {
       offsetof(ngx_http_memcached_loc_conf_t, upstream.next_upstream),
       &ngx_http_memcached_next_upstream_masks },
 
+    { ngx_string("memcached_binary"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_memcached_loc_conf_t, binary),
+      NULL },
+
+    { ngx_string("memcached_batch"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_memcached_loc_conf_t, batch),
+      NULL },
+
       ngx_null_command
 };
 
@@ -142,6 +171,23 @@ static ngx_str_t  ngx_http_memcached_key = ngx_string("memcached_key");
 #define NGX_HTTP_MEMCACHED_END   (sizeof(ngx_http_memcached_end) - 1)
 static u_char  ngx_http_memcached_end[] = CRLF "END" CRLF;
 
+
+/* the longest "VALUE <key> <flags> <bytes> [<cas unique>]" line */
+
+#define NGX_HTTP_MEMCACHED_KEY_LEN     250
+#define NGX_HTTP_MEMCACHED_LINE_LEN                                           \
+    (sizeof("VALUE ") - 1 + NGX_HTTP_MEMCACHED_KEY_LEN                        \
+     + 3 * (NGX_INT64_LEN + 1) + sizeof(CRLF) - 1)
+
+
+/* the binary protocol */
+
+#define NGX_HTTP_MEMCACHED_HEADER_LEN  24
+#define NGX_HTTP_MEMCACHED_REQUEST     0x80
+#define NGX_HTTP_MEMCACHED_RESPONSE    0x81
+#define NGX_HTTP_MEMCACHED_GETK        0x0c
+#define NGX_HTTP_MEMCACHED_NOT_FOUND   0x0001
+
 //upstreamصupstream
 static ngx_int_t
 ngx_http_memcached_handler(ngx_http_request_t *r)
@@ -180,7 +226,8 @@ ngx_http_memcached_handler(ngx_http_request_t *r)
 	//ûص
     u->create_request = ngx_http_memcached_create_request;
     u->reinit_request = ngx_http_memcached_reinit_request;
-    u->process_header = ngx_http_memcached_process_header;
+    u->process_header = mlcf->binary ? ngx_http_memcached_process_binary_header
+                                     : ngx_http_memcached_process_header;
     u->abort_request = ngx_http_memcached_abort_request;
     u->finalize_request = ngx_http_memcached_finalize_request;
 
@@ -191,12 +238,30 @@ ngx_http_memcached_handler(ngx_http_request_t *r)
 
     ctx->rest = NGX_HTTP_MEMCACHED_END;
     ctx->request = r;
+    ctx->state = 0;
+    ctx->size = 0;
+    ctx->line = NULL;
+    ctx->line_len = 0;
 
     ngx_http_set_ctx(r, ctx, ngx_http_memcached_module);
 
     u->input_filter_init = ngx_http_memcached_filter_init;
-    u->input_filter = ngx_http_memcached_filter;
     u->input_filter_ctx = ctx;
+
+    if (mlcf->binary) {
+        u->input_filter = ngx_http_memcached_binary_filter;
+
+    } else if (mlcf->batch) {
+        ctx->line = ngx_pnalloc(r->pool, NGX_HTTP_MEMCACHED_LINE_LEN);
+        if (ctx->line == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        u->input_filter = ngx_http_memcached_batch_filter;
+
+    } else {
+        u->input_filter = ngx_http_memcached_filter;
+    }
 	
     r->main->count++;										//ü
 
@@ -210,6 +275,7 @@ static ngx_int_t
 ngx_http_memcached_create_request(ngx_http_request_t *r)
 {
     size_t                          len;
+    u_char                         *p, *last, *start;
     uintptr_t                       escape;
     ngx_buf_t                      *b;
     ngx_chain_t                    *cl;
@@ -227,6 +293,10 @@ ngx_http_memcached_create_request(ngx_http_request_t *r)
         return NGX_ERROR;
     }
 
+    if (mlcf->binary) {
+        return ngx_http_memcached_create_binary_request(r, vv);
+    }
+
     escape = 2 * ngx_escape_uri(NULL, vv->data, vv->len, NGX_ESCAPE_MEMCACHED);
 
     len = sizeof("get ") - 1 + vv->len + escape + sizeof(CRLF) - 1;
@@ -252,7 +322,44 @@ ngx_http_memcached_create_request(ngx_http_request_t *r)
 
     ctx->key.data = b->last;
 
-    if (escape == 0) {
+    if (mlcf->batch) {
+
+        /*
+         * the keys are separated by spaces and are escaped one by one,
+         * so all of them are fetched by a single "get" command
+         */
+
+        p = vv->data;
+        last = vv->data + vv->len;
+
+        while (p < last) {
+
+            if (*p == ' ') {
+                p++;
+                continue;
+            }
+
+            start = p;
+
+            while (p < last && *p != ' ') {
+                p++;
+            }
+
+            if (b->last != ctx->key.data) {
+                *b->last++ = ' ';
+            }
+
+            b->last = (u_char *) ngx_escape_uri(b->last, start, p - start,
+                                                NGX_ESCAPE_MEMCACHED);
+        }
+
+        if (b->last == ctx->key.data) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "the \"$memcached_key\" variable has no keys");
+            return NGX_ERROR;
+        }
+
+    } else if (escape == 0) {
         b->last = ngx_copy(b->last, vv->data, vv->len);
 
     } else {
@@ -271,6 +378,68 @@ ngx_http_memcached_create_request(ngx_http_request_t *r)
 }
 
 
+static ngx_int_t
+ngx_http_memcached_create_binary_request(ngx_http_request_t *r,
+    ngx_http_variable_value_t *vv)
+{
+    u_char                    *p;
+    ngx_buf_t                 *b;
+    ngx_chain_t               *cl;
+    ngx_http_memcached_ctx_t  *ctx;
+
+    if (vv->len > NGX_HTTP_MEMCACHED_KEY_LEN) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "the \"$memcached_key\" variable is too long");
+        return NGX_ERROR;
+    }
+
+    b = ngx_create_temp_buf(r->pool, NGX_HTTP_MEMCACHED_HEADER_LEN + vv->len);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    cl->buf = b;
+    cl->next = NULL;
+
+    r->upstream->request_bufs = cl;
+
+    /*
+     * the GETK request header: the key length, the total body length
+     * and zero extras, data type, vbucket id, opaque and cas
+     */
+
+    p = b->last;
+
+    ngx_memzero(p, NGX_HTTP_MEMCACHED_HEADER_LEN);
+
+    p[0] = NGX_HTTP_MEMCACHED_REQUEST;
+    p[1] = NGX_HTTP_MEMCACHED_GETK;
+    p[2] = (u_char) (vv->len >> 8);
+    p[3] = (u_char) vv->len;
+    p[10] = (u_char) (vv->len >> 8);
+    p[11] = (u_char) vv->len;
+
+    b->last += NGX_HTTP_MEMCACHED_HEADER_LEN;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_memcached_module);
+
+    ctx->key.data = b->last;
+    ctx->key.len = vv->len;
+
+    b->last = ngx_copy(b->last, vv->data, vv->len);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http memcached binary request: \"%V\"", &ctx->key);
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_memcached_reinit_request(ngx_http_request_t *r)
 {
@@ -298,6 +467,19 @@ ngx_http_memcached_process_header(ngx_http_request_t *r)
 
 found:
 
+    ctx = ngx_http_get_module_ctx(r, ngx_http_memcached_module);
+
+    if (ctx->line
+        && ngx_strncmp(u->buffer.pos, "VALUE ", sizeof("VALUE ") - 1) == 0)
+    {
+        /* the values of the batch are parsed by the filter */
+
+        u->headers_in.status_n = 200;
+        u->state->status = 200;
+
+        return NGX_OK;
+    }
+
     *p = '\0';
 
     line.len = p - u->buffer.pos - 1;
@@ -308,8 +490,6 @@ found:
 
     p = u->buffer.pos;
 
-    ctx = ngx_http_get_module_ctx(r, ngx_http_memcached_module);
-
     if (ngx_strncmp(p, "VALUE ", sizeof("VALUE ") - 1) == 0) {
 
         p += sizeof("VALUE ") - 1;
@@ -368,6 +548,12 @@ found:
         u->headers_in.status_n = 404;
         u->state->status = 404;
 
+        u->buffer.pos += line.len + 2;
+
+        if (u->buffer.pos == u->buffer.last) {
+            u->keepalive = 1;
+        }
+
         return NGX_OK;
     }
 
@@ -380,15 +566,132 @@ no_valid:
 }
 
 
+static ngx_int_t
+ngx_http_memcached_process_binary_header(ngx_http_request_t *r)
+{
+    u_char                    *p;
+    size_t                     size, body, extras, key;
+    ngx_uint_t                 status;
+    ngx_http_upstream_t       *u;
+    ngx_http_memcached_ctx_t  *ctx;
+
+    u = r->upstream;
+
+    size = u->buffer.last - u->buffer.pos;
+
+    if (size < NGX_HTTP_MEMCACHED_HEADER_LEN) {
+        return NGX_AGAIN;
+    }
+
+    p = u->buffer.pos;
+
+    if (p[0] != NGX_HTTP_MEMCACHED_RESPONSE
+        || p[1] != NGX_HTTP_MEMCACHED_GETK)
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "memcached sent invalid binary response: "
+                      "magic:%02Xd opcode:%02Xd", p[0], p[1]);
+        return NGX_HTTP_UPSTREAM_INVALID_HEADER;
+    }
+
+    key = (p[2] << 8) + p[3];
+    extras = p[4];
+    status = (p[6] << 8) + p[7];
+    body = ((size_t) p[8] << 24) + (p[9] << 16) + (p[10] << 8) + p[11];
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "memcached binary: status:%ui body:%uz extras:%uz key:%uz",
+                   status, body, extras, key);
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_memcached_module);
+
+    if (status == NGX_HTTP_MEMCACHED_NOT_FOUND) {
+
+        /* the error message is read out to keep the connection usable */
+
+        if (size < NGX_HTTP_MEMCACHED_HEADER_LEN + body) {
+            return NGX_AGAIN;
+        }
+
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "key: \"%V\" was not found by memcached", &ctx->key);
+
+        u->headers_in.status_n = 404;
+        u->state->status = 404;
+
+        u->buffer.pos += NGX_HTTP_MEMCACHED_HEADER_LEN + body;
+
+        if (u->buffer.pos == u->buffer.last) {
+            u->keepalive = 1;
+        }
+
+        return NGX_OK;
+    }
+
+    if (status != 0) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "memcached sent error status %ui for key \"%V\"",
+                      status, &ctx->key);
+        return NGX_HTTP_UPSTREAM_INVALID_HEADER;
+    }
+
+    if (extras + key > body) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "memcached sent invalid body length %uz "
+                      "for key \"%V\"", body, &ctx->key);
+        return NGX_HTTP_UPSTREAM_INVALID_HEADER;
+    }
+
+    if (size < NGX_HTTP_MEMCACHED_HEADER_LEN + extras + key) {
+        return NGX_AGAIN;
+    }
+
+    p += NGX_HTTP_MEMCACHED_HEADER_LEN + extras;
+
+    if (key != ctx->key.len || ngx_memcmp(p, ctx->key.data, key) != 0) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "memcached sent invalid key in binary response "
+                      "for key \"%V\"", &ctx->key);
+        return NGX_HTTP_UPSTREAM_INVALID_HEADER;
+    }
+
+    r->headers_out.content_length_n = body - extras - key;
+
+    u->headers_in.status_n = 200;
+    u->state->status = 200;
+    u->buffer.pos = p + key;
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_memcached_filter_init(void *data)
 {
     ngx_http_memcached_ctx_t  *ctx = data;
 
-    ngx_http_upstream_t  *u;
+    ngx_http_upstream_t            *u;
+    ngx_http_memcached_loc_conf_t  *mlcf;
 
     u = ctx->request->upstream;
 
+    mlcf = ngx_http_get_module_loc_conf(ctx->request,
+                                        ngx_http_memcached_module);
+
+    if (mlcf->binary) {
+
+        if (u->length == 0) {
+            u->keepalive = 1;
+        }
+
+        return NGX_OK;
+    }
+
+    if (mlcf->batch) {
+        /* the length of the values is not known until "END" */
+        return NGX_OK;
+    }
+
     u->length += NGX_HTTP_MEMCACHED_END;
 
     return NGX_OK;
@@ -427,6 +730,10 @@ ngx_http_memcached_filter(void *data, ssize_t bytes)
         u->length -= bytes;
         ctx->rest -= bytes;
 
+        if (u->length == 0) {
+            u->keepalive = 1;
+        }
+
         return NGX_OK;
     }
 
@@ -464,6 +771,13 @@ ngx_http_memcached_filter(void *data, ssize_t bytes)
     if (ngx_strncmp(last, ngx_http_memcached_end, b->last - last) != 0) {
         ngx_log_error(NGX_LOG_ERR, ctx->request->connection->log, 0,
                       "memcached sent invalid trailer");
+
+        b->last = last;
+        cl->buf->last = last;
+        u->length = 0;
+        ctx->rest = 0;
+
+        return NGX_OK;
     }
 
     ctx->rest -= b->last - last;
@@ -471,6 +785,275 @@ ngx_http_memcached_filter(void *data, ssize_t bytes)
     cl->buf->last = last;
     u->length = ctx->rest;
 
+    if (u->length == 0) {
+        u->keepalive = 1;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_memcached_binary_filter(void *data, ssize_t bytes)
+{
+    ngx_http_memcached_ctx_t  *ctx = data;
+
+    ngx_buf_t            *b;
+    ngx_chain_t          *cl, **ll;
+    ngx_http_upstream_t  *u;
+
+    u = ctx->request->upstream;
+    b = &u->buffer;
+
+    for (cl = u->out_bufs, ll = &u->out_bufs; cl; cl = cl->next) {
+        ll = &cl->next;
+    }
+
+    cl = ngx_chain_get_free_buf(ctx->request->pool, &u->free_bufs);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    cl->buf->flush = 1;
+    cl->buf->memory = 1;
+
+    *ll = cl;
+
+    cl->buf->pos = b->last;
+    b->last += bytes;
+    cl->buf->last = b->last;
+    cl->buf->tag = u->output.tag;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ctx->request->connection->log, 0,
+                   "memcached binary filter bytes:%z size:%z length:%z",
+                   bytes, b->last - b->pos, u->length);
+
+    if ((size_t) bytes < u->length) {
+        u->length -= bytes;
+        return NGX_OK;
+    }
+
+    if ((size_t) bytes > u->length) {
+        ngx_log_error(NGX_LOG_WARN, ctx->request->connection->log, 0,
+                      "memcached sent more data than specified "
+                      "for key \"%V\"", &ctx->key);
+
+        b->last = cl->buf->pos + u->length;
+        cl->buf->last = b->last;
+        u->length = 0;
+        u->keepalive = 0;
+
+        return NGX_OK;
+    }
+
+    u->length = 0;
+    u->keepalive = 1;
+
+    return NGX_OK;
+}
+
+
+/*
+ * the batch response is a sequence of the "VALUE" lines, each of them
+ * followed by the value and CRLF, and the final "END" line; the values
+ * found are passed on one after another in the order of the keys and
+ * the keys not found are just skipped
+ */
+
+static ngx_int_t
+ngx_http_memcached_batch_filter(void *data, ssize_t bytes)
+{
+    ngx_http_memcached_ctx_t  *ctx = data;
+
+    u_char               *p, *last, ch;
+    off_t                 size;
+    ngx_int_t             rc;
+    ngx_buf_t            *b;
+    ngx_chain_t          *cl, **ll;
+    ngx_http_upstream_t  *u;
+    enum {
+        sw_line = 0,
+        sw_data,
+        sw_data_cr,
+        sw_data_lf
+    } state;
+
+    u = ctx->request->upstream;
+    b = &u->buffer;
+
+    for (cl = u->out_bufs, ll = &u->out_bufs; cl; cl = cl->next) {
+        ll = &cl->next;
+    }
+
+    state = ctx->state;
+
+    p = b->last;
+    last = b->last + bytes;
+    b->last = last;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->request->connection->log, 0,
+                   "memcached batch filter bytes:%z state:%ui",
+                   bytes, ctx->state);
+
+    while (p < last) {
+
+        switch (state) {
+
+        case sw_line:
+
+            ch = *p++;
+
+            if (ctx->line_len == NGX_HTTP_MEMCACHED_LINE_LEN) {
+                goto invalid;
+            }
+
+            ctx->line[ctx->line_len++] = ch;
+
+            if (ch != LF) {
+                break;
+            }
+
+            rc = ngx_http_memcached_parse_value(ctx);
+
+            if (rc == NGX_ERROR) {
+                goto invalid;
+            }
+
+            ctx->line_len = 0;
+
+            if (rc == NGX_DONE) {
+                b->last = p;
+                u->length = 0;
+
+                if (p == last) {
+                    u->keepalive = 1;
+                }
+
+                return NGX_OK;
+            }
+
+            state = ctx->size ? sw_data : sw_data_cr;
+            break;
+
+        case sw_data:
+
+            size = last - p;
+
+            if (size > ctx->size) {
+                size = ctx->size;
+            }
+
+            cl = ngx_chain_get_free_buf(ctx->request->pool, &u->free_bufs);
+            if (cl == NULL) {
+                return NGX_ERROR;
+            }
+
+            cl->buf->flush = 1;
+            cl->buf->memory = 1;
+            cl->buf->pos = p;
+            cl->buf->last = p + (size_t) size;
+            cl->buf->tag = u->output.tag;
+
+            *ll = cl;
+            ll = &cl->next;
+
+            p += (size_t) size;
+            ctx->size -= size;
+
+            if (ctx->size == 0) {
+                state = sw_data_cr;
+            }
+
+            break;
+
+        case sw_data_cr:
+
+            if (*p++ != CR) {
+                goto invalid;
+            }
+
+            state = sw_data_lf;
+            break;
+
+        case sw_data_lf:
+
+            if (*p++ != LF) {
+                goto invalid;
+            }
+
+            state = sw_line;
+            break;
+        }
+    }
+
+    ctx->state = state;
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, ctx->request->connection->log, 0,
+                  "memcached sent invalid response for keys \"%V\"",
+                  &ctx->key);
+
+    u->length = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_memcached_parse_value(ngx_http_memcached_ctx_t *ctx)
+{
+    u_char  *p, *last, *len;
+
+    if (ctx->line_len < 2 || ctx->line[ctx->line_len - 2] != CR) {
+        return NGX_ERROR;
+    }
+
+    p = ctx->line;
+    last = ctx->line + ctx->line_len - 2;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->request->connection->log, 0,
+                   "memcached: \"%*s\"", last - p, p);
+
+    if (last - p == 3 && ngx_strncmp(p, "END", 3) == 0) {
+        return NGX_DONE;
+    }
+
+    if (last - p < (ssize_t) sizeof("VALUE ") - 1
+        || ngx_strncmp(p, "VALUE ", sizeof("VALUE ") - 1) != 0)
+    {
+        return NGX_ERROR;
+    }
+
+    p += sizeof("VALUE ") - 1;
+
+    /* skip key and flags */
+
+    while (p < last && *p != ' ') { p++; }
+
+    if (p++ == last) {
+        return NGX_ERROR;
+    }
+
+    while (p < last && *p != ' ') { p++; }
+
+    if (p++ == last) {
+        return NGX_ERROR;
+    }
+
+    /* the optional cas unique follows the length */
+
+    len = p;
+
+    while (p < last && *p != ' ') { p++; }
+
+    ctx->size = ngx_atoof(len, p - len);
+    if (ctx->size == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
     return NGX_OK;
 }
 
@@ -534,6 +1117,8 @@ ngx_http_memcached_create_loc_conf(ngx_conf_t *cf)
     conf->upstream.pass_request_body = 0;
 
     conf->index = NGX_CONF_UNSET;
+    conf->binary = NGX_CONF_UNSET;
+    conf->batch = NGX_CONF_UNSET;
 
     return conf;
 }
@@ -577,6 +1162,16 @@ ngx_http_memcached_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
         conf->index = prev->index;
     }
 
+    ngx_conf_merge_value(conf->binary, prev->binary, 0);
+    ngx_conf_merge_value(conf->batch, prev->batch, 0);
+
+    if (conf->binary && conf->batch) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"memcached_batch\" cannot be used "
+                           "with \"memcached_binary\"");
+        return NGX_CONF_ERROR;
+    }
+
     return NGX_CONF_OK;
 }
 
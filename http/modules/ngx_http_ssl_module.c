@@ -7,6 +7,9 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_http.h>
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif
 
 
 typedef ngx_int_t (*ngx_ssl_variable_handler_pt)(ngx_connection_t *c,
@@ -16,6 +19,15 @@ typedef ngx_int_t (*ngx_ssl_variable_handler_pt)(ngx_connection_t *c,
 #define NGX_DEFAULT_CIPHERS     "HIGH:!aNULL:!MD5"
 #define NGX_DEFAULT_ECDH_CURVE  "prime256v1"
 
+#define NGX_HTTP_ALPN_ADVERTISE  "\x08http/1.1"
+
+
+#ifdef TLSEXT_TYPE_application_layer_protocol_negotiation
+static int ngx_http_ssl_alpn_select(ngx_ssl_conn_t *ssl_conn,
+    const unsigned char **out, unsigned char *outlen,
+    const unsigned char *in, unsigned int inlen, void *arg);
+#endif
+
 
 static ngx_int_t ngx_http_ssl_static_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
@@ -31,6 +43,16 @@ static char *ngx_http_ssl_enable(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static char *ngx_http_ssl_session_cache(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_ssl_async_handshake(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+static ngx_int_t ngx_http_ssl_certificate_cache_init(ngx_conf_t *cf,
+    ngx_http_ssl_srv_conf_t *sscf);
+static void ngx_http_ssl_certificate_cache_cleanup(void *data);
+static SSL_CTX *ngx_http_ssl_certificate_load(ngx_http_ssl_srv_conf_t *sscf,
+    ngx_str_t *host, ngx_log_t *log);
+#endif
 
 
 static ngx_conf_bitmask_t  ngx_http_ssl_protocols[] = {
@@ -49,6 +71,16 @@ static ngx_conf_enum_t  ngx_http_ssl_verify[] = {
 };
 
 
+static ngx_conf_num_bounds_t  ngx_http_ssl_record_start_size_bounds = {
+    ngx_conf_check_num_bounds, 0, NGX_SSL_BUFSIZE
+};
+
+
+static ngx_conf_num_bounds_t  ngx_http_ssl_buffer_size_bounds = {
+    ngx_conf_check_num_bounds, 1, 16 * NGX_SSL_BUFSIZE
+};
+
+
 static ngx_command_t  ngx_http_ssl_commands[] = {
 
     { ngx_string("ssl"),
@@ -72,6 +104,20 @@ static ngx_command_t  ngx_http_ssl_commands[] = {
       offsetof(ngx_http_ssl_srv_conf_t, certificate_key),
       NULL },
 
+    { ngx_string("ssl_certificate_dir"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_ssl_srv_conf_t, certificate_dir),
+      NULL },
+
+    { ngx_string("ssl_certificate_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_ssl_srv_conf_t, certificate_cache_size),
+      NULL },
+
     { ngx_string("ssl_dhparam"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_str_slot,
@@ -142,6 +188,69 @@ static ngx_command_t  ngx_http_ssl_commands[] = {
       offsetof(ngx_http_ssl_srv_conf_t, session_timeout),
       NULL },
 
+    { ngx_string("ssl_session_tickets"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_ssl_srv_conf_t, session_tickets),
+      NULL },
+
+    { ngx_string("ssl_session_ticket_key"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_array_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_ssl_srv_conf_t, session_ticket_keys),
+      NULL },
+
+    { ngx_string("ssl_session_ticket_key_rotate"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_ssl_srv_conf_t, session_ticket_key_rotate),
+      NULL },
+
+    { ngx_string("ssl_record_start_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_ssl_srv_conf_t, record_start_size),
+      &ngx_http_ssl_record_start_size_bounds },
+
+    { ngx_string("ssl_record_idle_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_ssl_srv_conf_t, record_idle_timeout),
+      NULL },
+
+    { ngx_string("ssl_buffer_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_ssl_srv_conf_t, buffer_size),
+      &ngx_http_ssl_buffer_size_bounds },
+
+    { ngx_string("ssl_stapling"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_ssl_srv_conf_t, stapling),
+      NULL },
+
+    { ngx_string("ssl_stapling_responder"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_ssl_srv_conf_t, stapling_responder),
+      NULL },
+
+    { ngx_string("ssl_stapling_verify"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_ssl_srv_conf_t, stapling_verify),
+      NULL },
+
     { ngx_string("ssl_crl"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_str_slot,
@@ -149,6 +258,13 @@ static ngx_command_t  ngx_http_ssl_commands[] = {
       offsetof(ngx_http_ssl_srv_conf_t, crl),
       NULL },
 
+    { ngx_string("ssl_async_handshake"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_http_ssl_async_handshake,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
@@ -214,6 +330,21 @@ static ngx_http_variable_t  ngx_http_ssl_vars[] = {
     { ngx_string("ssl_client_verify"), NULL, ngx_http_ssl_variable,
       (uintptr_t) ngx_ssl_get_client_verify, NGX_HTTP_VAR_CHANGEABLE, 0 },
 
+    { ngx_string("ssl_session_reused"), NULL, ngx_http_ssl_variable,
+      (uintptr_t) ngx_ssl_get_session_reused, NGX_HTTP_VAR_CHANGEABLE, 0 },
+
+    { ngx_string("ssl_session_stats"), NULL, ngx_http_ssl_variable,
+      (uintptr_t) ngx_ssl_get_session_stats, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("ssl_stapling_stats"), NULL, ngx_http_ssl_variable,
+      (uintptr_t) ngx_ssl_get_stapling_stats, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("ssl_handshake_time"), NULL, ngx_http_ssl_variable,
+      (uintptr_t) ngx_ssl_get_handshake_time, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("ssl_handshake_queue"), NULL, ngx_http_ssl_variable,
+      (uintptr_t) ngx_ssl_get_handshake_queue, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
     { ngx_null_string, NULL, NULL, 0, 0, 0 }
 };
 
@@ -221,6 +352,53 @@ static ngx_http_variable_t  ngx_http_ssl_vars[] = {
 static ngx_str_t ngx_http_ssl_sess_id_ctx = ngx_string("HTTP");
 
 
+#ifdef TLSEXT_TYPE_application_layer_protocol_negotiation
+
+static int
+ngx_http_ssl_alpn_select(ngx_ssl_conn_t *ssl_conn, const unsigned char **out,
+    unsigned char *outlen, const unsigned char *in, unsigned int inlen,
+    void *arg)
+{
+    unsigned int         srvlen;
+    unsigned char       *srv;
+#if (NGX_HTTP_V2)
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+#endif
+
+#if (NGX_HTTP_V2)
+
+    /* c->data is the request allocated by ngx_http_init_request() */
+
+    c = ngx_ssl_get_connection(ssl_conn);
+    r = c->data;
+
+    if (r->http_connection->http2) {
+        srv = (unsigned char *) NGX_HTTP_V2_ALPN_ADVERTISE
+                                NGX_HTTP_ALPN_ADVERTISE;
+        srvlen = sizeof(NGX_HTTP_V2_ALPN_ADVERTISE NGX_HTTP_ALPN_ADVERTISE)
+                 - 1;
+
+    } else
+#endif
+    {
+        srv = (unsigned char *) NGX_HTTP_ALPN_ADVERTISE;
+        srvlen = sizeof(NGX_HTTP_ALPN_ADVERTISE) - 1;
+    }
+
+    if (SSL_select_next_proto((unsigned char **) out, outlen, srv, srvlen,
+                              in, inlen)
+        != OPENSSL_NPN_NEGOTIATED)
+    {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+
+    return SSL_TLSEXT_ERR_OK;
+}
+
+#endif
+
+
 static ngx_int_t
 ngx_http_ssl_static_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data)
@@ -319,20 +497,33 @@ ngx_http_ssl_create_srv_conf(ngx_conf_t *cf)
      *     sscf->protocols = 0;
      *     sscf->certificate = { 0, NULL };
      *     sscf->certificate_key = { 0, NULL };
+     *     sscf->certificate_dir = { 0, NULL };
+     *     sscf->certificate_cache = NULL;
      *     sscf->dhparam = { 0, NULL };
      *     sscf->ecdh_curve = { 0, NULL };
      *     sscf->client_certificate = { 0, NULL };
      *     sscf->crl = { 0, NULL };
      *     sscf->ciphers = { 0, NULL };
      *     sscf->shm_zone = NULL;
+     *     sscf->stapling_responder = { 0, NULL };
      */
 
     sscf->enable = NGX_CONF_UNSET;
     sscf->prefer_server_ciphers = NGX_CONF_UNSET;
     sscf->verify = NGX_CONF_UNSET_UINT;
     sscf->verify_depth = NGX_CONF_UNSET_UINT;
+    sscf->certificate_cache_size = NGX_CONF_UNSET_UINT;
     sscf->builtin_session_cache = NGX_CONF_UNSET;
     sscf->session_timeout = NGX_CONF_UNSET;
+    sscf->session_tickets = NGX_CONF_UNSET;
+    sscf->session_ticket_keys = NGX_CONF_UNSET_PTR;
+    sscf->session_ticket_key_rotate = NGX_CONF_UNSET;
+    sscf->record_start_size = NGX_CONF_UNSET_SIZE;
+    sscf->record_idle_timeout = NGX_CONF_UNSET_MSEC;
+    sscf->buffer_size = NGX_CONF_UNSET_SIZE;
+    sscf->stapling = NGX_CONF_UNSET;
+    sscf->stapling_verify = NGX_CONF_UNSET;
+    sscf->thread_pool = NGX_CONF_UNSET_PTR;
 
     return sscf;
 }
@@ -351,6 +542,24 @@ ngx_http_ssl_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->session_timeout,
                          prev->session_timeout, 300);
 
+    ngx_conf_merge_value(conf->session_tickets, prev->session_tickets, 1);
+    ngx_conf_merge_ptr_value(conf->session_ticket_keys,
+                         prev->session_ticket_keys, NULL);
+    ngx_conf_merge_sec_value(conf->session_ticket_key_rotate,
+                         prev->session_ticket_key_rotate, 3600);
+
+    ngx_conf_merge_size_value(conf->record_start_size,
+                         prev->record_start_size, 0);
+    ngx_conf_merge_msec_value(conf->record_idle_timeout,
+                         prev->record_idle_timeout, 1000);
+    ngx_conf_merge_size_value(conf->buffer_size,
+                         prev->buffer_size, NGX_SSL_BUFSIZE);
+
+    ngx_conf_merge_value(conf->stapling, prev->stapling, 0);
+    ngx_conf_merge_value(conf->stapling_verify, prev->stapling_verify, 1);
+    ngx_conf_merge_str_value(conf->stapling_responder,
+                         prev->stapling_responder, "");
+
     ngx_conf_merge_value(conf->prefer_server_ciphers,
                          prev->prefer_server_ciphers, 0);
 
@@ -362,6 +571,9 @@ ngx_http_ssl_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_str_value(conf->certificate, prev->certificate, "");
     ngx_conf_merge_str_value(conf->certificate_key, prev->certificate_key, "");
+    ngx_conf_merge_str_value(conf->certificate_dir, prev->certificate_dir, "");
+    ngx_conf_merge_uint_value(conf->certificate_cache_size,
+                         prev->certificate_cache_size, 1024);
 
     ngx_conf_merge_str_value(conf->dhparam, prev->dhparam, "");
 
@@ -374,12 +586,13 @@ ngx_http_ssl_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_str_value(conf->ciphers, prev->ciphers, NGX_DEFAULT_CIPHERS);
 
+    ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, NULL);
 
     conf->ssl.log = cf->log;
 
     if (conf->enable) {
 
-        if (conf->certificate.len == 0) {
+        if (conf->certificate.len == 0 && conf->certificate_dir.len == 0) {
             ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
                           "no \"ssl_certificate\" is defined for "
                           "the \"ssl\" directive in %s:%ui",
@@ -387,7 +600,7 @@ ngx_http_ssl_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
             return NGX_CONF_ERROR;
         }
 
-        if (conf->certificate_key.len == 0) {
+        if (conf->certificate.len && conf->certificate_key.len == 0) {
             ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
                           "no \"ssl_certificate_key\" is defined for "
                           "the \"ssl\" directive in %s:%ui",
@@ -397,11 +610,11 @@ ngx_http_ssl_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
 
     } else {
 
-        if (conf->certificate.len == 0) {
+        if (conf->certificate.len == 0 && conf->certificate_dir.len == 0) {
             return NGX_CONF_OK;
         }
 
-        if (conf->certificate_key.len == 0) {
+        if (conf->certificate.len && conf->certificate_key.len == 0) {
             ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
                           "no \"ssl_certificate_key\" is defined "
                           "for certificate \"%V\"", &conf->certificate);
@@ -413,6 +626,14 @@ ngx_http_ssl_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
         return NGX_CONF_ERROR;
     }
 
+    conf->ssl.record_start_size = conf->record_start_size;
+    conf->ssl.record_idle_timeout = conf->record_idle_timeout;
+    conf->ssl.buffer_size = conf->buffer_size;
+
+#if (NGX_THREADS)
+    conf->ssl.thread_pool = conf->thread_pool;
+#endif
+
 #ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
 
     if (SSL_CTX_set_tlsext_servername_callback(conf->ssl.ctx,
@@ -427,6 +648,10 @@ ngx_http_ssl_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
 
 #endif
 
+#ifdef TLSEXT_TYPE_application_layer_protocol_negotiation
+    SSL_CTX_set_alpn_select_cb(conf->ssl.ctx, ngx_http_ssl_alpn_select, NULL);
+#endif
+
     cln = ngx_pool_cleanup_add(cf->pool, 0);
     if (cln == NULL) {
         return NGX_CONF_ERROR;
@@ -435,9 +660,15 @@ ngx_http_ssl_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
     cln->handler = ngx_ssl_cleanup_ctx;
     cln->data = &conf->ssl;
 
-    if (ngx_ssl_certificate(cf, &conf->ssl, &conf->certificate,
-                            &conf->certificate_key)
-        != NGX_OK)
+    /*
+     * with ssl_certificate_dir the server certificate is optional,
+     * it is used for the clients without SNI and for the unknown names
+     */
+
+    if (conf->certificate.len
+        && ngx_ssl_certificate(cf, &conf->ssl, &conf->certificate,
+                               &conf->certificate_key)
+           != NGX_OK)
     {
         return NGX_CONF_ERROR;
     }
@@ -502,6 +733,49 @@ ngx_http_ssl_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
         return NGX_CONF_ERROR;
     }
 
+#ifdef SSL_OP_NO_TICKET
+
+    if (!conf->session_tickets) {
+        SSL_CTX_set_options(conf->ssl.ctx, SSL_OP_NO_TICKET);
+    }
+
+#endif
+
+    if (conf->session_tickets
+        && ngx_ssl_session_ticket_keys(cf, &conf->ssl,
+                                       conf->session_ticket_keys,
+                                       conf->session_ticket_key_rotate)
+           != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    if (conf->stapling
+        && ngx_ssl_stapling(cf, &conf->ssl, &conf->stapling_responder,
+                            conf->stapling_verify)
+           != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    if (conf->certificate_dir.len) {
+
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+
+        if (ngx_http_ssl_certificate_cache_init(cf, conf) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+
+#else
+
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "\"ssl_certificate_dir\" requires SNI support, "
+                      "nginx was built without it");
+        return NGX_CONF_ERROR;
+
+#endif
+    }
+
     return NGX_CONF_OK;
 }
 
@@ -635,3 +909,402 @@ invalid:
 
     return NGX_CONF_ERROR;
 }
+
+
+static char *
+ngx_http_ssl_async_handshake(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_ssl_srv_conf_t *sscf = conf;
+
+    ngx_str_t  *value;
+#if (NGX_THREADS)
+    ngx_str_t   name;
+#endif
+
+    if (sscf->thread_pool != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        sscf->thread_pool = NULL;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strncmp(value[1].data, "threads", 7) == 0
+        && (value[1].len == 7 || value[1].data[7] == '='))
+    {
+#if (NGX_THREADS)
+
+        if (value[1].len > 8) {
+            name.len = value[1].len - 8;
+            name.data = value[1].data + 8;
+
+            sscf->thread_pool = ngx_thread_pool_add(cf, &name);
+
+        } else {
+            sscf->thread_pool = ngx_thread_pool_add(cf, NULL);
+        }
+
+        if (sscf->thread_pool == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        return NGX_CONF_OK;
+
+#else
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"ssl_async_handshake threads\" "
+                           "is unsupported on this platform");
+        return NGX_CONF_ERROR;
+#endif
+    }
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid value \"%V\"", &value[1]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+
+/*
+ * the certificates from ssl_certificate_dir are loaded in the SNI callback
+ * on the first use of a name instead of reading all of them on startup,
+ * the contexts created for them are kept in a per worker LRU cache
+ * of ssl_certificate_cache entries
+ */
+
+static ngx_int_t
+ngx_http_ssl_certificate_cache_init(ngx_conf_t *cf,
+    ngx_http_ssl_srv_conf_t *sscf)
+{
+    ngx_pool_cleanup_t                *cln;
+    ngx_http_ssl_certificate_cache_t  *cache;
+
+    if (sscf->certificate_cache_size == 0) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "\"ssl_certificate_cache\" must be greater than 0");
+        return NGX_ERROR;
+    }
+
+    if (ngx_conf_full_name(cf->cycle, &sscf->certificate_dir, 1) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_ssl_certificate_cache_t));
+    if (cache == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_rbtree_init(&cache->rbtree, &cache->sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    ngx_queue_init(&cache->queue);
+
+#if (NGX_THREADS)
+    if (ngx_thread_mutex_create(&cache->mutex, cf->log) != NGX_OK) {
+        return NGX_ERROR;
+    }
+#endif
+
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_ssl_certificate_cache_cleanup;
+    cln->data = cache;
+
+    sscf->certificate_cache = cache;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_ssl_certificate_cache_cleanup(void *data)
+{
+    ngx_http_ssl_certificate_cache_t *cache = data;
+
+    ngx_queue_t                      *q;
+    ngx_http_ssl_certificate_node_t  *cn;
+
+    while (!ngx_queue_empty(&cache->queue)) {
+        q = ngx_queue_head(&cache->queue);
+        ngx_queue_remove(q);
+
+        cn = ngx_queue_data(q, ngx_http_ssl_certificate_node_t, queue);
+
+        if (cn->ctx) {
+            SSL_CTX_free(cn->ctx);
+        }
+
+        ngx_free(cn);
+    }
+
+#if (NGX_THREADS)
+    ngx_thread_mutex_destroy(&cache->mutex);
+#endif
+}
+
+
+/*
+ * the context is switched under the cache lock: the handshakes may run
+ * in the thread pools, and an evicted context is freed as soon as the last
+ * connection switched to it releases its reference
+ */
+
+ngx_int_t
+ngx_http_ssl_certificate(ngx_ssl_conn_t *ssl_conn,
+    ngx_http_ssl_srv_conf_t *sscf, ngx_str_t *host, ngx_log_t *log)
+{
+    SSL_CTX                           *ctx;
+    uint32_t                           hash;
+    ngx_queue_t                       *q;
+    ngx_http_ssl_certificate_node_t   *cn;
+    ngx_http_ssl_certificate_cache_t  *cache;
+
+    cache = sscf->certificate_cache;
+
+    hash = ngx_crc32_short(host->data, host->len);
+
+#if (NGX_THREADS)
+    ngx_thread_mutex_lock(&cache->mutex);
+#endif
+
+    cn = (ngx_http_ssl_certificate_node_t *)
+             ngx_str_rbtree_lookup(&cache->rbtree, host, hash);
+
+    if (cn && (cn->ctx || cn->expire > ngx_time())) {
+        ngx_queue_remove(&cn->queue);
+        ngx_queue_insert_head(&cache->queue, &cn->queue);
+
+        goto done;
+    }
+
+#if (NGX_THREADS)
+    ngx_thread_mutex_unlock(&cache->mutex);
+#endif
+
+    /* the files are read without the lock */
+
+    ctx = ngx_http_ssl_certificate_load(sscf, host, log);
+
+#if (NGX_THREADS)
+    ngx_thread_mutex_lock(&cache->mutex);
+#endif
+
+    cn = (ngx_http_ssl_certificate_node_t *)
+             ngx_str_rbtree_lookup(&cache->rbtree, host, hash);
+
+    if (cn) {
+        ngx_queue_remove(&cn->queue);
+
+        if (cn->ctx == NULL) {
+            cn->ctx = ctx;
+
+        } else if (ctx) {
+            /* the same name has been loaded concurrently */
+            SSL_CTX_free(ctx);
+        }
+
+    } else {
+
+        if (cache->nodes == sscf->certificate_cache_size) {
+            q = ngx_queue_last(&cache->queue);
+            ngx_queue_remove(q);
+
+            cn = ngx_queue_data(q, ngx_http_ssl_certificate_node_t, queue);
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                           "ssl certificate cache evict \"%V\"", &cn->sn.str);
+
+            ngx_rbtree_delete(&cache->rbtree, &cn->sn.node);
+
+            if (cn->ctx) {
+                SSL_CTX_free(cn->ctx);
+            }
+
+            ngx_free(cn);
+            cache->nodes--;
+        }
+
+        cn = ngx_alloc(sizeof(ngx_http_ssl_certificate_node_t) + host->len,
+                       log);
+        if (cn == NULL) {
+#if (NGX_THREADS)
+            ngx_thread_mutex_unlock(&cache->mutex);
+#endif
+            if (ctx) {
+                SSL_CTX_free(ctx);
+            }
+
+            return NGX_ERROR;
+        }
+
+        cn->sn.node.key = hash;
+        cn->sn.str.len = host->len;
+        cn->sn.str.data = (u_char *) cn
+                          + sizeof(ngx_http_ssl_certificate_node_t);
+        ngx_memcpy(cn->sn.str.data, host->data, host->len);
+
+        cn->ctx = ctx;
+
+        ngx_rbtree_insert(&cache->rbtree, &cn->sn.node);
+        cache->nodes++;
+    }
+
+    /* the absence of the certificate is rechecked in a minute */
+
+    cn->expire = ngx_time() + 60;
+
+    ngx_queue_insert_head(&cache->queue, &cn->queue);
+
+done:
+
+    if (cn->ctx == NULL) {
+#if (NGX_THREADS)
+        ngx_thread_mutex_unlock(&cache->mutex);
+#endif
+        return NGX_DECLINED;
+    }
+
+    SSL_set_SSL_CTX(ssl_conn, cn->ctx);
+
+#if (NGX_THREADS)
+    ngx_thread_mutex_unlock(&cache->mutex);
+#endif
+
+    return NGX_OK;
+}
+
+
+/*
+ * the context is created as in ngx_http_ssl_merge_srv_conf(),
+ * the protocols, the session ticket options and the verification mode
+ * are kept from the initial context of the connection, while
+ * the certificate store is shared to verify the client certificates
+ */
+
+static SSL_CTX *
+ngx_http_ssl_certificate_load(ngx_http_ssl_srv_conf_t *sscf, ngx_str_t *host,
+    ngx_log_t *log)
+{
+    u_char               *cert, *key;
+    size_t                len;
+    ngx_ssl_t             ssl;
+    X509_STORE           *store;
+    ngx_file_info_t       fi;
+    STACK_OF(X509_NAME)  *list;
+
+    len = sscf->certificate_dir.len + 1 + host->len + sizeof(".crt");
+
+    cert = ngx_alloc(2 * len, log);
+    if (cert == NULL) {
+        return NULL;
+    }
+
+    key = cert + len;
+
+    ngx_sprintf(cert, "%V/%V.crt%Z", &sscf->certificate_dir, host);
+    ngx_sprintf(key, "%V/%V.key%Z", &sscf->certificate_dir, host);
+
+    if (ngx_file_info(cert, &fi) == NGX_FILE_ERROR) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, ngx_errno,
+                       "ssl certificate \"%s\" not found", cert);
+        ngx_free(cert);
+        return NULL;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "ssl certificate load \"%s\"", cert);
+
+    ssl.log = log;
+
+    if (ngx_ssl_create(&ssl, sscf->protocols, sscf) != NGX_OK) {
+        ngx_free(cert);
+        return NULL;
+    }
+
+    if (SSL_CTX_use_certificate_chain_file(ssl.ctx, (char *) cert) == 0) {
+        ngx_ssl_error(NGX_LOG_ERR, log, 0,
+                      "SSL_CTX_use_certificate_chain_file(\"%s\") failed",
+                      cert);
+        goto failed;
+    }
+
+    if (SSL_CTX_use_PrivateKey_file(ssl.ctx, (char *) key, SSL_FILETYPE_PEM)
+        == 0)
+    {
+        ngx_ssl_error(NGX_LOG_ERR, log, 0,
+                      "SSL_CTX_use_PrivateKey_file(\"%s\") failed", key);
+        goto failed;
+    }
+
+    ngx_free(cert);
+    cert = NULL;
+
+    if (SSL_CTX_set_cipher_list(ssl.ctx, (const char *) sscf->ciphers.data)
+        == 0)
+    {
+        ngx_ssl_error(NGX_LOG_ERR, log, 0,
+                      "SSL_CTX_set_cipher_list(\"%V\") failed",
+                      &sscf->ciphers);
+    }
+
+    if (sscf->verify) {
+        store = SSL_CTX_get_cert_store(sscf->ssl.ctx);
+
+        CRYPTO_add(&store->references, 1, CRYPTO_LOCK_X509_STORE);
+        SSL_CTX_set_cert_store(ssl.ctx, store);
+
+        list = SSL_CTX_get_client_CA_list(sscf->ssl.ctx);
+
+        if (list) {
+            SSL_CTX_set_client_CA_list(ssl.ctx, SSL_dup_CA_list(list));
+        }
+    }
+
+    if (sscf->prefer_server_ciphers) {
+        SSL_CTX_set_options(ssl.ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
+    }
+
+    SSL_CTX_set_tmp_rsa_callback(ssl.ctx, ngx_ssl_rsa512_key_callback);
+
+    if (ngx_ssl_dhparam(NULL, &ssl, &sscf->dhparam) != NGX_OK) {
+        goto failed;
+    }
+
+    if (ngx_ssl_ecdh_curve(NULL, &ssl, &sscf->ecdh_curve) != NGX_OK) {
+        goto failed;
+    }
+
+    if (ngx_ssl_session_cache(&ssl, &ngx_http_ssl_sess_id_ctx,
+                              sscf->builtin_session_cache,
+                              sscf->shm_zone, sscf->session_timeout)
+        != NGX_OK)
+    {
+        goto failed;
+    }
+
+#ifdef TLSEXT_TYPE_application_layer_protocol_negotiation
+    SSL_CTX_set_alpn_select_cb(ssl.ctx, ngx_http_ssl_alpn_select, NULL);
+#endif
+
+    return ssl.ctx;
+
+failed:
+
+    if (cert) {
+        ngx_free(cert);
+    }
+
+    SSL_CTX_free(ssl.ctx);
+
+    return NULL;
+}
+
+#endif
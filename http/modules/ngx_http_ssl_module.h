@@ -13,6 +13,30 @@
 #include <ngx_http.h>
 
 
+/*
+ * the contexts of the certificates loaded on demand are cached per worker,
+ * a node without context caches the absence of the certificate for a while
+ */
+
+typedef struct {
+    ngx_str_node_t                  sn;
+    ngx_queue_t                     queue;
+    SSL_CTX                        *ctx;
+    time_t                          expire;
+} ngx_http_ssl_certificate_node_t;
+
+
+typedef struct {
+    ngx_rbtree_t                    rbtree;
+    ngx_rbtree_node_t               sentinel;
+    ngx_queue_t                     queue;
+    ngx_uint_t                      nodes;
+#if (NGX_THREADS)
+    ngx_thread_mutex_t              mutex;
+#endif
+} ngx_http_ssl_certificate_cache_t;
+
+
 typedef struct {
     ngx_flag_t                      enable;
 
@@ -29,8 +53,15 @@ typedef struct {
 
     time_t                          session_timeout;
 
+    ngx_flag_t                      session_tickets;
+    ngx_array_t                    *session_ticket_keys;
+    time_t                          session_ticket_key_rotate;
+
     ngx_str_t                       certificate;
     ngx_str_t                       certificate_key;
+    ngx_str_t                       certificate_dir;
+    ngx_uint_t                      certificate_cache_size;
+    ngx_http_ssl_certificate_cache_t  *certificate_cache;
     ngx_str_t                       dhparam;
     ngx_str_t                       ecdh_curve;
     ngx_str_t                       client_certificate;
@@ -40,11 +71,27 @@ typedef struct {
 
     ngx_shm_zone_t                 *shm_zone;
 
+    size_t                          record_start_size;
+    ngx_msec_t                      record_idle_timeout;
+    size_t                          buffer_size;
+
+    ngx_flag_t                      stapling;
+    ngx_flag_t                      stapling_verify;
+    ngx_str_t                       stapling_responder;
+
+    ngx_thread_pool_t              *thread_pool;
+
     u_char                         *file;
     ngx_uint_t                      line;
 } ngx_http_ssl_srv_conf_t;
 
 
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+ngx_int_t ngx_http_ssl_certificate(ngx_ssl_conn_t *ssl_conn,
+    ngx_http_ssl_srv_conf_t *sscf, ngx_str_t *host, ngx_log_t *log);
+#endif
+
+
 extern ngx_module_t  ngx_http_ssl_module;
 
 
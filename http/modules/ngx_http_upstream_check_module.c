@@ -0,0 +1,757 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_UPSTREAM_CHECK_TCP   1
+#define NGX_HTTP_UPSTREAM_CHECK_HTTP  2
+
+
+typedef struct {
+    ngx_msec_t                           interval;
+    ngx_msec_t                           timeout;
+    ngx_uint_t                           fails;
+    ngx_uint_t                           passes;
+    ngx_uint_t                           type;
+    ngx_str_t                            uri;
+    ngx_uint_t                           status_min;
+    ngx_uint_t                           status_max;
+    ngx_str_t                            match;
+} ngx_http_upstream_check_srv_conf_t;
+
+
+typedef struct {
+    ngx_http_upstream_check_srv_conf_t  *conf;
+    ngx_http_upstream_rr_peers_t        *peers;
+    ngx_http_upstream_rr_peer_t         *peer;
+
+    ngx_event_t                          timer;
+    ngx_peer_connection_t                pc;
+    ngx_msec_t                           start;
+    ngx_uint_t                           status;   /* unsigned  status:1; */
+
+    ngx_buf_t                           *send;
+    ngx_buf_t                           *recv;
+} ngx_http_upstream_check_peer_t;
+
+
+static ngx_int_t ngx_http_upstream_check_init_process(ngx_cycle_t *cycle);
+static void ngx_http_upstream_check_begin(ngx_event_t *ev);
+static void ngx_http_upstream_check_send_handler(ngx_event_t *wev);
+static void ngx_http_upstream_check_recv_handler(ngx_event_t *rev);
+static ngx_int_t ngx_http_upstream_check_parse(
+    ngx_http_upstream_check_peer_t *cp, ngx_uint_t done);
+static void ngx_http_upstream_check_finalize(
+    ngx_http_upstream_check_peer_t *cp, ngx_uint_t ok);
+static void *ngx_http_upstream_check_create_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_check(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_http_upstream_check_commands[] = {
+
+    { ngx_string("health_check"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_ANY,
+      ngx_http_upstream_check,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_check_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_upstream_check_create_conf,   /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_check_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_check_module_ctx,   /* module context */
+    ngx_http_upstream_check_commands,      /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_http_upstream_check_init_process,  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+/*
+ * every worker arms a timer for every checked peer; the peer's "checked"
+ * time is taken under the zone mutex, so with a shared zone only one
+ * worker checks a peer per interval and the result is seen by all workers
+ */
+
+static ngx_int_t
+ngx_http_upstream_check_init_process(ngx_cycle_t *cycle)
+{
+    u_char                              *p;
+    size_t                               len, size;
+    ngx_uint_t                           i, j;
+    ngx_http_upstream_rr_peers_t        *peers;
+    ngx_http_upstream_srv_conf_t       **uscfp;
+    ngx_http_upstream_check_peer_t      *cp;
+    ngx_http_upstream_main_conf_t       *umcf;
+    ngx_http_upstream_check_srv_conf_t  *ucf;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL || uscfp[i]->peer.data == NULL) {
+            continue;
+        }
+
+        ucf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                              ngx_http_upstream_check_module);
+
+        if (ucf->interval == NGX_CONF_UNSET_MSEC) {
+            continue;
+        }
+
+        len = 0;
+        p = NULL;
+
+        if (ucf->type == NGX_HTTP_UPSTREAM_CHECK_HTTP) {
+            len = sizeof("GET  HTTP/1.0" CRLF) - 1 + ucf->uri.len
+                  + sizeof("Host: " CRLF) - 1 + uscfp[i]->host.len
+                  + sizeof("Connection: close" CRLF CRLF) - 1;
+
+            p = ngx_pnalloc(cycle->pool, len);
+            if (p == NULL) {
+                return NGX_ERROR;
+            }
+
+            ngx_sprintf(p, "GET %V HTTP/1.0" CRLF "Host: %V" CRLF
+                        "Connection: close" CRLF CRLF,
+                        &ucf->uri, &uscfp[i]->host);
+        }
+
+        /*
+         * the buffer is reused while the match is searched for, so it
+         * keeps the tail of the response where a match may start
+         */
+
+        size = ngx_max(ngx_pagesize, 2 * ucf->match.len);
+
+        for (peers = uscfp[i]->peer.data; peers; peers = peers->next) {
+
+            for (j = 0; j < peers->number; j++) {
+
+                cp = ngx_pcalloc(cycle->pool,
+                                 sizeof(ngx_http_upstream_check_peer_t));
+                if (cp == NULL) {
+                    return NGX_ERROR;
+                }
+
+                cp->conf = ucf;
+                cp->peers = peers;
+                cp->peer = &peers->peer[j];
+
+                cp->send = ngx_calloc_buf(cycle->pool);
+                if (cp->send == NULL) {
+                    return NGX_ERROR;
+                }
+
+                cp->send->start = p;
+                cp->send->end = p + len;
+
+                cp->recv = ngx_create_temp_buf(cycle->pool, size);
+                if (cp->recv == NULL) {
+                    return NGX_ERROR;
+                }
+
+                cp->timer.handler = ngx_http_upstream_check_begin;
+                cp->timer.data = cp;
+                cp->timer.log = cycle->log;
+                cp->timer.cancelable = 1;
+
+                /* the first checks are spread over the interval */
+
+                ngx_add_timer(&cp->timer,
+                              (ngx_msec_t) ngx_random() % ucf->interval);
+            }
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_check_begin(ngx_event_t *ev)
+{
+    ngx_http_upstream_check_peer_t *cp = ev->data;
+
+    ngx_int_t                     rc;
+    ngx_connection_t             *c;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    peer = cp->peer;
+
+    ngx_http_upstream_rr_peers_lock(cp->peers);
+
+    if (ngx_current_msec - peer->checked < cp->conf->interval) {
+        ngx_http_upstream_rr_peers_unlock(cp->peers);
+
+        ngx_add_timer(&cp->timer, cp->conf->interval);
+        return;
+    }
+
+    peer->checked = ngx_current_msec;
+
+    if (peer->down) {
+        ngx_http_upstream_rr_peers_unlock(cp->peers);
+
+        ngx_add_timer(&cp->timer, cp->conf->interval);
+        return;
+    }
+
+    ngx_http_upstream_rr_peers_unlock(cp->peers);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "upstream health check: %V", &peer->name);
+
+    cp->start = ngx_current_msec;
+
+    ngx_memzero(&cp->pc, sizeof(ngx_peer_connection_t));
+
+    cp->pc.sockaddr = peer->sockaddr;
+    cp->pc.socklen = peer->socklen;
+    cp->pc.name = &peer->name;
+    cp->pc.get = ngx_event_get_peer;
+    cp->pc.log = ev->log;
+    cp->pc.log_error = NGX_ERROR_ERR;
+
+    rc = ngx_event_connect_peer(&cp->pc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_http_upstream_check_finalize(cp, 0);
+        return;
+    }
+
+    c = cp->pc.connection;
+
+    c->data = cp;
+    c->log = ev->log;
+    c->read->log = ev->log;
+    c->write->log = ev->log;
+
+    c->write->handler = ngx_http_upstream_check_send_handler;
+    c->read->handler = ngx_http_upstream_check_recv_handler;
+
+    cp->send->pos = cp->send->start;
+    cp->send->last = cp->send->end;
+    cp->recv->pos = cp->recv->start;
+    cp->recv->last = cp->recv->start;
+    cp->status = 0;
+
+    /* the timeout covers the whole check */
+
+    ngx_add_timer(c->read, cp->conf->timeout);
+
+    if (rc == NGX_OK) {
+        ngx_http_upstream_check_send_handler(c->write);
+    }
+}
+
+
+static void
+ngx_http_upstream_check_send_handler(ngx_event_t *wev)
+{
+    int                              err;
+    ssize_t                          n;
+    socklen_t                        len;
+    ngx_connection_t                *c;
+    ngx_http_upstream_check_peer_t  *cp;
+
+    c = wev->data;
+    cp = c->data;
+
+    if (cp->send->pos == cp->send->last) {
+
+        if (cp->conf->type == NGX_HTTP_UPSTREAM_CHECK_HTTP) {
+            (void) ngx_handle_write_event(wev, 0);
+            return;
+        }
+
+        /* a TCP check succeeds once the connection is established */
+
+        err = 0;
+        len = sizeof(int);
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+            == -1)
+        {
+            err = ngx_errno;
+        }
+
+        if (err) {
+            ngx_log_error(NGX_LOG_ERR, c->log, err,
+                          "health check connect() to %V failed",
+                          cp->pc.name);
+        }
+
+        ngx_http_upstream_check_finalize(cp, err == 0);
+        return;
+    }
+
+    while (cp->send->pos < cp->send->last) {
+
+        n = c->send(c, cp->send->pos, cp->send->last - cp->send->pos);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+                ngx_http_upstream_check_finalize(cp, 0);
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR) {
+            ngx_http_upstream_check_finalize(cp, 0);
+            return;
+        }
+
+        cp->send->pos += n;
+    }
+
+    if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+        ngx_http_upstream_check_finalize(cp, 0);
+        return;
+    }
+
+    if (c->read->ready) {
+        ngx_http_upstream_check_recv_handler(c->read);
+    }
+}
+
+
+static void
+ngx_http_upstream_check_recv_handler(ngx_event_t *rev)
+{
+    size_t                           len;
+    ssize_t                          n;
+    ngx_int_t                        rc;
+    ngx_buf_t                       *b;
+    ngx_connection_t                *c;
+    ngx_http_upstream_check_peer_t  *cp;
+
+    c = rev->data;
+    cp = c->data;
+    b = cp->recv;
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "health check of %V timed out", cp->pc.name);
+        ngx_http_upstream_check_finalize(cp, 0);
+        return;
+    }
+
+    if (cp->conf->type == NGX_HTTP_UPSTREAM_CHECK_TCP) {
+        ngx_http_upstream_check_send_handler(c->write);
+        return;
+    }
+
+    for ( ;; ) {
+
+        if (b->last == b->end) {
+            rc = ngx_http_upstream_check_parse(cp, 0);
+
+            if (rc != NGX_AGAIN) {
+                break;
+            }
+
+            /* the match is searched for in the rest of the response */
+
+            len = cp->conf->match.len - 1;
+
+            b->pos = b->start;
+            b->last = ngx_movemem(b->start, b->last - len, len);
+        }
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            rc = ngx_http_upstream_check_parse(cp, 0);
+
+            if (rc == NGX_AGAIN) {
+                if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                    rc = NGX_ERROR;
+                }
+            }
+
+            break;
+        }
+
+        if (n == NGX_ERROR) {
+            rc = NGX_ERROR;
+            break;
+        }
+
+        if (n == 0) {
+            rc = ngx_http_upstream_check_parse(cp, 1);
+            break;
+        }
+
+        b->last += n;
+    }
+
+    if (rc == NGX_AGAIN) {
+        return;
+    }
+
+    ngx_http_upstream_check_finalize(cp, rc == NGX_OK);
+}
+
+
+/*
+ * the status of the response must be in the expected range and, if
+ * a match is configured, the response must contain it; the status line
+ * must fit in the buffer, the match is searched for in the whole response
+ */
+
+static ngx_int_t
+ngx_http_upstream_check_parse(ngx_http_upstream_check_peer_t *cp,
+    ngx_uint_t done)
+{
+    u_char     *p, *last;
+    ngx_int_t   status;
+
+    p = cp->recv->pos;
+    last = cp->recv->last;
+
+    if (cp->status) {
+        goto match;
+    }
+
+    if (ngx_strlchr(p, last, LF) == NULL) {
+
+        if (!done && last < cp->recv->end) {
+            return NGX_AGAIN;
+        }
+
+        ngx_log_error(NGX_LOG_ERR, cp->pc.log, 0,
+                      "health check of %V: no response status line",
+                      cp->pc.name);
+        return NGX_DECLINED;
+    }
+
+    if (last - p < (ssize_t) sizeof("HTTP/1.x 200") - 1
+        || ngx_strncmp(p, "HTTP/1.", sizeof("HTTP/1.") - 1) != 0
+        || p[8] != ' ')
+    {
+        ngx_log_error(NGX_LOG_ERR, cp->pc.log, 0,
+                      "health check of %V: invalid response status line",
+                      cp->pc.name);
+        return NGX_DECLINED;
+    }
+
+    status = ngx_atoi(p + 9, 3);
+
+    if (status == NGX_ERROR
+        || (ngx_uint_t) status < cp->conf->status_min
+        || (ngx_uint_t) status > cp->conf->status_max)
+    {
+        ngx_log_error(NGX_LOG_ERR, cp->pc.log, 0,
+                      "health check of %V: unexpected status %*s",
+                      cp->pc.name, (size_t) 3, p + 9);
+        return NGX_DECLINED;
+    }
+
+    if (cp->conf->match.len == 0) {
+        return NGX_OK;
+    }
+
+    cp->status = 1;
+
+match:
+
+    if (ngx_strnstr(p, (char *) cp->conf->match.data, last - p)) {
+        return NGX_OK;
+    }
+
+    if (!done) {
+        return NGX_AGAIN;
+    }
+
+    ngx_log_error(NGX_LOG_ERR, cp->pc.log, 0,
+                  "health check of %V: response does not match \"%V\"",
+                  cp->pc.name, &cp->conf->match);
+
+    return NGX_DECLINED;
+}
+
+
+static void
+ngx_http_upstream_check_finalize(ngx_http_upstream_check_peer_t *cp,
+    ngx_uint_t ok)
+{
+    ngx_msec_t                    latency;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    if (cp->pc.connection) {
+        ngx_close_connection(cp->pc.connection);
+        cp->pc.connection = NULL;
+    }
+
+    latency = ngx_current_msec - cp->start;
+    peer = cp->peer;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, cp->timer.log, 0,
+                   "upstream health check: %V %ui %Mms",
+                   &peer->name, ok, latency);
+
+    ngx_http_upstream_rr_peers_lock(cp->peers);
+
+    peer->check_latency = latency;
+
+    if (ok) {
+        peer->check_fails = 0;
+
+        if (peer->unhealthy && ++peer->check_passes >= cp->conf->passes) {
+            peer->unhealthy = 0;
+            peer->check_passes = 0;
+            peer->fails = 0;
+
+            ngx_log_error(NGX_LOG_WARN, cp->timer.log, 0,
+                          "upstream peer %V is healthy", &peer->name);
+        }
+
+    } else {
+        peer->check_passes = 0;
+
+        if (!peer->unhealthy && ++peer->check_fails >= cp->conf->fails) {
+            peer->unhealthy = 1;
+            peer->check_fails = 0;
+
+            ngx_log_error(NGX_LOG_WARN, cp->timer.log, 0,
+                          "upstream peer %V is unhealthy", &peer->name);
+        }
+    }
+
+    ngx_http_upstream_rr_peers_unlock(cp->peers);
+
+    if (!ngx_exiting) {
+        ngx_add_timer(&cp->timer, cp->conf->interval);
+    }
+}
+
+
+static void *
+ngx_http_upstream_check_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_check_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_check_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->uri = { 0, NULL };
+     *     conf->match = { 0, NULL };
+     */
+
+    conf->interval = NGX_CONF_UNSET_MSEC;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_check(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_check_srv_conf_t *ucf = conf;
+
+    u_char       *p;
+    ngx_int_t     n;
+    ngx_str_t    *value, s;
+    ngx_uint_t    i;
+
+    if (ucf->interval != NGX_CONF_UNSET_MSEC) {
+        return "is duplicate";
+    }
+
+    ucf->interval = 5000;
+    ucf->timeout = 1000;
+    ucf->fails = 1;
+    ucf->passes = 1;
+    ucf->type = NGX_HTTP_UPSTREAM_CHECK_HTTP;
+    ngx_str_set(&ucf->uri, "/");
+    ucf->status_min = 200;
+    ucf->status_max = 399;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = &value[i].data[9];
+
+            ucf->interval = ngx_parse_time(&s, 0);
+            if (ucf->interval == (ngx_msec_t) NGX_ERROR
+                || ucf->interval == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+
+            s.len = value[i].len - 8;
+            s.data = &value[i].data[8];
+
+            ucf->timeout = ngx_parse_time(&s, 0);
+            if (ucf->timeout == (ngx_msec_t) NGX_ERROR || ucf->timeout == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "fails=", 6) == 0) {
+
+            n = ngx_atoi(&value[i].data[6], value[i].len - 6);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            ucf->fails = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "passes=", 7) == 0) {
+
+            n = ngx_atoi(&value[i].data[7], value[i].len - 7);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            ucf->passes = n;
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "type=tcp") == 0) {
+            ucf->type = NGX_HTTP_UPSTREAM_CHECK_TCP;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "type=http") == 0) {
+            ucf->type = NGX_HTTP_UPSTREAM_CHECK_HTTP;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "uri=", 4) == 0) {
+
+            ucf->uri.len = value[i].len - 4;
+            ucf->uri.data = &value[i].data[4];
+
+            if (ucf->uri.len == 0 || ucf->uri.data[0] != '/') {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "status=", 7) == 0) {
+
+            s.data = &value[i].data[7];
+            s.len = value[i].len - 7;
+
+            p = ngx_strlchr(s.data, s.data + s.len, '-');
+
+            if (p) {
+                n = ngx_atoi(s.data, p - s.data);
+                ucf->status_max = ngx_atoi(p + 1, s.data + s.len - p - 1);
+
+                if (ucf->status_max == (ngx_uint_t) NGX_ERROR) {
+                    goto invalid;
+                }
+
+            } else {
+                n = ngx_atoi(s.data, s.len);
+                ucf->status_max = n;
+            }
+
+            if (n == NGX_ERROR || n < 100 || (ngx_uint_t) n > ucf->status_max
+                || ucf->status_max > 599)
+            {
+                goto invalid;
+            }
+
+            ucf->status_min = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "match=", 6) == 0) {
+
+            ucf->match.len = value[i].len - 6;
+            ucf->match.data = &value[i].data[6];
+
+            if (ucf->match.len == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
@@ -0,0 +1,1142 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+typedef struct {
+    ngx_str_t                       state;
+} ngx_http_upstream_conf_srv_conf_t;
+
+
+typedef struct {
+    struct sockaddr_in              sockaddr;
+    ngx_uint_t                      addr;      /* unsigned  addr:1; */
+    ngx_int_t                       weight;
+    ngx_int_t                       max_fails;
+    time_t                          fail_timeout;
+    ngx_int_t                       max_conns;
+    ngx_int_t                       down;
+    ngx_int_t                       drain;
+    ngx_int_t                       up;
+} ngx_http_upstream_conf_server_t;
+
+
+#define NGX_HTTP_UPSTREAM_CONF_LINE_LEN                                       \
+    (sizeof("server  weight= max_fails= fail_timeout=s max_conns="            \
+            " backup drain; # id= conns= check_latency=ms unhealthy"          \
+            " resolve=\n")                                                    \
+     + NGX_SOCKADDR_STRLEN + 7 * NGX_INT_T_LEN + NGX_INT64_LEN)
+
+
+static ngx_int_t ngx_http_upstream_conf_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_upstream_conf_send(ngx_http_request_t *r,
+    ngx_uint_t status, ngx_buf_t *b);
+static ngx_int_t ngx_http_upstream_conf_parse(
+    ngx_http_upstream_conf_server_t *s, ngx_str_t *name, ngx_str_t *value);
+static void ngx_http_upstream_conf_fill(ngx_http_upstream_rr_peer_t *peer,
+    ngx_http_upstream_conf_server_t *s);
+static void ngx_http_upstream_conf_set(ngx_http_upstream_rr_peer_t *peer,
+    ngx_http_upstream_conf_server_t *s);
+static u_char *ngx_http_upstream_conf_server(u_char *p,
+    ngx_http_upstream_rr_peer_t *peer, ngx_uint_t backup);
+static u_char *ngx_http_upstream_conf_dump(u_char *p,
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peers_t *local);
+static void ngx_http_upstream_conf_save(ngx_http_upstream_rr_peers_t *peers,
+    ngx_uint_t change, ngx_str_t *state, u_char *buf, size_t len,
+    ngx_pool_t *pool, ngx_log_t *log);
+static ngx_int_t ngx_http_upstream_conf_load(ngx_cycle_t *cycle,
+    ngx_http_upstream_srv_conf_t *uscf, ngx_str_t *state);
+
+static void *ngx_http_upstream_conf_create_srv_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_conf(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_upstream_conf_state(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_http_upstream_conf_init_module(ngx_cycle_t *cycle);
+
+
+static ngx_command_t  ngx_http_upstream_conf_commands[] = {
+
+    { ngx_string("upstream_conf"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_upstream_conf,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("state"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_http_upstream_conf_state,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_conf_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_upstream_conf_create_srv_conf, /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_conf_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_conf_module_ctx,    /* module context */
+    ngx_http_upstream_conf_commands,       /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    ngx_http_upstream_conf_init_module,    /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_str_t  ngx_http_upstream_conf_params[] = {
+    ngx_string("server"),
+    ngx_string("weight"),
+    ngx_string("max_fails"),
+    ngx_string("fail_timeout"),
+    ngx_string("max_conns"),
+    ngx_string("down"),
+    ngx_string("drain"),
+    ngx_string("up"),
+    ngx_null_string
+};
+
+
+/*
+ * the API changes the peers of an upstream in a shared zone, so the change
+ * is seen by all workers at once; GET and HEAD only show the servers,
+ * a change requires POST, PUT or DELETE:
+ *
+ *   ?upstream=name                      lists the servers
+ *   ?upstream=name&id=N                 shows a server
+ *   ?upstream=name&add=&server=ip:port  adds a server to an empty slot
+ *   ?upstream=name&id=N&remove=         removes a server
+ *   ?upstream=name&id=N&weight=2        changes a server, also "max_fails=",
+ *                                       "fail_timeout=", "max_conns=",
+ *                                       "down=", "drain=" and "up="
+ */
+
+static ngx_int_t
+ngx_http_upstream_conf_handler(ngx_http_request_t *r)
+{
+    u_char                             *buf, *last;
+    size_t                              size;
+    ngx_int_t                           rc, id;
+    ngx_uint_t                          version;
+    ngx_buf_t                          *b;
+    ngx_str_t                           name, value, arg;
+    ngx_uint_t                          i, n, add, remove, change, backup;
+    ngx_http_upstream_rr_host_t        *host;
+    ngx_http_upstream_rr_peer_t        *peer;
+    ngx_http_upstream_rr_peers_t       *peers, *primary, *local;
+    ngx_http_upstream_srv_conf_t       *uscf, **uscfp;
+    ngx_http_upstream_main_conf_t      *umcf;
+    ngx_http_upstream_conf_server_t     s;
+    ngx_http_upstream_conf_srv_conf_t  *ucscf;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD|NGX_HTTP_POST
+                       |NGX_HTTP_PUT|NGX_HTTP_DELETE)))
+    {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    b = ngx_create_temp_buf(r->pool, NGX_HTTP_UPSTREAM_CONF_LINE_LEN);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "upstream", 8, &name) != NGX_OK) {
+        b->last = ngx_cpymem(b->last, "upstream is required\n",
+                             sizeof("upstream is required\n") - 1);
+        return ngx_http_upstream_conf_send(r, NGX_HTTP_BAD_REQUEST, b);
+    }
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+
+    uscf = NULL;
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        if (uscfp[i]->srv_conf
+            && uscfp[i]->host.len == name.len
+            && ngx_strncasecmp(uscfp[i]->host.data, name.data, name.len) == 0)
+        {
+            uscf = uscfp[i];
+            break;
+        }
+    }
+
+    if (uscf == NULL) {
+        b->last = ngx_cpymem(b->last, "upstream not found\n",
+                             sizeof("upstream not found\n") - 1);
+        return ngx_http_upstream_conf_send(r, NGX_HTTP_NOT_FOUND, b);
+    }
+
+    if (uscf->shm_zone == NULL || uscf->peer.data == NULL) {
+        b->last = ngx_cpymem(b->last, "upstream is not in a shared zone\n",
+                             sizeof("upstream is not in a shared zone\n") - 1);
+        return ngx_http_upstream_conf_send(r, NGX_HTTP_BAD_REQUEST, b);
+    }
+
+    ucscf = uscf->srv_conf[ngx_http_upstream_conf_module.ctx_index];
+
+    ngx_memzero(&s, sizeof(ngx_http_upstream_conf_server_t));
+
+    s.weight = NGX_CONF_UNSET;
+    s.max_fails = NGX_CONF_UNSET;
+    s.fail_timeout = NGX_CONF_UNSET;
+    s.max_conns = NGX_CONF_UNSET;
+    s.down = NGX_CONF_UNSET;
+    s.drain = NGX_CONF_UNSET;
+    s.up = NGX_CONF_UNSET;
+
+    change = 0;
+
+    for (i = 0; ngx_http_upstream_conf_params[i].len; i++) {
+
+        if (ngx_http_arg(r, ngx_http_upstream_conf_params[i].data,
+                         ngx_http_upstream_conf_params[i].len, &arg)
+            != NGX_OK)
+        {
+            continue;
+        }
+
+        value.data = ngx_pnalloc(r->pool, arg.len);
+        if (value.data == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        last = value.data;
+        buf = arg.data;
+
+        ngx_unescape_uri(&last, &buf, arg.len, 0);
+
+        value.len = last - value.data;
+
+        if (ngx_http_upstream_conf_parse(&s, &ngx_http_upstream_conf_params[i],
+                                         &value)
+            != NGX_OK)
+        {
+            b->last = ngx_snprintf(b->last, b->end - b->last,
+                                   "invalid \"%V\" value\n",
+                                   &ngx_http_upstream_conf_params[i]);
+            return ngx_http_upstream_conf_send(r, NGX_HTTP_BAD_REQUEST, b);
+        }
+
+        change = 1;
+    }
+
+    add = (ngx_http_arg(r, (u_char *) "add", 3, &arg) == NGX_OK);
+    remove = (ngx_http_arg(r, (u_char *) "remove", 6, &arg) == NGX_OK);
+
+    id = NGX_ERROR;
+
+    if (ngx_http_arg(r, (u_char *) "id", 2, &arg) == NGX_OK) {
+        id = ngx_atoi(arg.data, arg.len);
+
+        if (id == NGX_ERROR) {
+            b->last = ngx_cpymem(b->last, "invalid \"id\" value\n",
+                                 sizeof("invalid \"id\" value\n") - 1);
+            return ngx_http_upstream_conf_send(r, NGX_HTTP_BAD_REQUEST, b);
+        }
+    }
+
+    if (add && !s.addr) {
+        b->last = ngx_cpymem(b->last, "server is required\n",
+                             sizeof("server is required\n") - 1);
+        return ngx_http_upstream_conf_send(r, NGX_HTTP_BAD_REQUEST, b);
+    }
+
+    if ((add || remove || change)
+        && (r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD)))
+    {
+        b->last = ngx_cpymem(b->last, "changes require POST, PUT or DELETE\n",
+                             sizeof("changes require POST, PUT or DELETE\n")
+                             - 1);
+        return ngx_http_upstream_conf_send(r, NGX_HTTP_NOT_ALLOWED, b);
+    }
+
+    if (!add && (remove || change) && id == NGX_ERROR) {
+        b->last = ngx_cpymem(b->last, "id is required\n",
+                             sizeof("id is required\n") - 1);
+        return ngx_http_upstream_conf_send(r, NGX_HTTP_BAD_REQUEST, b);
+    }
+
+    primary = uscf->peer.data;
+
+    n = primary->number + (primary->next ? primary->next->number : 0);
+
+    size = n * NGX_HTTP_UPSTREAM_CONF_LINE_LEN;
+
+    /* the names of the resolved servers are listed too */
+
+    for (local = uscf->local_peers; local; local = local->next) {
+        for (i = 0; i < local->number; i++) {
+            if (local->peer[i].host) {
+                size += local->peer[i].host->name.len;
+            }
+        }
+    }
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    buf = NULL;
+
+    if ((add || remove || change) && ucscf->state.len) {
+        buf = ngx_pnalloc(r->pool, primary->number
+                                   * NGX_HTTP_UPSTREAM_CONF_LINE_LEN);
+        if (buf == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    ngx_http_upstream_rr_peers_lock(primary);
+
+    if (add) {
+        for (i = 0; i < primary->number; i++) {
+            if (primary->peer[i].empty) {
+                break;
+            }
+        }
+
+        if (i == primary->number) {
+            ngx_http_upstream_rr_peers_unlock(primary);
+
+            b->last = ngx_cpymem(b->last, "no free slots\n",
+                                 sizeof("no free slots\n") - 1);
+            return ngx_http_upstream_conf_send(r, NGX_HTTP_CONFLICT, b);
+        }
+
+        peer = &primary->peer[i];
+
+        ngx_http_upstream_conf_fill(peer, &s);
+
+        ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                      "upstream \"%V\": server %V added",
+                      &uscf->host, &peer->name);
+
+        b->last = ngx_http_upstream_conf_server(b->last, peer, 0);
+        b->last = ngx_sprintf(b->last, " # id=%ui\n", i);
+
+        goto done;
+    }
+
+    n = 0;
+
+    /* the resolved servers are known from the peers of the process */
+
+    for (peers = primary, local = uscf->local_peers, backup = 0;
+         peers;
+         peers = peers->next, local = local->next, backup = 1)
+    {
+        for (i = 0; i < peers->number; i++, n++) {
+
+            peer = &peers->peer[i];
+
+            if (id != NGX_ERROR && (ngx_uint_t) id != n) {
+                continue;
+            }
+
+            host = (i < local->number) ? local->peer[i].host : NULL;
+
+            if (peer->empty || (host && peer->down)) {
+                /* an empty slot or an unresolved address */
+                continue;
+            }
+
+            if (remove || change) {
+
+                if (host) {
+                    ngx_http_upstream_rr_peers_unlock(primary);
+
+                    b->last = ngx_cpymem(b->last,
+                                         "server is resolved at run time\n",
+                                         sizeof("server is resolved at run "
+                                                "time\n") - 1);
+                    return ngx_http_upstream_conf_send(r, NGX_HTTP_CONFLICT,
+                                                       b);
+                }
+
+                if (remove) {
+                    peer->empty = 1;
+                    peer->down = 1;
+                    peer->drain = 0;
+
+                    ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                                  "upstream \"%V\": server %V removed",
+                                  &uscf->host, &peer->name);
+
+                } else {
+                    ngx_http_upstream_conf_set(peer, &s);
+                }
+            }
+
+            b->last = ngx_http_upstream_conf_server(b->last, peer, backup);
+            b->last = ngx_sprintf(b->last, " # id=%ui conns=%ui",
+                                  n, peer->conns);
+
+            /* the time the last health check took */
+
+            if (peer->checked) {
+                b->last = ngx_sprintf(b->last, " check_latency=%Mms",
+                                      peer->check_latency);
+            }
+
+            if (peer->unhealthy) {
+                b->last = ngx_cpymem(b->last, " unhealthy",
+                                     sizeof(" unhealthy") - 1);
+            }
+
+            if (host) {
+                b->last = ngx_sprintf(b->last, " resolve=%V", &host->name);
+            }
+
+            *b->last++ = LF;
+
+            if (id != NGX_ERROR) {
+                goto done;
+            }
+        }
+    }
+
+    if (id != NGX_ERROR) {
+        ngx_http_upstream_rr_peers_unlock(primary);
+
+        b->last = ngx_cpymem(b->last, "server not found\n",
+                             sizeof("server not found\n") - 1);
+        return ngx_http_upstream_conf_send(r, NGX_HTTP_NOT_FOUND, b);
+    }
+
+done:
+
+    version = 0;
+
+    if (buf) {
+        last = ngx_http_upstream_conf_dump(buf, primary, uscf->local_peers);
+        version = ++primary->changes;
+    }
+
+    ngx_http_upstream_rr_peers_unlock(primary);
+
+    if (buf) {
+        ngx_http_upstream_conf_save(primary, version, &ucscf->state, buf,
+                                    last - buf, r->pool, r->connection->log);
+    }
+
+    return ngx_http_upstream_conf_send(r, NGX_HTTP_OK, b);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_conf_send(ngx_http_request_t *r, ngx_uint_t status,
+    ngx_buf_t *b)
+{
+    ngx_int_t    rc;
+    ngx_chain_t  out;
+
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+
+    r->headers_out.status = status;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    if (b->last == b->pos) {
+        r->header_only = 1;
+    }
+
+    b->last_buf = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_conf_parse(ngx_http_upstream_conf_server_t *s,
+    ngx_str_t *name, ngx_str_t *value)
+{
+    u_char     *p;
+    ngx_int_t   port;
+    in_addr_t   addr;
+
+    if (ngx_strcmp(name->data, "server") == 0) {
+
+        /* IPv4 only: "address[:port]" */
+
+        p = ngx_strlchr(value->data, value->data + value->len, ':');
+
+        if (p) {
+            port = ngx_atoi(p + 1, value->data + value->len - p - 1);
+
+            if (port < 1 || port > 65535) {
+                return NGX_ERROR;
+            }
+
+        } else {
+            p = value->data + value->len;
+            port = 80;
+        }
+
+        addr = ngx_inet_addr(value->data, p - value->data);
+
+        if (addr == INADDR_NONE) {
+            return NGX_ERROR;
+        }
+
+        s->sockaddr.sin_family = AF_INET;
+        s->sockaddr.sin_port = htons((in_port_t) port);
+        s->sockaddr.sin_addr.s_addr = addr;
+        s->addr = 1;
+
+        return NGX_OK;
+    }
+
+    if (ngx_strcmp(name->data, "weight") == 0) {
+        s->weight = ngx_atoi(value->data, value->len);
+
+        if (s->weight == NGX_ERROR || s->weight == 0) {
+            return NGX_ERROR;
+        }
+
+        return NGX_OK;
+    }
+
+    if (ngx_strcmp(name->data, "max_fails") == 0) {
+        s->max_fails = ngx_atoi(value->data, value->len);
+
+        return (s->max_fails == NGX_ERROR) ? NGX_ERROR : NGX_OK;
+    }
+
+    if (ngx_strcmp(name->data, "fail_timeout") == 0) {
+        s->fail_timeout = ngx_parse_time(value, 1);
+
+        return (s->fail_timeout == (time_t) NGX_ERROR) ? NGX_ERROR : NGX_OK;
+    }
+
+    if (ngx_strcmp(name->data, "max_conns") == 0) {
+        s->max_conns = ngx_atoi(value->data, value->len);
+
+        return (s->max_conns == NGX_ERROR) ? NGX_ERROR : NGX_OK;
+    }
+
+    /* the flags take any value */
+
+    if (ngx_strcmp(name->data, "down") == 0) {
+        s->down = 1;
+        return NGX_OK;
+    }
+
+    if (ngx_strcmp(name->data, "drain") == 0) {
+        s->drain = 1;
+        return NGX_OK;
+    }
+
+    if (ngx_strcmp(name->data, "up") == 0) {
+        s->up = 1;
+        return NGX_OK;
+    }
+
+    return NGX_ERROR;
+}
+
+
+/*
+ * a slot is reused with the counters left intact, because the requests
+ * to the removed server may still hold its connections
+ */
+
+static void
+ngx_http_upstream_conf_fill(ngx_http_upstream_rr_peer_t *peer,
+    ngx_http_upstream_conf_server_t *s)
+{
+    ngx_memcpy(peer->sockaddr, &s->sockaddr, sizeof(struct sockaddr_in));
+    peer->socklen = sizeof(struct sockaddr_in);
+
+    peer->name.len = ngx_sock_ntop(peer->sockaddr, peer->name.data,
+                                   NGX_SOCKADDR_STRLEN, 1);
+
+    peer->current_weight = 0;
+    peer->weight = 1;
+    peer->fails = 0;
+    peer->accessed = 0;
+    peer->max_fails = 1;
+    peer->fail_timeout = 10;
+    peer->max_conns = 0;
+
+    peer->ewma = 0;
+    peer->ewma_stamp = 0;
+
+    peer->checked = 0;
+    peer->check_latency = 0;
+    peer->check_fails = 0;
+    peer->check_passes = 0;
+    peer->unhealthy = 0;
+
+    peer->down = 0;
+    peer->drain = 0;
+    peer->empty = 0;
+
+    ngx_http_upstream_conf_set(peer, s);
+}
+
+
+static void
+ngx_http_upstream_conf_set(ngx_http_upstream_rr_peer_t *peer,
+    ngx_http_upstream_conf_server_t *s)
+{
+    if (s->weight != NGX_CONF_UNSET) {
+        peer->weight = s->weight;
+        peer->current_weight = 0;
+    }
+
+    if (s->max_fails != NGX_CONF_UNSET) {
+        peer->max_fails = s->max_fails;
+    }
+
+    if (s->fail_timeout != NGX_CONF_UNSET) {
+        peer->fail_timeout = s->fail_timeout;
+    }
+
+    if (s->max_conns != NGX_CONF_UNSET) {
+        peer->max_conns = s->max_conns;
+    }
+
+    if (s->up != NGX_CONF_UNSET) {
+        peer->down = 0;
+        peer->drain = 0;
+        peer->fails = 0;
+    }
+
+    if (s->down != NGX_CONF_UNSET) {
+        peer->down = 1;
+        peer->drain = 0;
+    }
+
+    /* a draining server takes no new requests, its connections complete */
+
+    if (s->drain != NGX_CONF_UNSET) {
+        peer->down = 1;
+        peer->drain = 1;
+    }
+}
+
+
+static u_char *
+ngx_http_upstream_conf_server(u_char *p, ngx_http_upstream_rr_peer_t *peer,
+    ngx_uint_t backup)
+{
+    p = ngx_sprintf(p, "server %V weight=%i max_fails=%ui fail_timeout=%Ts "
+                    "max_conns=%ui", &peer->name, peer->weight,
+                    peer->max_fails, peer->fail_timeout, peer->max_conns);
+
+    if (backup) {
+        p = ngx_cpymem(p, " backup", sizeof(" backup") - 1);
+    }
+
+    if (peer->drain) {
+        p = ngx_cpymem(p, " drain", sizeof(" drain") - 1);
+
+    } else if (peer->down) {
+        p = ngx_cpymem(p, " down", sizeof(" down") - 1);
+    }
+
+    *p++ = ';';
+
+    return p;
+}
+
+
+/*
+ * the state file keeps the primary servers which are not resolved at
+ * run time; they are copied under the zone lock
+ */
+
+static u_char *
+ngx_http_upstream_conf_dump(u_char *p, ngx_http_upstream_rr_peers_t *peers,
+    ngx_http_upstream_rr_peers_t *local)
+{
+    ngx_uint_t                    i;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    for (i = 0; i < peers->number; i++) {
+        peer = &peers->peer[i];
+
+        if (peer->empty || (i < local->number && local->peer[i].host)) {
+            continue;
+        }
+
+        p = ngx_http_upstream_conf_server(p, peer, 0);
+        *p++ = LF;
+    }
+
+    return p;
+}
+
+
+/*
+ * the state is written to a temporary file outside of the zone lock and
+ * then renamed over the state file, so the file is never left truncated;
+ * only the rename is done under the lock, and only if no later change
+ * has been saved, so the workers do not replace a newer state
+ */
+
+static void
+ngx_http_upstream_conf_save(ngx_http_upstream_rr_peers_t *peers,
+    ngx_uint_t change, ngx_str_t *state, u_char *buf, size_t len,
+    ngx_pool_t *pool, ngx_log_t *log)
+{
+    ssize_t                 n;
+    ngx_fd_t                fd;
+    ngx_str_t               temp;
+    ngx_uint_t              newer;
+    ngx_ext_rename_file_t   ext;
+
+    temp.len = state->len + 1 + NGX_INT64_LEN;
+
+    temp.data = ngx_pnalloc(pool, temp.len + 1);
+    if (temp.data == NULL) {
+        return;
+    }
+
+    temp.len = ngx_sprintf(temp.data, "%V.%P", state, ngx_pid) - temp.data;
+    temp.data[temp.len] = '\0';
+
+    fd = ngx_open_file(temp.data, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                       NGX_FILE_DEFAULT_ACCESS);
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", temp.data);
+        return;
+    }
+
+    n = ngx_write_fd(fd, buf, len);
+
+    if (n == -1) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_write_fd_n " \"%s\" failed", temp.data);
+
+    } else if ((size_t) n != len) {
+        ngx_log_error(NGX_LOG_CRIT, log, 0,
+                      ngx_write_fd_n " has written only %z of %uz to \"%s\"",
+                      n, len, temp.data);
+    }
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", temp.data);
+    }
+
+    newer = 0;
+
+    if (n != -1 && (size_t) n == len) {
+        ext.access = 0;
+        ext.path_access = 0;
+        ext.time = -1;
+        ext.fd = NGX_INVALID_FILE;
+        ext.create_path = 0;
+        ext.delete_file = 1;
+        ext.log = log;
+
+        ngx_http_upstream_rr_peers_lock(peers);
+
+        if (change > peers->saved) {
+            if (ngx_ext_rename_file(&temp, state, &ext) == NGX_OK) {
+                peers->saved = change;
+            }
+
+        } else {
+            newer = 1;
+        }
+
+        ngx_http_upstream_rr_peers_unlock(peers);
+
+        if (!newer) {
+            return;
+        }
+    }
+
+    if (ngx_delete_file(temp.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", temp.data);
+    }
+}
+
+
+/*
+ * the servers from the state file replace the primary servers
+ * of the configuration which are not resolved at run time
+ */
+
+static ngx_int_t
+ngx_http_upstream_conf_load(ngx_cycle_t *cycle,
+    ngx_http_upstream_srv_conf_t *uscf, ngx_str_t *state)
+{
+    u_char                           *p, *last, *start, *end;
+    size_t                            size;
+    ssize_t                           n;
+    ngx_fd_t                          fd;
+    ngx_int_t                         rc;
+    ngx_str_t                         name, value;
+    ngx_uint_t                        i, k, line, first;
+    ngx_array_t                       servers;
+    ngx_pool_t                       *pool;
+    ngx_file_info_t                   fi;
+    ngx_http_upstream_rr_peer_t      *peer;
+    ngx_http_upstream_rr_peers_t     *peers, *local;
+    ngx_http_upstream_conf_server_t  *s;
+
+    fd = ngx_open_file(state->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE) {
+        if (ngx_errno == NGX_ENOENT) {
+            return NGX_OK;
+        }
+
+        ngx_log_error(NGX_LOG_CRIT, cycle->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", state->data);
+        return NGX_OK;
+    }
+
+    rc = NGX_ERROR;
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, cycle->log);
+    if (pool == NULL) {
+        goto close;
+    }
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, cycle->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", state->data);
+        goto failed;
+    }
+
+    size = (size_t) ngx_file_size(&fi);
+
+    start = ngx_pnalloc(pool, size + 1);
+    if (start == NULL) {
+        goto failed;
+    }
+
+    n = ngx_read_fd(fd, start, size);
+
+    if (n == -1) {
+        ngx_log_error(NGX_LOG_CRIT, cycle->log, ngx_errno,
+                      ngx_read_fd_n " \"%s\" failed", state->data);
+        goto failed;
+    }
+
+    end = start + n;
+
+    if (ngx_array_init(&servers, pool, 16,
+                       sizeof(ngx_http_upstream_conf_server_t))
+        != NGX_OK)
+    {
+        goto failed;
+    }
+
+    /* "server address name=value ... flag;" per line, "#" starts a comment */
+
+    for (line = 1, p = start; p < end; line++, p = last + 1) {
+
+        last = ngx_strlchr(p, end, LF);
+        if (last == NULL) {
+            last = end;
+        }
+
+        s = NULL;
+        first = 1;
+
+        while (p < last) {
+
+            while (p < last && (*p == ' ' || *p == '\t' || *p == CR)) {
+                p++;
+            }
+
+            if (p == last || *p == '#') {
+                break;
+            }
+
+            name.data = p;
+
+            while (p < last && *p != ' ' && *p != '\t' && *p != CR
+                   && *p != ';' && *p != '#')
+            {
+                p++;
+            }
+
+            name.len = p - name.data;
+
+            if (p < last && *p == ';') {
+                p++;
+            }
+
+            if (name.len == 0) {
+                continue;
+            }
+
+            if (s == NULL) {
+                if (name.len != 6 || ngx_strncmp(name.data, "server", 6) != 0) {
+                    goto invalid;
+                }
+
+                s = ngx_array_push(&servers);
+                if (s == NULL) {
+                    goto failed;
+                }
+
+                ngx_memzero(s, sizeof(ngx_http_upstream_conf_server_t));
+
+                s->weight = NGX_CONF_UNSET;
+                s->max_fails = NGX_CONF_UNSET;
+                s->fail_timeout = NGX_CONF_UNSET;
+                s->max_conns = NGX_CONF_UNSET;
+                s->down = NGX_CONF_UNSET;
+                s->drain = NGX_CONF_UNSET;
+                s->up = NGX_CONF_UNSET;
+
+                continue;
+            }
+
+            if (first) {
+                value = name;
+                ngx_str_set(&name, "server");
+                first = 0;
+
+            } else {
+                value.data = ngx_strlchr(name.data, name.data + name.len, '=');
+
+                if (value.data) {
+                    value.len = name.data + name.len - value.data - 1;
+                    name.len = value.data - name.data;
+                    value.data++;
+
+                } else {
+                    value.len = 0;
+                }
+            }
+
+            for (i = 0; ngx_http_upstream_conf_params[i].len; i++) {
+                if (ngx_http_upstream_conf_params[i].len == name.len
+                    && ngx_strncmp(ngx_http_upstream_conf_params[i].data,
+                                   name.data, name.len)
+                       == 0)
+                {
+                    break;
+                }
+            }
+
+            if (ngx_http_upstream_conf_params[i].len == 0
+                || ngx_http_upstream_conf_parse(s,
+                                               &ngx_http_upstream_conf_params[i],
+                                               &value)
+                   != NGX_OK)
+            {
+                goto invalid;
+            }
+        }
+
+        if (s && !s->addr) {
+            goto invalid;
+        }
+    }
+
+    /* the zone is not used by the workers yet */
+
+    peers = uscf->peer.data;
+    local = uscf->local_peers;
+    s = servers.elts;
+    k = 0;
+
+    for (i = 0; i < peers->number; i++) {
+        peer = &peers->peer[i];
+
+        if (i < local->number && local->peer[i].host) {
+            continue;
+        }
+
+        if (k < servers.nelts) {
+            ngx_http_upstream_conf_fill(peer, &s[k++]);
+            continue;
+        }
+
+        peer->empty = 1;
+        peer->down = 1;
+        peer->drain = 0;
+    }
+
+    if (k < servers.nelts) {
+        ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                      "no free slots for %ui servers from \"%s\" "
+                      "in upstream \"%V\", increase \"spare\"",
+                      servers.nelts - k, state->data, &uscf->host);
+    }
+
+    rc = NGX_OK;
+    goto failed;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                  "invalid server in \"%s\" line %ui", state->data, line);
+
+failed:
+
+    ngx_destroy_pool(pool);
+
+close:
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", state->data);
+    }
+
+    return rc;
+}
+
+
+static void *
+ngx_http_upstream_conf_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_conf_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_conf_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->state = { 0, NULL };
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_upstream_conf_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_upstream_conf_state(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_conf_srv_conf_t *ucscf = conf;
+
+    ngx_str_t  *value;
+
+    if (ucscf->state.data) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    ucscf->state = value[1];
+
+    if (ngx_conf_full_name(cf->cycle, &ucscf->state, 0) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_conf_init_module(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                          i;
+    ngx_http_upstream_srv_conf_t      **uscfp;
+    ngx_http_upstream_main_conf_t      *umcf;
+    ngx_http_upstream_conf_srv_conf_t  *ucscf;
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        ucscf = uscfp[i]->srv_conf[ngx_http_upstream_conf_module.ctx_index];
+
+        if (ucscf->state.len == 0) {
+            continue;
+        }
+
+        if (uscfp[i]->shm_zone == NULL || uscfp[i]->peer.data == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                          "\"state\" requires \"zone\" in upstream \"%V\" "
+                          "in %s:%ui", &uscfp[i]->host,
+                          uscfp[i]->file_name, uscfp[i]->line);
+            return NGX_ERROR;
+        }
+
+        /* the zone is loaded once, the workers on win32 attach to it */
+
+        if (uscfp[i]->shm_zone->shm.exists) {
+            continue;
+        }
+
+        if (ngx_http_upstream_conf_load(cycle, uscfp[i], &ucscf->state)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
@@ -0,0 +1,438 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+typedef struct {
+    ngx_msec_t                         decay;
+} ngx_http_upstream_ewma_srv_conf_t;
+
+
+typedef struct {
+    /* the round robin data must be first */
+    ngx_http_upstream_rr_peer_data_t   rrp;
+
+    ngx_http_upstream_rr_peer_t       *peer;
+    ngx_msec_t                         start;
+    ngx_msec_t                         decay;
+} ngx_http_upstream_ewma_peer_data_t;
+
+
+static ngx_int_t ngx_http_upstream_init_ewma(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_init_ewma_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_get_ewma_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_http_upstream_free_ewma_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+static uint64_t ngx_http_upstream_ewma_cost(ngx_http_upstream_rr_peer_t *peer,
+    ngx_msec_t decay);
+static void *ngx_http_upstream_ewma_create_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_ewma(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_http_upstream_ewma_commands[] = {
+
+    { ngx_string("peak_ewma"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+      ngx_http_upstream_ewma,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_ewma_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_upstream_ewma_create_conf,    /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_ewma_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_ewma_module_ctx,    /* module context */
+    ngx_http_upstream_ewma_commands,       /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_http_upstream_init_ewma(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
+{
+    if (ngx_http_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_http_upstream_init_ewma_peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_init_ewma_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_ewma_srv_conf_t   *escf;
+    ngx_http_upstream_ewma_peer_data_t  *ep;
+
+    ep = ngx_palloc(r->pool, sizeof(ngx_http_upstream_ewma_peer_data_t));
+    if (ep == NULL) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.data = &ep->rrp;
+
+    if (ngx_http_upstream_init_round_robin_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.get = ngx_http_upstream_get_ewma_peer;
+    r->upstream->peer.free = ngx_http_upstream_free_ewma_peer;
+
+    escf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_ewma_module);
+
+    ep->peer = NULL;
+    ep->start = 0;
+    ep->decay = escf->decay;
+
+    return NGX_OK;
+}
+
+
+/*
+ * the cost of a peer is its peak EWMA response time multiplied by
+ * the number of its active connections plus one, divided by weight;
+ * the peer with the least cost is chosen
+ */
+
+static ngx_int_t
+ngx_http_upstream_get_ewma_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_ewma_peer_data_t  *ep = data;
+
+    time_t                         now;
+    uint64_t                       cost, best_cost;
+    uintptr_t                      m;
+    ngx_uint_t                     i, n, p;
+    ngx_http_upstream_rr_peer_t   *peer, *best;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get ewma peer, try: %ui", pc->tries);
+
+    peers = ep->rrp.peers;
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    now = ngx_time();
+
+    ngx_http_upstream_rr_peers_lock(peers);
+
+    best = NULL;
+    best_cost = 0;
+    p = 0;
+
+    if (peers->single) {
+        best = &peers->peer[0];
+
+        if (best->max_conns && best->conns >= best->max_conns) {
+            goto failed;
+        }
+
+        goto found;
+    }
+
+    for (i = 0; i < peers->number; i++) {
+
+        n = i / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+        if (ep->rrp.tried[n] & m) {
+            continue;
+        }
+
+        peer = &peers->peer[i];
+
+        if (peer->down || peer->unhealthy || peer->weight <= 0) {
+            continue;
+        }
+
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
+            continue;
+        }
+
+        if (peer->max_fails
+            && peer->fails >= peer->max_fails
+            && now - peer->accessed <= peer->fail_timeout)
+        {
+            continue;
+        }
+
+        cost = ngx_http_upstream_ewma_cost(peer, ep->decay);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "get ewma peer: %V ewma:%ui cost:%uL",
+                       &peer->name, peer->ewma, cost);
+
+        if (best == NULL || cost < best_cost) {
+            best = peer;
+            best_cost = cost;
+            p = i;
+        }
+    }
+
+    if (best == NULL) {
+        goto failed;
+    }
+
+    if (best->max_fails && best->fails >= best->max_fails) {
+        best->fails = 0;
+    }
+
+    n = p / (8 * sizeof(uintptr_t));
+    m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
+
+    ep->rrp.tried[n] |= m;
+
+    /* the number of tries includes the backup peers */
+
+    if (pc->tries == 1 && peers->next) {
+        pc->tries += peers->next->number;
+
+        n = peers->next->number / (8 * sizeof(uintptr_t)) + 1;
+        for (i = 0; i < n; i++) {
+             ep->rrp.tried[i] = 0;
+        }
+    }
+
+found:
+
+    ep->rrp.current = p;
+
+    best->conns++;
+    ep->rrp.peer = best;
+
+    ep->peer = best;
+    ep->start = ngx_current_msec;
+
+    pc->sockaddr = best->sockaddr;
+    pc->socklen = best->socklen;
+    pc->name = &best->name;
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    return NGX_OK;
+
+failed:
+
+    if (peers->next) {
+
+        ngx_http_upstream_rr_peers_unlock(peers);
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "ewma backup servers");
+
+        ep->rrp.peers = peers->next;
+        ep->rrp.local = ep->rrp.local->next;
+        pc->tries = ep->rrp.peers->number;
+
+        n = ep->rrp.peers->number / (8 * sizeof(uintptr_t)) + 1;
+        for (i = 0; i < n; i++) {
+             ep->rrp.tried[i] = 0;
+        }
+
+        if (ngx_http_upstream_get_ewma_peer(pc, ep) != NGX_BUSY) {
+            return NGX_OK;
+        }
+
+        ngx_http_upstream_rr_peers_lock(peers);
+    }
+
+    /* all peers failed, mark them as live for quick recovery */
+
+    for (i = 0; i < peers->number; i++) {
+        peers->peer[i].fails = 0;
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    pc->name = peers->name;
+
+    return NGX_BUSY;
+}
+
+
+/*
+ * the response time is sampled when a peer is freed: a sample above
+ * the average replaces it at once, a sample below it is mixed with the
+ * weight of the time passed since the previous sample, so a stalled
+ * peer is penalized immediately and recovers within the decay time;
+ * a failed attempt is sampled as long as the decay time
+ */
+
+static void
+ngx_http_upstream_free_ewma_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_http_upstream_ewma_peer_data_t  *ep = data;
+
+    uint64_t                      rtt, td;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "free ewma peer %ui %ui", pc->tries, state);
+
+    peer = ep->peer;
+
+    if (peer) {
+        ep->peer = NULL;
+
+        ngx_http_upstream_rr_peers_lock(ep->rrp.peers);
+
+        rtt = (uint64_t) (ngx_current_msec - ep->start);
+
+        if ((state & NGX_PEER_FAILED) && rtt < ep->decay) {
+            rtt = ep->decay;
+        }
+
+        rtt *= 1000;
+
+        td = (uint64_t) (ngx_current_msec - peer->ewma_stamp);
+
+        if (rtt >= peer->ewma || peer->ewma_stamp == 0) {
+            peer->ewma = (ngx_uint_t) rtt;
+
+        } else {
+            peer->ewma = (ngx_uint_t) ((peer->ewma * (uint64_t) ep->decay
+                                        + rtt * td)
+                                       / (ep->decay + td));
+        }
+
+        peer->ewma_stamp = ngx_current_msec;
+
+        ngx_http_upstream_rr_peers_unlock(ep->rrp.peers);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "free ewma peer: %V rtt:%uLus ewma:%uius",
+                       &peer->name, rtt, peer->ewma);
+    }
+
+    ngx_http_upstream_free_round_robin_peer(pc, &ep->rrp, state);
+}
+
+
+static uint64_t
+ngx_http_upstream_ewma_cost(ngx_http_upstream_rr_peer_t *peer,
+    ngx_msec_t decay)
+{
+    uint64_t  ewma, td;
+
+    ewma = peer->ewma;
+
+    /* an idle peer's average decays towards zero */
+
+    td = (uint64_t) (ngx_current_msec - peer->ewma_stamp);
+
+    if (ewma && td) {
+        ewma = ewma * decay / (decay + td);
+    }
+
+    return (ewma + 1) * (peer->conns + 1) * 1000 / peer->weight;
+}
+
+
+static void *
+ngx_http_upstream_ewma_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_ewma_srv_conf_t  *conf;
+
+    conf = ngx_palloc(cf->pool, sizeof(ngx_http_upstream_ewma_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->decay = NGX_CONF_UNSET_MSEC;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_ewma(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_ewma_srv_conf_t *escf = conf;
+
+    ngx_str_t                     *value, s;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    if (escf->decay != NGX_CONF_UNSET_MSEC) {
+        return "is duplicate";
+    }
+
+    escf->decay = 10000;
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts == 2) {
+
+        if (ngx_strncmp(value[1].data, "decay=", 6) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        s.len = value[1].len - 6;
+        s.data = value[1].data + 6;
+
+        escf->decay = ngx_parse_time(&s, 0);
+
+        if (escf->decay == (ngx_msec_t) NGX_ERROR || escf->decay == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid decay \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    uscf->peer.init_upstream = ngx_http_upstream_init_ewma;
+
+    uscf->flags = NGX_HTTP_UPSTREAM_CREATE
+                  |NGX_HTTP_UPSTREAM_WEIGHT
+                  |NGX_HTTP_UPSTREAM_MAX_FAILS
+                  |NGX_HTTP_UPSTREAM_MAX_CONNS
+                  |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_HTTP_UPSTREAM_DOWN
+                  |NGX_HTTP_UPSTREAM_BACKUP;
+
+    return NGX_CONF_OK;
+}
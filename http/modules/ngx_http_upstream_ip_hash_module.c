@@ -16,7 +16,8 @@ typedef struct {
 
     ngx_uint_t                         hash;
 
-    u_char                             addr[3];
+    u_char                             addrlen;
+    u_char                            *addr;
 
     u_char                             tries;
 
@@ -60,6 +61,9 @@ static ngx_http_module_t  ngx_http_upstream_ip_hash_module_ctx = {
 };
 
 
+static u_char ngx_http_upstream_ip_hash_pseudo_addr[3];
+
+
 ngx_module_t  ngx_http_upstream_ip_hash_module = {
     NGX_MODULE_V1,
     &ngx_http_upstream_ip_hash_module_ctx, /* module context */
@@ -93,8 +97,10 @@ static ngx_int_t
 ngx_http_upstream_init_ip_hash_peer(ngx_http_request_t *r,
     ngx_http_upstream_srv_conf_t *us)
 {
-    u_char                                 *p;
     struct sockaddr_in                     *sin;
+#if (NGX_HAVE_INET6)
+    struct sockaddr_in6                    *sin6;
+#endif
     ngx_http_upstream_ip_hash_peer_data_t  *iphp;
 
     iphp = ngx_palloc(r->pool, sizeof(ngx_http_upstream_ip_hash_peer_data_t));
@@ -110,20 +116,25 @@ ngx_http_upstream_init_ip_hash_peer(ngx_http_request_t *r,
 
     r->upstream->peer.get = ngx_http_upstream_get_ip_hash_peer;
 
-    /* AF_INET only */
-
-    if (r->connection->sockaddr->sa_family == AF_INET) {
+    switch (r->connection->sockaddr->sa_family) {
 
+    case AF_INET:
         sin = (struct sockaddr_in *) r->connection->sockaddr;
-        p = (u_char *) &sin->sin_addr.s_addr;
-        iphp->addr[0] = p[0];
-        iphp->addr[1] = p[1];
-        iphp->addr[2] = p[2];
-
-    } else {
-        iphp->addr[0] = 0;
-        iphp->addr[1] = 0;
-        iphp->addr[2] = 0;
+        iphp->addr = (u_char *) &sin->sin_addr.s_addr;
+        iphp->addrlen = 3;
+        break;
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        sin6 = (struct sockaddr_in6 *) r->connection->sockaddr;
+        iphp->addr = (u_char *) &sin6->sin6_addr.s6_addr;
+        iphp->addrlen = 16;
+        break;
+#endif
+
+    default:
+        iphp->addr = ngx_http_upstream_ip_hash_pseudo_addr;
+        iphp->addrlen = 3;
     }
 
     iphp->hash = 89;
@@ -162,7 +173,7 @@ ngx_http_upstream_get_ip_hash_peer(ngx_peer_connection_t *pc, void *data)
 
     for ( ;; ) {
 
-        for (i = 0; i < 3; i++) {
+        for (i = 0; i < (ngx_uint_t) iphp->addrlen; i++) {
             hash = (hash * 113 + iphp->addr[i]) % 6271;
         }
 
@@ -178,9 +189,11 @@ ngx_http_upstream_get_ip_hash_peer(ngx_peer_connection_t *pc, void *data)
 
             peer = &iphp->rrp.peers->peer[p];				//õһַ
 
-            /* ngx_lock_mutex(iphp->rrp.peers->mutex); */
+            ngx_http_upstream_rr_peers_lock(iphp->rrp.peers);
 
-            if (!peer->down) {
+            if (!peer->down && !peer->unhealthy
+                && (peer->max_conns == 0 || peer->conns < peer->max_conns))
+            {
 
                 if (peer->max_fails == 0 || peer->fails < peer->max_fails) {
                     break;
@@ -194,7 +207,7 @@ ngx_http_upstream_get_ip_hash_peer(ngx_peer_connection_t *pc, void *data)
 
             iphp->rrp.tried[n] |= m;
 
-            /* ngx_unlock_mutex(iphp->rrp.peers->mutex); */
+            ngx_http_upstream_rr_peers_unlock(iphp->rrp.peers);
 
             pc->tries--;
         }
@@ -210,7 +223,10 @@ ngx_http_upstream_get_ip_hash_peer(ngx_peer_connection_t *pc, void *data)
     pc->socklen = peer->socklen;
     pc->name = &peer->name;
 
-    /* ngx_unlock_mutex(iphp->rrp.peers->mutex); */
+    peer->conns++;
+    iphp->rrp.peer = peer;
+
+    ngx_http_upstream_rr_peers_unlock(iphp->rrp.peers);
 
     iphp->rrp.tried[n] |= m;
     iphp->hash = hash;
@@ -230,6 +246,7 @@ ngx_http_upstream_ip_hash(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     uscf->flags = NGX_HTTP_UPSTREAM_CREATE
                   |NGX_HTTP_UPSTREAM_MAX_FAILS
+                  |NGX_HTTP_UPSTREAM_MAX_CONNS
                   |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
                   |NGX_HTTP_UPSTREAM_DOWN;
 
@@ -0,0 +1,341 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+static char *ngx_http_upstream_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_http_upstream_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static ngx_http_upstream_rr_peers_t *ngx_http_upstream_zone_copy_peers(
+    ngx_slab_pool_t *shpool, ngx_http_upstream_rr_peers_t *src,
+    ngx_uint_t spare);
+
+
+static ngx_command_t  ngx_http_upstream_zone_commands[] = {
+
+    { ngx_string("zone"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE123,
+      ngx_http_upstream_zone,
+      0,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_zone_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_zone_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_zone_module_ctx,    /* module context */
+    ngx_http_upstream_zone_commands,       /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static char *
+ngx_http_upstream_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ssize_t                         size;
+    ngx_int_t                       n;
+    ngx_str_t                      *value, s;
+    ngx_uint_t                      nelts;
+    ngx_http_upstream_srv_conf_t   *uscf;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+
+    if (uscf->shm_zone) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (value[1].len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone name \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    nelts = cf->args->nelts;
+
+    if (nelts > 2 && ngx_strncmp(value[nelts - 1].data, "spare=", 6) == 0) {
+        s.len = value[nelts - 1].len - 6;
+        s.data = value[nelts - 1].data + 6;
+
+        n = ngx_atoi(s.data, s.len);
+
+        if (n == NGX_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[nelts - 1]);
+            return NGX_CONF_ERROR;
+        }
+
+        uscf->spare = n;
+        nelts--;
+    }
+
+    if (nelts == 3) {
+        size = ngx_parse_size(&value[2]);
+
+        if (size == NGX_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid zone size \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        if (size < (ssize_t) (8 * ngx_pagesize)) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "zone \"%V\" is too small", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+    } else {
+        size = 0;
+    }
+
+    uscf->shm_zone = ngx_shared_memory_add(cf, &value[1], size,
+                                           &ngx_http_upstream_zone_module);
+    if (uscf->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    uscf->shm_zone->init = ngx_http_upstream_init_zone;
+    uscf->shm_zone->data = umcf;
+
+    /*
+     * the peers are copied anew on reconfiguration, because the servers
+     * may change while the old workers still use the old copy
+     */
+
+    uscf->shm_zone->noreuse = 1;
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * the peers of all upstreams in the zone are copied to the shared memory
+ * after the configuration is read, so the workers share the failure
+ * counters, the weights and the connection counts of the peers
+ */
+
+static ngx_int_t
+ngx_http_upstream_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    size_t                          len;
+    ngx_uint_t                      i;
+    ngx_slab_pool_t                *shpool;
+    ngx_http_upstream_rr_peers_t   *peers, **peersp;
+    ngx_http_upstream_srv_conf_t   *uscf, **uscfp;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    umcf = shm_zone->data;
+    uscfp = umcf->upstreams.elts;
+
+    if (shm_zone->shm.exists) {
+        peers = shpool->data;
+
+        for (i = 0; i < umcf->upstreams.nelts; i++) {
+            uscf = uscfp[i];
+
+            if (uscf->shm_zone != shm_zone) {
+                continue;
+            }
+
+            /* a worker on win32 attaches with the peers it has parsed */
+
+            uscf->local_peers = uscf->peer.data;
+            uscf->peer.data = peers;
+            peers = peers->zone_next;
+        }
+
+        return NGX_OK;
+    }
+
+    len = sizeof(" in upstream zone \"\"") + shm_zone->shm.name.len;
+
+    shpool->log_ctx = ngx_slab_alloc(shpool, len);
+    if (shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(shpool->log_ctx, " in upstream zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    peersp = (ngx_http_upstream_rr_peers_t **) (void *) &shpool->data;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        uscf = uscfp[i];
+
+        if (uscf->shm_zone != shm_zone) {
+            continue;
+        }
+
+        peers = ngx_http_upstream_zone_copy_peers(shpool, uscf->peer.data,
+                                                  uscf->spare);
+        if (peers == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "upstream zone \"%V\" is too small for "
+                          "upstream \"%V\"", &shm_zone->shm.name, &uscf->host);
+            return NGX_ERROR;
+        }
+
+        uscf->local_peers = uscf->peer.data;
+        uscf->peer.data = peers;
+
+        *peersp = peers;
+        peersp = &peers->zone_next;
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * the spare peers are empty slots at the end of the primary peers,
+ * the upstream_conf API adds the servers to them at run time
+ */
+
+static ngx_http_upstream_rr_peers_t *
+ngx_http_upstream_zone_copy_peers(ngx_slab_pool_t *shpool,
+    ngx_http_upstream_rr_peers_t *src, ngx_uint_t spare)
+{
+    size_t                         size, len;
+    ngx_str_t                     *name;
+    ngx_uint_t                     i;
+    socklen_t                      socklen;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    size = sizeof(ngx_http_upstream_rr_peers_t)
+           + sizeof(ngx_http_upstream_rr_peer_t) * (src->number - 1);
+
+    peers = ngx_slab_alloc(shpool,
+                           size + sizeof(ngx_http_upstream_rr_peer_t) * spare);
+    if (peers == NULL) {
+        return NULL;
+    }
+
+    ngx_memcpy(peers, src, size);
+
+    if (spare) {
+        ngx_memzero(&peers->peer[src->number],
+                    sizeof(ngx_http_upstream_rr_peer_t) * spare);
+
+        for (i = src->number; i < src->number + spare; i++) {
+            peer = &peers->peer[i];
+
+            peer->socklen = sizeof(struct sockaddr_in);
+            peer->weight = 1;
+            peer->max_fails = 1;
+            peer->fail_timeout = 10;
+            peer->down = 1;
+            peer->empty = 1;
+        }
+
+        peers->number += spare;
+        peers->single = 0;
+    }
+
+    name = ngx_slab_alloc(shpool, sizeof(ngx_str_t) + src->name->len);
+    if (name == NULL) {
+        return NULL;
+    }
+
+    name->len = src->name->len;
+    name->data = (u_char *) name + sizeof(ngx_str_t);
+    ngx_memcpy(name->data, src->name->data, src->name->len);
+
+    peers->name = name;
+    peers->shpool = shpool;
+    peers->zone_next = NULL;
+
+    for (i = 0; i < peers->number; i++) {
+        peer = &peers->peer[i];
+
+        /*
+         * the addresses and the names of the resolved peers and of the peers
+         * changed by the upstream_conf API are rewritten in place
+         */
+
+        socklen = (i < src->number) ? src->peer[i].socklen : 0;
+
+        peer->sockaddr = ngx_slab_alloc(shpool,
+                               ngx_max(socklen, sizeof(struct sockaddr_in)));
+        if (peer->sockaddr == NULL) {
+            return NULL;
+        }
+
+        if (i < src->number && src->peer[i].host) {
+            len = src->peer[i].host->name_size;
+
+        } else {
+            len = (i < src->number) ? src->peer[i].name.len : 0;
+            len = ngx_max(len, NGX_SOCKADDR_STRLEN);
+        }
+
+        peer->name.data = ngx_slab_alloc(shpool, len);
+        if (peer->name.data == NULL) {
+            return NULL;
+        }
+
+        if (i < src->number) {
+            ngx_memcpy(peer->sockaddr, src->peer[i].sockaddr, socklen);
+            ngx_memcpy(peer->name.data, src->peer[i].name.data,
+                       src->peer[i].name.len);
+
+        } else {
+            ngx_memzero(peer->sockaddr, sizeof(struct sockaddr_in));
+            peer->sockaddr->sa_family = AF_INET;
+        }
+
+        /* the pointers to the process memory are not shared */
+
+        peer->host = NULL;
+
+#if (NGX_HTTP_SSL)
+        peer->ssl_session = NULL;
+#endif
+    }
+
+    if (src->next) {
+        peers->next = ngx_http_upstream_zone_copy_peers(shpool, src->next, 0);
+        if (peers->next == NULL) {
+            return NULL;
+        }
+    }
+
+    return peers;
+}
@@ -22,6 +22,15 @@
 #define NGX_HTTP_CACHE_SCARCE        7
 
 #define NGX_HTTP_CACHE_KEY_LEN       16
+#define NGX_HTTP_CACHE_VARY_LEN      128
+
+#define NGX_HTTP_CACHE_VERSION       2
+
+#define NGX_HTTP_FILE_CACHE_MAX_DISKS     32
+#define NGX_HTTP_FILE_CACHE_DISK_SLOTS    256
+#define NGX_HTTP_FILE_CACHE_PARTIAL_MIN   5
+#define NGX_HTTP_FILE_CACHE_PARTIAL_WAIT  100
+#define NGX_HTTP_FILE_CACHE_TAG_LEN       255
 
 
 typedef struct {
@@ -33,6 +42,7 @@ typedef struct {
 typedef struct {
     ngx_rbtree_node_t                node;
     ngx_queue_t                      queue;
+    ngx_queue_t                      tags;
 
     u_char                           key[NGX_HTTP_CACHE_KEY_LEN
                                          - sizeof(ngx_rbtree_key_t)];
@@ -44,21 +54,50 @@ typedef struct {
     unsigned                         exists:1;
     unsigned                         updating:1;
     unsigned                         deleting:1;
-                                     /* 11 unused bits */
+    unsigned                         disk:5;
+    unsigned                         writing:1;
+                                     /* 5 unused bits */
 
     ngx_file_uniq_t                  uniq;
     time_t                           expire;
     time_t                           valid_sec;
     size_t                           body_start;
     off_t                            fs_size;
+    u_char                          *temp_name;
+    ngx_uint_t                       write_gen;
 } ngx_http_file_cache_node_t;
 
 
+/* a surrogate key, the rbtree key is crc32 of the key */
+
+typedef struct {
+    ngx_rbtree_node_t                node;
+    ngx_queue_t                      links;
+    u_char                           len;
+    u_char                           data[1];
+} ngx_http_file_cache_tag_t;
+
+
+/* links an entry to a surrogate key, the both sides are queues */
+
+typedef struct {
+    ngx_queue_t                      tag_queue;
+    ngx_queue_t                      node_queue;
+    ngx_http_file_cache_tag_t       *tag;
+    ngx_http_file_cache_node_t      *node;
+} ngx_http_file_cache_tag_link_t;
+
+
 struct ngx_http_cache_s {
     ngx_file_t                       file;
     ngx_array_t                      keys;
     uint32_t                         crc32;
     u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+    u_char                           main[NGX_HTTP_CACHE_KEY_LEN];
+
+    /* the Vary list of the response and the variant of the request */
+    ngx_str_t                        vary;
+    u_char                           variant[NGX_HTTP_CACHE_KEY_LEN];
 
     ngx_file_uniq_t                  uniq;
     time_t                           valid_sec;
@@ -73,20 +112,36 @@ struct ngx_http_cache_s {
     ngx_uint_t                       min_uses;
     ngx_uint_t                       error;
     ngx_uint_t                       valid_msec;
+    ngx_uint_t                       io_start;
 
     ngx_buf_t                       *buf;
 
     ngx_http_file_cache_t           *file_cache;
+    ngx_http_file_cache_disk_t      *disk;
     ngx_http_file_cache_node_t      *node;
 
+    /* the surrogate keys of the response, ngx_str_t */
+    ngx_array_t                     *tags;
+
+    /* read while write */
+    ngx_uint_t                       write_gen;
+    ngx_msec_t                       partial_wait;
+    ngx_buf_t                       *partial_buf;
+    ngx_event_t                      partial_event;
+
     unsigned                         updated:1;
     unsigned                         updating:1;
     unsigned                         exists:1;
     unsigned                         temp_file:1;
+    unsigned                         read_while_write:1;
+    unsigned                         writing:1;
+    unsigned                         partial:1;
+    unsigned                         secondary:1;
 };
 
 
 typedef struct {
+    ngx_uint_t                       version;
     time_t                           valid_sec;
     time_t                           last_modified;
     time_t                           date;
@@ -94,33 +149,80 @@ typedef struct {
     u_short                          valid_msec;
     u_short                          header_start;
     u_short                          body_start;
+    u_char                           vary_len;
+    u_char                           vary[NGX_HTTP_CACHE_VARY_LEN];
+    u_char                           variant[NGX_HTTP_CACHE_KEY_LEN];
 } ngx_http_file_cache_header_t;
 
 
 typedef struct {
-    ngx_rbtree_t                     rbtree;
-    ngx_rbtree_node_t                sentinel;
     ngx_queue_t                      queue;
     ngx_atomic_t                     cold;
     ngx_atomic_t                     loading;
     off_t                            size;
+
+    ngx_uint_t                       weight;
+
+    /* i/o statistics, times are in microseconds */
+
+    ngx_atomic_t                     reads;
+    ngx_atomic_t                     read_time;
+    ngx_atomic_t                     writes;
+    ngx_atomic_t                     write_time;
+    ngx_uint_t                       read_latency;
+    ngx_uint_t                       write_latency;
+} ngx_http_file_cache_disk_sh_t;
+
+
+typedef struct {
+    ngx_rbtree_t                     rbtree;
+    ngx_rbtree_node_t                sentinel;
+
+    ngx_rbtree_t                     tags;
+    ngx_rbtree_node_t                tags_sentinel;
+
+    ngx_uint_t                       ndisks;
+    u_char                           slots[NGX_HTTP_FILE_CACHE_DISK_SLOTS];
+
+    ngx_http_file_cache_disk_sh_t    disks[1];
 } ngx_http_file_cache_sh_t;
 
 
-struct ngx_http_file_cache_s {
-    ngx_http_file_cache_sh_t        *sh;
-    ngx_slab_pool_t                 *shpool;
+struct ngx_http_file_cache_disk_s {
+    ngx_http_file_cache_disk_sh_t   *sh;
+    ngx_http_file_cache_t           *cache;
 
     ngx_path_t                      *path;
+    ngx_path_t                      *temp_path;
 
     off_t                            max_size;
     size_t                           bsize;
-
-    time_t                           inactive;
+    ngx_uint_t                       weight;
+    ngx_uint_t                       index;
 
     ngx_msec_t                       last;
     ngx_uint_t                       files;
 
+    /* the statistics seen by the previous manager run */
+
+    ngx_uint_t                       reads;
+    ngx_uint_t                       read_time;
+    ngx_uint_t                       writes;
+    ngx_uint_t                       write_time;
+};
+
+
+struct ngx_http_file_cache_s {
+    ngx_http_file_cache_sh_t        *sh;
+    ngx_slab_pool_t                 *shpool;
+
+    ngx_path_t                      *path;
+
+    ngx_http_file_cache_disk_t      *disks;
+    ngx_uint_t                       ndisks;
+
+    time_t                           inactive;
+
     ngx_shm_zone_t                  *shm_zone;
 };
 
@@ -129,11 +231,19 @@ ngx_int_t ngx_http_file_cache_new(ngx_http_request_t *r);
 ngx_int_t ngx_http_file_cache_create(ngx_http_request_t *r);
 void ngx_http_file_cache_create_key(ngx_http_request_t *r);
 ngx_int_t ngx_http_file_cache_open(ngx_http_request_t *r);
-void ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf);
+ngx_int_t ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf);
 void ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf);
+void ngx_http_file_cache_set_writing(ngx_http_request_t *r,
+    ngx_temp_file_t *tf);
+ngx_int_t ngx_http_file_cache_set_tags(ngx_http_request_t *r,
+    ngx_str_t *value);
 ngx_int_t ngx_http_cache_send(ngx_http_request_t *);
 void ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf);
 time_t ngx_http_file_cache_valid(ngx_array_t *cache_valid, ngx_uint_t status);
+ngx_int_t ngx_http_file_cache_purge_tag(ngx_http_file_cache_t *cache,
+    ngx_str_t *tag, ngx_pool_t *pool, ngx_uint_t *purged);
+ngx_http_file_cache_t *ngx_http_file_cache_zone(ngx_conf_t *cf,
+    ngx_str_t *name);
 
 char *ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
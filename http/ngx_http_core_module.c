@@ -3639,11 +3639,36 @@ ngx_http_core_listen(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 #endif
         }
 
+        if (ngx_strcmp(value[n].data, "http2") == 0) {
+#if (NGX_HTTP_V2)
+            lsopt.http2 = 1;
+            continue;
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "the \"http2\" parameter requires "
+                               "ngx_http_v2_module");
+            return NGX_CONF_ERROR;
+#endif
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "the invalid \"%V\" parameter", &value[n]);
         return NGX_CONF_ERROR;
     }
 
+#if (NGX_HTTP_SSL && NGX_HTTP_V2)
+#ifndef TLSEXT_TYPE_application_layer_protocol_negotiation
+
+    if (lsopt.ssl && lsopt.http2) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "OpenSSL lacks ALPN support, HTTP/2 over TLS "
+                           "is used only by the clients sending "
+                           "the connection preface without negotiation");
+    }
+
+#endif
+#endif
+
     if (ngx_http_add_listen(cf, cscf, &lsopt) == NGX_OK) {
         return NGX_CONF_OK;
     }
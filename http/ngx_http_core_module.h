@@ -69,6 +69,9 @@ typedef struct {
 #if (NGX_HTTP_SSL)
     unsigned                   ssl:1;
 #endif
+#if (NGX_HTTP_V2)
+    unsigned                   http2:1;
+#endif
 #if (NGX_HAVE_INET6 && defined IPV6_V6ONLY)
     unsigned                   ipv6only:2;
 #endif
@@ -250,6 +253,9 @@ typedef struct {
 #if (NGX_HTTP_SSL)
     ngx_uint_t                 ssl;   /* unsigned  ssl:1; */
 #endif
+#if (NGX_HTTP_V2)
+    ngx_uint_t                 http2; /* unsigned  http2:1; */
+#endif
 } ngx_http_addr_conf_t;
 
 
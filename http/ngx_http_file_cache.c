@@ -12,11 +12,30 @@
 
 static ngx_int_t ngx_http_file_cache_read(ngx_http_request_t *r,
     ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_reopen(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_update_variant(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary,
+    size_t len, u_char *hash);
+static void ngx_http_file_cache_vary_header(ngx_http_request_t *r,
+    ngx_md5_t *md5, ngx_str_t *name);
+static ngx_uint_t ngx_http_file_cache_vary_codings(u_char *p, u_char *last);
+static ngx_int_t ngx_http_file_cache_open_partial(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_send_partial(ngx_http_request_t *r);
+static void ngx_http_file_cache_partial_handler(ngx_http_request_t *r);
+static void ngx_http_file_cache_partial_wait_handler(ngx_event_t *ev);
+static void ngx_http_file_cache_clear_writing(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c);
 static ssize_t ngx_http_file_cache_aio_read(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 #if (NGX_HAVE_FILE_AIO)
 static void ngx_http_cache_aio_event_handler(ngx_event_t *ev);
 #endif
+static ngx_uint_t ngx_http_file_cache_usec(void);
+static void ngx_http_file_cache_account_io(ngx_http_file_cache_disk_t *disk,
+    ngx_uint_t start, ngx_uint_t write);
 static ngx_int_t ngx_http_file_cache_exists(ngx_http_file_cache_t *cache,
     ngx_http_cache_t *c);
 static ngx_int_t ngx_http_file_cache_name(ngx_http_request_t *r,
@@ -25,20 +44,33 @@ static ngx_http_file_cache_node_t *
     ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key);
 static void ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static void ngx_http_file_cache_tag(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, ngx_array_t *tags, ngx_log_t *log);
+static void ngx_http_file_cache_untag(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
+static ngx_http_file_cache_tag_t *
+    ngx_http_file_cache_lookup_tag(ngx_http_file_cache_t *cache,
+    ngx_str_t *tag, uint32_t hash);
+static void ngx_http_file_cache_tag_rbtree_insert_value(
+    ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel);
 static void ngx_http_file_cache_cleanup(void *data);
-static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache);
-static time_t ngx_http_file_cache_expire(ngx_http_file_cache_t *cache);
-static void ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
+static time_t
+    ngx_http_file_cache_forced_expire(ngx_http_file_cache_disk_t *disk);
+static time_t ngx_http_file_cache_expire(ngx_http_file_cache_disk_t *disk);
+static void ngx_http_file_cache_delete(ngx_http_file_cache_disk_t *disk,
     ngx_queue_t *q, u_char *name);
+static void ngx_http_file_cache_set_slots(ngx_http_file_cache_t *cache);
+static void ngx_http_file_cache_disk_weights(ngx_http_file_cache_t *cache);
 static ngx_int_t
-    ngx_http_file_cache_manager_sleep(ngx_http_file_cache_t *cache);
+    ngx_http_file_cache_manager_sleep(ngx_http_file_cache_disk_t *disk);
 static ngx_int_t ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
 static ngx_int_t ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
 static ngx_int_t ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
-static ngx_int_t ngx_http_file_cache_add(ngx_http_file_cache_t *cache,
+static ngx_int_t ngx_http_file_cache_add(ngx_http_file_cache_disk_t *disk,
     ngx_http_cache_t *c);
 static ngx_int_t ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
@@ -57,48 +89,88 @@ ngx_str_t  ngx_http_cache_status[] = {
 static u_char  ngx_http_file_cache_key[] = { LF, 'K', 'E', 'Y', ':', ' ' };
 
 
+/* the content codings which are significant in Accept-Encoding */
+
+static ngx_str_t  ngx_http_file_cache_codings[] = {
+    ngx_string("gzip"),
+    ngx_string("deflate"),
+    ngx_string("br"),
+    ngx_string("compress"),
+    ngx_null_string
+};
+
+
 static ngx_int_t
 ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 {
     ngx_http_file_cache_t  *ocache = data;
 
-    size_t                  len;
-    ngx_uint_t              n;
-    ngx_http_file_cache_t  *cache;
+    size_t                       len;
+    ngx_uint_t                   i, n;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_disk_t  *disk, *odisk;
 
     cache = shm_zone->data;
 
     if (ocache) {
-        if (ngx_strcmp(cache->path->name.data, ocache->path->name.data) != 0) {
+        if (cache->ndisks != ocache->ndisks) {
             ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
-                          "cache \"%V\" uses the \"%V\" cache path "
-                          "while previously it used the \"%V\" cache path",
-                          &shm_zone->shm.name, &cache->path->name,
-                          &ocache->path->name);
-
+                          "cache \"%V\" uses %ui disks "
+                          "while previously it used %ui disks",
+                          &shm_zone->shm.name, cache->ndisks, ocache->ndisks);
             return NGX_ERROR;
         }
 
-        for (n = 0; n < 3; n++) {
-            if (cache->path->level[n] != ocache->path->level[n]) {
+        for (i = 0; i < cache->ndisks; i++) {
+            disk = &cache->disks[i];
+            odisk = &ocache->disks[i];
+
+            if (ngx_strcmp(disk->path->name.data, odisk->path->name.data) != 0)
+            {
                 ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
-                              "cache \"%V\" had previously different levels",
-                              &shm_zone->shm.name);
+                              "cache \"%V\" uses the \"%V\" cache path "
+                              "while previously it used the \"%V\" cache path",
+                              &shm_zone->shm.name, &disk->path->name,
+                              &odisk->path->name);
+
                 return NGX_ERROR;
             }
+
+            for (n = 0; n < 3; n++) {
+                if (disk->path->level[n] != odisk->path->level[n]) {
+                    ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                                  "cache \"%V\" had previously different levels",
+                                  &shm_zone->shm.name);
+                    return NGX_ERROR;
+                }
+            }
         }
 
         cache->sh = ocache->sh;
 
         cache->shpool = ocache->shpool;
-        cache->bsize = ocache->bsize;
 
-        cache->max_size /= cache->bsize;
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        for (i = 0; i < cache->ndisks; i++) {
+            disk = &cache->disks[i];
 
-        if (!cache->sh->cold || cache->sh->loading) {
-            cache->path->loader = NULL;
+            disk->sh = &cache->sh->disks[i];
+            disk->bsize = ocache->disks[i].bsize;
+
+            disk->max_size /= disk->bsize;
+
+            disk->sh->weight = disk->weight;
+
+            if (!disk->sh->cold || disk->sh->loading) {
+                disk->path->loader = NULL;
+            }
         }
 
+        ngx_http_file_cache_set_slots(cache);
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
         return NGX_OK;
     }
 
@@ -106,30 +178,55 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 
     if (shm_zone->shm.exists) {
         cache->sh = cache->shpool->data;
-        cache->bsize = ngx_fs_bsize(cache->path->name.data);
+
+        for (i = 0; i < cache->ndisks; i++) {
+            disk = &cache->disks[i];
+
+            disk->sh = &cache->sh->disks[i];
+            disk->bsize = ngx_fs_bsize(disk->path->name.data);
+        }
 
         return NGX_OK;
     }
 
-    cache->sh = ngx_slab_alloc(cache->shpool, sizeof(ngx_http_file_cache_sh_t));
+    len = sizeof(ngx_http_file_cache_sh_t)
+          + (cache->ndisks - 1) * sizeof(ngx_http_file_cache_disk_sh_t);
+
+    cache->sh = ngx_slab_alloc(cache->shpool, len);
     if (cache->sh == NULL) {
         return NGX_ERROR;
     }
 
+    ngx_memzero(cache->sh, len);
+
     cache->shpool->data = cache->sh;
 
     ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
                     ngx_http_file_cache_rbtree_insert_value);
 
-    ngx_queue_init(&cache->sh->queue);
+    ngx_rbtree_init(&cache->sh->tags, &cache->sh->tags_sentinel,
+                    ngx_http_file_cache_tag_rbtree_insert_value);
 
-    cache->sh->cold = 1;
-    cache->sh->loading = 0;
-    cache->sh->size = 0;
+    cache->sh->ndisks = cache->ndisks;
 
-    cache->bsize = ngx_fs_bsize(cache->path->name.data);
+    for (i = 0; i < cache->ndisks; i++) {
+        disk = &cache->disks[i];
 
-    cache->max_size /= cache->bsize;
+        disk->sh = &cache->sh->disks[i];
+
+        ngx_queue_init(&disk->sh->queue);
+
+        disk->sh->cold = 1;
+        disk->sh->loading = 0;
+        disk->sh->size = 0;
+        disk->sh->weight = disk->weight;
+
+        disk->bsize = ngx_fs_bsize(disk->path->name.data);
+
+        disk->max_size /= disk->bsize;
+    }
+
+    ngx_http_file_cache_set_slots(cache);
 
     len = sizeof(" in cache keys zone \"\"") + shm_zone->shm.name.len;
 
@@ -189,7 +286,7 @@ ngx_http_file_cache_create(ngx_http_request_t *r)
     cln->handler = ngx_http_file_cache_cleanup;
     cln->data = c;
 
-    if (ngx_http_file_cache_name(r, cache->path) != NGX_OK) {
+    if (ngx_http_file_cache_name(r, c->disk->path) != NGX_OK) {
         return NGX_ERROR;
     }
 
@@ -229,6 +326,8 @@ ngx_http_file_cache_create_key(ngx_http_request_t *r)
 
     ngx_crc32_final(c->crc32);
     ngx_md5_final(c->key, &md5);
+
+    ngx_memcpy(c->main, c->key, NGX_HTTP_CACHE_KEY_LEN);
 }
 
 
@@ -236,7 +335,7 @@ ngx_int_t
 ngx_http_file_cache_open(ngx_http_request_t *r)
 {
     ngx_int_t                  rc, rv;
-    ngx_uint_t                 cold, test;
+    ngx_uint_t                 cold, test, partial;
     ngx_http_cache_t          *c;
     ngx_pool_cleanup_t        *cln;
     ngx_open_file_info_t       of;
@@ -251,9 +350,15 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
 
     cache = c->file_cache;
 
-    cln = ngx_pool_cleanup_add(r->pool, 0);
-    if (cln == NULL) {
-        return NGX_ERROR;
+    /* a secondary key is opened with the cleanup of the main one */
+
+    cln = NULL;
+
+    if (!c->secondary) {
+        cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
     }
 
     rc = ngx_http_file_cache_exists(cache, c);
@@ -265,14 +370,17 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         return rc;
     }
 
-    cln->handler = ngx_http_file_cache_cleanup;
-    cln->data = c;
+    if (cln) {
+        cln->handler = ngx_http_file_cache_cleanup;
+        cln->data = c;
+    }
 
     if (rc == NGX_AGAIN) {
         return NGX_HTTP_CACHE_SCARCE;
     }
 
-    cold = cache->sh->cold;
+    cold = c->disk->sh->cold;
+    partial = 0;
 
     if (rc == NGX_OK) {
 
@@ -282,6 +390,7 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
 
         c->temp_file = 1;
         test = c->exists ? 1 : 0;
+        partial = (c->read_while_write && !c->exists) ? 1 : 0;
         rv = NGX_DECLINED;
 
     } else { /* rc == NGX_DECLINED */
@@ -302,14 +411,24 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         }
     }
 
-    if (ngx_http_file_cache_name(r, cache->path) != NGX_OK) {
+    if (ngx_http_file_cache_name(r, c->disk->path) != NGX_OK) {
         return NGX_ERROR;
     }
 
+    if (partial) {
+        rc = ngx_http_file_cache_open_partial(r, c);
+
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+    }
+
     if (!test) {
         return NGX_DECLINED;
     }
 
+    c->io_start = ngx_http_file_cache_usec();
+
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
     ngx_memzero(&of, sizeof(ngx_open_file_info_t));
@@ -347,7 +466,7 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
     c->file.log = r->connection->log;
     c->uniq = of.uniq;
     c->length = of.size;
-    c->fs_size = (of.fs_size + cache->bsize - 1) / cache->bsize;
+    c->fs_size = (of.fs_size + c->disk->bsize - 1) / c->disk->bsize;
 
     c->buf = ngx_create_temp_buf(r->pool, c->body_start);
     if (c->buf == NULL) {
@@ -381,14 +500,47 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     h = (ngx_http_file_cache_header_t *) c->buf->pos;
 
+    if (h->version != NGX_HTTP_CACHE_VERSION) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "cache file \"%s\" version mismatch", c->file.name.data);
+        return NGX_DECLINED;
+    }
+
     if (h->crc32 != c->crc32) {
         ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
                       "cache file \"%s\" has md5 collision", c->file.name.data);
         return NGX_DECLINED;
     }
 
+    if (h->vary_len > NGX_HTTP_CACHE_VARY_LEN) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" has incorrect vary length",
+                      c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    if (h->vary_len) {
+        ngx_http_file_cache_vary(r, h->vary, h->vary_len, c->variant);
+
+        if (ngx_memcmp(c->variant, h->variant, NGX_HTTP_CACHE_KEY_LEN) != 0) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http file cache vary mismatch");
+
+            if (c->partial) {
+                return NGX_DECLINED;
+            }
+
+            return ngx_http_file_cache_reopen(r, c);
+        }
+    }
+
     c->buf->last += n;
 
+    if (c->io_start) {
+        ngx_http_file_cache_account_io(c->disk, c->io_start, 0);
+        c->io_start = 0;
+    }
+
     c->valid_sec = h->valid_sec;
     c->last_modified = h->last_modified;
     c->date = h->date;
@@ -400,7 +552,11 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     cache = c->file_cache;
 
-    if (cache->sh->cold) {
+    if (c->partial) {
+        return NGX_OK;
+    }
+
+    if (c->disk->sh->cold) {
 
         ngx_shmtx_lock(&cache->shpool->mutex);
 
@@ -410,7 +566,7 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
             c->node->exists = 1;
             c->node->uniq = c->uniq;
 
-            cache->sh->size += c->fs_size;
+            c->disk->sh->size += c->fs_size;
         }
 
         ngx_shmtx_unlock(&cache->shpool->mutex);
@@ -444,6 +600,195 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 }
 
 
+/*
+ * the main entry records the Vary list, the variant which does not match
+ * the one stored in the main entry is looked up by the secondary key
+ */
+
+static ngx_int_t
+ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_http_file_cache_t  *cache;
+
+    if (c->secondary) {
+        return NGX_DECLINED;
+    }
+
+    cache = c->file_cache;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    c->node->count--;
+    c->node = NULL;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    c->secondary = 1;
+    c->exists = 0;
+    c->file.name.len = 0;
+    c->body_start = c->buf->end - c->buf->start;
+    c->buf = NULL;
+
+    ngx_memcpy(c->key, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache reopen as secondary");
+
+    return ngx_http_file_cache_open(r);
+}
+
+
+/*
+ * a response stored by the secondary key without the Vary list,
+ * or with the list which gives another variant, replaces the main entry
+ */
+
+static ngx_int_t
+ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_http_file_cache_t  *cache;
+
+    if (!c->secondary) {
+        return NGX_OK;
+    }
+
+    if (c->vary.len
+        && ngx_memcmp(c->variant, c->key, NGX_HTTP_CACHE_KEY_LEN) == 0)
+    {
+        return NGX_OK;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache switch to main key");
+
+    cache = c->file_cache;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    c->node->count--;
+
+    if (c->updating) {
+        c->node->updating = 0;
+        c->updating = 0;
+    }
+
+    c->node = NULL;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    c->secondary = 0;
+    c->file.name.len = 0;
+
+    ngx_memcpy(c->key, c->main, NGX_HTTP_CACHE_KEY_LEN);
+
+    if (ngx_http_file_cache_exists(cache, c) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    return ngx_http_file_cache_name(r, c->disk->path);
+}
+
+
+/*
+ * a response which is still being received from an upstream server
+ * is read from the temporary file the upstream writes it to
+ */
+
+static ngx_int_t
+ngx_http_file_cache_open_partial(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    u_char                   *name;
+    size_t                    len;
+    ngx_fd_t                  fd;
+    ngx_int_t                 rc;
+    ngx_file_info_t           fi;
+    ngx_pool_cleanup_t       *cln;
+    ngx_pool_cleanup_file_t  *clnf;
+    ngx_http_file_cache_t    *cache;
+
+    cache = c->file_cache;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    if (!c->node->writing) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    c->write_gen = c->node->write_gen;
+
+    len = ngx_strlen(c->node->temp_name);
+
+    name = ngx_pnalloc(r->pool, len + 1);
+    if (name == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(name, c->node->temp_name, len + 1);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    fd = ngx_open_file(name, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE) {
+
+        /* the response has been just stored or abandoned */
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, ngx_errno,
+                       "http file cache partial: \"%s\" for \"%s\"",
+                       name, c->file.name.data);
+
+        return NGX_DECLINED;
+    }
+
+    cln->handler = ngx_pool_cleanup_file;
+    clnf = cln->data;
+
+    clnf->fd = fd;
+    clnf->name = name;
+    clnf->log = r->pool->log;
+
+    c->file.fd = fd;
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", name);
+        return NGX_ERROR;
+    }
+
+    c->length = ngx_file_size(&fi);
+
+    if (c->length < (off_t) c->header_start) {
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache partial: \"%s\" %O", name, c->length);
+
+    c->buf = ngx_create_temp_buf(r->pool, c->body_start);
+    if (c->buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    c->partial = 1;
+
+    rc = ngx_http_file_cache_read(r, c);
+
+    if (rc == NGX_DECLINED) {
+        c->partial = 0;
+        c->buf = NULL;
+    }
+
+    return rc;
+}
+
+
 static ssize_t
 ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
@@ -503,10 +848,41 @@ ngx_http_cache_aio_event_handler(ngx_event_t *ev)
 #endif
 
 
+static ngx_uint_t
+ngx_http_file_cache_usec(void)
+{
+    struct timeval  tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (ngx_uint_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+static void
+ngx_http_file_cache_account_io(ngx_http_file_cache_disk_t *disk,
+    ngx_uint_t start, ngx_uint_t write)
+{
+    ngx_uint_t  usec;
+
+    usec = ngx_http_file_cache_usec() - start;
+
+    if (write) {
+        (void) ngx_atomic_fetch_add(&disk->sh->writes, 1);
+        (void) ngx_atomic_fetch_add(&disk->sh->write_time, usec);
+
+    } else {
+        (void) ngx_atomic_fetch_add(&disk->sh->reads, 1);
+        (void) ngx_atomic_fetch_add(&disk->sh->read_time, usec);
+    }
+}
+
+
 static ngx_int_t
 ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 {
     ngx_int_t                    rc;
+    ngx_uint_t                   disk;
     ngx_http_file_cache_node_t  *fcn;
 
     ngx_shmtx_lock(&cache->shpool->mutex);
@@ -547,12 +923,16 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
         goto done;
     }
 
+    /* new entries are spread over the disks according to their weights */
+
+    disk = cache->sh->slots[c->key[0]];
+
     fcn = ngx_slab_alloc_locked(cache->shpool,
                                 sizeof(ngx_http_file_cache_node_t));
     if (fcn == NULL) {
         ngx_shmtx_unlock(&cache->shpool->mutex);
 
-        (void) ngx_http_file_cache_forced_expire(cache);
+        (void) ngx_http_file_cache_forced_expire(&cache->disks[disk]);
 
         ngx_shmtx_lock(&cache->shpool->mutex);
 
@@ -571,10 +951,16 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 
     ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
 
+    ngx_queue_init(&fcn->tags);
+
     fcn->uses = 1;
     fcn->count = 1;
     fcn->updating = 0;
     fcn->deleting = 0;
+    fcn->disk = disk;
+    fcn->writing = 0;
+    fcn->temp_name = NULL;
+    fcn->write_gen = 0;
 
 renew:
 
@@ -592,7 +978,9 @@ done:
 
     fcn->expire = ngx_time() + cache->inactive;
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    c->disk = &cache->disks[fcn->disk];
+
+    ngx_queue_insert_head(&c->disk->sh->queue, &fcn->queue);
 
     c->uniq = fcn->uniq;
     c->error = fcn->error;
@@ -730,7 +1118,7 @@ ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
 }
 
 
-void
+ngx_int_t
 ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
 {
     ngx_http_file_cache_header_t  *h = (ngx_http_file_cache_header_t *) buf;
@@ -745,6 +1133,7 @@ ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
 
     c = r->cache;
 
+    h->version = NGX_HTTP_CACHE_VERSION;
     h->valid_sec = c->valid_sec;
     h->last_modified = c->last_modified;
     h->date = c->date;
@@ -753,6 +1142,27 @@ ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
     h->header_start = (u_short) c->header_start;
     h->body_start = (u_short) c->body_start;
 
+    if (c->vary.len) {
+        if (c->vary.len > NGX_HTTP_CACHE_VARY_LEN) {
+            /* should not happen */
+            c->vary.len = NGX_HTTP_CACHE_VARY_LEN;
+        }
+
+        h->vary_len = (u_char) c->vary.len;
+        ngx_memcpy(h->vary, c->vary.data, c->vary.len);
+
+        ngx_http_file_cache_vary(r, c->vary.data, c->vary.len, c->variant);
+        ngx_memcpy(h->variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+
+    } else {
+        h->vary_len = 0;
+        ngx_memzero(h->variant, NGX_HTTP_CACHE_KEY_LEN);
+    }
+
+    if (ngx_http_file_cache_update_variant(r, c) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
     p = buf + sizeof(ngx_http_file_cache_header_t);
 
     p = ngx_cpymem(p, ngx_http_file_cache_key, sizeof(ngx_http_file_cache_key));
@@ -763,36 +1173,285 @@ ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
     }
 
     *p = LF;
+
+    return NGX_OK;
 }
 
 
-void
-ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
+/*
+ * the variant hash is calculated from the main key and the request headers
+ * listed in Vary; the headers are normalized to have less variants
+ */
+
+static void
+ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary, size_t len,
+    u_char *hash)
 {
-    off_t                   fs_size;
-    ngx_int_t               rc;
-    ngx_file_uniq_t         uniq;
-    ngx_file_info_t         fi;
-    ngx_http_cache_t        *c;
-    ngx_ext_rename_file_t   ext;
-    ngx_http_file_cache_t  *cache;
+    u_char     *p, *last;
+    ngx_str_t   name;
+    ngx_md5_t   md5;
+    u_char      buf[NGX_HTTP_CACHE_VARY_LEN];
 
-    c = r->cache;
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache vary: \"%*s\"", len, vary);
 
-    if (c->updated) {
-        return;
-    }
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, r->cache->main, NGX_HTTP_CACHE_KEY_LEN);
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache update");
+    ngx_strlow(buf, vary, len);
 
-    c->updated = 1;
-    c->updating = 0;
+    p = buf;
+    last = buf + len;
 
-    cache = c->file_cache;
+    while (p < last) {
 
-    uniq = 0;
-    fs_size = 0;
+        while (p < last && (*p == ' ' || *p == ',')) {
+            p++;
+        }
+
+        name.data = p;
+
+        while (p < last && *p != ',' && *p != ' ') {
+            p++;
+        }
+
+        name.len = p - name.data;
+
+        if (name.len == 0) {
+            break;
+        }
+
+        ngx_md5_update(&md5, name.data, name.len);
+        ngx_md5_update(&md5, ":", sizeof(":") - 1);
+
+        ngx_http_file_cache_vary_header(r, &md5, &name);
+
+        ngx_md5_update(&md5, CRLF, sizeof(CRLF) - 1);
+    }
+
+    ngx_md5_final(hash, &md5);
+}
+
+
+static void
+ngx_http_file_cache_vary_header(ngx_http_request_t *r, ngx_md5_t *md5,
+    ngx_str_t *name)
+{
+    size_t            len;
+    u_char           *p, *start, *last;
+    ngx_uint_t        i, multiple, normalize, encoding, codings;
+    ngx_list_part_t  *part;
+    ngx_table_elt_t  *header;
+
+    multiple = 0;
+    codings = 0;
+
+    encoding = (name->len == sizeof("accept-encoding") - 1
+                && ngx_strncmp(name->data, "accept-encoding", name->len) == 0);
+
+    /* the spaces are not significant in the Accept-* lists */
+
+    normalize = (name->len >= sizeof("accept") - 1
+                 && ngx_strncmp(name->data, "accept", sizeof("accept") - 1)
+                    == 0);
+
+    part = &r->headers_in.headers.part;
+    header = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            header = part->elts;
+            i = 0;
+        }
+
+        if (header[i].key.len != name->len
+            || ngx_strncasecmp(header[i].key.data, name->data, name->len) != 0)
+        {
+            continue;
+        }
+
+        p = header[i].value.data;
+        last = p + header[i].value.len;
+
+        if (encoding) {
+            codings |= ngx_http_file_cache_vary_codings(p, last);
+            continue;
+        }
+
+        if (!normalize) {
+            if (multiple) {
+                ngx_md5_update(md5, ",", sizeof(",") - 1);
+            }
+
+            ngx_md5_update(md5, p, last - p);
+
+            multiple = 1;
+            continue;
+        }
+
+        while (p < last) {
+
+            while (p < last && (*p == ' ' || *p == ',')) {
+                p++;
+            }
+
+            start = p;
+
+            while (p < last && *p != ',' && *p != ' ') {
+                p++;
+            }
+
+            len = p - start;
+
+            if (len == 0) {
+                break;
+            }
+
+            if (multiple) {
+                ngx_md5_update(md5, ",", sizeof(",") - 1);
+            }
+
+            ngx_md5_update(md5, start, len);
+
+            multiple = 1;
+        }
+    }
+
+    if (!encoding) {
+        return;
+    }
+
+    /*
+     * Accept-Encoding is reduced to the set of the known content codings,
+     * so "gzip, deflate" and "deflate,gzip;q=1.0, sdch" give one variant
+     */
+
+    for (i = 0; ngx_http_file_cache_codings[i].len; i++) {
+        if (codings & (1 << i)) {
+            ngx_md5_update(md5, ngx_http_file_cache_codings[i].data,
+                           ngx_http_file_cache_codings[i].len);
+            ngx_md5_update(md5, ",", sizeof(",") - 1);
+        }
+    }
+}
+
+
+static ngx_uint_t
+ngx_http_file_cache_vary_codings(u_char *p, u_char *last)
+{
+    size_t       len;
+    u_char      *start;
+    ngx_uint_t   i, n, codings, zero;
+
+    codings = 0;
+
+    while (p < last) {
+
+        while (p < last && (*p == ' ' || *p == ',')) {
+            p++;
+        }
+
+        start = p;
+
+        while (p < last && *p != ',' && *p != ';' && *p != ' ') {
+            p++;
+        }
+
+        len = p - start;
+
+        if (len > 2 && start[0] == 'x' && start[1] == '-') {
+            start += 2;
+            len -= 2;
+        }
+
+        if (len == 1 && *start == '*') {
+            n = (ngx_uint_t) -1;
+
+        } else {
+            n = 0;
+
+            for (i = 0; ngx_http_file_cache_codings[i].len; i++) {
+                if (len == ngx_http_file_cache_codings[i].len
+                    && ngx_strncasecmp(start,
+                                       ngx_http_file_cache_codings[i].data,
+                                       len)
+                       == 0)
+                {
+                    n = 1 << i;
+                    break;
+                }
+            }
+        }
+
+        /* "q=0", "q=0.0", etc. disable the coding */
+
+        zero = 0;
+
+        while (p < last && *p != ',') {
+
+            if ((*p == 'q' || *p == 'Q') && p + 2 < last && p[1] == '='
+                && p[2] == '0')
+            {
+                p += 2;
+                zero = 1;
+
+                while (p < last && *p != ',' && *p != ' ' && *p != ';') {
+                    if (*p != '0' && *p != '.') {
+                        zero = 0;
+                    }
+
+                    p++;
+                }
+
+                continue;
+            }
+
+            p++;
+        }
+
+        if (!zero) {
+            codings |= n;
+        }
+    }
+
+    return codings;
+}
+
+
+void
+ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
+{
+    off_t                   fs_size;
+    ngx_int_t               rc;
+    ngx_uint_t              start, deleting;
+    ngx_file_uniq_t         uniq;
+    ngx_file_info_t         fi;
+    ngx_http_cache_t        *c;
+    ngx_ext_rename_file_t   ext;
+    ngx_http_file_cache_t  *cache;
+
+    c = r->cache;
+
+    if (c->updated) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache update");
+
+    c->updated = 1;
+    c->updating = 0;
+
+    cache = c->file_cache;
+
+    uniq = 0;
+    fs_size = 0;
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http file cache rename: \"%s\" to \"%s\"",
@@ -805,7 +1464,36 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
     ext.delete_file = 1;
     ext.log = r->connection->log;
 
-    rc = ngx_ext_rename_file(&tf->file.name, &c->file.name, &ext);
+    /*
+     * a purge removes files outside of the lock, so the file is not
+     * replaced while the previous one is being removed, and the node
+     * is marked as deleting while it is replaced to keep a purge off it
+     */
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    deleting = c->node->deleting;
+    c->node->deleting = 1;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    start = ngx_http_file_cache_usec();
+
+    if (deleting) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache purged: \"%s\"", c->file.name.data);
+
+        if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed",
+                          tf->file.name.data);
+        }
+
+        rc = NGX_DECLINED;
+
+    } else {
+        rc = ngx_ext_rename_file(&tf->file.name, &c->file.name, &ext);
+    }
 
     if (rc == NGX_OK) {
 
@@ -817,77 +1505,655 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
 
         } else {
             uniq = ngx_file_uniq(&fi);
-            fs_size = (ngx_file_fs_size(&fi) + cache->bsize - 1) / cache->bsize;
+            fs_size = (ngx_file_fs_size(&fi) + c->disk->bsize - 1)
+                      / c->disk->bsize;
+
+            ngx_http_file_cache_account_io(c->disk, start, 1);
+        }
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    c->node->count--;
+    c->node->uniq = uniq;
+    c->node->body_start = c->body_start;
+
+    c->disk->sh->size += fs_size - c->node->fs_size;
+    c->node->fs_size = fs_size;
+
+    if (rc == NGX_OK) {
+        c->node->exists = 1;
+
+        /* the surrogate keys of the previous response are replaced */
+
+        ngx_http_file_cache_untag(cache, c->node);
+
+        if (c->tags) {
+            ngx_http_file_cache_tag(cache, c->node, c->tags,
+                                    r->connection->log);
+        }
+    }
+
+    if (!deleting) {
+        c->node->deleting = 0;
+    }
+
+    ngx_http_file_cache_clear_writing(cache, c);
+
+    c->node->updating = 0;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+
+void
+ngx_http_file_cache_set_writing(ngx_http_request_t *r, ngx_temp_file_t *tf)
+{
+    u_char                 *name;
+    ngx_http_cache_t       *c;
+    ngx_http_file_cache_t  *cache;
+
+    c = r->cache;
+
+    if (!c->read_while_write || c->updated || c->node == NULL) {
+        return;
+    }
+
+    /* the temporary file is published only once */
+
+    c->read_while_write = 0;
+
+    cache = c->file_cache;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    if (c->node->writing || c->node->exists) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return;
+    }
+
+    name = ngx_slab_alloc_locked(cache->shpool, tf->file.name.len + 1);
+
+    if (name) {
+        ngx_memcpy(name, tf->file.name.data, tf->file.name.len + 1);
+
+        c->node->temp_name = name;
+        c->node->writing = 1;
+        c->node->write_gen++;
+        c->writing = 1;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache writing: \"%s\" %d",
+                   tf->file.name.data, c->writing);
+}
+
+
+static void
+ngx_http_file_cache_clear_writing(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c)
+{
+    if (!c->writing) {
+        return;
+    }
+
+    c->writing = 0;
+
+    c->node->writing = 0;
+    ngx_slab_free_locked(cache->shpool, c->node->temp_name);
+    c->node->temp_name = NULL;
+}
+
+
+ngx_int_t
+ngx_http_file_cache_set_tags(ngx_http_request_t *r, ngx_str_t *value)
+{
+    u_char            *p, *last, *start;
+    size_t             len;
+    ngx_str_t         *tag;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    if (c->tags == NULL) {
+        c->tags = ngx_array_create(r->pool, 4, sizeof(ngx_str_t));
+        if (c->tags == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    p = value->data;
+    last = p + value->len;
+
+    for ( ;; ) {
+
+        while (p < last && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+
+        if (p == last) {
+            return NGX_OK;
+        }
+
+        start = p;
+
+        while (p < last && *p != ' ' && *p != '\t' && *p != ',') {
+            p++;
+        }
+
+        len = p - start;
+
+        if (len > NGX_HTTP_FILE_CACHE_TAG_LEN) {
+            ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                          "too long surrogate key \"%*s...\" is ignored",
+                          32, start);
+            continue;
+        }
+
+        tag = ngx_array_push(c->tags);
+        if (tag == NULL) {
+            return NGX_ERROR;
+        }
+
+        /* the upstream buffer may be reused before the entry is stored */
+
+        tag->data = ngx_pnalloc(r->pool, len);
+        if (tag->data == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(tag->data, start, len);
+        tag->len = len;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache tag: \"%V\"", tag);
+    }
+}
+
+
+static void
+ngx_http_file_cache_tag(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, ngx_array_t *tags, ngx_log_t *log)
+{
+    uint32_t                         hash;
+    ngx_str_t                       *tag;
+    ngx_uint_t                       i;
+    ngx_queue_t                     *q;
+    ngx_http_file_cache_tag_t       *fct;
+    ngx_http_file_cache_tag_link_t  *link;
+
+    tag = tags->elts;
+
+    for (i = 0; i < tags->nelts; i++) {
+
+        hash = ngx_crc32_short(tag[i].data, tag[i].len);
+
+        fct = ngx_http_file_cache_lookup_tag(cache, &tag[i], hash);
+
+        if (fct) {
+
+            /* a key repeated in the response */
+
+            for (q = ngx_queue_head(&fcn->tags);
+                 q != ngx_queue_sentinel(&fcn->tags);
+                 q = ngx_queue_next(q))
+            {
+                link = ngx_queue_data(q, ngx_http_file_cache_tag_link_t,
+                                      node_queue);
+
+                if (link->tag == fct) {
+                    break;
+                }
+            }
+
+            if (q != ngx_queue_sentinel(&fcn->tags)) {
+                continue;
+            }
+
+        } else {
+            fct = ngx_slab_alloc_locked(cache->shpool,
+                                   offsetof(ngx_http_file_cache_tag_t, data)
+                                   + tag[i].len);
+            if (fct == NULL) {
+                ngx_log_error(NGX_LOG_CRIT, log, 0,
+                              "could not allocate surrogate key \"%V\" "
+                              "in cache keys zone \"%V\"",
+                              &tag[i], &cache->shm_zone->shm.name);
+                return;
+            }
+
+            fct->node.key = hash;
+            fct->len = (u_char) tag[i].len;
+            ngx_memcpy(fct->data, tag[i].data, tag[i].len);
+
+            ngx_queue_init(&fct->links);
+
+            ngx_rbtree_insert(&cache->sh->tags, &fct->node);
+        }
+
+        link = ngx_slab_alloc_locked(cache->shpool,
+                                     sizeof(ngx_http_file_cache_tag_link_t));
+        if (link == NULL) {
+            ngx_log_error(NGX_LOG_CRIT, log, 0,
+                          "could not allocate surrogate key \"%V\" "
+                          "link in cache keys zone \"%V\"",
+                          &tag[i], &cache->shm_zone->shm.name);
+
+            if (ngx_queue_empty(&fct->links)) {
+                ngx_rbtree_delete(&cache->sh->tags, &fct->node);
+                ngx_slab_free_locked(cache->shpool, fct);
+            }
+
+            return;
+        }
+
+        link->tag = fct;
+        link->node = fcn;
+
+        ngx_queue_insert_tail(&fct->links, &link->tag_queue);
+        ngx_queue_insert_tail(&fcn->tags, &link->node_queue);
+    }
+}
+
+
+static void
+ngx_http_file_cache_untag(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    ngx_queue_t                     *q;
+    ngx_http_file_cache_tag_t       *fct;
+    ngx_http_file_cache_tag_link_t  *link;
+
+    while (!ngx_queue_empty(&fcn->tags)) {
+
+        q = ngx_queue_head(&fcn->tags);
+        link = ngx_queue_data(q, ngx_http_file_cache_tag_link_t, node_queue);
+
+        ngx_queue_remove(&link->node_queue);
+        ngx_queue_remove(&link->tag_queue);
+
+        fct = link->tag;
+
+        if (ngx_queue_empty(&fct->links)) {
+            ngx_rbtree_delete(&cache->sh->tags, &fct->node);
+            ngx_slab_free_locked(cache->shpool, fct);
+        }
+
+        ngx_slab_free_locked(cache->shpool, link);
+    }
+}
+
+
+static ngx_http_file_cache_tag_t *
+ngx_http_file_cache_lookup_tag(ngx_http_file_cache_t *cache, ngx_str_t *tag,
+    uint32_t hash)
+{
+    ngx_int_t                   rc;
+    ngx_rbtree_node_t          *node, *sentinel;
+    ngx_http_file_cache_tag_t  *fct;
+
+    node = cache->sh->tags.root;
+    sentinel = cache->sh->tags.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        do {
+            fct = (ngx_http_file_cache_tag_t *) node;
+
+            rc = ngx_memn2cmp(tag->data, fct->data, tag->len, (size_t) fct->len);
+
+            if (rc == 0) {
+                return fct;
+            }
+
+            node = (rc < 0) ? node->left : node->right;
+
+        } while (node != sentinel && hash == node->key);
+
+        break;
+    }
+
+    /* not found */
+
+    return NULL;
+}
+
+
+static void
+ngx_http_file_cache_tag_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t          **p;
+    ngx_http_file_cache_tag_t   *ct, *ctt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            ct = (ngx_http_file_cache_tag_t *) node;
+            ctt = (ngx_http_file_cache_tag_t *) temp;
+
+            p = (ngx_memn2cmp(ct->data, ctt->data, ct->len, ctt->len) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+ngx_int_t
+ngx_http_cache_send(ngx_http_request_t *r)
+{
+    ngx_int_t               rc;
+    ngx_buf_t              *b;
+    ngx_chain_t             out;
+    ngx_http_cache_t       *c;
+    ngx_http_file_cache_t  *cache;
+
+    c = r->cache;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache send: %s", c->file.name.data);
+
+    if (c->tags && c->node) {
+
+        /* the entries loaded from disk are indexed on their first hit */
+
+        cache = c->file_cache;
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        if (c->node->exists && ngx_queue_empty(&c->node->tags)) {
+            ngx_http_file_cache_tag(cache, c->node, c->tags,
+                                    r->connection->log);
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+    }
+
+    /* we need to allocate all before the header would be sent */
+
+    b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+    if (b->file == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (!c->partial) {
+        r->header_only = (c->length - c->body_start) == 0;
+    }
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    if (c->partial) {
+        b->file_pos = c->body_start;
+        b->file_last = c->body_start;
+
+        b->file->fd = c->file.fd;
+        b->file->name = c->file.name;
+        b->file->log = r->connection->log;
+
+        c->partial_buf = b;
+        c->partial_wait = NGX_HTTP_FILE_CACHE_PARTIAL_MIN;
+
+        c->partial_event.handler = ngx_http_file_cache_partial_wait_handler;
+        c->partial_event.data = r;
+        c->partial_event.log = r->connection->log;
+
+        r->write_event_handler = ngx_http_file_cache_partial_handler;
+
+        return ngx_http_file_cache_send_partial(r);
+    }
+
+    b->file_pos = c->body_start;
+    b->file_last = c->length;
+
+    b->in_file = 1;
+    b->last_buf = (r == r->main) ? 1: 0;
+    b->last_in_chain = 1;
+
+    b->file->fd = c->file.fd;
+    b->file->name = c->file.name;
+    b->file->log = r->connection->log;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+/*
+ * sends the data appended to the temporary file since the previous call,
+ * and finishes the response once the file has been stored in the cache
+ */
+
+static ngx_int_t
+ngx_http_file_cache_send_partial(ngx_http_request_t *r)
+{
+    off_t                      size;
+    ngx_int_t                  rc;
+    ngx_buf_t                 *b;
+    ngx_uint_t                 current, writing, exists;
+    ngx_event_t               *wev;
+    ngx_chain_t                out;
+    ngx_file_info_t            fi;
+    ngx_http_cache_t          *c;
+    ngx_http_file_cache_t     *cache;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    c = r->cache;
+    cache = c->file_cache;
+    b = c->partial_buf;
+
+    if (r->buffered || r->connection->buffered) {
+
+        rc = ngx_http_output_filter(r, NULL);
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (r->buffered || r->connection->buffered) {
+            goto wait_client;
+        }
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    /*
+     * the node may have been given up and published again with another
+     * temporary file, the generation tells them apart
+     */
+
+    current = (c->node->write_gen == c->write_gen);
+    writing = (current && c->node->writing);
+    exists = (current && c->node->exists);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (!writing && !exists) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "cache file \"%s\" has been abandoned by upstream",
+                      c->file.name.data);
+        return NGX_ERROR;
+    }
+
+    if (ngx_fd_info(c->file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", c->file.name.data);
+        return NGX_ERROR;
+    }
+
+    size = ngx_file_size(&fi);
+
+    if (!writing && size == b->file_last && r != r->main) {
+        return NGX_OK;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache partial send: %O-%O e:%ui",
+                   b->file_last, size, exists);
+
+    if (size > b->file_last || !writing) {
+
+        /* the file grows, it is polled again soon */
+
+        c->partial_wait = NGX_HTTP_FILE_CACHE_PARTIAL_MIN;
+
+        b->file_pos = b->file_last;
+        b->file_last = size;
+
+        b->in_file = (size > b->file_pos) ? 1 : 0;
+        b->flush = writing ? 1 : 0;
+        b->last_buf = (!writing && r == r->main) ? 1 : 0;
+        b->last_in_chain = writing ? 0 : 1;
+
+        out.buf = b;
+        out.next = NULL;
+
+        rc = ngx_http_output_filter(r, &out);
+
+        if (!writing || rc == NGX_ERROR) {
+            return rc;
+        }
+
+        if (r->buffered || r->connection->buffered) {
+            goto wait_client;
         }
+
+    } else {
+        c->partial_wait = ngx_min(c->partial_wait * 2,
+                                  NGX_HTTP_FILE_CACHE_PARTIAL_WAIT);
     }
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_add_timer(&c->partial_event, c->partial_wait);
 
-    c->node->count--;
-    c->node->uniq = uniq;
-    c->node->body_start = c->body_start;
+    return NGX_DONE;
 
-    cache->sh->size += fs_size - c->node->fs_size;
-    c->node->fs_size = fs_size;
+wait_client:
 
-    if (rc == NGX_OK) {
-        c->node->exists = 1;
+    wev = r->connection->write;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (!wev->delayed) {
+        ngx_add_timer(wev, clcf->send_timeout);
     }
 
-    c->node->updating = 0;
+    if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+        return NGX_ERROR;
+    }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    return NGX_DONE;
 }
 
 
-ngx_int_t
-ngx_http_cache_send(ngx_http_request_t *r)
+static void
+ngx_http_file_cache_partial_handler(ngx_http_request_t *r)
 {
-    ngx_int_t          rc;
-    ngx_buf_t         *b;
-    ngx_chain_t        out;
-    ngx_http_cache_t  *c;
+    ngx_int_t                  rc;
+    ngx_event_t               *wev;
+    ngx_http_core_loc_conf_t  *clcf;
 
-    c = r->cache;
+    wev = r->connection->write;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache send: %s", c->file.name.data);
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, wev->log, 0,
+                   "http file cache partial handler");
 
-    /* we need to allocate all before the header would be sent */
+    if (wev->timedout) {
+        if (!wev->delayed) {
+            ngx_log_error(NGX_LOG_INFO, wev->log, NGX_ETIMEDOUT,
+                          "client timed out");
+            r->connection->timedout = 1;
 
-    b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
-    if (b == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
-    }
+            ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+            return;
+        }
 
-    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
-    if (b->file == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        wev->timedout = 0;
+        wev->delayed = 0;
+
+    } else if (wev->delayed) {
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+        if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+            ngx_http_finalize_request(r, NGX_ERROR);
+        }
+
+        return;
     }
 
-    r->header_only = (c->length - c->body_start) == 0;
+    if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
 
-    rc = ngx_http_send_header(r);
+    rc = ngx_http_file_cache_send_partial(r);
 
-    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
-        return rc;
+    if (rc != NGX_DONE) {
+        ngx_http_finalize_request(r, rc);
     }
+}
 
-    b->file_pos = c->body_start;
-    b->file_last = c->length;
 
-    b->in_file = 1;
-    b->last_buf = (r == r->main) ? 1: 0;
-    b->last_in_chain = 1;
+static void
+ngx_http_file_cache_partial_wait_handler(ngx_event_t *ev)
+{
+    ngx_int_t            rc;
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
 
-    b->file->fd = c->file.fd;
-    b->file->name = c->file.name;
-    b->file->log = r->connection->log;
+    r = ev->data;
+    c = r->connection;
 
-    out.buf = b;
-    out.next = NULL;
+    rc = ngx_http_file_cache_send_partial(r);
 
-    return ngx_http_output_filter(r, &out);
+    if (rc != NGX_DONE) {
+        ngx_http_finalize_request(r, rc);
+    }
+
+    ngx_http_run_posted_requests(c);
 }
 
 
@@ -911,6 +2177,8 @@ ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
     fcn = c->node;
     fcn->count--;
 
+    ngx_http_file_cache_clear_writing(cache, c);
+
     if (c->updating) {
         fcn->updating = 0;
     }
@@ -924,6 +2192,7 @@ ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
         }
 
     } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
+        ngx_http_file_cache_untag(cache, fcn);
         ngx_queue_remove(&fcn->queue);
         ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
         ngx_slab_free_locked(cache->shpool, fcn);
@@ -963,6 +2232,10 @@ ngx_http_file_cache_cleanup(void *data)
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
                    "http file cache cleanup");
 
+    if (c->partial_event.timer_set) {
+        ngx_del_timer(&c->partial_event);
+    }
+
     if (c->updating) {
         ngx_log_error(NGX_LOG_ALERT, c->file.log, 0,
                       "stalled cache updating, error:%ui", c->error);
@@ -973,7 +2246,7 @@ ngx_http_file_cache_cleanup(void *data)
 
 
 static time_t
-ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
+ngx_http_file_cache_forced_expire(ngx_http_file_cache_disk_t *disk)
 {
     u_char                      *name;
     size_t                       len;
@@ -981,12 +2254,14 @@ ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
     ngx_uint_t                   tries;
     ngx_path_t                  *path;
     ngx_queue_t                 *q;
+    ngx_http_file_cache_t       *cache;
     ngx_http_file_cache_node_t  *fcn;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache forced expire");
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache forced expire, disk: %ui", disk->index);
 
-    path = cache->path;
+    cache = disk->cache;
+    path = disk->path;
     len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
 
     name = ngx_alloc(len + 1, ngx_cycle->log);
@@ -1001,8 +2276,8 @@ ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
 
     ngx_shmtx_lock(&cache->shpool->mutex);
 
-    for (q = ngx_queue_last(&cache->sh->queue);
-         q != ngx_queue_sentinel(&cache->sh->queue);
+    for (q = ngx_queue_last(&disk->sh->queue);
+         q != ngx_queue_sentinel(&disk->sh->queue);
          q = ngx_queue_prev(q))
     {
         fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
@@ -1013,7 +2288,7 @@ ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
                   fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
 
         if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
+            ngx_http_file_cache_delete(disk, q, name);
             wait = 0;
 
         } else {
@@ -1036,178 +2311,489 @@ ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
 
 
 static time_t
-ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
+ngx_http_file_cache_expire(ngx_http_file_cache_disk_t *disk)
 {
     u_char                      *name, *p;
     size_t                       len;
     time_t                       now, wait;
     ngx_path_t                  *path;
     ngx_queue_t                 *q;
+    ngx_http_file_cache_t       *cache;
     ngx_http_file_cache_node_t  *fcn;
     u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache expire");
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache expire, disk: %ui", disk->index);
+
+    cache = disk->cache;
+    path = disk->path;
+    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+
+    name = ngx_alloc(len + 1, ngx_cycle->log);
+    if (name == NULL) {
+        return 10;
+    }
+
+    ngx_memcpy(name, path->name.data, path->name.len);
+
+    now = ngx_time();
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    for ( ;; ) {
+
+        if (ngx_queue_empty(&disk->sh->queue)) {
+            wait = 10;
+            break;
+        }
+
+        q = ngx_queue_last(&disk->sh->queue);
+
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        wait = fcn->expire - now;
+
+        if (wait > 0) {
+            wait = wait > 10 ? 10 : wait;
+            break;
+        }
+
+        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache expire: #%d %d %02xd%02xd%02xd%02xd",
+                       fcn->count, fcn->exists,
+                       fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+
+        if (fcn->count == 0) {
+            ngx_http_file_cache_delete(disk, q, name);
+            continue;
+        }
+
+        if (fcn->deleting) {
+            wait = 1;
+            break;
+        }
+
+        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        (void) ngx_hex_dump(p, fcn->key, len);
+
+        /*
+         * abnormally exited workers may leave locked cache entries,
+         * and although it may be safe to remove them completely,
+         * we prefer to remove them from inactive queue and rbtree
+         * only, and to allow other leaks
+         */
+
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
+        ngx_http_file_cache_untag(cache, fcn);
+
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "ignore long locked inactive cache entry %*s, count:%d",
+                      2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_free(name);
+
+    return wait;
+}
+
+
+static void
+ngx_http_file_cache_delete(ngx_http_file_cache_disk_t *disk, ngx_queue_t *q,
+    u_char *name)
+{
+    u_char                      *p;
+    size_t                       len;
+    ngx_path_t                  *path;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_node_t  *fcn;
+
+    cache = disk->cache;
+
+    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+    if (fcn->exists) {
+        disk->sh->size -= fcn->fs_size;
+
+        path = disk->path;
+        p = name + path->name.len + 1 + path->len;
+        p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        p = ngx_hex_dump(p, fcn->key, len);
+        *p = '\0';
+
+        fcn->count++;
+        fcn->deleting = 1;
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+        ngx_create_hashed_filename(path, name, len);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache expire: \"%s\"", name);
+
+        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed", name);
+        }
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+        fcn->count--;
+        fcn->deleting = 0;
+    }
+
+    if (fcn->count == 0) {
+        ngx_http_file_cache_untag(cache, fcn);
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
+        ngx_slab_free_locked(cache->shpool, fcn);
+    }
+}
+
+
+/*
+ * the entries of a surrogate key are found through the key links only,
+ * so the time is proportional to the number of the purged entries;
+ * the entries are left in the tree as not existing ones to be refreshed
+ * by the next request or to be expired by the manager
+ */
+
+ngx_int_t
+ngx_http_file_cache_purge_tag(ngx_http_file_cache_t *cache, ngx_str_t *tag,
+    ngx_pool_t *pool, ngx_uint_t *purged)
+{
+    u_char                          *p, *name;
+    size_t                           len;
+    uint32_t                         hash;
+    ngx_int_t                        rc;
+    ngx_uint_t                       i, n;
+    ngx_path_t                      *path;
+    ngx_array_t                      files;
+    ngx_queue_t                     *q;
+    ngx_http_file_cache_tag_t       *fct;
+    ngx_http_file_cache_disk_t      *disk;
+    ngx_http_file_cache_node_t      *fcn, **nodes;
+    ngx_http_file_cache_tag_link_t  *link;
+
+    *purged = 0;
+
+    if (tag->len == 0 || tag->len > NGX_HTTP_FILE_CACHE_TAG_LEN) {
+        return NGX_DECLINED;
+    }
+
+    if (ngx_array_init(&files, pool, 16, sizeof(ngx_http_file_cache_node_t *))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    hash = ngx_crc32_short(tag->data, tag->len);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fct = ngx_http_file_cache_lookup_tag(cache, tag, hash);
+
+    if (fct == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    rc = NGX_OK;
+    n = 0;
+
+    while (!ngx_queue_empty(&fct->links)) {
+
+        q = ngx_queue_head(&fct->links);
+        link = ngx_queue_data(q, ngx_http_file_cache_tag_link_t, tag_queue);
+
+        fcn = link->node;
+
+        if (fcn->exists && !fcn->deleting) {
+            nodes = ngx_array_push(&files);
+            if (nodes == NULL) {
+                rc = NGX_ERROR;
+                break;
+            }
+
+            *nodes = fcn;
+
+            disk = &cache->disks[fcn->disk];
+            disk->sh->size -= fcn->fs_size;
+
+            fcn->fs_size = 0;
+            fcn->exists = 0;
+
+            /* the file is removed outside of the lock as in expiration */
+
+            fcn->count++;
+            fcn->deleting = 1;
+        }
+
+        ngx_queue_remove(&link->tag_queue);
+        ngx_queue_remove(&link->node_queue);
+        ngx_slab_free_locked(cache->shpool, link);
+
+        n++;
+    }
+
+    if (ngx_queue_empty(&fct->links)) {
+        ngx_rbtree_delete(&cache->sh->tags, &fct->node);
+        ngx_slab_free_locked(cache->shpool, fct);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    nodes = files.elts;
+
+    for (i = 0; i < files.nelts; i++) {
+        fcn = nodes[i];
+
+        path = cache->disks[fcn->disk].path;
+        len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+
+        name = ngx_pnalloc(pool, len + 1);
+
+        if (name) {
+            ngx_memcpy(name, path->name.data, path->name.len);
+
+            p = name + path->name.len + 1 + path->len;
+            p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
+                             sizeof(ngx_rbtree_key_t));
+            p = ngx_hex_dump(p, fcn->key,
+                             NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+            *p = '\0';
+
+            ngx_create_hashed_filename(path, name, len);
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                           "http file cache purge: \"%s\"", name);
+
+            if (ngx_delete_file(name) == NGX_FILE_ERROR) {
+                ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                              ngx_delete_file_n " \"%s\" failed", name);
+            }
+
+        } else {
+            rc = NGX_ERROR;
+        }
+    }
+
+    if (files.nelts) {
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        for (i = 0; i < files.nelts; i++) {
+            nodes[i]->count--;
+            nodes[i]->deleting = 0;
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+    }
+
+    *purged = n;
+
+    return rc;
+}
+
+
+/*
+ * the slots map the first byte of a key to a disk, the disks are
+ * interleaved in the smooth weighted round robin order
+ */
+
+static void
+ngx_http_file_cache_set_slots(ngx_http_file_cache_t *cache)
+{
+    ngx_int_t                  total;
+    ngx_uint_t                 i, n, best;
+    ngx_http_file_cache_sh_t  *sh;
+    ngx_int_t                  current[NGX_HTTP_FILE_CACHE_MAX_DISKS];
 
-    path = cache->path;
-    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+    sh = cache->sh;
 
-    name = ngx_alloc(len + 1, ngx_cycle->log);
-    if (name == NULL) {
-        return 10;
+    if (cache->ndisks == 1) {
+        ngx_memzero(sh->slots, NGX_HTTP_FILE_CACHE_DISK_SLOTS);
+        return;
     }
 
-    ngx_memcpy(name, path->name.data, path->name.len);
+    total = 0;
 
-    now = ngx_time();
+    for (i = 0; i < cache->ndisks; i++) {
+        current[i] = 0;
+        total += sh->disks[i].weight;
+    }
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    for (n = 0; n < NGX_HTTP_FILE_CACHE_DISK_SLOTS; n++) {
 
-    for ( ;; ) {
+        best = 0;
 
-        if (ngx_queue_empty(&cache->sh->queue)) {
-            wait = 10;
-            break;
+        for (i = 0; i < cache->ndisks; i++) {
+            current[i] += sh->disks[i].weight;
+
+            if (current[i] > current[best]) {
+                best = i;
+            }
         }
 
-        q = ngx_queue_last(&cache->sh->queue);
+        current[best] -= total;
 
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+        sh->slots[n] = (u_char) best;
+    }
+}
 
-        wait = fcn->expire - now;
 
-        if (wait > 0) {
-            wait = wait > 10 ? 10 : wait;
-            break;
-        }
+/*
+ * the disk latencies are averaged over the manager runs, and the disks
+ * which are more than twice slower than the fastest one get proportionally
+ * less new cache entries
+ */
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache expire: #%d %d %02xd%02xd%02xd%02xd",
-                       fcn->count, fcn->exists,
-                       fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+static void
+ngx_http_file_cache_disk_weights(ngx_http_file_cache_t *cache)
+{
+    ngx_uint_t                      i, n, min, latency, sample, changed;
+    ngx_uint_t                      reads, read_time, writes, write_time;
+    ngx_http_file_cache_disk_t     *disk;
+    ngx_http_file_cache_disk_sh_t  *sh;
+    ngx_uint_t                      weights[NGX_HTTP_FILE_CACHE_MAX_DISKS];
 
-        if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
-            continue;
-        }
+    min = 0;
 
-        if (fcn->deleting) {
-            wait = 1;
-            break;
-        }
+    for (i = 0; i < cache->ndisks; i++) {
+        disk = &cache->disks[i];
+        sh = disk->sh;
 
-        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        (void) ngx_hex_dump(p, fcn->key, len);
+        reads = sh->reads;
+        read_time = sh->read_time;
+        writes = sh->writes;
+        write_time = sh->write_time;
 
-        /*
-         * abnormally exited workers may leave locked cache entries,
-         * and although it may be safe to remove them completely,
-         * we prefer to remove them from inactive queue and rbtree
-         * only, and to allow other leaks
-         */
+        n = reads - disk->reads;
 
-        ngx_queue_remove(q);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
+        if (n) {
+            sample = (read_time - disk->read_time) / n;
 
-        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                      "ignore long locked inactive cache entry %*s, count:%d",
-                      2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
-    }
+            sh->read_latency = sh->read_latency
+                               ? (3 * sh->read_latency + sample) / 4 : sample;
+        }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+        n = writes - disk->writes;
 
-    ngx_free(name);
+        if (n) {
+            sample = (write_time - disk->write_time) / n;
 
-    return wait;
-}
+            sh->write_latency = sh->write_latency
+                               ? (3 * sh->write_latency + sample) / 4 : sample;
+        }
 
+        disk->reads = reads;
+        disk->read_time = read_time;
+        disk->writes = writes;
+        disk->write_time = write_time;
 
-static void
-ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
-    u_char *name)
-{
-    u_char                      *p;
-    size_t                       len;
-    ngx_path_t                  *path;
-    ngx_http_file_cache_node_t  *fcn;
+        latency = ngx_max(sh->read_latency, sh->write_latency);
 
-    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+        if (latency && (min == 0 || latency < min)) {
+            min = latency;
+        }
 
-    if (fcn->exists) {
-        cache->sh->size -= fcn->fs_size;
+        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache disk %ui, reads: %ui %uius, "
+                       "writes: %ui %uius, weight: %ui",
+                       i, reads, sh->read_latency,
+                       writes, sh->write_latency, sh->weight);
+    }
 
-        path = cache->path;
-        p = name + path->name.len + 1 + path->len;
-        p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        p = ngx_hex_dump(p, fcn->key, len);
-        *p = '\0';
+    changed = 0;
 
-        fcn->count++;
-        fcn->deleting = 1;
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+    for (i = 0; i < cache->ndisks; i++) {
+        disk = &cache->disks[i];
+        sh = disk->sh;
 
-        len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
-        ngx_create_hashed_filename(path, name, len);
+        latency = ngx_max(sh->read_latency, sh->write_latency);
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache expire: \"%s\"", name);
+        weights[i] = disk->weight;
 
-        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
-            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
-                          ngx_delete_file_n " \"%s\" failed", name);
+        if (min && latency > 2 * min) {
+            weights[i] = disk->weight * 2 * min / latency;
+
+            if (weights[i] == 0) {
+                weights[i] = 1;
+            }
         }
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
-        fcn->count--;
-        fcn->deleting = 0;
+        if (weights[i] != sh->weight) {
+            ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                          "http file cache: %V weight %ui, "
+                          "read latency: %uius, write latency: %uius",
+                          &disk->path->name, weights[i],
+                          sh->read_latency, sh->write_latency);
+            changed = 1;
+        }
     }
 
-    if (fcn->count == 0) {
-        ngx_queue_remove(q);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
+    if (!changed) {
+        return;
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    for (i = 0; i < cache->ndisks; i++) {
+        cache->disks[i].sh->weight = weights[i];
     }
+
+    ngx_http_file_cache_set_slots(cache);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 }
 
 
 static time_t
 ngx_http_file_cache_manager(void *data)
 {
-    ngx_http_file_cache_t  *cache = data;
+    ngx_http_file_cache_disk_t  *disk = data;
+
+    off_t                   size;
+    time_t                  next, wait;
+    ngx_http_file_cache_t  *cache;
 
-    off_t   size;
-    time_t  next, wait;
+    cache = disk->cache;
 
-    next = ngx_http_file_cache_expire(cache);
+    if (disk->index == 0 && cache->ndisks > 1) {
+        ngx_http_file_cache_disk_weights(cache);
+    }
+
+    next = ngx_http_file_cache_expire(disk);
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+    disk->last = ngx_current_msec;
+    disk->files = 0;
 
     for ( ;; ) {
         ngx_shmtx_lock(&cache->shpool->mutex);
 
-        size = cache->sh->size;
+        size = disk->sh->size;
 
         ngx_shmtx_unlock(&cache->shpool->mutex);
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache size: %O", size);
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache size: %O, disk: %ui",
+                       size, disk->index);
 
-        if (size < cache->max_size) {
+        if (size < disk->max_size) {
             return next;
         }
 
-        wait = ngx_http_file_cache_forced_expire(cache);
+        wait = ngx_http_file_cache_forced_expire(disk);
 
         if (wait > 0) {
             return wait;
         }
 
-        if (ngx_http_file_cache_manager_sleep(cache) != NGX_OK) {
+        if (ngx_http_file_cache_manager_sleep(disk) != NGX_OK) {
             return next;
         }
     }
@@ -1217,15 +2803,15 @@ ngx_http_file_cache_manager(void *data)
 static void
 ngx_http_file_cache_loader(void *data)
 {
-    ngx_http_file_cache_t  *cache = data;
+    ngx_http_file_cache_disk_t  *disk = data;
 
     ngx_tree_ctx_t  tree;
 
-    if (!cache->sh->cold || cache->sh->loading) {
+    if (!disk->sh->cold || disk->sh->loading) {
         return;
     }
 
-    if (!ngx_atomic_cmp_set(&cache->sh->loading, 0, ngx_pid)) {
+    if (!ngx_atomic_cmp_set(&disk->sh->loading, 0, ngx_pid)) {
         return;
     }
 
@@ -1237,39 +2823,39 @@ ngx_http_file_cache_loader(void *data)
     tree.pre_tree_handler = ngx_http_file_cache_noop;
     tree.post_tree_handler = ngx_http_file_cache_noop;
     tree.spec_handler = ngx_http_file_cache_delete_file;
-    tree.data = cache;
+    tree.data = disk;
     tree.alloc = 0;
     tree.log = ngx_cycle->log;
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+    disk->last = ngx_current_msec;
+    disk->files = 0;
 
-    if (ngx_walk_tree(&tree, &cache->path->name) == NGX_ABORT) {
-        cache->sh->loading = 0;
+    if (ngx_walk_tree(&tree, &disk->path->name) == NGX_ABORT) {
+        disk->sh->loading = 0;
         return;
     }
 
-    cache->sh->cold = 0;
-    cache->sh->loading = 0;
+    disk->sh->cold = 0;
+    disk->sh->loading = 0;
 
     ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
                   "http file cache: %V %.3fM, bsize: %uz",
-                  &cache->path->name,
-                  ((double) cache->sh->size * cache->bsize) / (1024 * 1024),
-                  cache->bsize);
+                  &disk->path->name,
+                  ((double) disk->sh->size * disk->bsize) / (1024 * 1024),
+                  disk->bsize);
 }
 
 
 static ngx_int_t
-ngx_http_file_cache_manager_sleep(ngx_http_file_cache_t *cache)
+ngx_http_file_cache_manager_sleep(ngx_http_file_cache_disk_t *disk)
 {
     ngx_msec_t  elapsed;
 
-    if (cache->files++ > 100) {
+    if (disk->files++ > 100) {
 
         ngx_time_update();
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - disk->last));
 
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
                        "http file cache manager time: %M", elapsed);
@@ -1287,8 +2873,8 @@ ngx_http_file_cache_manager_sleep(ngx_http_file_cache_t *cache)
             ngx_time_update();
         }
 
-        cache->last = ngx_current_msec;
-        cache->files = 0;
+        disk->last = ngx_current_msec;
+        disk->files = 0;
     }
 
     return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
@@ -1305,26 +2891,41 @@ ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
 static ngx_int_t
 ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
 {
-    ngx_http_file_cache_t  *cache;
+    ngx_str_t                   *temp;
+    ngx_http_file_cache_disk_t  *disk;
+
+    disk = ctx->data;
+
+    if (disk->temp_path) {
+
+        /* skip the files being written by workers to the disk temp path */
+
+        temp = &disk->temp_path->name;
 
-    cache = ctx->data;
+        if (path->len > temp->len
+            && path->data[temp->len] == '/'
+            && ngx_strncmp(path->data, temp->data, temp->len) == 0)
+        {
+            return NGX_OK;
+        }
+    }
 
     if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
         (void) ngx_http_file_cache_delete_file(ctx, path);
     }
 
-    return ngx_http_file_cache_manager_sleep(cache);
+    return ngx_http_file_cache_manager_sleep(disk);
 }
 
 
 static ngx_int_t
 ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
 {
-    u_char                 *p;
-    ngx_int_t               n;
-    ngx_uint_t              i;
-    ngx_http_cache_t        c;
-    ngx_http_file_cache_t  *cache;
+    u_char                      *p;
+    ngx_int_t                    n;
+    ngx_uint_t                   i;
+    ngx_http_cache_t             c;
+    ngx_http_file_cache_disk_t  *disk;
 
     if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
         return NGX_ERROR;
@@ -1337,10 +2938,10 @@ ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
     }
 
     ngx_memzero(&c, sizeof(ngx_http_cache_t));
-    cache = ctx->data;
+    disk = ctx->data;
 
     c.length = ctx->size;
-    c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
+    c.fs_size = (ctx->fs_size + disk->bsize - 1) / disk->bsize;
 
     p = &name->data[name->len - 2 * NGX_HTTP_CACHE_KEY_LEN];
 
@@ -1356,15 +2957,18 @@ ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
         c.key[i] = (u_char) n;
     }
 
-    return ngx_http_file_cache_add(cache, &c);
+    return ngx_http_file_cache_add(disk, &c);
 }
 
 
 static ngx_int_t
-ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+ngx_http_file_cache_add(ngx_http_file_cache_disk_t *disk, ngx_http_cache_t *c)
 {
+    ngx_http_file_cache_t       *cache;
     ngx_http_file_cache_node_t  *fcn;
 
+    cache = disk->cache;
+
     ngx_shmtx_lock(&cache->shpool->mutex);
 
     fcn = ngx_http_file_cache_lookup(cache, c->key);
@@ -1385,6 +2989,8 @@ ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 
         ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
 
+        ngx_queue_init(&fcn->tags);
+
         fcn->uses = 1;
         fcn->count = 0;
         fcn->valid_msec = 0;
@@ -1396,8 +3002,33 @@ ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
         fcn->valid_sec = 0;
         fcn->body_start = 0;
         fcn->fs_size = c->fs_size;
+        fcn->disk = disk->index;
+        fcn->writing = 0;
+        fcn->temp_name = NULL;
+        fcn->write_gen = 0;
+
+        disk->sh->size += c->fs_size;
+
+    } else if (fcn->disk != disk->index) {
+
+        /*
+         * the entry is known on another disk: a copy left there after
+         * the disks weights were changed is removed, while an entry
+         * which is not yet stored is moved to the disk the file is on
+         */
+
+        if (fcn->exists || fcn->count) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return NGX_ERROR;
+        }
+
+        ngx_queue_remove(&fcn->queue);
+
+        fcn->exists = 1;
+        fcn->fs_size = c->fs_size;
+        fcn->disk = disk->index;
 
-        cache->sh->size += c->fs_size;
+        disk->sh->size += c->fs_size;
 
     } else {
         ngx_queue_remove(&fcn->queue);
@@ -1405,7 +3036,7 @@ ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 
     fcn->expire = ngx_time() + cache->inactive;
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    ngx_queue_insert_head(&disk->sh->queue, &fcn->queue);
 
     ngx_shmtx_unlock(&cache->shpool->mutex);
 
@@ -1457,13 +3088,16 @@ ngx_http_file_cache_valid(ngx_array_t *cache_valid, ngx_uint_t status)
 char *
 ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    off_t                   max_size;
-    u_char                 *last, *p;
-    time_t                  inactive;
-    ssize_t                 size;
-    ngx_str_t               s, name, *value;
-    ngx_uint_t              i, n;
-    ngx_http_file_cache_t  *cache;
+    off_t                        max_size, largest;
+    u_char                      *last, *p;
+    time_t                       inactive;
+    ssize_t                      size;
+    ngx_str_t                    s, name, *value;
+    ngx_uint_t                   i, n;
+    ngx_path_t                  *path;
+    ngx_array_t                 *disks;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_disk_t  *disk;
 
     cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_file_cache_t));
     if (cache == NULL) {
@@ -1475,6 +3109,20 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    disks = ngx_array_create(cf->pool, 1, sizeof(ngx_http_file_cache_disk_t));
+    if (disks == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    disk = ngx_array_push(disks);
+    if (disk == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(disk, sizeof(ngx_http_file_cache_disk_t));
+
+    disk->path = cache->path;
+
     inactive = 600;
 
     name.len = 0;
@@ -1589,6 +3237,82 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "disk=", 5) == 0) {
+
+            if (disks->nelts == NGX_HTTP_FILE_CACHE_MAX_DISKS) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "too many disks, maximum is %d",
+                                   NGX_HTTP_FILE_CACHE_MAX_DISKS);
+                return NGX_CONF_ERROR;
+            }
+
+            disk = ngx_array_push(disks);
+            if (disk == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            ngx_memzero(disk, sizeof(ngx_http_file_cache_disk_t));
+
+            disk->path = ngx_pcalloc(cf->pool, sizeof(ngx_path_t));
+            if (disk->path == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            disk->max_size = NGX_MAX_OFF_T_VALUE;
+
+            /*
+             * "disk=path[:max_size]", the colon after a drive letter
+             * is not treated as the size delimiter
+             */
+
+            p = value[i].data + 5;
+            last = value[i].data + value[i].len;
+
+            while (last > p + 2 && *(last - 1) != ':') {
+                last--;
+            }
+
+            if (last > p + 2) {
+                s.len = value[i].data + value[i].len - last;
+                s.data = last;
+
+                disk->max_size = ngx_parse_offset(&s);
+                if (disk->max_size < 0) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                       "invalid disk max_size \"%V\"",
+                                       &value[i]);
+                    return NGX_CONF_ERROR;
+                }
+
+                last--;
+
+            } else {
+                last = value[i].data + value[i].len;
+            }
+
+            disk->path->name.len = last - p;
+            disk->path->name.data = p;
+
+            if (disk->path->name.len
+                && disk->path->name.data[disk->path->name.len - 1] == '/')
+            {
+                disk->path->name.len--;
+            }
+
+            if (disk->path->name.len == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid disk \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (ngx_conf_full_name(cf->cycle, &disk->path->name, 0) != NGX_OK)
+            {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[i]);
         return NGX_CONF_ERROR;
@@ -1601,14 +3325,106 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
-    cache->path->manager = ngx_http_file_cache_manager;
-    cache->path->loader = ngx_http_file_cache_loader;
-    cache->path->data = cache;
+    disk = disks->elts;
+    disk[0].max_size = max_size;
 
-    if (ngx_add_path(cf, &cache->path) != NGX_OK) {
-        return NGX_CONF_ERROR;
+    cache->disks = disk;
+    cache->ndisks = disks->nelts;
+
+    /*
+     * the disks get new cache entries in proportion to their max_size
+     * if all sizes are limited, and evenly otherwise
+     */
+
+    largest = 0;
+
+    for (i = 0; i < cache->ndisks; i++) {
+        if (disk[i].max_size == NGX_MAX_OFF_T_VALUE) {
+            largest = 0;
+            break;
+        }
+
+        if (disk[i].max_size > largest) {
+            largest = disk[i].max_size;
+        }
+    }
+
+    for (i = 0; i < cache->ndisks; i++) {
+
+        for (n = 0; n < i; n++) {
+            if (ngx_strcmp(disk[i].path->name.data, disk[n].path->name.data)
+                == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "duplicate cache disk \"%V\"",
+                                   &disk[i].path->name);
+                return NGX_CONF_ERROR;
+            }
+        }
+
+        disk[i].cache = cache;
+        disk[i].index = i;
+
+        if (largest) {
+            disk[i].weight = (ngx_uint_t) (disk[i].max_size * 100 / largest);
+
+            if (disk[i].weight == 0) {
+                disk[i].weight = 1;
+            }
+
+        } else {
+            disk[i].weight = 100;
+        }
+
+        path = disk[i].path;
+
+        if (i) {
+            ngx_memcpy(path->level, cache->path->level, sizeof(path->level));
+            path->len = cache->path->len;
+        }
+
+        path->manager = ngx_http_file_cache_manager;
+        path->loader = ngx_http_file_cache_loader;
+        path->data = &disk[i];
+
+        if (ngx_add_path(cf, &disk[i].path) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+
+        if (cache->ndisks == 1) {
+            continue;
+        }
+
+        /*
+         * the responses are stored to a temporary directory on the same
+         * disk, so that the cache files are renamed but never copied
+         */
+
+        path = ngx_pcalloc(cf->pool, sizeof(ngx_path_t));
+        if (path == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        path->name.len = disk[i].path->name.len + sizeof("/temp") - 1;
+        path->name.data = ngx_pnalloc(cf->pool, path->name.len + 1);
+        if (path->name.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_sprintf(path->name.data, "%V/temp%Z", &disk[i].path->name);
+
+        path->conf_file = cf->conf_file->file.name.data;
+        path->line = cf->conf_file->line;
+
+        if (ngx_add_path(cf, &path) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+
+        disk[i].temp_path = path;
     }
 
+    cache->path = disk[0].path;
+
     cache->shm_zone = ngx_shared_memory_add(cf, &name, size, cmd->post);
     if (cache->shm_zone == NULL) {
         return NGX_CONF_ERROR;
@@ -1625,7 +3441,6 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->shm_zone->data = cache;
 
     cache->inactive = inactive;
-    cache->max_size = max_size;
 
     return NGX_CONF_OK;
 }
@@ -1771,3 +3586,40 @@ ngx_http_no_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     return NGX_CONF_OK;
 }
+
+
+ngx_http_file_cache_t *
+ngx_http_file_cache_zone(ngx_conf_t *cf, ngx_str_t *name)
+{
+    ngx_uint_t        i;
+    ngx_shm_zone_t   *shm_zone;
+    ngx_list_part_t  *part;
+
+    part = &cf->cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        if (shm_zone[i].init != ngx_http_file_cache_init) {
+            continue;
+        }
+
+        if (name->len == shm_zone[i].shm.name.len
+            && ngx_strncmp(name->data, shm_zone[i].shm.name.data, name->len)
+               == 0)
+        {
+            return shm_zone[i].data;
+        }
+    }
+
+    return NULL;
+}
@@ -29,8 +29,6 @@ static ngx_int_t ngx_http_process_user_agent(ngx_http_request_t *r,
 static ngx_int_t ngx_http_process_cookie(ngx_http_request_t *r,
     ngx_table_elt_t *h, ngx_uint_t offset);
 
-static ngx_int_t ngx_http_process_request_header(ngx_http_request_t *r);
-static void ngx_http_process_request(ngx_http_request_t *r);
 static ssize_t ngx_http_validate_host(ngx_http_request_t *r, u_char **host,
     size_t len, ngx_uint_t alloc);
 static ngx_int_t ngx_http_find_virtual_server(ngx_http_request_t *r,
@@ -50,13 +48,9 @@ static void ngx_http_set_lingering_close(ngx_http_request_t *r);
 static void ngx_http_lingering_close_handler(ngx_event_t *ev);
 static ngx_int_t ngx_http_post_action(ngx_http_request_t *r);
 static void ngx_http_close_request(ngx_http_request_t *r, ngx_int_t error);
-static void ngx_http_free_request(ngx_http_request_t *r, ngx_int_t error);
 static void ngx_http_log_request(ngx_http_request_t *r);
-static void ngx_http_close_connection(ngx_connection_t *c);
 
 static u_char *ngx_http_log_error(ngx_log_t *log, u_char *buf, size_t len);
-static u_char *ngx_http_log_error_handler(ngx_http_request_t *r,
-    ngx_http_request_t *sr, u_char *buf, size_t len);
 
 #if (NGX_HTTP_SSL)
 static void ngx_http_ssl_handshake(ngx_event_t *rev);
@@ -137,6 +131,9 @@ ngx_http_header_t  ngx_http_headers_in[] = {
     { ngx_string("Keep-Alive"), offsetof(ngx_http_headers_in_t, keep_alive),
                  ngx_http_process_header_line },
 
+    { ngx_string("Upgrade"), offsetof(ngx_http_headers_in_t, upgrade),
+                 ngx_http_process_unique_header_line },
+
 #if (NGX_HTTP_PROXY || NGX_HTTP_REALIP || NGX_HTTP_GEO)
     { ngx_string("X-Forwarded-For"),
                  offsetof(ngx_http_headers_in_t, x_forwarded_for),
@@ -405,6 +402,10 @@ ngx_http_init_request(ngx_event_t *rev)
 	/*δΪַaddr:portƥserver configӶȷá
 	nginx֧ȷr->virtual_namesǸaddr:portӦ飬
 	HOSTƥӦӶȷյá*/
+#if (NGX_HTTP_V2)
+    hc->http2 = addr_conf->http2;
+#endif
+
     rev->handler = ngx_http_process_request_line; //  Ӷ¼handlerΪngx_http_process_request_line
     r->read_event_handler = ngx_http_block_reading;
 
@@ -440,6 +441,20 @@ ngx_http_init_request(ngx_event_t *rev)
 
         r->main_filter_need_in_memory = 1;
     }
+
+#if (NGX_HTTP_V2)
+    if (addr_conf->http2 && !sscf->enable && !addr_conf->ssl) {
+        ngx_http_v2_init(rev);
+        return;
+    }
+#endif
+    }
+
+#elif (NGX_HTTP_V2)
+
+    if (addr_conf->http2) {
+        ngx_http_v2_init(rev);
+        return;
     }
 
 #endif
@@ -632,6 +647,20 @@ ngx_http_ssl_handshake_handler(ngx_connection_t *c)
 
         c->ssl->no_wait_shutdown = 1;
 
+#if (NGX_HTTP_V2 && defined TLSEXT_TYPE_application_layer_protocol_negotiation)
+        {
+        unsigned int          len;
+        const unsigned char  *data;
+
+        SSL_get0_alpn_selected(c->ssl->connection, &data, &len);
+
+        if (len == 2 && data[0] == 'h' && data[1] == '2') {
+            ngx_http_v2_init(c->read);
+            return;
+        }
+        }
+#endif
+
         c->read->handler = ngx_http_process_request_line;
         /* STUB: epoll edge */ c->write->handler = ngx_http_empty_handler;
 
@@ -654,6 +683,7 @@ ngx_http_ssl_servername(ngx_ssl_conn_t *ssl_conn, int *ad, void *arg)
 {
     size_t                    len;
     u_char                   *host;
+    ngx_str_t                 name;
     const char               *servername;
     ngx_connection_t         *c;
     ngx_http_request_t       *r;
@@ -693,6 +723,15 @@ ngx_http_ssl_servername(ngx_ssl_conn_t *ssl_conn, int *ad, void *arg)
 
     sscf = ngx_http_get_module_srv_conf(r, ngx_http_ssl_module);
 
+    if (sscf->certificate_cache) {
+        name.len = len;
+        name.data = host;
+
+        if (ngx_http_ssl_certificate(ssl_conn, sscf, &name, c->log) == NGX_OK) {
+            return SSL_TLSEXT_ERR_OK;
+        }
+    }
+
     SSL_set_SSL_CTX(ssl_conn, sscf->ssl.ctx);
 
     return SSL_TLSEXT_ERR_OK;
@@ -706,12 +745,11 @@ ngx_http_ssl_servername(ngx_ssl_conn_t *ssl_conn, int *ad, void *arg)
 static void
 ngx_http_process_request_line(ngx_event_t *rev)
 {
-    u_char                    *host;
-    ssize_t                    n;
-    ngx_int_t                  rc, rv;
-    ngx_connection_t          *c;
-    ngx_http_request_t        *r;
-    ngx_http_core_srv_conf_t  *cscf;
+    u_char              *host;
+    ssize_t              n;
+    ngx_int_t            rc, rv;
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
 	//revлȡԼ
 
     c = rev->data;
@@ -741,124 +779,41 @@ ngx_http_process_request_line(ngx_event_t *rev)
                 return;
             }
         }
-		/*״̬*/
-        rc = ngx_http_parse_request_line(r, r->header_in);
-
-        if (rc == NGX_OK) {
-
-            /* the request line has been parsed successfully */
-
-            r->request_line.len = r->request_end - r->request_start;
-            r->request_line.data = r->request_start;
-
-
-            if (r->args_start) {
-                r->uri.len = r->args_start - 1 - r->uri_start;
-            } else {
-                r->uri.len = r->uri_end - r->uri_start;
-            }
 
+#if (NGX_HTTP_V2)
 
-            if (r->complex_uri || r->quoted_uri) {
-
-                r->uri.data = ngx_pnalloc(r->pool, r->uri.len + 1);
-                if (r->uri.data == NULL) {
-                    ngx_http_close_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
-                    return;
-                }
-
-                cscf = ngx_http_get_module_srv_conf(r, ngx_http_core_module);
-
-                rc = ngx_http_parse_complex_uri(r, cscf->merge_slashes);
-
-                if (rc == NGX_HTTP_PARSE_INVALID_REQUEST) {
-                    ngx_log_error(NGX_LOG_INFO, c->log, 0,
-                                  "client sent invalid request");
-                    ngx_http_finalize_request(r, NGX_HTTP_BAD_REQUEST);
-                    return;
-                }
-
-            } else {
-                r->uri.data = r->uri_start;
-            }
-
-
-            r->unparsed_uri.len = r->uri_end - r->uri_start;
-            r->unparsed_uri.data = r->uri_start;
-
-            r->valid_unparsed_uri = r->space_in_uri ? 0 : 1;
-
-            r->method_name.len = r->method_end - r->request_start + 1;
-            r->method_name.data = r->request_line.data;
-
-
-            if (r->http_protocol.data) {
-                r->http_protocol.len = r->request_end - r->http_protocol.data;
-            }
-
-
-            if (r->uri_ext) {
-                if (r->args_start) {
-                    r->exten.len = r->args_start - 1 - r->uri_ext;
-                } else {
-                    r->exten.len = r->uri_end - r->uri_ext;
-                }
-
-                r->exten.data = r->uri_ext;
-            }
-
-
-            if (r->args_start && r->uri_end > r->args_start) {
-                r->args.len = r->uri_end - r->args_start;
-                r->args.data = r->args_start;
-            }
-
-#if (NGX_WIN32)
-            {
-            u_char  *p;
+        /*
+         * an HTTP/2 client that has not used ALPN, e.g. with OpenSSL
+         * lacking ALPN support, starts with the connection preface
+         */
 
-            p = r->uri.data + r->uri.len - 1;
+        if (r->http_connection->http2
+            && c->requests == 1
+            && (size_t) (r->header_in->last - r->header_in->start)
+               >= sizeof(NGX_HTTP_V2_PREFACE_START) - 1
+            && ngx_strncmp(r->header_in->start, NGX_HTTP_V2_PREFACE_START,
+                           sizeof(NGX_HTTP_V2_PREFACE_START) - 1)
+               == 0)
+        {
+            ngx_http_v2_init(rev);
+            return;
+        }
 
-            while (p > r->uri.data) {
+#endif
 
-                if (*p == ' ') {
-                    p--;
-                    continue;
-                }
+        rc = ngx_http_parse_request_line(r, r->header_in);
 
-                if (*p == '.') {
-                    p--;
-                    continue;
-                }
+        if (rc == NGX_OK) {
 
-                if (ngx_strncasecmp(p - 6, (u_char *) "::$data", 7) == 0) {
-                    p -= 7;
-                    continue;
-                }
+            /* the request line has been parsed successfully */
 
-                break;
-            }
+            r->request_line.len = r->request_end - r->request_start;
+            r->request_line.data = r->request_start;
 
-            if (p != r->uri.data + r->uri.len - 1) {
-                r->uri.len = p + 1 - r->uri.data;
-                ngx_http_set_exten(r);
-            }
 
+            if (ngx_http_process_request_uri(r) != NGX_OK) {
+                return;
             }
-#endif
-
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                           "http request line: \"%V\"", &r->request_line);
-
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                           "http uri: \"%V\"", &r->uri);
-			NGX_LOG(LOG_DEBUG, "http uri: \"%s\"", r->uri.data);
-
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                           "http args: \"%V\"", &r->args);
-
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                           "http exten: \"%V\"", &r->exten);
 			/* ֤host */
             if (r->host_start && r->host_end) {
 
@@ -957,6 +912,127 @@ ngx_http_process_request_line(ngx_event_t *rev)
     }
 }
 
+ngx_int_t
+ngx_http_process_request_uri(ngx_http_request_t *r)
+{
+    ngx_int_t                  rc;
+    ngx_connection_t          *c;
+    ngx_http_core_srv_conf_t  *cscf;
+
+    c = r->connection;
+
+    if (r->args_start) {
+        r->uri.len = r->args_start - 1 - r->uri_start;
+    } else {
+        r->uri.len = r->uri_end - r->uri_start;
+    }
+
+
+    if (r->complex_uri || r->quoted_uri) {
+
+        r->uri.data = ngx_pnalloc(r->pool, r->uri.len + 1);
+        if (r->uri.data == NULL) {
+            ngx_http_close_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return NGX_ERROR;
+        }
+
+        cscf = ngx_http_get_module_srv_conf(r, ngx_http_core_module);
+
+        rc = ngx_http_parse_complex_uri(r, cscf->merge_slashes);
+
+        if (rc == NGX_HTTP_PARSE_INVALID_REQUEST) {
+            ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                          "client sent invalid request");
+            ngx_http_finalize_request(r, NGX_HTTP_BAD_REQUEST);
+            return NGX_ERROR;
+        }
+
+    } else {
+        r->uri.data = r->uri_start;
+    }
+
+
+    r->unparsed_uri.len = r->uri_end - r->uri_start;
+    r->unparsed_uri.data = r->uri_start;
+
+    r->valid_unparsed_uri = r->space_in_uri ? 0 : 1;
+
+    r->method_name.len = r->method_end - r->request_start + 1;
+    r->method_name.data = r->request_line.data;
+
+
+    if (r->http_protocol.data) {
+        r->http_protocol.len = r->request_end - r->http_protocol.data;
+    }
+
+
+    if (r->uri_ext) {
+        if (r->args_start) {
+            r->exten.len = r->args_start - 1 - r->uri_ext;
+        } else {
+            r->exten.len = r->uri_end - r->uri_ext;
+        }
+
+        r->exten.data = r->uri_ext;
+    }
+
+
+    if (r->args_start && r->uri_end > r->args_start) {
+        r->args.len = r->uri_end - r->args_start;
+        r->args.data = r->args_start;
+    }
+
+#if (NGX_WIN32)
+    {
+    u_char  *p;
+
+    p = r->uri.data + r->uri.len - 1;
+
+    while (p > r->uri.data) {
+
+        if (*p == ' ') {
+            p--;
+            continue;
+        }
+
+        if (*p == '.') {
+            p--;
+            continue;
+        }
+
+        if (ngx_strncasecmp(p - 6, (u_char *) "::$data", 7) == 0) {
+            p -= 7;
+            continue;
+        }
+
+        break;
+    }
+
+    if (p != r->uri.data + r->uri.len - 1) {
+        r->uri.len = p + 1 - r->uri.data;
+        ngx_http_set_exten(r);
+    }
+
+    }
+#endif
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http request line: \"%V\"", &r->request_line);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http uri: \"%V\"", &r->uri);
+			NGX_LOG(LOG_DEBUG, "http uri: \"%s\"", r->uri.data);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http args: \"%V\"", &r->args);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http exten: \"%V\"", &r->exten);
+
+    return NGX_OK;
+}
+
+
 //ͷ
 static void
 ngx_http_process_request_headers(ngx_event_t *rev)
@@ -1441,6 +1517,10 @@ ngx_http_process_connection(ngx_http_request_t *r, ngx_table_elt_t *h,
         r->headers_in.connection_type = NGX_HTTP_CONNECTION_KEEP_ALIVE;
     }
 
+    if (ngx_strcasestrn(h->value.data, "upgrade", 7 - 1)) {
+        r->headers_in.connection_upgrade = 1;
+    }
+
     return NGX_OK;
 }
 
@@ -1537,7 +1617,7 @@ ngx_http_process_cookie(ngx_http_request_t *r, ngx_table_elt_t *h,
 }
 
 
-static ngx_int_t
+ngx_int_t
 ngx_http_process_request_header(ngx_http_request_t *r)
 {
     if (ngx_http_find_virtual_server(r, r->headers_in.server.data,
@@ -1548,7 +1628,10 @@ ngx_http_process_request_header(ngx_http_request_t *r)
         return NGX_ERROR;
     }
 
-    if (r->headers_in.host == NULL && r->http_version > NGX_HTTP_VERSION_10) {
+    if (r->headers_in.host == NULL
+        && r->http_version > NGX_HTTP_VERSION_10
+        && r->http_version < NGX_HTTP_VERSION_20)
+    {
         ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
                    "client sent HTTP/1.1 request without \"Host\" header");
         ngx_http_finalize_request(r, NGX_HTTP_BAD_REQUEST);
@@ -1568,7 +1651,10 @@ ngx_http_process_request_header(ngx_http_request_t *r)
         }
     }
 
-    if (r->method & NGX_HTTP_PUT && r->headers_in.content_length_n == -1) {
+    if (r->method & NGX_HTTP_PUT
+        && r->headers_in.content_length_n == -1
+        && r->http_version < NGX_HTTP_VERSION_20)
+    {
         ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
                   "client sent %V method without \"Content-Length\" header",
                   &r->method_name);
@@ -1605,7 +1691,7 @@ ngx_http_process_request_header(ngx_http_request_t *r)
 }
 
 //öд¼handler
-static void
+void
 ngx_http_process_request(ngx_http_request_t *r)
 {
     ngx_connection_t  *c;
@@ -2162,6 +2248,13 @@ ngx_http_finalize_connection(ngx_http_request_t *r)
 
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
+#if (NGX_HTTP_V2)
+    if (r->stream) {
+        ngx_http_close_request(r, 0);
+        return;
+    }
+#endif
+
     if (r->main->count != 1) {
 
         if (r->discard_body) {
@@ -2337,6 +2430,14 @@ ngx_http_block_reading(ngx_http_request_t *r)
                    "http reading blocked");
 	NGX_LOG(LOG_DEBUG, "http reading blocked");
 
+#if (NGX_HTTP_V2)
+
+    if (r->main->stream) {
+        return;
+    }
+
+#endif
+
     /* aio does not call this handler */
 
     if ((ngx_event_flags & NGX_USE_LEVEL_EVENT)
@@ -2364,6 +2465,19 @@ ngx_http_test_reading(ngx_http_request_t *r)
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http test reading");
 	NGX_LOG(LOG_DEBUG, "http test reading");
 
+#if (NGX_HTTP_V2)
+
+    if (r->stream) {
+        if (c->error) {
+            err = 0;
+            goto closed;
+        }
+
+        return;
+    }
+
+#endif
+
 #if (NGX_HAVE_KQUEUE)
 
     if (ngx_event_flags & NGX_USE_KQUEUE_EVENT) {
@@ -2454,6 +2568,15 @@ ngx_http_set_keepalive(ngx_http_request_t *r)
 
     c->log->action = "closing request";
 
+#if (NGX_HTTP_SSL)
+
+    if (c->ssl) {
+        /* the next response starts with the small records again */
+        c->ssl->record_size = 0;
+    }
+
+#endif
+
     hc = r->http_connection;
     b = r->header_in;
 
@@ -2729,6 +2852,22 @@ ngx_http_keepalive_handler(ngx_event_t *rev)
     if (n == NGX_AGAIN) {
         if (ngx_handle_read_event(rev, 0) != NGX_OK) {
             ngx_http_close_connection(c);
+            return;
+        }
+
+        /*
+         * Like ngx_http_set_keepalive() we are trying to not hold
+         * c->buffer's memory for a keepalive connection: for SSL
+         * the read event is often reported for a part of a record only.
+         */
+
+        if (ngx_pfree(c->pool, b->start) == NGX_OK) {
+
+            /*
+             * the special note that c->buffer's memory was freed
+             */
+
+            b->pos = NULL;
         }
 
         return;
@@ -2978,12 +3117,19 @@ ngx_http_close_request(ngx_http_request_t *r, ngx_int_t rc)
         return;
     }
 
+#if (NGX_HTTP_V2)
+    if (r->stream) {
+        ngx_http_v2_close_stream(r->stream, rc);
+        return;
+    }
+#endif
+
     ngx_http_free_request(r, rc);
     ngx_http_close_connection(c);
 }
 
 
-static void
+void
 ngx_http_free_request(ngx_http_request_t *r, ngx_int_t rc)
 {
     ngx_log_t                 *log;
@@ -3030,7 +3176,12 @@ ngx_http_free_request(ngx_http_request_t *r, ngx_int_t rc)
 
     log->action = "closing request";
 
-    if (r->connection->timedout) {
+    if (r->connection->timedout
+#if (NGX_HTTP_V2)
+        && r->stream == NULL
+#endif
+       )
+    {
         clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
         if (clcf->reset_timedout_connection) {
@@ -3076,7 +3227,7 @@ ngx_http_log_request(ngx_http_request_t *r)
 }
 
 
-static void
+void
 ngx_http_close_connection(ngx_connection_t *c)
 {
     ngx_pool_t  *pool;
@@ -3142,7 +3293,7 @@ ngx_http_log_error(ngx_log_t *log, u_char *buf, size_t len)
 }
 
 
-static u_char *
+u_char *
 ngx_http_log_error_handler(ngx_http_request_t *r, ngx_http_request_t *sr,
     u_char *buf, size_t len)
 {
@@ -22,6 +22,7 @@
 #define NGX_HTTP_VERSION_9                 9
 #define NGX_HTTP_VERSION_10                1000
 #define NGX_HTTP_VERSION_11                1001
+#define NGX_HTTP_VERSION_20                2000
 
 #define NGX_HTTP_UNKNOWN                   0x0001
 #define NGX_HTTP_GET                       0x0002
@@ -62,6 +63,8 @@
 #define NGX_HTTP_SUBREQUEST_WAITED         4
 #define NGX_HTTP_LOG_UNSAFE                8
 
+#define NGX_HTTP_SWITCHING_PROTOCOLS       101
+
 //2XX״̬
 #define NGX_HTTP_OK                        200
 #define NGX_HTTP_CREATED                   201
@@ -190,6 +193,7 @@ typedef struct {
     ngx_table_elt_t                  *authorization;
 
     ngx_table_elt_t                  *keep_alive;
+    ngx_table_elt_t                  *upgrade;
 
 #if (NGX_HTTP_PROXY || NGX_HTTP_REALIP || NGX_HTTP_GEO)
     ngx_table_elt_t                  *x_forwarded_for;
@@ -221,6 +225,7 @@ typedef struct {
     time_t                            keep_alive_n;
 
     unsigned                          connection_type:2;
+    unsigned                          connection_upgrade:1;
     unsigned                          msie:1;  //
     unsigned                          msie4:1;
     unsigned                          msie6:1;
@@ -268,6 +273,7 @@ typedef struct {
 
     //ָcontent_length_n󣬲ٵngx_table_elt_t
     off_t                             content_length_n; //Ӧݳ
+    off_t                             content_offset;
     time_t                            date_time;
     time_t                            last_modified_time;
 } ngx_http_headers_out_t;
@@ -322,6 +328,9 @@ typedef struct {
     ngx_int_t                         nfree;
 
     ngx_uint_t                        pipeline;    /* unsigned  pipeline:1; */
+#if (NGX_HTTP_V2)
+    ngx_uint_t                        http2;       /* unsigned  http2:1; */
+#endif
 } ngx_http_connection_t;
 
 
@@ -535,6 +544,9 @@ struct ngx_http_request_s {
     ngx_uint_t                        err_status;
 
     ngx_http_connection_t            *http_connection;
+#if (NGX_HTTP_V2)
+    ngx_http_v2_stream_t             *stream;
+#endif
 
     ngx_http_log_handler_pt           log_handler;
 
@@ -659,6 +671,8 @@ struct ngx_http_request_s {
     unsigned                          filter_need_in_memory:1;
     unsigned                          filter_need_temporary:1;
     unsigned                          allow_ranges:1;
+    unsigned                          subrequest_ranges:1;
+    unsigned                          single_range:1;
 
 #if (NGX_STAT_STUB)
     unsigned                          stat_reading:1;
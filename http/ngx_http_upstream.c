@@ -26,6 +26,25 @@ static void ngx_http_upstream_check_broken_connection(ngx_http_request_t *r,
     ngx_event_t *ev);
 static void ngx_http_upstream_connect(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_queue_request(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_uint_t ngx_http_upstream_queue_busy(
+    ngx_http_upstream_srv_conf_t *uscf);
+static void ngx_http_upstream_queue_handler(ngx_event_t *ev);
+static void ngx_http_upstream_dequeue(ngx_http_upstream_t *u);
+static void ngx_http_upstream_queue_wake(ngx_http_upstream_srv_conf_t *uscf);
+static void ngx_http_upstream_hedge_init(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_msec_t ngx_http_upstream_hedge_percentile(
+    ngx_http_upstream_srv_conf_t *uscf, ngx_uint_t percentile);
+static void ngx_http_upstream_hedge_handler(ngx_event_t *ev);
+static void ngx_http_upstream_hedge_standby_handler(ngx_event_t *ev);
+static void ngx_http_upstream_hedge_restore(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_hedge_cancel(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_hedge_update(ngx_http_upstream_t *u);
+static void ngx_http_upstream_hedge_close(ngx_connection_t *c);
 static ngx_int_t ngx_http_upstream_reinit(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static void ngx_http_upstream_send_request(ngx_http_request_t *r,
@@ -56,6 +75,27 @@ static void
 static ngx_int_t ngx_http_upstream_non_buffered_filter_init(void *data);
 static ngx_int_t ngx_http_upstream_non_buffered_filter(void *data,
     ssize_t bytes);
+static void ngx_http_upstream_upgrade(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_upgraded_read_downstream(ngx_http_request_t *r);
+static void ngx_http_upstream_upgraded_write_downstream(ngx_http_request_t *r);
+static void ngx_http_upstream_upgraded_read_upstream(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_upgraded_write_upstream(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
+    ngx_uint_t from_upstream, ngx_uint_t do_write);
+static size_t ngx_http_upstream_upgraded_pending(ngx_http_request_t *r,
+    ngx_uint_t from_upstream);
+static void ngx_http_upstream_tunnel_cleanup(void *data);
+#if (NGX_HAVE_SPLICE)
+static void ngx_http_upstream_splice_init(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_splice(ngx_connection_t *src,
+    ngx_connection_t *dst, ngx_http_upstream_splice_t *sp);
+static void ngx_http_upstream_splice_close(ngx_http_upstream_splice_t *sp,
+    ngx_log_t *log);
+#endif
 static void ngx_http_upstream_process_downstream(ngx_http_request_t *r);
 static void ngx_http_upstream_process_upstream(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
@@ -83,12 +123,21 @@ static ngx_int_t ngx_http_upstream_process_expires(ngx_http_request_t *r,
     ngx_table_elt_t *h, ngx_uint_t offset);
 static ngx_int_t ngx_http_upstream_process_accel_expires(ngx_http_request_t *r,
     ngx_table_elt_t *h, ngx_uint_t offset);
+static ngx_int_t ngx_http_upstream_process_connection(ngx_http_request_t *r,
+    ngx_table_elt_t *h, ngx_uint_t offset);
+static ngx_int_t
+    ngx_http_upstream_process_transfer_encoding(ngx_http_request_t *r,
+    ngx_table_elt_t *h, ngx_uint_t offset);
 static ngx_int_t ngx_http_upstream_process_limit_rate(ngx_http_request_t *r,
     ngx_table_elt_t *h, ngx_uint_t offset);
 static ngx_int_t ngx_http_upstream_process_buffering(ngx_http_request_t *r,
     ngx_table_elt_t *h, ngx_uint_t offset);
 static ngx_int_t ngx_http_upstream_process_charset(ngx_http_request_t *r,
     ngx_table_elt_t *h, ngx_uint_t offset);
+static ngx_int_t ngx_http_upstream_process_surrogate_key(ngx_http_request_t *r,
+    ngx_table_elt_t *h, ngx_uint_t offset);
+static ngx_int_t ngx_http_upstream_process_vary(ngx_http_request_t *r,
+    ngx_table_elt_t *h, ngx_uint_t offset);
 static ngx_int_t ngx_http_upstream_copy_header_line(ngx_http_request_t *r,
     ngx_table_elt_t *h, ngx_uint_t offset);
 static ngx_int_t
@@ -121,18 +170,33 @@ static ngx_int_t ngx_http_upstream_response_time_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_upstream_response_length_variable(
     ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_upstream_queue_time_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+#if (NGX_HTTP_SSL)
+static ngx_int_t ngx_http_upstream_ssl_session_stats_variable(
+    ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+#endif
+static ngx_int_t ngx_http_upstream_queue_length_variable(
+    ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
 
 static char *ngx_http_upstream(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy);
 static char *ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_upstream_queue(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 
 static void *ngx_http_upstream_create_main_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_init_main_conf(ngx_conf_t *cf, void *conf);
+static ngx_int_t ngx_http_upstream_init_process(ngx_cycle_t *cycle);
 
 #if (NGX_HTTP_SSL)
 static void ngx_http_upstream_ssl_init_connection(ngx_http_request_t *,
     ngx_http_upstream_t *u, ngx_connection_t *c);
 static void ngx_http_upstream_ssl_handshake(ngx_connection_t *c);
+static ngx_int_t ngx_http_upstream_ssl_name(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_connection_t *c);
+static ngx_int_t ngx_http_upstream_ssl_session_key(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_str_t *key);
 #endif
 
 
@@ -170,6 +234,11 @@ ngx_http_upstream_header_t  ngx_http_upstream_headers_in[] = {
                  ngx_http_upstream_copy_header_line,
                  offsetof(ngx_http_headers_out_t, etag), 0 },
 
+    { ngx_string("Content-Range"),
+                 ngx_http_upstream_ignore_header_line, 0,
+                 ngx_http_upstream_copy_header_line,
+                 offsetof(ngx_http_headers_out_t, content_range), 0 },
+
     { ngx_string("Server"),
                  ngx_http_upstream_process_header_line,
                  offsetof(ngx_http_upstream_headers_in_t, server),
@@ -215,13 +284,17 @@ ngx_http_upstream_header_t  ngx_http_upstream_headers_in[] = {
                  offsetof(ngx_http_headers_out_t, accept_ranges), 1 },
 
     { ngx_string("Connection"),
-                 ngx_http_upstream_ignore_header_line, 0,
+                 ngx_http_upstream_process_connection, 0,
                  ngx_http_upstream_ignore_header_line, 0, 0 },
 
     { ngx_string("Keep-Alive"),
                  ngx_http_upstream_ignore_header_line, 0,
                  ngx_http_upstream_ignore_header_line, 0, 0 },
 
+    { ngx_string("Transfer-Encoding"),
+                 ngx_http_upstream_process_transfer_encoding, 0,
+                 ngx_http_upstream_ignore_header_line, 0, 0 },
+
     { ngx_string("X-Powered-By"),
                  ngx_http_upstream_ignore_header_line, 0,
                  ngx_http_upstream_copy_header_line, 0, 0 },
@@ -247,6 +320,14 @@ ngx_http_upstream_header_t  ngx_http_upstream_headers_in[] = {
                  ngx_http_upstream_process_charset, 0,
                  ngx_http_upstream_copy_header_line, 0, 0 },
 
+    { ngx_string("Surrogate-Key"),
+                 ngx_http_upstream_process_surrogate_key, 0,
+                 ngx_http_upstream_copy_header_line, 0, 0 },
+
+    { ngx_string("Vary"),
+                 ngx_http_upstream_process_vary, 0,
+                 ngx_http_upstream_copy_header_line, 0, 0 },
+
 #if (NGX_HTTP_GZIP)
     { ngx_string("Content-Encoding"),
                  ngx_http_upstream_process_header_line,
@@ -274,6 +355,13 @@ static ngx_command_t  ngx_http_upstream_commands[] = {
       0,
       NULL },
 
+    { ngx_string("queue"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
+      ngx_http_upstream_queue,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
@@ -300,7 +388,7 @@ ngx_module_t  ngx_http_upstream_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_upstream_init_process,        /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -327,6 +415,22 @@ static ngx_http_variable_t  ngx_http_upstream_vars[] = {
       ngx_http_upstream_response_length_variable, 0,
       NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
+    { ngx_string("upstream_queue_time"), NULL,
+      ngx_http_upstream_queue_time_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("upstream_queue_length"), NULL,
+      ngx_http_upstream_queue_length_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+#if (NGX_HTTP_SSL)
+
+    { ngx_string("upstream_ssl_session_stats"), NULL,
+      ngx_http_upstream_ssl_session_stats_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+#endif
+
 #if (NGX_HTTP_CACHE)
 
     { ngx_string("upstream_cache_status"), NULL,
@@ -363,6 +467,7 @@ ngx_conf_bitmask_t  ngx_http_upstream_ignore_headers_masks[] = {
     { ngx_string("Expires"), NGX_HTTP_UPSTREAM_IGN_EXPIRES },
     { ngx_string("Cache-Control"), NGX_HTTP_UPSTREAM_IGN_CACHE_CONTROL },
     { ngx_string("Set-Cookie"), NGX_HTTP_UPSTREAM_IGN_SET_COOKIE },
+    { ngx_string("Vary"), NGX_HTTP_UPSTREAM_IGN_VARY },
     { ngx_null_string, 0 }
 };
 
@@ -419,6 +524,13 @@ ngx_http_upstream_init(ngx_http_request_t *r)
         ngx_del_timer(c->read);
     }
 
+#if (NGX_HTTP_V2)
+    if (r->stream) {
+        ngx_http_upstream_init_request(r);
+        return;
+    }
+#endif
+
     if (ngx_event_flags & NGX_USE_CLEAR_EVENT) {
 
         if (!c->write->active) {
@@ -458,6 +570,8 @@ ngx_http_upstream_init_request(ngx_http_request_t *r)
     if (u->conf->cache) {
         ngx_int_t  rc;
 
+        r->write_event_handler = ngx_http_request_empty_handler;
+
         rc = ngx_http_upstream_cache(r, u);
 
         if (rc == NGX_BUSY) {
@@ -465,8 +579,6 @@ ngx_http_upstream_init_request(ngx_http_request_t *r)
             return;
         }
 
-        r->write_event_handler = ngx_http_request_empty_handler;
-
         if (rc == NGX_DONE) {
             return;
         }
@@ -625,6 +737,8 @@ ngx_http_upstream_init_request(ngx_http_request_t *r)
     }
 
 found:
+
+    u->upstream = uscf;
 	//ʼؾ㷨
     if (uscf->peer.init(r, uscf) != NGX_OK) {
         ngx_http_upstream_finalize_request(r, u,
@@ -697,6 +811,7 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
         c->min_uses = u->conf->cache_min_uses;
         c->body_start = u->conf->buffer_size;
         c->file_cache = u->conf->cache->data;
+        c->read_while_write = u->conf->cache_read_while_write;
 
         u->cache_status = NGX_HTTP_CACHE_MISS;
     }
@@ -959,6 +1074,22 @@ ngx_http_upstream_check_broken_connection(ngx_http_request_t *r,
     c = r->connection;
     u = r->upstream;
 
+#if (NGX_HTTP_V2)
+
+    if (r->stream) {
+
+        /* the stream has no socket of its own, the h2 connection sets error */
+
+        if (c->error && !u->cacheable) {
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_CLIENT_CLOSED_REQUEST);
+        }
+
+        return;
+    }
+
+#endif
+
     if (c->error) {
         if ((ngx_event_flags & NGX_USE_LEVEL_EVENT) && ev->active) {
 
@@ -1123,6 +1254,11 @@ ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
     u->state->peer = u->peer.name;
 
     if (rc == NGX_BUSY) {
+
+        if (ngx_http_upstream_queue_request(r, u) == NGX_OK) {
+            return;
+        }
+
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "no live upstreams");
         ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_NOLIVE);
         return;
@@ -1133,7 +1269,7 @@ ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
         return;
     }
 
-    /* rc == NGX_OK || rc == NGX_AGAIN */
+    /* rc == NGX_OK || rc == NGX_AGAIN || rc == NGX_DONE */
 
     c = u->peer.connection;
 
@@ -1152,8 +1288,19 @@ ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
     c->sendfile &= r->connection->sendfile;
     u->output.sendfile = c->sendfile;
 
-    c->pool = r->pool;
+    /* a kept connection outlives the request, so it has its own pool */
+
+    if (c->pool == NULL) {
+        c->pool = ngx_create_pool(128, r->connection->log);
+        if (c->pool == NULL) {
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+    }
+
     c->log = r->connection->log;
+    c->pool->log = c->log;
     c->read->log = c->log;
     c->write->log = c->log;
 
@@ -1225,6 +1372,7 @@ ngx_http_upstream_ssl_init_connection(ngx_http_request_t *r,
     ngx_http_upstream_t *u, ngx_connection_t *c)
 {
     ngx_int_t   rc;
+    ngx_str_t   key;
 
     if (ngx_ssl_create_connection(u->conf->ssl, c,
                                   NGX_SSL_BUFFER|NGX_SSL_CLIENT)
@@ -1238,7 +1386,28 @@ ngx_http_upstream_ssl_init_connection(ngx_http_request_t *r,
     c->sendfile = 0;
     u->output.sendfile = 0;
 
-    if (u->conf->ssl_session_reuse) {
+    if (u->conf->ssl_server_name) {
+        if (ngx_http_upstream_ssl_name(r, u, c) != NGX_OK) {
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+    }
+
+    if (u->conf->ssl_session_reuse && u->conf->ssl_session_cache) {
+
+        /* the session shared among the workers */
+
+        if (ngx_http_upstream_ssl_session_key(r, u, &key) != NGX_OK
+            || ngx_ssl_set_cached_session(c, u->conf->ssl_session_cache, &key)
+               != NGX_OK)
+        {
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+    } else if (u->conf->ssl_session_reuse) {
         if (u->peer.set_session(&u->peer, u->peer.data) != NGX_OK) {
             ngx_http_upstream_finalize_request(r, u,
                                                NGX_HTTP_INTERNAL_SERVER_ERROR);
@@ -1262,6 +1431,7 @@ ngx_http_upstream_ssl_init_connection(ngx_http_request_t *r,
 static void
 ngx_http_upstream_ssl_handshake(ngx_connection_t *c)
 {
+    ngx_str_t             key;
     ngx_http_request_t   *r;
     ngx_http_upstream_t  *u;
 
@@ -1270,7 +1440,13 @@ ngx_http_upstream_ssl_handshake(ngx_connection_t *c)
 
     if (c->ssl->handshaked) {
 
-        if (u->conf->ssl_session_reuse) {
+        if (u->conf->ssl_session_reuse && u->conf->ssl_session_cache) {
+            if (ngx_http_upstream_ssl_session_key(r, u, &key) == NGX_OK) {
+                ngx_ssl_save_cached_session(c, u->conf->ssl_session_cache,
+                                            &key);
+            }
+
+        } else if (u->conf->ssl_session_reuse) {
             u->peer.save_session(&u->peer, u->peer.data);
         }
 
@@ -1286,1207 +1462,2468 @@ ngx_http_upstream_ssl_handshake(ngx_connection_t *c)
 
 }
 
-#endif
 
+/*
+ * the name is sent in SNI without the port,
+ * IP addresses are not allowed there
+ */
 
 static ngx_int_t
-ngx_http_upstream_reinit(ngx_http_request_t *r, ngx_http_upstream_t *u)
+ngx_http_upstream_ssl_name(ngx_http_request_t *r, ngx_http_upstream_t *u,
+    ngx_connection_t *c)
 {
-    ngx_chain_t  *cl;
+    u_char     *p, *last;
+    ngx_str_t   name;
 
-    if (u->reinit_request(r) != NGX_OK) {
-        return NGX_ERROR;
+    name = u->ssl_name;
+
+    if (name.len == 0 || name.data[0] == '[') {
+        return NGX_OK;
     }
 
-    ngx_memzero(&u->headers_in, sizeof(ngx_http_upstream_headers_in_t));
+    last = name.data + name.len;
 
-    if (ngx_list_init(&u->headers_in.headers, r->pool, 8,
-                      sizeof(ngx_table_elt_t))
-        != NGX_OK)
+    p = ngx_strlchr(name.data, last, ':');
+
+    if (p) {
+        name.len = p - name.data;
+    }
+
+    if (name.len == 0
+        || ngx_inet_addr(name.data, name.len) != INADDR_NONE)
     {
-        return NGX_ERROR;
+        return NGX_OK;
     }
 
-    /* reinit the request chain */
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
 
-    for (cl = u->request_bufs; cl; cl = cl->next) {
-        cl->buf->pos = cl->buf->start;
-        cl->buf->file_pos = 0;
+    p = ngx_pnalloc(r->pool, name.len + 1);
+    if (p == NULL) {
+        return NGX_ERROR;
     }
 
-    /* reinit the subrequest's ngx_output_chain() context */
-
-    if (r->request_body && r->request_body->temp_file
-        && r != r->main && u->output.buf)
-    {
-        u->output.free = ngx_alloc_chain_link(r->pool);
-        if (u->output.free == NULL) {
-            return NGX_ERROR;
-        }
+    (void) ngx_cpystrn(p, name.data, name.len + 1);
 
-        u->output.free->buf = u->output.buf;
-        u->output.free->next = NULL;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "upstream SSL server name: \"%s\"", p);
 
-        u->output.buf->pos = u->output.buf->start;
-        u->output.buf->last = u->output.buf->start;
+    if (SSL_set_tlsext_host_name(c->ssl->connection, (char *) p) == 0) {
+        ngx_ssl_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "SSL_set_tlsext_host_name(\"%s\") failed", p);
+        return NGX_ERROR;
     }
 
-    u->output.buf = NULL;
-    u->output.in = NULL;
-    u->output.busy = NULL;
+#endif
 
-    /* reinit u->buffer */
+    return NGX_OK;
+}
 
-    u->buffer.pos = u->buffer.start;
 
-#if (NGX_HTTP_CACHE)
+/*
+ * the sessions are cached by the peer address and the server name
+ * sent in SNI, as a peer may serve several names with the different
+ * certificates and session contexts
+ */
 
-    if (r->cache) {
-        u->buffer.pos += r->cache->header_start;
-    }
+static ngx_int_t
+ngx_http_upstream_ssl_session_key(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_str_t *key)
+{
+    u_char      *p;
+    size_t       len;
+    const char  *name;
+
+    name = NULL;
 
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+    name = SSL_get_servername(u->peer.connection->ssl->connection,
+                              TLSEXT_NAMETYPE_host_name);
 #endif
 
-    u->buffer.last = u->buffer.pos;
+    if (name == NULL) {
+        name = "";
+    }
+
+    len = u->peer.name->len + 1 + ngx_strlen(name);
+
+    p = ngx_pnalloc(r->pool, len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    key->data = p;
+    key->len = ngx_sprintf(p, "%V/%s", u->peer.name, name) - p;
 
     return NGX_OK;
 }
 
+#endif
 
-static void
-ngx_http_upstream_send_request(ngx_http_request_t *r, ngx_http_upstream_t *u)
-{
-    ngx_int_t          rc;
-    ngx_connection_t  *c;
-
-    c = u->peer.connection;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http upstream send request");
-	NGX_LOG(LOG_DEBUG, "http upstream send request");
 
-    if (!u->request_sent && ngx_http_upstream_test_connect(c) != NGX_OK) {
-        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
-        return;
-    }
+/*
+ * a request that finds all live peers at their max_conns limit waits
+ * in the upstream queue of the worker until a connection slot is released
+ * or the queue timeout expires; with a shared zone the slots released
+ * by other workers are noticed by polling
+ */
 
-    c->log->action = "sending request to upstream";
+static ngx_int_t
+ngx_http_upstream_queue_request(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_msec_t                     timer, elapsed;
+    ngx_http_upstream_rr_peers_t  *peers;
+    ngx_http_upstream_srv_conf_t  *uscf;
 
-    rc = ngx_output_chain(&u->output, u->request_sent ? NULL : u->request_bufs);
+    uscf = u->upstream;
 
-    u->request_sent = 1;
+    if (uscf == NULL || uscf->queue_max == 0 || u->resolved
+        || u->rr_data == NULL || u->hedge_connection)
+    {
+        return NGX_DECLINED;
+    }
 
-    if (rc == NGX_ERROR) {
-        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
-        return;
+    if (!ngx_http_upstream_queue_busy(uscf)) {
+        return NGX_DECLINED;
     }
 
-    if (c->write->timer_set) {
-        ngx_del_timer(c->write);
+    if (uscf->queue_len >= uscf->queue_max) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "upstream queue is full (%ui)", uscf->queue_len);
+        return NGX_DECLINED;
     }
 
-    if (rc == NGX_AGAIN) {
-        ngx_add_timer(c->write, u->conf->send_timeout);
+    /* the state of the attempt is not kept */
 
-        if (ngx_handle_write_event(c->write, u->conf->send_lowat) != NGX_OK) {
-            ngx_http_upstream_finalize_request(r, u,
-                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
-            return;
-        }
+    r->upstream_states->nelts--;
+    u->state = NULL;
 
-        return;
+    if (u->queue_start == 0) {
+        u->queue_start = ngx_current_msec;
     }
 
-    /* rc == NGX_OK */
+    elapsed = ngx_current_msec - u->queue_start;
 
-    if (c->tcp_nopush == NGX_TCP_NOPUSH_SET) {
-        if (ngx_tcp_push(c->fd) == NGX_ERROR) {
-            ngx_log_error(NGX_LOG_CRIT, c->log, ngx_socket_errno,
-                          ngx_tcp_push_n " failed");
-            ngx_http_upstream_finalize_request(r, u,
-                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
-            return;
-        }
+    timer = (elapsed < uscf->queue_timeout) ? uscf->queue_timeout - elapsed
+                                            : 0;
 
-        c->tcp_nopush = NGX_TCP_NOPUSH_UNSET;
-    }
+    peers = uscf->peer.data;
 
-    ngx_add_timer(c->read, u->conf->read_timeout);
+    if (peers->shpool && timer > 100) {
+        timer = 100;
+    }
 
-#if 1
-    if (c->read->ready) {
+    u->queue_event.handler = ngx_http_upstream_queue_handler;
+    u->queue_event.data = r;
+    u->queue_event.log = r->connection->log;
 
-        /* post aio operation */
+    ngx_add_timer(&u->queue_event, timer);
 
-        /*
-         * TODO comment
-         * although we can post aio operation just in the end
-         * of ngx_http_upstream_connect() CHECK IT !!!
-         * it's better to do here because we postpone header buffer allocation
-         */
+    ngx_queue_insert_tail(&uscf->queue, &u->queue);
+    uscf->queue_len++;
+    u->queued = 1;
 
-        ngx_http_upstream_process_header(r, u);
-        return;
-    }
-#endif
+    r->connection->log->action = "waiting in upstream queue";
 
-    u->write_event_handler = ngx_http_upstream_dummy_handler;
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream queued: %ui %M", uscf->queue_len, elapsed);
 
-    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
-        ngx_http_upstream_finalize_request(r, u,
-                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
-        return;
-    }
+    return NGX_OK;
 }
 
 
-static void
-ngx_http_upstream_send_request_handler(ngx_http_request_t *r,
-    ngx_http_upstream_t *u)
+static ngx_uint_t
+ngx_http_upstream_queue_busy(ngx_http_upstream_srv_conf_t *uscf)
 {
-    ngx_connection_t  *c;
+    ngx_uint_t                     i, busy;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers, *p;
 
-    c = u->peer.connection;
+    peers = uscf->peer.data;
+    busy = 0;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http upstream send request handler");
-	NGX_LOG(LOG_DEBUG, "http upstream send request handler");
+    ngx_http_upstream_rr_peers_lock(peers);
 
-    if (c->write->timedout) {
-        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_TIMEOUT);
-        return;
-    }
+    for (p = peers; p && !busy; p = p->next) {
 
-#if (NGX_HTTP_SSL)
+        for (i = 0; i < p->number; i++) {
+            peer = &p->peer[i];
 
-    if (u->ssl && c->ssl == NULL) {
-        ngx_http_upstream_ssl_init_connection(r, u, c);
-        return;
+            if (peer->down || peer->unhealthy) {
+                continue;
+            }
+
+            if (peer->max_conns && peer->conns >= peer->max_conns) {
+                busy = 1;
+                break;
+            }
+        }
     }
 
-#endif
+    ngx_http_upstream_rr_peers_unlock(peers);
 
-    if (u->header_sent) {
-        u->write_event_handler = ngx_http_upstream_dummy_handler;
+    return busy;
+}
 
-        (void) ngx_handle_write_event(c->write, 0);
 
+static void
+ngx_http_upstream_queue_handler(ngx_event_t *ev)
+{
+    ngx_connection_t              *c;
+    ngx_http_request_t            *r;
+    ngx_http_upstream_t           *u;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    r = ev->data;
+    c = r->connection;
+    u = r->upstream;
+    uscf = u->upstream;
+
+    if (u->queued) {
+        ngx_http_upstream_dequeue(u);
+    }
+
+    u->queue_time = ngx_current_msec - u->queue_start;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream queue handler: %M", u->queue_time);
+
+    if (u->queue_time >= uscf->queue_timeout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "upstream queue timed out");
+        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_SERVICE_UNAVAILABLE);
+        ngx_http_run_posted_requests(c);
         return;
     }
 
-    ngx_http_upstream_send_request(r, u);
+    /* the balancer is not initialized again, its data is reused */
+
+    ngx_http_upstream_reset_round_robin_peer(r, uscf);
+
+    ngx_http_upstream_connect(r, u);
+
+    ngx_http_run_posted_requests(c);
 }
 
 
 static void
-ngx_http_upstream_process_header(ngx_http_request_t *r, ngx_http_upstream_t *u)
+ngx_http_upstream_dequeue(ngx_http_upstream_t *u)
 {
-    ssize_t            n;
-    ngx_int_t          rc;
-    ngx_connection_t  *c;
+    ngx_queue_remove(&u->queue);
+    u->upstream->queue_len--;
+    u->queued = 0;
 
-    c = u->peer.connection;
+    if (u->queue_event.timer_set) {
+        ngx_del_timer(&u->queue_event);
+    }
+}
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http upstream process header");
-	NGX_LOG(LOG_DEBUG, "http upstream process header");
 
-    c->log->action = "reading response header from upstream";
+static void
+ngx_http_upstream_queue_wake(ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_event_t          *ev;
+    ngx_queue_t          *q;
+    ngx_http_upstream_t  *u;
 
-    if (c->read->timedout) {
-        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_TIMEOUT);
+    if (uscf == NULL || uscf->queue_len == 0) {
         return;
     }
 
-    if (!u->request_sent && ngx_http_upstream_test_connect(c) != NGX_OK) {
-        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
-        return;
-    }
+    q = ngx_queue_head(&uscf->queue);
+    u = ngx_queue_data(q, ngx_http_upstream_t, queue);
 
-    if (u->buffer.start == NULL) {
-        u->buffer.start = ngx_palloc(r->pool, u->conf->buffer_size);
-        if (u->buffer.start == NULL) {
-            ngx_http_upstream_finalize_request(r, u,
-                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
-            return;
-        }
+    ngx_http_upstream_dequeue(u);
 
-        u->buffer.pos = u->buffer.start;
-        u->buffer.last = u->buffer.start;
-        u->buffer.end = u->buffer.start + u->conf->buffer_size;
-        u->buffer.temporary = 1;
+    ev = &u->queue_event;
 
-        u->buffer.tag = u->output.tag;
+    ngx_post_event(ev, &ngx_posted_events);
+}
 
-        if (ngx_list_init(&u->headers_in.headers, r->pool, 8,
-                          sizeof(ngx_table_elt_t))
-            != NGX_OK)
-        {
-            ngx_http_upstream_finalize_request(r, u,
-                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
-            return;
-        }
 
-#if (NGX_HTTP_CACHE)
+/*
+ * an idempotent request that has not got a response header within
+ * the hedge delay is sent to another peer as well; the request stays
+ * pending on the original connection, and the connection that starts
+ * to answer first is used while the other one is closed
+ */
 
-        if (r->cache) {
-            u->buffer.pos += r->cache->header_start;
-            u->buffer.last = u->buffer.pos;
-        }
-#endif
-    }
+static void
+ngx_http_upstream_hedge_init(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_msec_t                     delay;
+    ngx_http_upstream_hedge_t     *hedge;
+    ngx_http_upstream_srv_conf_t  *uscf;
 
-    for ( ;; ) {
+    hedge = u->conf->hedge;
+    uscf = u->upstream;
 
-        n = c->recv(c, u->buffer.last, u->buffer.end - u->buffer.last);
+    if (hedge == NULL || uscf == NULL || u->resolved || u->hedged
+        || u->rr_data == NULL || u->hedge_event.timer_set
+        || !(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))
+        || r->headers_in.upgrade)
+    {
+        return;
+    }
 
-        if (n == NGX_AGAIN) {
-#if 0
-            ngx_add_timer(rev, u->read_timeout);
-#endif
+    u->hedge_start = ngx_current_msec;
 
-            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
-                ngx_http_upstream_finalize_request(r, u,
-                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
-                return;
-            }
+    if (hedge->percentile) {
+        delay = ngx_http_upstream_hedge_percentile(uscf, hedge->percentile);
 
+        if (delay == 0) {
             return;
         }
 
-        if (n == 0) {
-            ngx_log_error(NGX_LOG_ERR, c->log, 0,
-                          "upstream prematurely closed connection");
-        }
+    } else {
+        delay = hedge->delay;
+    }
 
-        if (n == NGX_ERROR || n == 0) {
-            ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
-            return;
-        }
+    if (u->peer.tries <= 1) {
+        return;
+    }
 
-        u->buffer.last += n;
+    u->hedge_event.handler = ngx_http_upstream_hedge_handler;
+    u->hedge_event.data = r;
+    u->hedge_event.log = r->connection->log;
 
-#if 0
-        u->valid_header_in = 0;
+    ngx_add_timer(&u->hedge_event, delay);
 
-        u->peer.cached = 0;
-#endif
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream hedge delay: %M", delay);
+}
 
-        rc = u->process_header(r);
 
-        if (rc == NGX_AGAIN) {
+/*
+ * the response times are kept in the buckets of the powers of two
+ * milliseconds, the percentile is interpolated within its bucket
+ */
 
-            if (u->buffer.pos == u->buffer.end) {
-                ngx_log_error(NGX_LOG_ERR, c->log, 0,
-                              "upstream sent too big header");
+static ngx_msec_t
+ngx_http_upstream_hedge_percentile(ngx_http_upstream_srv_conf_t *uscf,
+    ngx_uint_t percentile)
+{
+    ngx_uint_t  i, n, need;
+    ngx_msec_t  lo, hi;
 
-                ngx_http_upstream_next(r, u,
-                                       NGX_HTTP_UPSTREAM_FT_INVALID_HEADER);
-                return;
-            }
+    if (uscf->hedge_samples < 100) {
+        return 0;
+    }
 
-            continue;
+    need = uscf->hedge_samples * percentile / 100;
+    n = 0;
+
+    for (i = 0; i < NGX_HTTP_UPSTREAM_HEDGE_HIST - 1; i++) {
+
+        if (n + uscf->hedge_hist[i] > need) {
+            break;
         }
 
-        break;
+        n += uscf->hedge_hist[i];
     }
 
-    if (rc == NGX_HTTP_UPSTREAM_INVALID_HEADER) {
-        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_INVALID_HEADER);
-        return;
-    }
+    lo = i ? (ngx_msec_t) 1 << (i - 1) : 0;
+    hi = (ngx_msec_t) 1 << i;
 
-    if (rc == NGX_ERROR) {
-        ngx_http_upstream_finalize_request(r, u,
-                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
-        return;
+    if (uscf->hedge_hist[i]) {
+        hi = lo + (hi - lo) * (need - n) / uscf->hedge_hist[i];
     }
 
-    /* rc == NGX_OK */
+    return hi ? hi : 1;
+}
 
-    if (u->headers_in.status_n > NGX_HTTP_SPECIAL_RESPONSE) {
 
-        if (r->subrequest_in_memory) {
-            u->buffer.last = u->buffer.pos;
-        }
+static void
+ngx_http_upstream_hedge_handler(ngx_event_t *ev)
+{
+    uintptr_t                          m;
+    ngx_uint_t                         n;
+    ngx_connection_t                  *c, *pc;
+    ngx_http_request_t                *r;
+    ngx_http_upstream_t               *u;
+    ngx_http_upstream_srv_conf_t      *uscf;
+    ngx_http_upstream_rr_peer_data_t  *rrp, *orrp;
+
+    r = ev->data;
+    c = r->connection;
+    u = r->upstream;
+    uscf = u->upstream;
+    pc = u->peer.connection;
 
-        if (ngx_http_upstream_test_next(r, u) == NGX_OK) {
-            return;
-        }
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream hedge handler");
 
-        if (ngx_http_upstream_intercept_errors(r, u) == NGX_OK) {
-            return;
-        }
-    }
+    /* the request is not sent yet or the response has begun */
 
-    if (ngx_http_upstream_process_headers(r, u) != NGX_OK) {
+    if (pc == NULL || !u->request_sent || pc->write->timer_set
+        || u->hedged || u->peer.tries <= 1)
+    {
         return;
     }
 
-    if (!r->subrequest_in_memory) {
-        ngx_http_upstream_send_response(r, u);
+    if (uscf->hedged * 100 >= uscf->hedge_requests * u->conf->hedge->budget) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http upstream hedge budget exceeded: %ui of %ui",
+                       uscf->hedged, uscf->hedge_requests);
         return;
     }
 
-    /* subrequest content in memory */
+    uscf->hedged++;
+    u->hedged = 1;
 
-    if (u->input_filter == NULL) {
-        u->input_filter_init = ngx_http_upstream_non_buffered_filter_init;
-        u->input_filter = ngx_http_upstream_non_buffered_filter;
-        u->input_filter_ctx = r;
-    }
+    ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                  "upstream \"%V\" has not responded in %M ms, "
+                  "the request is hedged", u->peer.name,
+                  ngx_current_msec - u->hedge_start);
+
+    u->hedge_connection = pc;
+
+    pc->read->handler = ngx_http_upstream_hedge_standby_handler;
+    pc->write->handler = ngx_http_upstream_hedge_standby_handler;
+
+    /*
+     * the hedged attempt gets a balancer of its own, so the original peer
+     * stays counted by its balancer while its connection is pending, and
+     * the peer that closes its connection is the one that is freed
+     */
+
+    u->hedge_peer = u->peer;
+    u->hedge_rr_data = u->rr_data;
+
+    u->peer.connection = NULL;
+    u->peer.data = NULL;
+
+    if (uscf->peer.init(r, uscf) != NGX_OK) {
+        u->hedge_connection = NULL;
+        u->peer = u->hedge_peer;
+        u->rr_data = u->hedge_rr_data;
 
-    if (u->input_filter_init(u->input_filter_ctx) == NGX_ERROR) {
         ngx_http_upstream_finalize_request(r, u,
                                            NGX_HTTP_INTERNAL_SERVER_ERROR);
+        ngx_http_run_posted_requests(c);
         return;
     }
 
-    n = u->buffer.last - u->buffer.pos;
+    /* the original peer is not chosen again, as if it was freed */
 
-    if (n) {
-        u->buffer.last -= n;
+    rrp = u->rr_data;
+    orrp = u->hedge_rr_data;
 
-        u->state->response_length += n;
+    if (orrp->peer && rrp->peers == orrp->peers && u->peer.tries > 1) {
+        n = orrp->current / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << orrp->current % (8 * sizeof(uintptr_t));
 
-        if (u->input_filter(u->input_filter_ctx, n) == NGX_ERROR) {
-            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-            return;
-        }
+        rrp->tried[n] |= m;
+        u->peer.tries--;
 
-        if (u->length == 0) {
-            ngx_http_upstream_finalize_request(r, u, 0);
-            return;
+        rrp->current = orrp->current + 1;
+
+        if (rrp->current >= rrp->peers->number) {
+            rrp->current = 0;
         }
     }
 
-    u->read_event_handler = ngx_http_upstream_process_body_in_memory;
+    ngx_http_upstream_connect(r, u);
 
-    ngx_http_upstream_process_body_in_memory(r, u);
+    ngx_http_run_posted_requests(c);
 }
 
 
-static ngx_int_t
-ngx_http_upstream_test_next(ngx_http_request_t *r, ngx_http_upstream_t *u)
+static void
+ngx_http_upstream_hedge_standby_handler(ngx_event_t *ev)
 {
-    ngx_uint_t                 status;
-    ngx_http_upstream_next_t  *un;
+    ngx_connection_t     *c;
+    ngx_http_request_t   *r;
+    ngx_http_upstream_t  *u;
 
-    status = u->headers_in.status_n;
+    if (ev->write) {
+        return;
+    }
 
-    for (un = ngx_http_upstream_next_errors; un->status; un++) {
+    c = ev->data;
+    r = c->data;
+    u = r->upstream;
 
-        if (status != un->status) {
-            continue;
-        }
+    if (ev->timedout) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http upstream hedged connection timed out");
 
-        if (u->peer.tries > 1 && (u->conf->next_upstream & un->mask)) {
-            ngx_http_upstream_next(r, u, un->mask);
-            return NGX_OK;
-        }
+        u->hedge_connection = NULL;
+        ngx_http_upstream_hedge_close(c);
 
-#if (NGX_HTTP_CACHE)
+        u->hedge_peer.connection = NULL;
+        u->hedge_peer.free(&u->hedge_peer, u->hedge_peer.data,
+                           NGX_PEER_FAILED);
+        ngx_http_upstream_queue_wake(u->upstream);
+        return;
+    }
 
-        if (u->cache_status == NGX_HTTP_CACHE_EXPIRED
-            && (u->conf->cache_use_stale & un->mask))
-        {
-            ngx_int_t  rc;
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream hedged original answers first");
 
-            rc = u->reinit_request(r);
+    /* the request may be freed while the header is processed */
 
-            if (rc == NGX_OK) {
-                u->cache_status = NGX_HTTP_CACHE_STALE;
-                rc = ngx_http_upstream_cache_send(r, u);
-            }
+    c = r->connection;
 
-            ngx_http_upstream_finalize_request(r, u, rc);
-            return NGX_OK;
-        }
+    ngx_http_upstream_hedge_restore(r, u);
 
-#endif
-    }
+    ngx_http_upstream_process_header(r, u);
 
-    return NGX_DECLINED;
+    ngx_http_run_posted_requests(c);
 }
 
 
-static ngx_int_t
-ngx_http_upstream_intercept_errors(ngx_http_request_t *r,
+/*
+ * the hedged attempt is closed and the original connection is used
+ * again with its balancer; the hedged attempt has not read anything,
+ * so the response parser is still in its initial state
+ */
+
+static void
+ngx_http_upstream_hedge_restore(ngx_http_request_t *r,
     ngx_http_upstream_t *u)
 {
-    ngx_int_t                  status;
-    ngx_uint_t                 i;
-    ngx_table_elt_t           *h;
-    ngx_http_err_page_t       *err_page;
-    ngx_http_core_loc_conf_t  *clcf;
+    ngx_connection_t  *c;
 
-    status = u->headers_in.status_n;
+    if (u->peer.connection) {
 
-    if (status == NGX_HTTP_NOT_FOUND && u->conf->intercept_404) {
-        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_NOT_FOUND);
-        return NGX_OK;
-    }
+        /* the original peer answers first, the hedged peer is released */
 
-    if (!u->conf->intercept_errors) {
-        return NGX_DECLINED;
+        ngx_http_upstream_hedge_close(u->peer.connection);
+        u->peer.connection = NULL;
+
+        u->peer.free(&u->peer, u->peer.data, 0);
+        ngx_http_upstream_queue_wake(u->upstream);
     }
 
-    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    c = u->hedge_connection;
 
-    if (clcf->error_pages == NULL) {
-        return NGX_DECLINED;
+    u->hedge_connection = NULL;
+    u->peer = u->hedge_peer;
+    u->rr_data = u->hedge_rr_data;
+
+    if (u->state) {
+        u->state->peer = u->peer.name;
     }
 
-    err_page = clcf->error_pages->elts;
-    for (i = 0; i < clcf->error_pages->nelts; i++) {
+    c->read->handler = ngx_http_upstream_handler;
+    c->write->handler = ngx_http_upstream_handler;
 
-        if (err_page[i].status == status) {
+    u->write_event_handler = ngx_http_upstream_dummy_handler;
+    u->read_event_handler = ngx_http_upstream_process_header;
 
-            if (status == NGX_HTTP_UNAUTHORIZED
-                && u->headers_in.www_authenticate)
-            {
-                h = ngx_list_push(&r->headers_out.headers);
+    u->writer.connection = c;
+    u->request_sent = 1;
+}
 
-                if (h == NULL) {
-                    ngx_http_upstream_finalize_request(r, u,
-                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
-                    return NGX_OK;
-                }
 
-                *h = *u->headers_in.www_authenticate;
+static void
+ngx_http_upstream_hedge_cancel(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    if (u->hedge_event.timer_set) {
+        ngx_del_timer(&u->hedge_event);
+    }
 
-                r->headers_out.www_authenticate = h;
-            }
+    if (u->hedge_connection) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http upstream close hedged connection");
 
-#if (NGX_HTTP_CACHE)
+        ngx_http_upstream_hedge_close(u->hedge_connection);
+        u->hedge_connection = NULL;
 
-            if (r->cache) {
-                time_t  valid;
+        /* the original peer is released by its own balancer */
 
-                valid = ngx_http_file_cache_valid(u->conf->cache_valid, status);
+        u->hedge_peer.connection = NULL;
+        u->hedge_peer.free(&u->hedge_peer, u->hedge_peer.data, 0);
+        ngx_http_upstream_queue_wake(u->upstream);
+    }
+}
 
-                if (valid) {
-                    r->cache->valid_sec = ngx_time() + valid;
-                    r->cache->error = status;
-                }
 
-                ngx_http_file_cache_free(r->cache, u->pipe->temp_file);
-            }
-#endif
-            ngx_http_upstream_finalize_request(r, u, status);
+static void
+ngx_http_upstream_hedge_update(ngx_http_upstream_t *u)
+{
+    ngx_uint_t                     i, n;
+    ngx_msec_t                     time;
+    ngx_http_upstream_srv_conf_t  *uscf;
 
-            return NGX_OK;
-        }
+    uscf = u->upstream;
+
+    if (uscf == NULL || u->hedge_start == 0) {
+        return;
     }
 
-    return NGX_DECLINED;
+    uscf->hedge_requests++;
+
+    if (uscf->hedge_requests >= 1000) {
+        uscf->hedge_requests /= 2;
+        uscf->hedged /= 2;
+    }
+
+    /* the response time of the hedged requests is not representative */
+
+    if (u->hedged) {
+        return;
+    }
+
+    time = ngx_current_msec - u->hedge_start;
+
+    for (i = 0; time && i < NGX_HTTP_UPSTREAM_HEDGE_HIST - 1; i++) {
+        time >>= 1;
+    }
+
+    uscf->hedge_hist[i]++;
+    uscf->hedge_samples++;
+
+    /* the old samples decay */
+
+    if (uscf->hedge_samples >= 10000) {
+        n = 0;
+
+        for (i = 0; i < NGX_HTTP_UPSTREAM_HEDGE_HIST; i++) {
+            uscf->hedge_hist[i] /= 2;
+            n += uscf->hedge_hist[i];
+        }
+
+        uscf->hedge_samples = n;
+    }
 }
 
 
-static ngx_int_t
-ngx_http_upstream_test_connect(ngx_connection_t *c)
+static void
+ngx_http_upstream_hedge_close(ngx_connection_t *c)
 {
-    int        err;
-    socklen_t  len;
+#if (NGX_HTTP_SSL)
 
-#if (NGX_HAVE_KQUEUE)
+    if (c->ssl) {
+        c->ssl->no_wait_shutdown = 1;
+        c->ssl->no_send_shutdown = 1;
 
-    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT)  {
-        if (c->write->pending_eof) {
-            c->log->action = "connecting to upstream";
-            (void) ngx_connection_error(c, c->write->kq_errno,
-                                    "kevent() reported that connect() failed");
-            return NGX_ERROR;
-        }
+        (void) ngx_ssl_shutdown(c);
+    }
 
-    } else
 #endif
+
+    if (c->pool) {
+        ngx_destroy_pool(c->pool);
+    }
+
+    ngx_close_connection(c);
+}
+
+static ngx_int_t
+ngx_http_upstream_reinit(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_chain_t  *cl;
+
+    if (u->reinit_request(r) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    u->keepalive = 0;
+
+    ngx_memzero(&u->headers_in, sizeof(ngx_http_upstream_headers_in_t));
+
+    if (ngx_list_init(&u->headers_in.headers, r->pool, 8,
+                      sizeof(ngx_table_elt_t))
+        != NGX_OK)
     {
-        err = 0;
-        len = sizeof(int);
+        return NGX_ERROR;
+    }
 
-        /*
-         * BSDs and Linux return 0 and set a pending error in err
-         * Solaris returns -1 and sets errno
-         */
+#if (NGX_HTTP_CACHE)
 
-        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
-            == -1)
-        {
-            err = ngx_errno;
-        }
+    if (r->cache) {
+        r->cache->vary.len = 0;
+        r->cache->tags = NULL;
+    }
 
-        if (err) {
-            c->log->action = "connecting to upstream";
-            (void) ngx_connection_error(c, err, "connect() failed");
+#endif
+
+    /* reinit the request chain */
+
+    for (cl = u->request_bufs; cl; cl = cl->next) {
+        cl->buf->pos = cl->buf->start;
+        cl->buf->file_pos = 0;
+    }
+
+    /* reinit the subrequest's ngx_output_chain() context */
+
+    if (r->request_body && r->request_body->temp_file
+        && r != r->main && u->output.buf)
+    {
+        u->output.free = ngx_alloc_chain_link(r->pool);
+        if (u->output.free == NULL) {
             return NGX_ERROR;
         }
+
+        u->output.free->buf = u->output.buf;
+        u->output.free->next = NULL;
+
+        u->output.buf->pos = u->output.buf->start;
+        u->output.buf->last = u->output.buf->start;
+    }
+
+    u->output.buf = NULL;
+    u->output.in = NULL;
+    u->output.busy = NULL;
+
+    /* reinit u->buffer */
+
+    u->buffer.pos = u->buffer.start;
+
+#if (NGX_HTTP_CACHE)
+
+    if (r->cache) {
+        u->buffer.pos += r->cache->header_start;
     }
 
+#endif
+
+    u->buffer.last = u->buffer.pos;
+
     return NGX_OK;
 }
 
 
-static ngx_int_t
-ngx_http_upstream_process_headers(ngx_http_request_t *r, ngx_http_upstream_t *u)
+static void
+ngx_http_upstream_send_request(ngx_http_request_t *r, ngx_http_upstream_t *u)
 {
-    ngx_str_t                      *uri, args;
-    ngx_uint_t                      i, flags;
-    ngx_list_part_t                *part;
-    ngx_table_elt_t                *h;
-    ngx_http_upstream_header_t     *hh;
-    ngx_http_upstream_main_conf_t  *umcf;
+    ngx_int_t          rc;
+    ngx_connection_t  *c;
 
-    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+    c = u->peer.connection;
 
-    if (u->headers_in.x_accel_redirect
-        && !(u->conf->ignore_headers & NGX_HTTP_UPSTREAM_IGN_XA_REDIRECT))
-    {
-        ngx_http_upstream_finalize_request(r, u, NGX_DECLINED);
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream send request");
+	NGX_LOG(LOG_DEBUG, "http upstream send request");
 
-        part = &u->headers_in.headers.part;
-        h = part->elts;
+    if (!u->request_sent && ngx_http_upstream_test_connect(c) != NGX_OK) {
+        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
+        return;
+    }
 
-        for (i = 0; /* void */; i++) {
+    c->log->action = "sending request to upstream";
 
-            if (i >= part->nelts) {
-                if (part->next == NULL) {
-                    break;
-                }
+    rc = ngx_output_chain(&u->output, u->request_sent ? NULL : u->request_bufs);
 
-                part = part->next;
-                h = part->elts;
-                i = 0;
-            }
+    u->request_sent = 1;
 
-            hh = ngx_hash_find(&umcf->headers_in_hash, h[i].hash,
-                               h[i].lowcase_key, h[i].key.len);
+    if (rc == NGX_ERROR) {
+        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
+        return;
+    }
 
-            if (hh && hh->redirect) {
-                if (hh->copy_handler(r, &h[i], hh->conf) != NGX_OK) {
-                    ngx_http_finalize_request(r,
-                                              NGX_HTTP_INTERNAL_SERVER_ERROR);
-                    return NGX_DONE;
-                }
-            }
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    if (rc == NGX_AGAIN) {
+        ngx_add_timer(c->write, u->conf->send_timeout);
+
+        if (ngx_handle_write_event(c->write, u->conf->send_lowat) != NGX_OK) {
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
         }
 
-        uri = &u->headers_in.x_accel_redirect->value;
-        ngx_str_null(&args);
-        flags = NGX_HTTP_LOG_UNSAFE;
+        return;
+    }
 
-        if (ngx_http_parse_unsafe_uri(r, uri, &args, &flags) != NGX_OK) {
-			NGX_LOG(LOG_DEBUG, "++++++++++++++++++++++++++++++++++++");
-            ngx_http_finalize_request(r, NGX_HTTP_NOT_FOUND);
-            return NGX_DONE;
+    /* rc == NGX_OK */
+
+    if (c->tcp_nopush == NGX_TCP_NOPUSH_SET) {
+        if (ngx_tcp_push(c->fd) == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, c->log, ngx_socket_errno,
+                          ngx_tcp_push_n " failed");
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
         }
 
-        if (r->method != NGX_HTTP_HEAD) {
-            r->method = NGX_HTTP_GET;
+        c->tcp_nopush = NGX_TCP_NOPUSH_UNSET;
+    }
+
+    ngx_add_timer(c->read, u->conf->read_timeout);
+
+    if (u->conf->hedge) {
+        ngx_http_upstream_hedge_init(r, u);
+    }
+
+#if 1
+    if (c->read->ready) {
+
+        /* post aio operation */
+
+        /*
+         * TODO comment
+         * although we can post aio operation just in the end
+         * of ngx_http_upstream_connect() CHECK IT !!!
+         * it's better to do here because we postpone header buffer allocation
+         */
+
+        ngx_http_upstream_process_header(r, u);
+        return;
+    }
+#endif
+
+    u->write_event_handler = ngx_http_upstream_dummy_handler;
+
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+}
+
+
+static void
+ngx_http_upstream_send_request_handler(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    ngx_connection_t  *c;
+
+    c = u->peer.connection;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream send request handler");
+	NGX_LOG(LOG_DEBUG, "http upstream send request handler");
+
+    if (c->write->timedout) {
+        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_TIMEOUT);
+        return;
+    }
+
+#if (NGX_HTTP_SSL)
+
+    if (u->ssl && c->ssl == NULL) {
+        ngx_http_upstream_ssl_init_connection(r, u, c);
+        return;
+    }
+
+#endif
+
+    if (u->header_sent) {
+        u->write_event_handler = ngx_http_upstream_dummy_handler;
+
+        (void) ngx_handle_write_event(c->write, 0);
+
+        return;
+    }
+
+    ngx_http_upstream_send_request(r, u);
+}
+
+
+static void
+ngx_http_upstream_process_header(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ssize_t            n;
+    ngx_int_t          rc;
+    ngx_connection_t  *c;
+
+    c = u->peer.connection;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream process header");
+	NGX_LOG(LOG_DEBUG, "http upstream process header");
+
+    c->log->action = "reading response header from upstream";
+
+    if (c->read->timedout) {
+        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_TIMEOUT);
+        return;
+    }
+
+    if (!u->request_sent && ngx_http_upstream_test_connect(c) != NGX_OK) {
+        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
+        return;
+    }
+
+    if (u->buffer.start == NULL) {
+        u->buffer.start = ngx_palloc(r->pool, u->conf->buffer_size);
+        if (u->buffer.start == NULL) {
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+        u->buffer.pos = u->buffer.start;
+        u->buffer.last = u->buffer.start;
+        u->buffer.end = u->buffer.start + u->conf->buffer_size;
+        u->buffer.temporary = 1;
+
+        u->buffer.tag = u->output.tag;
+
+        if (ngx_list_init(&u->headers_in.headers, r->pool, 8,
+                          sizeof(ngx_table_elt_t))
+            != NGX_OK)
+        {
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+#if (NGX_HTTP_CACHE)
+
+        if (r->cache) {
+            u->buffer.pos += r->cache->header_start;
+            u->buffer.last = u->buffer.pos;
+        }
+#endif
+    }
+
+    for ( ;; ) {
+
+        n = c->recv(c, u->buffer.last, u->buffer.end - u->buffer.last);
+
+        if (n == NGX_AGAIN) {
+#if 0
+            ngx_add_timer(rev, u->read_timeout);
+#endif
+
+            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+                ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+                return;
+            }
+
+            return;
+        }
+
+        if (n == 0) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "upstream prematurely closed connection");
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
+            return;
+        }
+
+        u->buffer.last += n;
+
+        if (u->hedge_event.timer_set || u->hedge_connection) {
+            ngx_http_upstream_hedge_cancel(r, u);
+        }
+
+#if 0
+        u->valid_header_in = 0;
+
+        u->peer.cached = 0;
+#endif
+
+        rc = u->process_header(r);
+
+        if (rc == NGX_AGAIN) {
+
+            if (u->buffer.pos == u->buffer.end) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                              "upstream sent too big header");
+
+                ngx_http_upstream_next(r, u,
+                                       NGX_HTTP_UPSTREAM_FT_INVALID_HEADER);
+                return;
+            }
+
+            continue;
+        }
+
+        break;
+    }
+
+    if (rc == NGX_HTTP_UPSTREAM_INVALID_HEADER) {
+        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_INVALID_HEADER);
+        return;
+    }
+
+    if (rc == NGX_ERROR) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    /* rc == NGX_OK */
+
+    if (u->hedge_start) {
+        ngx_http_upstream_hedge_update(u);
+    }
+
+    if (u->headers_in.status_n > NGX_HTTP_SPECIAL_RESPONSE) {
+
+        if (r->subrequest_in_memory) {
+            u->buffer.last = u->buffer.pos;
+        }
+
+        if (ngx_http_upstream_test_next(r, u) == NGX_OK) {
+            return;
+        }
+
+        if (ngx_http_upstream_intercept_errors(r, u) == NGX_OK) {
+            return;
+        }
+    }
+
+    if (ngx_http_upstream_process_headers(r, u) != NGX_OK) {
+        return;
+    }
+
+    if (!r->subrequest_in_memory) {
+        ngx_http_upstream_send_response(r, u);
+        return;
+    }
+
+    /* subrequest content in memory */
+
+    if (u->input_filter == NULL) {
+        u->input_filter_init = ngx_http_upstream_non_buffered_filter_init;
+        u->input_filter = ngx_http_upstream_non_buffered_filter;
+        u->input_filter_ctx = r;
+    }
+
+    if (u->input_filter_init(u->input_filter_ctx) == NGX_ERROR) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    n = u->buffer.last - u->buffer.pos;
+
+    if (n) {
+        u->buffer.last -= n;
+
+        u->state->response_length += n;
+
+        if (u->input_filter(u->input_filter_ctx, n) == NGX_ERROR) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+    }
+
+    if (u->length == 0) {
+        ngx_http_upstream_finalize_request(r, u, 0);
+        return;
+    }
+
+    u->read_event_handler = ngx_http_upstream_process_body_in_memory;
+
+    ngx_http_upstream_process_body_in_memory(r, u);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_test_next(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_uint_t                 status;
+    ngx_http_upstream_next_t  *un;
+
+    status = u->headers_in.status_n;
+
+    for (un = ngx_http_upstream_next_errors; un->status; un++) {
+
+        if (status != un->status) {
+            continue;
+        }
+
+        if (u->peer.tries > 1 && (u->conf->next_upstream & un->mask)) {
+            ngx_http_upstream_next(r, u, un->mask);
+            return NGX_OK;
+        }
+
+#if (NGX_HTTP_CACHE)
+
+        if (u->cache_status == NGX_HTTP_CACHE_EXPIRED
+            && (u->conf->cache_use_stale & un->mask))
+        {
+            ngx_int_t  rc;
+
+            rc = u->reinit_request(r);
+
+            if (rc == NGX_OK) {
+                u->cache_status = NGX_HTTP_CACHE_STALE;
+                rc = ngx_http_upstream_cache_send(r, u);
+            }
+
+            ngx_http_upstream_finalize_request(r, u, rc);
+            return NGX_OK;
+        }
+
+#endif
+    }
+
+    return NGX_DECLINED;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_intercept_errors(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    ngx_int_t                  status;
+    ngx_uint_t                 i;
+    ngx_table_elt_t           *h;
+    ngx_http_err_page_t       *err_page;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    status = u->headers_in.status_n;
+
+    if (status == NGX_HTTP_NOT_FOUND && u->conf->intercept_404) {
+        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_NOT_FOUND);
+        return NGX_OK;
+    }
+
+    if (!u->conf->intercept_errors) {
+        return NGX_DECLINED;
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (clcf->error_pages == NULL) {
+        return NGX_DECLINED;
+    }
+
+    err_page = clcf->error_pages->elts;
+    for (i = 0; i < clcf->error_pages->nelts; i++) {
+
+        if (err_page[i].status == status) {
+
+            if (status == NGX_HTTP_UNAUTHORIZED
+                && u->headers_in.www_authenticate)
+            {
+                h = ngx_list_push(&r->headers_out.headers);
+
+                if (h == NULL) {
+                    ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+                    return NGX_OK;
+                }
+
+                *h = *u->headers_in.www_authenticate;
+
+                r->headers_out.www_authenticate = h;
+            }
+
+#if (NGX_HTTP_CACHE)
+
+            if (r->cache) {
+                time_t  valid;
+
+                valid = ngx_http_file_cache_valid(u->conf->cache_valid, status);
+
+                if (valid) {
+                    r->cache->valid_sec = ngx_time() + valid;
+                    r->cache->error = status;
+                }
+
+                ngx_http_file_cache_free(r->cache, u->pipe->temp_file);
+            }
+#endif
+            ngx_http_upstream_finalize_request(r, u, status);
+
+            return NGX_OK;
+        }
+    }
+
+    return NGX_DECLINED;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_test_connect(ngx_connection_t *c)
+{
+    int        err;
+    socklen_t  len;
+
+#if (NGX_HAVE_KQUEUE)
+
+    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT)  {
+        if (c->write->pending_eof) {
+            c->log->action = "connecting to upstream";
+            (void) ngx_connection_error(c, c->write->kq_errno,
+                                    "kevent() reported that connect() failed");
+            return NGX_ERROR;
+        }
+
+    } else
+#endif
+    {
+        err = 0;
+        len = sizeof(int);
+
+        /*
+         * BSDs and Linux return 0 and set a pending error in err
+         * Solaris returns -1 and sets errno
+         */
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+            == -1)
+        {
+            err = ngx_errno;
+        }
+
+        if (err) {
+            c->log->action = "connecting to upstream";
+            (void) ngx_connection_error(c, err, "connect() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_process_headers(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_str_t                      *uri, args;
+    ngx_uint_t                      i, flags;
+    ngx_list_part_t                *part;
+    ngx_table_elt_t                *h;
+    ngx_http_upstream_header_t     *hh;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+
+    if (u->headers_in.x_accel_redirect
+        && !(u->conf->ignore_headers & NGX_HTTP_UPSTREAM_IGN_XA_REDIRECT))
+    {
+        ngx_http_upstream_finalize_request(r, u, NGX_DECLINED);
+
+        part = &u->headers_in.headers.part;
+        h = part->elts;
+
+        for (i = 0; /* void */; i++) {
+
+            if (i >= part->nelts) {
+                if (part->next == NULL) {
+                    break;
+                }
+
+                part = part->next;
+                h = part->elts;
+                i = 0;
+            }
+
+            hh = ngx_hash_find(&umcf->headers_in_hash, h[i].hash,
+                               h[i].lowcase_key, h[i].key.len);
+
+            if (hh && hh->redirect) {
+                if (hh->copy_handler(r, &h[i], hh->conf) != NGX_OK) {
+                    ngx_http_finalize_request(r,
+                                              NGX_HTTP_INTERNAL_SERVER_ERROR);
+                    return NGX_DONE;
+                }
+            }
+        }
+
+        uri = &u->headers_in.x_accel_redirect->value;
+        ngx_str_null(&args);
+        flags = NGX_HTTP_LOG_UNSAFE;
+
+        if (ngx_http_parse_unsafe_uri(r, uri, &args, &flags) != NGX_OK) {
+			NGX_LOG(LOG_DEBUG, "++++++++++++++++++++++++++++++++++++");
+            ngx_http_finalize_request(r, NGX_HTTP_NOT_FOUND);
+            return NGX_DONE;
+        }
+
+        if (r->method != NGX_HTTP_HEAD) {
+            r->method = NGX_HTTP_GET;
+        }
+
+        r->valid_unparsed_uri = 0;
+
+        ngx_http_internal_redirect(r, uri, &args);
+        ngx_http_finalize_request(r, NGX_DONE);
+        return NGX_DONE;
+    }
+
+    part = &u->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        if (ngx_hash_find(&u->conf->hide_headers_hash, h[i].hash,
+                          h[i].lowcase_key, h[i].key.len))
+        {
+            continue;
+        }
+
+        hh = ngx_hash_find(&umcf->headers_in_hash, h[i].hash,
+                           h[i].lowcase_key, h[i].key.len);
+
+        if (hh) {
+            if (hh->copy_handler(r, &h[i], hh->conf) != NGX_OK) {
+                ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+                return NGX_DONE;
+            }
+
+            continue;
+        }
+
+        if (ngx_http_upstream_copy_header_line(r, &h[i], 0) != NGX_OK) {
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return NGX_DONE;
+        }
+    }
+
+    if (r->headers_out.server && r->headers_out.server->value.data == NULL) {
+        r->headers_out.server->hash = 0;
+    }
+
+    if (r->headers_out.date && r->headers_out.date->value.data == NULL) {
+        r->headers_out.date->hash = 0;
+    }
+
+    r->headers_out.status = u->headers_in.status_n;
+    r->headers_out.status_line = u->headers_in.status_line;
+
+    u->headers_in.content_length_n = r->headers_out.content_length_n;
+
+    if (r->headers_out.content_length_n != -1) {
+        u->length = (size_t) r->headers_out.content_length_n;
+
+    } else {
+        u->length = NGX_MAX_SIZE_T_VALUE;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_process_body_in_memory(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    size_t             size;
+    ssize_t            n;
+    ngx_buf_t         *b;
+    ngx_event_t       *rev;
+    ngx_connection_t  *c;
+
+    c = u->peer.connection;
+    rev = c->read;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream process body on memory");
+	NGX_LOG(LOG_DEBUG, "http upstream process body on memory");
+
+    if (rev->timedout) {
+        ngx_connection_error(c, NGX_ETIMEDOUT, "upstream timed out");
+        ngx_http_upstream_finalize_request(r, u, NGX_ETIMEDOUT);
+        return;
+    }
+
+    b = &u->buffer;
+
+    for ( ;; ) {
+
+        size = b->end - b->last;
+
+        if (size == 0) {
+            ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                          "upstream buffer is too small to read response");
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+
+        n = c->recv(c, b->last, size);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == 0 || n == NGX_ERROR) {
+            ngx_http_upstream_finalize_request(r, u, n);
+            return;
+        }
+
+        u->state->response_length += n;
+
+        if (u->input_filter(u->input_filter_ctx, n) == NGX_ERROR) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+
+        if (u->length == 0) {
+            ngx_http_upstream_finalize_request(r, u, 0);
+            return;
+        }
+
+        if (!rev->ready) {
+            break;
+        }
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+        return;
+    }
+
+    if (rev->active) {
+        ngx_add_timer(rev, u->conf->read_timeout);
+
+    } else if (rev->timer_set) {
+        ngx_del_timer(rev);
+    }
+}
+
+
+static void
+ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    int                        tcp_nodelay;
+    ssize_t                    n;
+    ngx_int_t                  rc;
+    ngx_event_pipe_t          *p;
+    ngx_connection_t          *c;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->post_action) {
+        ngx_http_upstream_finalize_request(r, u, rc);
+        return;
+    }
+
+    c = r->connection;
+
+    if (r->header_only) {
+
+        if (u->cacheable || u->store) {
+
+            if (ngx_shutdown_socket(c->fd, NGX_WRITE_SHUTDOWN) == -1) {
+                ngx_connection_error(c, ngx_socket_errno,
+                                     ngx_shutdown_socket_n " failed");
+            }
+
+            r->read_event_handler = ngx_http_request_empty_handler;
+            r->write_event_handler = ngx_http_request_empty_handler;
+            c->error = 1;
+
+        } else {
+            ngx_http_upstream_finalize_request(r, u, rc);
+            return;
+        }
+    }
+
+    u->header_sent = 1;
+
+    if (r->request_body && r->request_body->temp_file) {
+        ngx_pool_run_cleanup_file(r->pool, r->request_body->temp_file->file.fd);
+        r->request_body->temp_file->file.fd = NGX_INVALID_FILE;
+    }
+
+    if (u->upgrade) {
+        ngx_http_upstream_upgrade(r, u);
+        return;
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (!u->buffering) {
+
+        if (u->input_filter == NULL) {
+            u->input_filter_init = ngx_http_upstream_non_buffered_filter_init;
+            u->input_filter = ngx_http_upstream_non_buffered_filter;
+            u->input_filter_ctx = r;
+        }
+
+        u->read_event_handler = ngx_http_upstream_process_non_buffered_upstream;
+        r->write_event_handler =
+                             ngx_http_upstream_process_non_buffered_downstream;
+
+        r->limit_rate = 0;
+
+        if (u->input_filter_init(u->input_filter_ctx) == NGX_ERROR) {
+            ngx_http_upstream_finalize_request(r, u, 0);
+            return;
+        }
+
+        if (clcf->tcp_nodelay && c->tcp_nodelay == NGX_TCP_NODELAY_UNSET) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "tcp_nodelay");
+
+            tcp_nodelay = 1;
+
+            if (setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY,
+                               (const void *) &tcp_nodelay, sizeof(int)) == -1)
+            {
+                ngx_connection_error(c, ngx_socket_errno,
+                                     "setsockopt(TCP_NODELAY) failed");
+                ngx_http_upstream_finalize_request(r, u, 0);
+                return;
+            }
+
+            c->tcp_nodelay = NGX_TCP_NODELAY_SET;
+        }
+
+        n = u->buffer.last - u->buffer.pos;
+
+        if (n) {
+            u->buffer.last = u->buffer.pos;
+
+            u->state->response_length += n;
+
+            if (u->input_filter(u->input_filter_ctx, n) == NGX_ERROR) {
+                ngx_http_upstream_finalize_request(r, u, 0);
+                return;
+            }
+
+            ngx_http_upstream_process_non_buffered_downstream(r);
+
+        } else {
+            u->buffer.pos = u->buffer.start;
+            u->buffer.last = u->buffer.start;
+
+            if (ngx_http_send_special(r, NGX_HTTP_FLUSH) == NGX_ERROR) {
+                ngx_http_upstream_finalize_request(r, u, 0);
+                return;
+            }
+
+            if (u->peer.connection->read->ready || u->length == 0) {
+                ngx_http_upstream_process_non_buffered_upstream(r, u);
+            }
+        }
+
+        return;
+    }
+
+    /* TODO: preallocate event_pipe bufs, look "Content-Length" */
+
+#if (NGX_HTTP_CACHE)
+
+    if (r->cache && r->cache->file.fd != NGX_INVALID_FILE) {
+        ngx_pool_run_cleanup_file(r->pool, r->cache->file.fd);
+        r->cache->file.fd = NGX_INVALID_FILE;
+    }
+
+    switch (ngx_http_test_predicates(r, u->conf->no_cache)) {
+
+    case NGX_ERROR:
+        ngx_http_upstream_finalize_request(r, u, 0);
+        return;
+
+    case NGX_DECLINED:
+        u->cacheable = 0;
+        break;
+
+    default: /* NGX_OK */
+
+        if (u->cache_status == NGX_HTTP_CACHE_BYPASS) {
+
+            r->cache->min_uses = u->conf->cache_min_uses;
+            r->cache->body_start = u->conf->buffer_size;
+            r->cache->file_cache = u->conf->cache->data;
+
+            if (ngx_http_file_cache_create(r) != NGX_OK) {
+                ngx_http_upstream_finalize_request(r, u, 0);
+                return;
+            }
+
+            u->cacheable = 1;
+        }
+
+        break;
+    }
+
+    if (u->cacheable) {
+        time_t  now, valid;
+
+        now = ngx_time();
+
+        valid = r->cache->valid_sec;
+
+        if (valid == 0) {
+            valid = ngx_http_file_cache_valid(u->conf->cache_valid,
+                                              u->headers_in.status_n);
+            if (valid) {
+                r->cache->valid_sec = now + valid;
+            }
+        }
+
+        if (valid) {
+            r->cache->last_modified = r->headers_out.last_modified_time;
+            r->cache->date = now;
+            r->cache->body_start = (u_short) (u->buffer.pos - u->buffer.start);
+
+            if (ngx_http_file_cache_set_header(r, u->buffer.start) != NGX_OK) {
+                ngx_http_upstream_finalize_request(r, u, 0);
+                return;
+            }
+
+        } else {
+            u->cacheable = 0;
+            r->headers_out.last_modified_time = -1;
+        }
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http cacheable: %d", u->cacheable);
+	NGX_LOG(LOG_DEBUG, "http cacheable: %d", u->cacheable);
+
+    if (u->cacheable == 0 && r->cache) {
+        ngx_http_file_cache_free(r->cache, u->pipe->temp_file);
+    }
+
+#endif
+
+    p = u->pipe;
+
+    p->output_filter = (ngx_event_pipe_output_filter_pt) ngx_http_output_filter;
+    p->output_ctx = r;
+    p->tag = u->output.tag;
+    p->bufs = u->conf->bufs;
+    p->busy_size = u->conf->busy_buffers_size;
+    p->upstream = u->peer.connection;
+    p->downstream = c;
+    p->pool = r->pool;
+    p->log = c->log;
+
+    p->cacheable = u->cacheable || u->store;
+
+    p->temp_file = ngx_pcalloc(r->pool, sizeof(ngx_temp_file_t));
+    if (p->temp_file == NULL) {
+        ngx_http_upstream_finalize_request(r, u, 0);
+        return;
+    }
+
+    p->temp_file->file.fd = NGX_INVALID_FILE;
+    p->temp_file->file.log = c->log;
+    p->temp_file->path = u->conf->temp_path;
+    p->temp_file->pool = r->pool;
+
+#if (NGX_HTTP_CACHE)
+
+    if (u->cacheable && r->cache && r->cache->disk
+        && r->cache->disk->temp_path)
+    {
+        p->temp_file->path = r->cache->disk->temp_path;
+    }
+
+#endif
+
+    if (p->cacheable) {
+        p->temp_file->persistent = 1;
+
+    } else {
+        p->temp_file->log_level = NGX_LOG_WARN;
+        p->temp_file->warn = "an upstream response is buffered "
+                             "to a temporary file";
+    }
+
+    p->max_temp_file_size = u->conf->max_temp_file_size;
+    p->temp_file_write_size = u->conf->temp_file_write_size;
+
+    p->preread_bufs = ngx_alloc_chain_link(r->pool);
+    if (p->preread_bufs == NULL) {
+        ngx_http_upstream_finalize_request(r, u, 0);
+        return;
+    }
+
+    p->preread_bufs->buf = &u->buffer;
+    p->preread_bufs->next = NULL;
+    u->buffer.recycled = 1;
+
+    p->preread_size = u->buffer.last - u->buffer.pos;
+
+    if (u->cacheable) {
+
+        p->buf_to_file = ngx_calloc_buf(r->pool);
+        if (p->buf_to_file == NULL) {
+            ngx_http_upstream_finalize_request(r, u, 0);
+            return;
+        }
+
+        p->buf_to_file->pos = u->buffer.start;
+        p->buf_to_file->last = u->buffer.pos;
+        p->buf_to_file->temporary = 1;
+    }
+
+    if (ngx_event_flags & NGX_USE_AIO_EVENT) {
+        /* the posted aio operation may currupt a shadow buffer */
+        p->single_buf = 1;
+    }
+
+    /* TODO: p->free_bufs = 0 if use ngx_create_chain_of_bufs() */
+    p->free_bufs = 1;
+
+    /*
+     * event_pipe would do u->buffer.last += p->preread_size
+     * as though these bytes were read
+     */
+    u->buffer.last = u->buffer.pos;
+
+    if (u->conf->cyclic_temp_file) {
+
+        /*
+         * we need to disable the use of sendfile() if we use cyclic temp file
+         * because the writing a new data may interfere with sendfile()
+         * that uses the same kernel file pages (at least on FreeBSD)
+         */
+
+        p->cyclic_temp_file = 1;
+        c->sendfile = 0;
+
+    } else {
+        p->cyclic_temp_file = 0;
+    }
+
+    p->read_timeout = u->conf->read_timeout;
+    p->send_timeout = clcf->send_timeout;
+    p->send_lowat = clcf->send_lowat;
+
+    p->length = -1;
+
+    if (u->input_filter_init
+        && u->input_filter_init(p->input_ctx) != NGX_OK)
+    {
+        ngx_http_upstream_finalize_request(r, u, 0);
+        return;
+    }
+
+    u->read_event_handler = ngx_http_upstream_process_upstream;
+    r->write_event_handler = ngx_http_upstream_process_downstream;
+
+    ngx_http_upstream_process_upstream(r, u);
+}
+
+
+static void
+ngx_http_upstream_process_non_buffered_downstream(ngx_http_request_t *r)
+{
+    ngx_event_t          *wev;
+    ngx_connection_t     *c;
+    ngx_http_upstream_t  *u;
+
+    c = r->connection;
+    u = r->upstream;
+    wev = c->write;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream process non buffered downstream");
+	NGX_LOG(LOG_DEBUG, "http upstream process non buffered downstream");
+
+    c->log->action = "sending to client";
+
+    if (wev->timedout) {
+        c->timedout = 1;
+        ngx_connection_error(c, NGX_ETIMEDOUT, "client timed out");
+        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    ngx_http_upstream_process_non_buffered_request(r, 1);
+}
+
+
+static void
+ngx_http_upstream_process_non_buffered_upstream(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    ngx_connection_t  *c;
+
+    c = u->peer.connection;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream process non buffered upstream");
+	NGX_LOG(LOG_DEBUG, "http upstream process non buffered upstream");
+
+    c->log->action = "reading upstream";
+
+    if (c->read->timedout) {
+        ngx_connection_error(c, NGX_ETIMEDOUT, "upstream timed out");
+        ngx_http_upstream_finalize_request(r, u, 0);
+        return;
+    }
+
+    ngx_http_upstream_process_non_buffered_request(r, 0);
+}
+
+
+static void
+ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
+    ngx_uint_t do_write)
+{
+    size_t                     size;
+    ssize_t                    n;
+    ngx_buf_t                 *b;
+    ngx_int_t                  rc;
+    ngx_connection_t          *downstream, *upstream;
+    ngx_http_upstream_t       *u;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    u = r->upstream;
+    downstream = r->connection;
+    upstream = u->peer.connection;
+
+    b = &u->buffer;
+
+    do_write = do_write || u->length == 0;
+
+    for ( ;; ) {
+
+        if (do_write) {
+
+            if (u->out_bufs || u->busy_bufs) {
+                rc = ngx_http_output_filter(r, u->out_bufs);
+
+                if (rc == NGX_ERROR) {
+                    ngx_http_upstream_finalize_request(r, u, 0);
+                    return;
+                }
+
+                ngx_chain_update_chains(&u->free_bufs, &u->busy_bufs,
+                                        &u->out_bufs, u->output.tag);
+            }
+
+            if (u->busy_bufs == NULL) {
+
+                if (u->length == 0
+                    || upstream->read->eof
+                    || upstream->read->error)
+                {
+                    ngx_http_upstream_finalize_request(r, u, 0);
+                    return;
+                }
+
+                b->pos = b->start;
+                b->last = b->start;
+            }
         }
 
-        r->valid_unparsed_uri = 0;
+        size = b->end - b->last;
 
-        ngx_http_internal_redirect(r, uri, &args);
-        ngx_http_finalize_request(r, NGX_DONE);
-        return NGX_DONE;
-    }
+        if (size > u->length) {
+            size = u->length;
+        }
 
-    part = &u->headers_in.headers.part;
-    h = part->elts;
+        if (size && upstream->read->ready) {
 
-    for (i = 0; /* void */; i++) {
+            n = upstream->recv(upstream, b->last, size);
 
-        if (i >= part->nelts) {
-            if (part->next == NULL) {
+            if (n == NGX_AGAIN) {
                 break;
             }
 
-            part = part->next;
-            h = part->elts;
-            i = 0;
-        }
-
-        if (ngx_hash_find(&u->conf->hide_headers_hash, h[i].hash,
-                          h[i].lowcase_key, h[i].key.len))
-        {
-            continue;
-        }
-
-        hh = ngx_hash_find(&umcf->headers_in_hash, h[i].hash,
-                           h[i].lowcase_key, h[i].key.len);
+            if (n > 0) {
+                u->state->response_length += n;
 
-        if (hh) {
-            if (hh->copy_handler(r, &h[i], hh->conf) != NGX_OK) {
-                ngx_http_upstream_finalize_request(r, u,
-                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
-                return NGX_DONE;
+                if (u->input_filter(u->input_filter_ctx, n) == NGX_ERROR) {
+                    ngx_http_upstream_finalize_request(r, u, 0);
+                    return;
+                }
             }
 
+            do_write = 1;
+
             continue;
         }
 
-        if (ngx_http_upstream_copy_header_line(r, &h[i], 0) != NGX_OK) {
-            ngx_http_upstream_finalize_request(r, u,
-                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
-            return NGX_DONE;
-        }
+        break;
     }
 
-    if (r->headers_out.server && r->headers_out.server->value.data == NULL) {
-        r->headers_out.server->hash = 0;
-    }
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
-    if (r->headers_out.date && r->headers_out.date->value.data == NULL) {
-        r->headers_out.date->hash = 0;
+    if (downstream->data == r) {
+        if (ngx_handle_write_event(downstream->write, clcf->send_lowat)
+            != NGX_OK)
+        {
+            ngx_http_upstream_finalize_request(r, u, 0);
+            return;
+        }
     }
 
-    r->headers_out.status = u->headers_in.status_n;
-    r->headers_out.status_line = u->headers_in.status_line;
-
-    u->headers_in.content_length_n = r->headers_out.content_length_n;
+    if (downstream->write->active && !downstream->write->ready) {
+        ngx_add_timer(downstream->write, clcf->send_timeout);
 
-    if (r->headers_out.content_length_n != -1) {
-        u->length = (size_t) r->headers_out.content_length_n;
+    } else if (downstream->write->timer_set) {
+        ngx_del_timer(downstream->write);
+    }
 
-    } else {
-        u->length = NGX_MAX_SIZE_T_VALUE;
+    if (ngx_handle_read_event(upstream->read, 0) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u, 0);
+        return;
     }
 
-    return NGX_OK;
+    if (upstream->read->active && !upstream->read->ready) {
+        ngx_add_timer(upstream->read, u->conf->read_timeout);
+
+    } else if (upstream->read->timer_set) {
+        ngx_del_timer(upstream->read);
+    }
 }
 
 
 static void
-ngx_http_upstream_process_body_in_memory(ngx_http_request_t *r,
-    ngx_http_upstream_t *u)
+ngx_http_upstream_upgrade(ngx_http_request_t *r, ngx_http_upstream_t *u)
 {
-    size_t             size;
-    ssize_t            n;
-    ngx_buf_t         *b;
-    ngx_event_t       *rev;
-    ngx_connection_t  *c;
+    int                        tcp_nodelay;
+    ngx_buf_t                 *b;
+    ngx_connection_t          *c, *pc;
+    ngx_pool_cleanup_t        *cln;
+    ngx_http_core_loc_conf_t  *clcf;
 
-    c = u->peer.connection;
-    rev = c->read;
+    c = r->connection;
+    pc = u->peer.connection;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http upstream process body on memory");
-	NGX_LOG(LOG_DEBUG, "http upstream process body on memory");
+                   "http upstream upgrade");
 
-    if (rev->timedout) {
-        ngx_connection_error(c, NGX_ETIMEDOUT, "upstream timed out");
-        ngx_http_upstream_finalize_request(r, u, NGX_ETIMEDOUT);
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        ngx_http_upstream_finalize_request(r, u, 0);
         return;
     }
 
-    b = &u->buffer;
+    cln->handler = ngx_http_upstream_tunnel_cleanup;
+    cln->data = r;
 
-    for ( ;; ) {
+#if (NGX_STAT_STUB)
+    (void) ngx_atomic_fetch_add(ngx_stat_tunnels, 1);
+#endif
 
-        size = b->end - b->last;
+    r->keepalive = 0;
+    c->log->action = "proxying upgraded connection";
 
-        if (size == 0) {
-            ngx_log_error(NGX_LOG_ALERT, c->log, 0,
-                          "upstream buffer is too small to read response");
-            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-            return;
-        }
+    u->read_event_handler = ngx_http_upstream_upgraded_read_upstream;
+    u->write_event_handler = ngx_http_upstream_upgraded_write_upstream;
+    r->read_event_handler = ngx_http_upstream_upgraded_read_downstream;
+    r->write_event_handler = ngx_http_upstream_upgraded_write_downstream;
 
-        n = c->recv(c, b->last, size);
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
-        if (n == NGX_AGAIN) {
-            break;
-        }
+    if (clcf->tcp_nodelay) {
+        tcp_nodelay = 1;
 
-        if (n == 0 || n == NGX_ERROR) {
-            ngx_http_upstream_finalize_request(r, u, n);
-            return;
-        }
+        if (c->tcp_nodelay == NGX_TCP_NODELAY_UNSET) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "tcp_nodelay");
 
-        u->state->response_length += n;
+            if (setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY,
+                           (const void *) &tcp_nodelay, sizeof(int)) == -1)
+            {
+                ngx_connection_error(c, ngx_socket_errno,
+                                     "setsockopt(TCP_NODELAY) failed");
+                ngx_http_upstream_finalize_request(r, u, 0);
+                return;
+            }
 
-        if (u->input_filter(u->input_filter_ctx, n) == NGX_ERROR) {
-            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-            return;
+            c->tcp_nodelay = NGX_TCP_NODELAY_SET;
         }
 
-        if (!rev->ready) {
-            break;
+        if (pc->tcp_nodelay == NGX_TCP_NODELAY_UNSET) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0, "tcp_nodelay");
+
+            if (setsockopt(pc->fd, IPPROTO_TCP, TCP_NODELAY,
+                           (const void *) &tcp_nodelay, sizeof(int)) == -1)
+            {
+                ngx_connection_error(pc, ngx_socket_errno,
+                                     "setsockopt(TCP_NODELAY) failed");
+                ngx_http_upstream_finalize_request(r, u, 0);
+                return;
+            }
+
+            pc->tcp_nodelay = NGX_TCP_NODELAY_SET;
         }
     }
 
-    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
-        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-        return;
+    /* the tunnel is idle timed by the client read event only */
+
+    if (pc->read->timer_set) {
+        ngx_del_timer(pc->read);
     }
 
-    if (rev->active) {
-        ngx_add_timer(rev, u->conf->read_timeout);
+#if (NGX_HAVE_SPLICE)
 
-    } else if (rev->timer_set) {
-        ngx_del_timer(rev);
-    }
-}
+    ngx_http_upstream_splice_init(r, u);
 
+    if (u->splice == NULL)
 
-static void
-ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
-{
-    int                        tcp_nodelay;
-    ssize_t                    n;
-    ngx_int_t                  rc;
-    ngx_event_pipe_t          *p;
-    ngx_connection_t          *c;
-    ngx_http_core_loc_conf_t  *clcf;
+#endif
+    {
+        b = &u->from_client;
 
-    rc = ngx_http_send_header(r);
+        b->start = ngx_palloc(r->pool, u->conf->buffer_size);
+        if (b->start == NULL) {
+            ngx_http_upstream_finalize_request(r, u, 0);
+            return;
+        }
 
-    if (rc == NGX_ERROR || rc > NGX_OK || r->post_action) {
-        ngx_http_upstream_finalize_request(r, u, rc);
+        b->pos = b->start;
+        b->last = b->start;
+        b->end = b->start + u->conf->buffer_size;
+        b->temporary = 1;
+        b->tag = u->output.tag;
+    }
+
+    if (ngx_http_send_special(r, NGX_HTTP_FLUSH) == NGX_ERROR) {
+        ngx_http_upstream_finalize_request(r, u, 0);
         return;
     }
 
-    c = r->connection;
+    /*
+     * the client to upstream direction is run from the posted event
+     * as the first call may finalize the request
+     */
 
-    if (r->header_only) {
+    ngx_post_event(c->read, &ngx_posted_events);
 
-        if (u->cacheable || u->store) {
+    ngx_http_upstream_process_upgraded(r, 1, 1);
+}
 
-            if (ngx_shutdown_socket(c->fd, NGX_WRITE_SHUTDOWN) == -1) {
-                ngx_connection_error(c, ngx_socket_errno,
-                                     ngx_shutdown_socket_n " failed");
-            }
 
-            r->read_event_handler = ngx_http_request_empty_handler;
-            r->write_event_handler = ngx_http_request_empty_handler;
-            c->error = 1;
+static void
+ngx_http_upstream_upgraded_read_downstream(ngx_http_request_t *r)
+{
+    ngx_http_upstream_process_upgraded(r, 0, 0);
+}
 
-        } else {
-            ngx_http_upstream_finalize_request(r, u, rc);
-            return;
-        }
-    }
 
-    u->header_sent = 1;
+static void
+ngx_http_upstream_upgraded_write_downstream(ngx_http_request_t *r)
+{
+    ngx_http_upstream_process_upgraded(r, 1, 1);
+}
 
-    if (r->request_body && r->request_body->temp_file) {
-        ngx_pool_run_cleanup_file(r->pool, r->request_body->temp_file->file.fd);
-        r->request_body->temp_file->file.fd = NGX_INVALID_FILE;
-    }
 
-    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+static void
+ngx_http_upstream_upgraded_read_upstream(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    ngx_http_upstream_process_upgraded(r, 1, 0);
+}
 
-    if (!u->buffering) {
 
-        if (u->input_filter == NULL) {
-            u->input_filter_init = ngx_http_upstream_non_buffered_filter_init;
-            u->input_filter = ngx_http_upstream_non_buffered_filter;
-            u->input_filter_ctx = r;
-        }
+static void
+ngx_http_upstream_upgraded_write_upstream(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    ngx_http_upstream_process_upgraded(r, 0, 1);
+}
 
-        u->read_event_handler = ngx_http_upstream_process_non_buffered_upstream;
-        r->write_event_handler =
-                             ngx_http_upstream_process_non_buffered_downstream;
 
-        r->limit_rate = 0;
+static void
+ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
+    ngx_uint_t from_upstream, ngx_uint_t do_write)
+{
+    size_t                     size;
+    ssize_t                    n;
+    ngx_buf_t                 *b;
+    ngx_uint_t                 moved, flush;
+    ngx_connection_t          *c, *downstream, *upstream, *dst, *src;
+    ngx_http_upstream_t       *u;
+    ngx_http_core_loc_conf_t  *clcf;
 
-        if (u->input_filter_init(u->input_filter_ctx) == NGX_ERROR) {
-            ngx_http_upstream_finalize_request(r, u, 0);
-            return;
-        }
+    c = r->connection;
+    u = r->upstream;
 
-        if (clcf->tcp_nodelay && c->tcp_nodelay == NGX_TCP_NODELAY_UNSET) {
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "tcp_nodelay");
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream process upgraded, fu:%ui", from_upstream);
 
-            tcp_nodelay = 1;
+    downstream = c;
+    upstream = u->peer.connection;
 
-            if (setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY,
-                               (const void *) &tcp_nodelay, sizeof(int)) == -1)
-            {
-                ngx_connection_error(c, ngx_socket_errno,
-                                     "setsockopt(TCP_NODELAY) failed");
-                ngx_http_upstream_finalize_request(r, u, 0);
-                return;
-            }
+    if (downstream->write->timedout) {
+        c->timedout = 1;
+        ngx_connection_error(c, NGX_ETIMEDOUT, "client timed out");
+        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
 
-            c->tcp_nodelay = NGX_TCP_NODELAY_SET;
-        }
+    if (upstream->write->timedout) {
+        ngx_connection_error(upstream, NGX_ETIMEDOUT, "upstream timed out");
+        ngx_http_upstream_finalize_request(r, u, 0);
+        return;
+    }
 
-        n = u->buffer.last - u->buffer.pos;
+    if (downstream->read->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "upgraded connection timed out");
+        ngx_http_upstream_finalize_request(r, u, 0);
+        return;
+    }
 
-        if (n) {
-            u->buffer.last = u->buffer.pos;
+    if (from_upstream) {
+        src = upstream;
+        dst = downstream;
+        b = &u->buffer;
 
-            u->state->response_length += n;
+    } else {
+        src = downstream;
+        dst = upstream;
+        b = &u->from_client;
 
-            if (u->input_filter(u->input_filter_ctx, n) == NGX_ERROR) {
-                ngx_http_upstream_finalize_request(r, u, 0);
-                return;
-            }
+        if (r->header_in->last > r->header_in->pos) {
+            b = r->header_in;
+            b->end = b->last;
+            do_write = 1;
+        }
+    }
 
-            ngx_http_upstream_process_non_buffered_downstream(r);
+    /* the response header may be still in the output filters */
 
-        } else {
-            u->buffer.pos = u->buffer.start;
-            u->buffer.last = u->buffer.start;
+    flush = 0;
 
-            if (ngx_http_send_special(r, NGX_HTTP_FLUSH) == NGX_ERROR) {
-                ngx_http_upstream_finalize_request(r, u, 0);
-                return;
-            }
+    if (from_upstream && (r->out || downstream->buffered)) {
 
-            if (u->peer.connection->read->ready) {
-                ngx_http_upstream_process_non_buffered_upstream(r, u);
-            }
+        if (ngx_http_output_filter(r, NULL) == NGX_ERROR) {
+            ngx_http_upstream_finalize_request(r, u, 0);
+            return;
         }
 
-        return;
+        flush = (r->out || downstream->buffered);
     }
 
-    /* TODO: preallocate event_pipe bufs, look "Content-Length" */
+    moved = 0;
 
-#if (NGX_HTTP_CACHE)
+    for ( ;; ) {
 
-    if (r->cache && r->cache->file.fd != NGX_INVALID_FILE) {
-        ngx_pool_run_cleanup_file(r->pool, r->cache->file.fd);
-        r->cache->file.fd = NGX_INVALID_FILE;
-    }
+        if (do_write) {
 
-    switch (ngx_http_test_predicates(r, u->conf->no_cache)) {
+            size = b->last - b->pos;
 
-    case NGX_ERROR:
-        ngx_http_upstream_finalize_request(r, u, 0);
-        return;
+            if (size && dst->write->ready && !flush) {
 
-    case NGX_DECLINED:
-        u->cacheable = 0;
-        break;
+                n = dst->send(dst, b->pos, size);
 
-    default: /* NGX_OK */
+                if (n == NGX_ERROR) {
+                    ngx_http_upstream_finalize_request(r, u, 0);
+                    return;
+                }
 
-        if (u->cache_status == NGX_HTTP_CACHE_BYPASS) {
+                if (n > 0) {
+                    moved = 1;
+                    b->pos += n;
 
-            r->cache->min_uses = u->conf->cache_min_uses;
-            r->cache->body_start = u->conf->buffer_size;
-            r->cache->file_cache = u->conf->cache->data;
+                    if (b->pos == b->last) {
+                        b->pos = b->start;
+                        b->last = b->start;
+                    }
+                }
+            }
+        }
 
-            if (ngx_http_file_cache_create(r) != NGX_OK) {
+#if (NGX_HAVE_SPLICE)
+
+        if (u->splice && b->pos == b->last && !flush) {
+
+            switch (ngx_http_upstream_splice(src, dst,
+                                             &u->splice[from_upstream]))
+            {
+            case NGX_ERROR:
                 ngx_http_upstream_finalize_request(r, u, 0);
                 return;
+
+            case NGX_OK:
+                moved = 1;
+                break;
+
+            default: /* NGX_AGAIN */
+                break;
             }
 
-            u->cacheable = 1;
+            break;
         }
 
-        break;
-    }
+#endif
 
-    if (u->cacheable) {
-        time_t  now, valid;
+        size = b->end - b->last;
 
-        now = ngx_time();
+        if (size && src->read->ready) {
 
-        valid = r->cache->valid_sec;
+            n = src->recv(src, b->last, size);
 
-        if (valid == 0) {
-            valid = ngx_http_file_cache_valid(u->conf->cache_valid,
-                                              u->headers_in.status_n);
-            if (valid) {
-                r->cache->valid_sec = now + valid;
+            if (n == NGX_AGAIN || n == 0) {
+                break;
             }
-        }
 
-        if (valid) {
-            r->cache->last_modified = r->headers_out.last_modified_time;
-            r->cache->date = now;
-            r->cache->body_start = (u_short) (u->buffer.pos - u->buffer.start);
+            if (n > 0) {
+                moved = 1;
+                do_write = 1;
+                b->last += n;
 
-            ngx_http_file_cache_set_header(r, u->buffer.start);
+                continue;
+            }
 
-        } else {
-            u->cacheable = 0;
-            r->headers_out.last_modified_time = -1;
+            if (n == NGX_ERROR) {
+                src->read->eof = 1;
+            }
         }
-    }
-
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http cacheable: %d", u->cacheable);
-	NGX_LOG(LOG_DEBUG, "http cacheable: %d", u->cacheable);
 
-    if (u->cacheable == 0 && r->cache) {
-        ngx_http_file_cache_free(r->cache, u->pipe->temp_file);
+        break;
     }
 
-#endif
-
-    p = u->pipe;
-
-    p->output_filter = (ngx_event_pipe_output_filter_pt) ngx_http_output_filter;
-    p->output_ctx = r;
-    p->tag = u->output.tag;
-    p->bufs = u->conf->bufs;
-    p->busy_size = u->conf->busy_buffers_size;
-    p->upstream = u->peer.connection;
-    p->downstream = c;
-    p->pool = r->pool;
-    p->log = c->log;
+    if ((upstream->read->eof && ngx_http_upstream_upgraded_pending(r, 1) == 0)
+        || (downstream->read->eof
+            && ngx_http_upstream_upgraded_pending(r, 0) == 0)
+        || (downstream->read->eof && upstream->read->eof))
+    {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http upstream upgraded done");
+        ngx_http_upstream_finalize_request(r, u, 0);
+        return;
+    }
 
-    p->cacheable = u->cacheable || u->store;
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
-    p->temp_file = ngx_pcalloc(r->pool, sizeof(ngx_temp_file_t));
-    if (p->temp_file == NULL) {
+    if (ngx_handle_write_event(upstream->write, u->conf->send_lowat)
+        != NGX_OK)
+    {
         ngx_http_upstream_finalize_request(r, u, 0);
         return;
     }
 
-    p->temp_file->file.fd = NGX_INVALID_FILE;
-    p->temp_file->file.log = c->log;
-    p->temp_file->path = u->conf->temp_path;
-    p->temp_file->pool = r->pool;
-
-    if (p->cacheable) {
-        p->temp_file->persistent = 1;
+    if (upstream->write->active && !upstream->write->ready) {
+        ngx_add_timer(upstream->write, u->conf->send_timeout);
 
-    } else {
-        p->temp_file->log_level = NGX_LOG_WARN;
-        p->temp_file->warn = "an upstream response is buffered "
-                             "to a temporary file";
+    } else if (upstream->write->timer_set) {
+        ngx_del_timer(upstream->write);
     }
 
-    p->max_temp_file_size = u->conf->max_temp_file_size;
-    p->temp_file_write_size = u->conf->temp_file_write_size;
-
-    p->preread_bufs = ngx_alloc_chain_link(r->pool);
-    if (p->preread_bufs == NULL) {
+    if (ngx_handle_read_event(upstream->read, 0) != NGX_OK) {
         ngx_http_upstream_finalize_request(r, u, 0);
         return;
     }
 
-    p->preread_bufs->buf = &u->buffer;
-    p->preread_bufs->next = NULL;
-    u->buffer.recycled = 1;
-
-    p->preread_size = u->buffer.last - u->buffer.pos;
-
-    if (u->cacheable) {
+    if (ngx_handle_write_event(downstream->write, clcf->send_lowat)
+        != NGX_OK)
+    {
+        ngx_http_upstream_finalize_request(r, u, 0);
+        return;
+    }
 
-        p->buf_to_file = ngx_calloc_buf(r->pool);
-        if (p->buf_to_file == NULL) {
-            ngx_http_upstream_finalize_request(r, u, 0);
-            return;
-        }
+    if (downstream->write->active && !downstream->write->ready) {
+        ngx_add_timer(downstream->write, clcf->send_timeout);
 
-        p->buf_to_file->pos = u->buffer.start;
-        p->buf_to_file->last = u->buffer.pos;
-        p->buf_to_file->temporary = 1;
+    } else if (downstream->write->timer_set) {
+        ngx_del_timer(downstream->write);
     }
 
-    if (ngx_event_flags & NGX_USE_AIO_EVENT) {
-        /* the posted aio operation may currupt a shadow buffer */
-        p->single_buf = 1;
+    if (ngx_handle_read_event(downstream->read, 0) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u, 0);
+        return;
     }
 
-    /* TODO: p->free_bufs = 0 if use ngx_create_chain_of_bufs() */
-    p->free_bufs = 1;
+    if (moved || !downstream->read->timer_set) {
+        ngx_add_timer(downstream->read, u->conf->tunnel_timeout);
+    }
+}
 
-    /*
-     * event_pipe would do u->buffer.last += p->preread_size
-     * as though these bytes were read
-     */
-    u->buffer.last = u->buffer.pos;
 
-    if (u->conf->cyclic_temp_file) {
+static size_t
+ngx_http_upstream_upgraded_pending(ngx_http_request_t *r,
+    ngx_uint_t from_upstream)
+{
+    size_t                size;
+    ngx_http_upstream_t  *u;
 
-        /*
-         * we need to disable the use of sendfile() if we use cyclic temp file
-         * because the writing a new data may interfere with sendfile()
-         * that uses the same kernel file pages (at least on FreeBSD)
-         */
+    u = r->upstream;
 
-        p->cyclic_temp_file = 1;
-        c->sendfile = 0;
+    if (from_upstream) {
+        size = u->buffer.last - u->buffer.pos;
 
     } else {
-        p->cyclic_temp_file = 0;
+        size = (u->from_client.last - u->from_client.pos)
+               + (r->header_in->last - r->header_in->pos);
     }
 
-    p->read_timeout = u->conf->read_timeout;
-    p->send_timeout = clcf->send_timeout;
-    p->send_lowat = clcf->send_lowat;
+#if (NGX_HAVE_SPLICE)
 
-    u->read_event_handler = ngx_http_upstream_process_upstream;
-    r->write_event_handler = ngx_http_upstream_process_downstream;
+    if (u->splice) {
+        size += u->splice[from_upstream].size;
+    }
 
-    ngx_http_upstream_process_upstream(r, u);
+#endif
+
+    return size;
 }
 
 
 static void
-ngx_http_upstream_process_non_buffered_downstream(ngx_http_request_t *r)
+ngx_http_upstream_tunnel_cleanup(void *data)
 {
-    ngx_event_t          *wev;
-    ngx_connection_t     *c;
-    ngx_http_upstream_t  *u;
-
-    c = r->connection;
-    u = r->upstream;
-    wev = c->write;
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http upstream process non buffered downstream");
-	NGX_LOG(LOG_DEBUG, "http upstream process non buffered downstream");
+    ngx_http_request_t *r = data;
 
-    c->log->action = "sending to client";
+#if (NGX_HAVE_SPLICE)
 
-    if (wev->timedout) {
-        c->timedout = 1;
-        ngx_connection_error(c, NGX_ETIMEDOUT, "client timed out");
-        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_REQUEST_TIME_OUT);
-        return;
+    if (r->upstream->splice) {
+        ngx_http_upstream_splice_close(r->upstream->splice,
+                                       r->connection->log);
+        r->upstream->splice = NULL;
     }
 
-    ngx_http_upstream_process_non_buffered_request(r, 1);
+#endif
+
+#if (NGX_STAT_STUB)
+    (void) ngx_atomic_fetch_add(ngx_stat_tunnels, -1);
+#endif
 }
 
 
+#if (NGX_HAVE_SPLICE)
+
 static void
-ngx_http_upstream_process_non_buffered_upstream(ngx_http_request_t *r,
-    ngx_http_upstream_t *u)
+ngx_http_upstream_splice_init(ngx_http_request_t *r, ngx_http_upstream_t *u)
 {
-    ngx_connection_t  *c;
+    ngx_uint_t                   i;
+    ngx_http_upstream_splice_t  *sp;
 
-    c = u->peer.connection;
+#if (NGX_SSL)
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http upstream process non buffered upstream");
-	NGX_LOG(LOG_DEBUG, "http upstream process non buffered upstream");
+    if (r->connection->ssl || u->peer.connection->ssl) {
+        return;
+    }
 
-    c->log->action = "reading upstream";
+#endif
 
-    if (c->read->timedout) {
-        ngx_connection_error(c, NGX_ETIMEDOUT, "upstream timed out");
-        ngx_http_upstream_finalize_request(r, u, 0);
+    sp = ngx_palloc(r->pool, 2 * sizeof(ngx_http_upstream_splice_t));
+    if (sp == NULL) {
         return;
     }
 
-    ngx_http_upstream_process_non_buffered_request(r, 0);
-}
-
+    for (i = 0; i < 2; i++) {
+        sp[i].fd[0] = -1;
+        sp[i].fd[1] = -1;
+        sp[i].size = 0;
+    }
 
-static void
-ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
-    ngx_uint_t do_write)
-{
-    size_t                     size;
-    ssize_t                    n;
-    ngx_buf_t                 *b;
-    ngx_int_t                  rc;
-    ngx_connection_t          *downstream, *upstream;
-    ngx_http_upstream_t       *u;
-    ngx_http_core_loc_conf_t  *clcf;
+    for (i = 0; i < 2; i++) {
+        if (pipe(sp[i].fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                          "pipe() failed, upgraded connection is relayed "
+                          "through the buffers");
+            ngx_http_upstream_splice_close(sp, r->connection->log);
+            return;
+        }
+    }
 
-    u = r->upstream;
-    downstream = r->connection;
-    upstream = u->peer.connection;
+    u->splice = sp;
+}
 
-    b = &u->buffer;
 
-    do_write = do_write || u->length == 0;
+static ngx_int_t
+ngx_http_upstream_splice(ngx_connection_t *src, ngx_connection_t *dst,
+    ngx_http_upstream_splice_t *sp)
+{
+    ssize_t    n;
+    ngx_err_t  err;
+    ngx_int_t  rc;
+
+    rc = NGX_AGAIN;
 
     for ( ;; ) {
 
-        if (do_write) {
+        if (sp->size && dst->write->ready) {
 
-            if (u->out_bufs || u->busy_bufs) {
-                rc = ngx_http_output_filter(r, u->out_bufs);
+            n = splice(sp->fd[0], NULL, dst->fd, NULL, sp->size,
+                       SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
 
-                if (rc == NGX_ERROR) {
-                    ngx_http_upstream_finalize_request(r, u, 0);
-                    return;
-                }
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, dst->log, 0,
+                           "splice to %d: %z", dst->fd, n);
 
-                ngx_chain_update_chains(&u->free_bufs, &u->busy_bufs,
-                                        &u->out_bufs, u->output.tag);
-            }
+            if (n > 0) {
+                sp->size -= n;
+                dst->sent += n;
+                rc = NGX_OK;
 
-            if (u->busy_bufs == NULL) {
+                continue;
+            }
 
-                if (u->length == 0
-                    || upstream->read->eof
-                    || upstream->read->error)
-                {
-                    ngx_http_upstream_finalize_request(r, u, 0);
-                    return;
-                }
+            err = ngx_errno;
 
-                b->pos = b->start;
-                b->last = b->start;
+            if (n == -1 && err == NGX_EINTR) {
+                continue;
             }
-        }
 
-        size = b->end - b->last;
+            if (n == -1 && err != NGX_EAGAIN) {
+                dst->error = 1;
+                ngx_connection_error(dst, err, "splice() failed");
+                return NGX_ERROR;
+            }
 
-        if (size > u->length) {
-            size = u->length;
+            dst->write->ready = 0;
         }
 
-        if (size && upstream->read->ready) {
+        /*
+         * the socket is read only into an empty pipe: EAGAIN can not mean
+         * then that the pipe is full and the read event may be cleared
+         */
 
-            n = upstream->recv(upstream, b->last, size);
+        if (sp->size == 0 && src->read->ready) {
 
-            if (n == NGX_AGAIN) {
-                break;
-            }
+            n = splice(src->fd, NULL, sp->fd[1], NULL,
+                       NGX_HTTP_UPSTREAM_SPLICE_SIZE,
+                       SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, src->log, 0,
+                           "splice from %d: %z", src->fd, n);
 
             if (n > 0) {
-                u->state->response_length += n;
+                sp->size = n;
+                rc = NGX_OK;
 
-                if (u->input_filter(u->input_filter_ctx, n) == NGX_ERROR) {
-                    ngx_http_upstream_finalize_request(r, u, 0);
-                    return;
-                }
+                continue;
             }
 
-            do_write = 1;
+            if (n == 0) {
+                src->read->eof = 1;
 
-            continue;
-        }
+            } else {
+                err = ngx_socket_errno;
 
-        break;
-    }
+                if (err == NGX_EINTR) {
+                    continue;
+                }
 
-    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+                if (err != NGX_EAGAIN) {
+                    src->read->eof = 1;
+                    src->read->error = 1;
+                    ngx_connection_error(src, err, "splice() failed");
+                }
+            }
 
-    if (downstream->data == r) {
-        if (ngx_handle_write_event(downstream->write, clcf->send_lowat)
-            != NGX_OK)
-        {
-            ngx_http_upstream_finalize_request(r, u, 0);
-            return;
+            src->read->ready = 0;
         }
+
+        return rc;
     }
+}
 
-    if (downstream->write->active && !downstream->write->ready) {
-        ngx_add_timer(downstream->write, clcf->send_timeout);
 
-    } else if (downstream->write->timer_set) {
-        ngx_del_timer(downstream->write);
-    }
+static void
+ngx_http_upstream_splice_close(ngx_http_upstream_splice_t *sp, ngx_log_t *log)
+{
+    ngx_uint_t  i, j;
 
-    if (ngx_handle_read_event(upstream->read, 0) != NGX_OK) {
-        ngx_http_upstream_finalize_request(r, u, 0);
-        return;
-    }
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < 2; j++) {
 
-    if (upstream->read->active && !upstream->read->ready) {
-        ngx_add_timer(upstream->read, u->conf->read_timeout);
+            if (sp[i].fd[j] == -1) {
+                continue;
+            }
 
-    } else if (upstream->read->timer_set) {
-        ngx_del_timer(upstream->read);
+            if (close(sp[i].fd[j]) == -1) {
+                ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                              "close() pipe failed");
+            }
+
+            sp[i].fd[j] = -1;
+        }
     }
 }
 
+#endif
+
 
 static ngx_int_t
 ngx_http_upstream_non_buffered_filter_init(void *data)
@@ -2695,6 +4132,9 @@ ngx_http_upstream_process_request(ngx_http_request_t *r)
 
             } else if (p->upstream_error) {
                 ngx_http_file_cache_free(r->cache, u->pipe->temp_file);
+
+            } else if (p->temp_file->file.fd != NGX_INVALID_FILE) {
+                ngx_http_file_cache_set_writing(r, p->temp_file);
             }
         }
 
@@ -2826,14 +4266,32 @@ ngx_http_upstream_next(ngx_http_request_t *r, ngx_http_upstream_t *u,
     ngx_http_busy_unlock(u->conf->busy_lock, &u->busy_lock);
 #endif
 
-    if (ft_type == NGX_HTTP_UPSTREAM_FT_HTTP_404) {
+    if (ft_type == NGX_HTTP_UPSTREAM_FT_HTTP_404
+        || (u->peer.cached && ft_type == NGX_HTTP_UPSTREAM_FT_ERROR))
+    {
         state = NGX_PEER_NEXT;
+
     } else {
         state = NGX_PEER_FAILED;
     }
 
     if (ft_type != NGX_HTTP_UPSTREAM_FT_NOLIVE) {
         u->peer.free(&u->peer, u->peer.data, state);
+        ngx_http_upstream_queue_wake(u->upstream);
+    }
+
+    if (u->hedge_connection) {
+
+        /* the hedged attempt has failed, the original one is still pending */
+
+        if (u->peer.connection) {
+            ngx_http_upstream_hedge_close(u->peer.connection);
+            u->peer.connection = NULL;
+        }
+
+        ngx_http_upstream_hedge_restore(r, u);
+        ngx_http_upstream_process_header(r, u);
+        return;
     }
 
     if (ft_type == NGX_HTTP_UPSTREAM_FT_TIMEOUT) {
@@ -2842,7 +4300,14 @@ ngx_http_upstream_next(ngx_http_request_t *r, ngx_http_upstream_t *u,
     }
 
     if (u->peer.cached && ft_type == NGX_HTTP_UPSTREAM_FT_ERROR) {
+
+        /*
+         * a kept connection may be closed by the upstream at any moment,
+         * so the request is retried without counting the try
+         */
+
         status = 0;
+        u->peer.tries++;
 
     } else {
         switch(ft_type) {
@@ -2920,6 +4385,10 @@ ngx_http_upstream_next(ngx_http_request_t *r, ngx_http_upstream_t *u,
         }
 #endif
 
+        if (u->peer.connection->pool) {
+            ngx_destroy_pool(u->peer.connection->pool);
+        }
+
         ngx_close_connection(u->peer.connection);
     }
 
@@ -2960,7 +4429,8 @@ static void
 ngx_http_upstream_finalize_request(ngx_http_request_t *r,
     ngx_http_upstream_t *u, ngx_int_t rc)
 {
-    ngx_time_t  *tp;
+    ngx_time_t   *tp;
+    ngx_event_t  *ev;
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "finalize http upstream request: %i", rc);
@@ -2988,8 +4458,20 @@ ngx_http_upstream_finalize_request(ngx_http_request_t *r,
 
     u->finalize_request(r, rc);
 
+    if (u->queued) {
+        ngx_http_upstream_dequeue(u);
+    }
+
+    if (u->queue_event.prev) {
+        ev = &u->queue_event;
+        ngx_delete_posted_event(ev);
+    }
+
+    ngx_http_upstream_hedge_cancel(r, u);
+
     if (u->peer.free) {
         u->peer.free(&u->peer, u->peer.data, 0);
+        ngx_http_upstream_queue_wake(u->upstream);
     }
 
     if (u->peer.connection) {
@@ -3018,6 +4500,10 @@ ngx_http_upstream_finalize_request(ngx_http_request_t *r,
 		NGX_LOG(LOG_DEBUG, "close http upstream connection: %d",
                        u->peer.connection->fd);
 
+        if (u->peer.connection->pool) {
+            ngx_destroy_pool(u->peer.connection->pool);
+        }
+
         ngx_close_connection(u->peer.connection);
     }
 
@@ -3361,6 +4847,87 @@ ngx_http_upstream_process_charset(ngx_http_request_t *r, ngx_table_elt_t *h,
 }
 
 
+static ngx_int_t
+ngx_http_upstream_process_connection(ngx_http_request_t *r, ngx_table_elt_t *h,
+    ngx_uint_t offset)
+{
+    r->upstream->headers_in.connection = h;
+
+    if (ngx_strlcasestrn(h->value.data, h->value.data + h->value.len,
+                         (u_char *) "close", 5 - 1)
+        != NULL)
+    {
+        r->upstream->headers_in.connection_close = 1;
+    }
+
+    return NGX_OK;
+}
+
+
+/* the chunked body is decoded by the module, the header is not passed */
+
+static ngx_int_t
+ngx_http_upstream_process_transfer_encoding(ngx_http_request_t *r,
+    ngx_table_elt_t *h, ngx_uint_t offset)
+{
+    if (ngx_strlcasestrn(h->value.data, h->value.data + h->value.len,
+                         (u_char *) "chunked", 7 - 1)
+        != NULL)
+    {
+        r->upstream->headers_in.chunked = 1;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_process_surrogate_key(ngx_http_request_t *r,
+    ngx_table_elt_t *h, ngx_uint_t offset)
+{
+#if (NGX_HTTP_CACHE)
+
+    if (r->cache) {
+        return ngx_http_file_cache_set_tags(r, &h->value);
+    }
+
+#endif
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_process_vary(ngx_http_request_t *r, ngx_table_elt_t *h,
+    ngx_uint_t offset)
+{
+#if (NGX_HTTP_CACHE)
+    ngx_http_upstream_t  *u;
+
+    u = r->upstream;
+
+    if (r->cache == NULL
+        || (u->conf->ignore_headers & NGX_HTTP_UPSTREAM_IGN_VARY))
+    {
+        return NGX_OK;
+    }
+
+    /* the variants are not cached for "*", too long or multiple lists */
+
+    if (h->value.len > NGX_HTTP_CACHE_VARY_LEN
+        || (h->value.len == 1 && h->value.data[0] == '*')
+        || r->cache->vary.len)
+    {
+        u->cacheable = 0;
+    }
+
+    r->cache->vary = h->value;
+#endif
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_upstream_copy_header_line(ngx_http_request_t *r, ngx_table_elt_t *h,
     ngx_uint_t offset)
@@ -3474,6 +5041,12 @@ ngx_http_upstream_copy_content_length(ngx_http_request_t *r, ngx_table_elt_t *h,
 {
     ngx_table_elt_t  *ho;
 
+    /* "Transfer-Encoding" overrides "Content-Length" */
+
+    if (r->upstream->headers_in.chunked) {
+        return NGX_OK;
+    }
+
     ho = ngx_list_push(&r->headers_out.headers);
     if (ho == NULL) {
         return NGX_ERROR;
@@ -3829,60 +5402,153 @@ ngx_http_upstream_response_time_variable(ngx_http_request_t *r,
     v->no_cacheable = 0;
     v->not_found = 0;
 
-    if (r->upstream_states == NULL || r->upstream_states->nelts == 0) {
+    if (r->upstream_states == NULL || r->upstream_states->nelts == 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    len = r->upstream_states->nelts * (NGX_TIME_T_LEN + 4 + 2);
+
+    p = ngx_pnalloc(r->pool, len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->data = p;
+
+    i = 0;
+    state = r->upstream_states->elts;
+
+    for ( ;; ) {
+        if (state[i].status) {
+            ms = (ngx_msec_int_t)
+                     (state[i].response_sec * 1000 + state[i].response_msec);
+            ms = ngx_max(ms, 0);
+            p = ngx_sprintf(p, "%d.%03d", ms / 1000, ms % 1000);
+
+        } else {
+            *p++ = '-';
+        }
+
+        if (++i == r->upstream_states->nelts) {
+            break;
+        }
+
+        if (state[i].peer) {
+            *p++ = ',';
+            *p++ = ' ';
+
+        } else {
+            *p++ = ' ';
+            *p++ = ':';
+            *p++ = ' ';
+
+            if (++i == r->upstream_states->nelts) {
+                break;
+            }
+
+            continue;
+        }
+    }
+
+    v->len = p - v->data;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_queue_time_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char  *p;
+
+    if (r->upstream == NULL || r->upstream->queue_start == 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_TIME_T_LEN + 4);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%M.%03M", r->upstream->queue_time / 1000,
+                         r->upstream->queue_time % 1000)
+             - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_queue_length_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char  *p;
+
+    if (r->upstream == NULL || r->upstream->upstream == NULL) {
         v->not_found = 1;
         return NGX_OK;
     }
 
-    len = r->upstream_states->nelts * (NGX_TIME_T_LEN + 4 + 2);
-
-    p = ngx_pnalloc(r->pool, len);
+    p = ngx_pnalloc(r->pool, NGX_INT_T_LEN);
     if (p == NULL) {
         return NGX_ERROR;
     }
 
+    v->len = ngx_sprintf(p, "%ui", r->upstream->upstream->queue_len) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
     v->data = p;
 
-    i = 0;
-    state = r->upstream_states->elts;
-
-    for ( ;; ) {
-        if (state[i].status) {
-            ms = (ngx_msec_int_t)
-                     (state[i].response_sec * 1000 + state[i].response_msec);
-            ms = ngx_max(ms, 0);
-            p = ngx_sprintf(p, "%d.%03d", ms / 1000, ms % 1000);
+    return NGX_OK;
+}
 
-        } else {
-            *p++ = '-';
-        }
 
-        if (++i == r->upstream_states->nelts) {
-            break;
-        }
+#if (NGX_HTTP_SSL)
 
-        if (state[i].peer) {
-            *p++ = ',';
-            *p++ = ' ';
+static ngx_int_t
+ngx_http_upstream_ssl_session_stats_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                          *p;
+    ngx_shm_zone_t                  *shm_zone;
+    ngx_ssl_client_session_cache_t  *cache;
 
-        } else {
-            *p++ = ' ';
-            *p++ = ':';
-            *p++ = ' ';
+    if (r->upstream == NULL || r->upstream->conf->ssl_session_cache == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
 
-            if (++i == r->upstream_states->nelts) {
-                break;
-            }
+    shm_zone = r->upstream->conf->ssl_session_cache;
+    cache = shm_zone->data;
 
-            continue;
-        }
+    p = ngx_pnalloc(r->pool, sizeof("full= resumed= hits= misses=") - 1
+                             + 4 * NGX_ATOMIC_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
     }
 
-    v->len = p - v->data;
+    v->len = ngx_sprintf(p, "full=%uA resumed=%uA hits=%uA misses=%uA",
+                         cache->full, cache->resumed, cache->hits,
+                         cache->misses)
+             - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
 
     return NGX_OK;
 }
 
+#endif
+
 
 static ngx_int_t
 ngx_http_upstream_response_length_variable(ngx_http_request_t *r,
@@ -4008,6 +5674,7 @@ ngx_http_upstream(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy)
     uscf = ngx_http_upstream_add(cf, &u, NGX_HTTP_UPSTREAM_CREATE
                                          |NGX_HTTP_UPSTREAM_WEIGHT
                                          |NGX_HTTP_UPSTREAM_MAX_FAILS
+                                         |NGX_HTTP_UPSTREAM_MAX_CONNS
                                          |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
                                          |NGX_HTTP_UPSTREAM_DOWN
                                          |NGX_HTTP_UPSTREAM_BACKUP);
@@ -4094,6 +5761,64 @@ ngx_http_upstream(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy)
 }
 
 
+static char *
+ngx_http_upstream_queue(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_srv_conf_t  *uscf = conf;
+
+    ngx_str_t   *value, s;
+    ngx_int_t    n;
+    ngx_uint_t   i;
+
+    if (uscf->queue_max) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    n = ngx_atoi(value[1].data, value[1].len);
+
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid queue size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    uscf->queue_max = n;
+    uscf->queue_timeout = 60000;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+
+            s.len = value[i].len - 8;
+            s.data = &value[i].data[8];
+
+            uscf->queue_timeout = ngx_parse_time(&s, 0);
+
+            if (uscf->queue_timeout == (ngx_msec_t) NGX_ERROR) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    ngx_queue_init(&uscf->queue);
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
 static char *
 ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
@@ -4102,7 +5827,7 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     time_t                       fail_timeout;
     ngx_str_t                   *value, s;
     ngx_url_t                    u;
-    ngx_int_t                    weight, max_fails;
+    ngx_int_t                    weight, max_fails, max_conns, resolve;
     ngx_uint_t                   i;
     ngx_http_upstream_server_t  *us;
 
@@ -4123,23 +5848,11 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     value = cf->args->elts;
 
-    ngx_memzero(&u, sizeof(ngx_url_t));
-
-    u.url = value[1];
-    u.default_port = 80;
-
-    if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
-        if (u.err) {
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                               "%s in upstream \"%V\"", u.err, &u.url);
-        }
-
-        return NGX_CONF_ERROR;
-    }
-
     weight = 1;
     max_fails = 1;
+    max_conns = 0;
     fail_timeout = 10;
+    resolve = 0;
 
     for (i = 2; i < cf->args->nelts; i++) {
 
@@ -4191,6 +5904,41 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "max_conns=", 10) == 0) {
+
+            if (!(uscf->flags & NGX_HTTP_UPSTREAM_MAX_CONNS)) {
+                goto invalid;
+            }
+
+            max_conns = ngx_atoi(&value[i].data[10], value[i].len - 10);
+
+            if (max_conns == NGX_ERROR) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "resolve", 7) == 0) {
+
+            if (value[i].len == 7) {
+                resolve = 16;
+                continue;
+            }
+
+            if (value[i].data[7] != '=') {
+                goto invalid;
+            }
+
+            resolve = ngx_atoi(&value[i].data[8], value[i].len - 8);
+
+            if (resolve == NGX_ERROR || resolve == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "backup", 6) == 0) {
 
             if (!(uscf->flags & NGX_HTTP_UPSTREAM_BACKUP)) {
@@ -4216,10 +5964,56 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         goto invalid;
     }
 
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url = value[1];
+    u.default_port = 80;
+    u.no_resolve = resolve ? 1 : 0;
+
+    if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+        if (u.err) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "%s in upstream \"%V\"", u.err, &u.url);
+        }
+
+        return NGX_CONF_ERROR;
+    }
+
+    if (resolve) {
+
+        if (u.host.len == 0
+            || ngx_strncasecmp(u.url.data, (u_char *) "unix:", 5) == 0
+            || ngx_inet_addr(u.host.data, u.host.len) != INADDR_NONE)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"resolve\" requires a host name "
+                               "in upstream \"%V\"", &u.url);
+            return NGX_CONF_ERROR;
+        }
+
+        if (u.no_port) {
+            u.port = u.default_port;
+        }
+
+        /* the addresses known at start are used until the first answer */
+
+        if (ngx_inet_resolve_host(cf->pool, &u) != NGX_OK) {
+            ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                               "host not found in upstream \"%V\", "
+                               "it will be resolved at run time", &u.url);
+            u.naddrs = 0;
+        }
+
+        us->host = u.host;
+        us->port = u.port;
+        us->resolve = resolve;
+    }
+
     us->addrs = u.addrs;
     us->naddrs = u.naddrs;
     us->weight = weight;
     us->max_fails = max_fails;
+    us->max_conns = max_conns;
     us->fail_timeout = fail_timeout;
 
     return NGX_CONF_OK;
@@ -4378,6 +6172,98 @@ ngx_http_upstream_bind_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
 }
 
 
+char *
+ngx_http_upstream_hedge_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    char  *p = conf;
+
+    ngx_int_t                    n;
+    ngx_str_t                   *value, s;
+    ngx_uint_t                   i;
+    ngx_http_upstream_hedge_t   *hedge, **phedge;
+
+    phedge = (ngx_http_upstream_hedge_t **) (p + cmd->offset);
+
+    if (*phedge != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts != 2) {
+            return "invalid number of arguments";
+        }
+
+        *phedge = NULL;
+        return NGX_CONF_OK;
+    }
+
+    hedge = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_hedge_t));
+    if (hedge == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    hedge->budget = 10;
+
+    i = 1;
+
+    if (value[1].data[0] == 'p') {
+        n = ngx_atoi(value[1].data + 1, value[1].len - 1);
+
+        if (n < 1 || n > 99) {
+            goto invalid;
+        }
+
+        hedge->percentile = n;
+
+    } else {
+        hedge->delay = ngx_parse_time(&value[1], 0);
+
+        if (hedge->delay == (ngx_msec_t) NGX_ERROR || hedge->delay == 0) {
+            goto invalid;
+        }
+    }
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "budget=", 7) == 0) {
+
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            if (s.len && s.data[s.len - 1] == '%') {
+                s.len--;
+            }
+
+            n = ngx_atoi(s.data, s.len);
+
+            if (n < 1 || n > 100) {
+                goto invalid;
+            }
+
+            hedge->budget = n;
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    *phedge = hedge;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
 ngx_int_t
 ngx_http_upstream_hide_headers_hash(ngx_conf_t *cf,
     ngx_http_upstream_conf_t *conf, ngx_http_upstream_conf_t *prev,
@@ -4570,3 +6456,43 @@ ngx_http_upstream_init_main_conf(ngx_conf_t *cf, void *conf)
 
     return NGX_CONF_OK;
 }
+
+
+static ngx_int_t
+ngx_http_upstream_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                      i;
+    ngx_http_upstream_srv_conf_t  **uscfp;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->servers == NULL || uscfp[i]->peer.data == NULL) {
+            continue;
+        }
+
+        /* the servers marked with "resolve" */
+
+        if (ngx_http_upstream_init_round_robin_resolve(cycle, uscfp[i])
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
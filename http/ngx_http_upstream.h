@@ -44,6 +44,7 @@
 #define NGX_HTTP_UPSTREAM_IGN_EXPIRES        0x00000008
 #define NGX_HTTP_UPSTREAM_IGN_CACHE_CONTROL  0x00000010
 #define NGX_HTTP_UPSTREAM_IGN_SET_COOKIE     0x00000020
+#define NGX_HTTP_UPSTREAM_IGN_VARY           0x00000040
 
 
 typedef struct {
@@ -85,8 +86,14 @@ typedef struct {
     ngx_uint_t                       naddrs;//ַĳ
     ngx_uint_t                       weight;//Ȩ
     ngx_uint_t                       max_fails;//ʧܴ
+    ngx_uint_t                       max_conns;
     time_t                           fail_timeout;//ʧܵʱ
 
+    /* the name is resolved at run time into the number of slots */
+    ngx_str_t                        host;
+    in_port_t                        port;
+    ngx_uint_t                       resolve;
+
     unsigned                         down:1;//Ƿ
     unsigned                         backup:1;//ǷǱݷ
 } ngx_http_upstream_server_t;
@@ -98,6 +105,10 @@ typedef struct {
 #define NGX_HTTP_UPSTREAM_FAIL_TIMEOUT  0x0008
 #define NGX_HTTP_UPSTREAM_DOWN          0x0010
 #define NGX_HTTP_UPSTREAM_BACKUP        0x0020
+#define NGX_HTTP_UPSTREAM_MAX_CONNS     0x0040
+
+
+#define NGX_HTTP_UPSTREAM_HEDGE_HIST  24
 
 //upstreamܵݽṹ
 struct ngx_http_upstream_srv_conf_s {
@@ -112,8 +123,51 @@ struct ngx_http_upstream_srv_conf_s {
     ngx_uint_t                       line;
     in_port_t                        port;
     in_port_t                        default_port;
+
+    ngx_shm_zone_t                  *shm_zone;
+
+    /*
+     * the peers parsed by the process, peer.data points to their copy
+     * in the zone, the copy has no pointers to the process memory
+     */
+    void                            *local_peers;
+
+    /* the empty peer slots reserved in the zone for the upstream_conf API */
+    ngx_uint_t                       spare;
+
+    /* the requests waiting for a peer with a free connection slot */
+    ngx_uint_t                       queue_max;
+    ngx_msec_t                       queue_timeout;
+    ngx_queue_t                      queue;
+    ngx_uint_t                       queue_len;
+
+    /* the response times and the hedged requests seen by the worker */
+    ngx_uint_t                       hedge_hist[NGX_HTTP_UPSTREAM_HEDGE_HIST];
+    ngx_uint_t                       hedge_samples;
+    ngx_uint_t                       hedge_requests;
+    ngx_uint_t                       hedged;
 };
 
+
+typedef struct {
+    ngx_msec_t                       delay;
+    ngx_uint_t                       percentile;
+    ngx_uint_t                       budget;
+} ngx_http_upstream_hedge_t;
+
+
+#if (NGX_HAVE_SPLICE)
+
+#define NGX_HTTP_UPSTREAM_SPLICE_SIZE  65536
+
+/* a pipe relaying one direction of an upgraded connection */
+typedef struct {
+    ngx_fd_t                         fd[2];
+    size_t                           size;
+} ngx_http_upstream_splice_t;
+
+#endif
+
 //ngx_http_upstrean_conf_tṹupstreamηĲ
 typedef struct {
     ngx_http_upstream_srv_conf_t    *upstream;
@@ -125,6 +179,7 @@ typedef struct {
     // TCPηĳʱʱ䣬λΪ
     ngx_msec_t                       read_timeout;
     ngx_msec_t                       timeout;
+    ngx_msec_t                       tunnel_timeout;
 
     size_t                           send_lowat;
     size_t                           buffer_size;//С
@@ -158,6 +213,8 @@ typedef struct {
 
     ngx_addr_t                      *local;
 
+    ngx_http_upstream_hedge_t       *hedge;
+
 #if (NGX_HTTP_CACHE)
     ngx_shm_zone_t                  *cache;
 
@@ -165,6 +222,8 @@ typedef struct {
     ngx_uint_t                       cache_use_stale;
     ngx_uint_t                       cache_methods;
 
+    ngx_flag_t                       cache_read_while_write;
+
     ngx_array_t                     *cache_valid;
     ngx_array_t                     *cache_bypass;
     ngx_array_t                     *no_cache;
@@ -180,6 +239,8 @@ typedef struct {
 #if (NGX_HTTP_SSL)
     ngx_ssl_t                       *ssl;
     ngx_flag_t                       ssl_session_reuse;
+    ngx_shm_zone_t                  *ssl_session_cache;
+    ngx_flag_t                       ssl_server_name;
 #endif
 
 } ngx_http_upstream_conf_t;
@@ -227,6 +288,9 @@ typedef struct {
     off_t                            content_length_n;
 
     ngx_array_t                      cache_control;
+
+    unsigned                         connection_close:1;
+    unsigned                         chunked:1;
 } ngx_http_upstream_headers_in_t;
 
 
@@ -268,6 +332,7 @@ struct ngx_http_upstream_s {
 
     /*ηõĽṹ壬TCP timeoutʱȵ*/
     ngx_http_upstream_conf_t        *conf;
+    ngx_http_upstream_srv_conf_t    *upstream;
 
     ngx_http_upstream_headers_in_t   headers_in;
 
@@ -278,6 +343,9 @@ struct ngx_http_upstream_s {
     ngx_buf_t                        buffer;
     size_t                           length;
 
+    /* the client data relayed to an upgraded connection */
+    ngx_buf_t                        from_client;
+
     ngx_chain_t                     *out_bufs;//νյ
     ngx_chain_t                     *busy_bufs;
     ngx_chain_t                     *free_bufs;
@@ -313,8 +381,30 @@ struct ngx_http_upstream_s {
     ngx_str_t                        schema;
     ngx_str_t                        uri;
 
+#if (NGX_HTTP_SSL)
+    ngx_str_t                        ssl_name;
+#endif
+
     ngx_http_cleanup_pt             *cleanup;
 
+    /* the round robin data inside the data of the balancer */
+    void                            *rr_data;
+
+    ngx_queue_t                      queue;
+    ngx_event_t                      queue_event;
+    ngx_msec_t                       queue_start;
+    ngx_msec_t                       queue_time;
+
+    ngx_event_t                      hedge_event;
+    ngx_connection_t                *hedge_connection;
+    ngx_peer_connection_t            hedge_peer;
+    void                            *hedge_rr_data;
+    ngx_msec_t                       hedge_start;
+
+#if (NGX_HAVE_SPLICE)
+    ngx_http_upstream_splice_t      *splice;
+#endif
+
     unsigned                         store:1;
     unsigned                         cacheable:1;
     unsigned                         accel:1;
@@ -332,6 +422,10 @@ struct ngx_http_upstream_s {
 
     unsigned                         request_sent:1;//ǷѾ
     unsigned                         header_sent:1;//ǷѾӦͷ
+    unsigned                         queued:1;
+    unsigned                         hedged:1;
+    unsigned                         keepalive:1;
+    unsigned                         upgrade:1;
 };
 
 
@@ -350,6 +444,8 @@ ngx_http_upstream_srv_conf_t *ngx_http_upstream_add(ngx_conf_t *cf,
     ngx_url_t *u, ngx_uint_t flags);
 char *ngx_http_upstream_bind_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+char *ngx_http_upstream_hedge_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 ngx_int_t ngx_http_upstream_hide_headers_hash(ngx_conf_t *cf,
     ngx_http_upstream_conf_t *conf, ngx_http_upstream_conf_t *prev,
     ngx_str_t *default_hide_headers, ngx_hash_init_t *hash);
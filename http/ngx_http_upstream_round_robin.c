@@ -13,6 +13,13 @@ static ngx_int_t ngx_http_upstream_cmp_servers(const void *one,
     const void *two);
 static ngx_uint_t
 ngx_http_upstream_get_peer(ngx_http_upstream_rr_peers_t *peers);
+static ngx_int_t ngx_http_upstream_init_round_robin_host(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us, ngx_http_upstream_server_t *server,
+    ngx_http_upstream_rr_peer_t *peer);
+static void ngx_http_upstream_rr_resolve_handler(ngx_event_t *ev);
+static void ngx_http_upstream_rr_resolve_done(ngx_resolver_ctx_t *ctx);
+static void ngx_http_upstream_rr_resolve_update(
+    ngx_http_upstream_rr_host_t *host, in_addr_t *addrs, ngx_uint_t naddrs);
 
 #if (NGX_HTTP_SSL)
 
@@ -29,7 +36,7 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
     ngx_http_upstream_srv_conf_t *us)
 {
     ngx_url_t                      u;
-    ngx_uint_t                     i, j, n;
+    ngx_uint_t                     i, j, n, resolve;
     ngx_http_upstream_server_t    *server;
     ngx_http_upstream_rr_peers_t  *peers, *backup;
 
@@ -39,12 +46,19 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
         server = us->servers->elts;							//׵ַ
 
         n = 0;												//ַ
+        resolve = 0;
 
         for (i = 0; i < us->servers->nelts; i++) {			//
             if (server[i].backup) {							//backup
                 continue;
             }
 
+            if (server[i].resolve) {
+                n += server[i].resolve;
+                resolve = 1;
+                continue;
+            }
+
             n += server[i].naddrs;							//ַ
         }
 		//IPбݽṹ
@@ -54,13 +68,25 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
             return NGX_ERROR;
         }
 
-        peers->single = (n == 1);							//Ƿֻһ
+        peers->single = (n == 1 && !resolve);							//Ƿֻһ
         peers->number = n;									//
         peers->name = &us->host;							//upstream
 
         n = 0;
 
         for (i = 0; i < us->servers->nelts; i++) {			//
+            if (server[i].resolve && !server[i].backup) {
+                if (ngx_http_upstream_init_round_robin_host(cf, us, &server[i],
+                                                            &peers->peer[n])
+                    != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+
+                n += server[i].resolve;
+                continue;
+            }
+
             for (j = 0; j < server[i].naddrs; j++) {		//ÿIPַ
                 if (server[i].backup) {						//ֻbackup
                     continue;
@@ -70,6 +96,7 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
                 peers->peer[n].socklen = server[i].addrs[j].socklen;  //socketṹ
                 peers->peer[n].name = server[i].addrs[j].name;		  //ַ
                 peers->peer[n].max_fails = server[i].max_fails;
+                peers->peer[n].max_conns = server[i].max_conns;
                 peers->peer[n].fail_timeout = server[i].fail_timeout;
                 peers->peer[n].down = server[i].down;
                 peers->peer[n].weight = server[i].down ? 0 : server[i].weight;
@@ -93,6 +120,11 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
                 continue;
             }
 
+            if (server[i].resolve) {
+                n += server[i].resolve;
+                continue;
+            }
+
             n += server[i].naddrs;
         }
 
@@ -114,6 +146,18 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
         n = 0;
 
         for (i = 0; i < us->servers->nelts; i++) {
+            if (server[i].resolve && server[i].backup) {
+                if (ngx_http_upstream_init_round_robin_host(cf, us, &server[i],
+                                                            &backup->peer[n])
+                    != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+
+                n += server[i].resolve;
+                continue;
+            }
+
             for (j = 0; j < server[i].naddrs; j++) {
                 if (!server[i].backup) {
                     continue;
@@ -125,6 +169,7 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
                 backup->peer[n].weight = server[i].weight;
                 backup->peer[n].current_weight = server[i].weight;
                 backup->peer[n].max_fails = server[i].max_fails;
+                backup->peer[n].max_conns = server[i].max_conns;
                 backup->peer[n].fail_timeout = server[i].fail_timeout;
                 backup->peer[n].down = server[i].down;
                 n++;
@@ -195,6 +240,338 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
 }
 
 
+/*
+ * a server marked with "resolve" takes the given number of peer slots,
+ * the slots are filled with the addresses of the name at run time;
+ * the slots without an address are down
+ */
+
+static ngx_int_t
+ngx_http_upstream_init_round_robin_host(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us, ngx_http_upstream_server_t *server,
+    ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_uint_t                    i;
+    struct sockaddr_in           *sin;
+    ngx_http_core_loc_conf_t     *clcf;
+    ngx_http_upstream_rr_host_t  *host;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    if (clcf->resolver == NULL) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "no resolver defined to resolve \"%V\" "
+                      "in upstream \"%V\" in %s:%ui",
+                      &server->host, &us->host, us->file_name, us->line);
+        return NGX_ERROR;
+    }
+
+    host = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_rr_host_t));
+    if (host == NULL) {
+        return NGX_ERROR;
+    }
+
+    host->name = server->host;
+    host->port = server->port;
+    host->down = server->down;
+    host->slots = server->resolve;
+    host->name_size = ngx_max(NGX_SOCKADDR_STRLEN,
+                              server->host.len + sizeof(":65535") - 1);
+
+    host->resolver = clcf->resolver;
+    host->resolver_timeout = (clcf->resolver_timeout == NGX_CONF_UNSET_MSEC)
+                             ? 30000 : clcf->resolver_timeout;
+
+    for (i = 0; i < host->slots; i++) {
+
+        sin = ngx_pcalloc(cf->pool, sizeof(struct sockaddr_in));
+        if (sin == NULL) {
+            return NGX_ERROR;
+        }
+
+        peer[i].name.data = ngx_pnalloc(cf->pool, host->name_size);
+        if (peer[i].name.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(host->port);
+
+        peer[i].sockaddr = (struct sockaddr *) sin;
+        peer[i].socklen = sizeof(struct sockaddr_in);
+
+        if (i < server->naddrs
+            && server->addrs[i].socklen == sizeof(struct sockaddr_in))
+        {
+            ngx_memcpy(sin, server->addrs[i].sockaddr,
+                       sizeof(struct sockaddr_in));
+
+            peer[i].name.len = ngx_sock_ntop(peer[i].sockaddr,
+                                             peer[i].name.data,
+                                             host->name_size, 1);
+            peer[i].down = server->down;
+
+        } else {
+            peer[i].name.len = ngx_sprintf(peer[i].name.data, "%V:%d",
+                                           &host->name, host->port)
+                               - peer[i].name.data;
+            peer[i].down = 1;
+        }
+
+        peer[i].host = host;
+        peer[i].weight = server->down ? 0 : server->weight;
+        peer[i].current_weight = peer[i].weight;
+        peer[i].max_fails = server->max_fails;
+        peer[i].max_conns = server->max_conns;
+        peer[i].fail_timeout = server->fail_timeout;
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * every worker resolves the names on its own; the slots are updated
+ * in place, an address keeps its slot while it is in the answers, so
+ * the workers that share a zone agree on the slots
+ */
+
+ngx_int_t
+ngx_http_upstream_init_round_robin_resolve(ngx_cycle_t *cycle,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_uint_t                     i;
+    ngx_http_upstream_rr_host_t   *host;
+    ngx_http_upstream_rr_peers_t  *peers, *local;
+
+    /* the hosts are found in the peers of the process, not in the zone */
+
+    peers = us->peer.data;
+    local = us->local_peers ? us->local_peers : peers;
+
+    for ( /* void */ ; local; local = local->next, peers = peers->next) {
+
+        for (i = 0; i < local->number; i++) {
+            host = local->peer[i].host;
+
+            if (host == NULL || host->peers) {
+                continue;
+            }
+
+            host->peers = peers;
+            host->local = local;
+
+            host->event.handler = ngx_http_upstream_rr_resolve_handler;
+            host->event.data = host;
+            host->event.log = cycle->log;
+            host->event.cancelable = 1;
+
+            ngx_add_timer(&host->event, 1);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_rr_resolve_handler(ngx_event_t *ev)
+{
+    ngx_resolver_ctx_t           *ctx;
+    ngx_http_upstream_rr_host_t  *host;
+
+    host = ev->data;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    ctx = ngx_resolve_start(host->resolver, NULL);
+    if (ctx == NULL) {
+        goto failed;
+    }
+
+    if (ctx == NGX_NO_RESOLVER) {
+        ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+                      "no resolver defined to resolve %V", &host->name);
+        return;
+    }
+
+    ctx->name = host->name;
+    ctx->type = NGX_RESOLVE_A;
+    ctx->handler = ngx_http_upstream_rr_resolve_done;
+    ctx->data = host;
+    ctx->timeout = host->resolver_timeout;
+
+    if (ngx_resolve_name(ctx) != NGX_OK) {
+        goto failed;
+    }
+
+    return;
+
+failed:
+
+    ngx_add_timer(ev, 10000);
+}
+
+
+static void
+ngx_http_upstream_rr_resolve_done(ngx_resolver_ctx_t *ctx)
+{
+    time_t                        valid;
+    ngx_http_upstream_rr_host_t  *host;
+
+    host = ctx->data;
+
+    if (ctx->state) {
+        ngx_log_error(NGX_LOG_ERR, host->event.log, 0,
+                      "upstream server %V could not be resolved (%i: %s)",
+                      &ctx->name, ctx->state,
+                      ngx_resolver_strerror(ctx->state));
+
+        /* the addresses are kept on the temporary errors */
+
+        if (ctx->state == NGX_RESOLVE_NXDOMAIN) {
+            ngx_http_upstream_rr_resolve_update(host, NULL, 0);
+        }
+
+        valid = 10;
+
+    } else {
+        ngx_http_upstream_rr_resolve_update(host, ctx->addrs, ctx->naddrs);
+
+        valid = ctx->valid - ngx_time();
+    }
+
+    ngx_resolve_name_done(ctx);
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    if (valid < 1) {
+        valid = 1;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, host->event.log, 0,
+                   "upstream resolve %V again in %T", &host->name, valid);
+
+    ngx_add_timer(&host->event, (ngx_msec_t) valid * 1000);
+}
+
+
+static void
+ngx_http_upstream_rr_resolve_update(ngx_http_upstream_rr_host_t *host,
+    in_addr_t *addrs, ngx_uint_t naddrs)
+{
+    ngx_uint_t                     i, j, lost;
+    struct sockaddr_in            *sin;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers, *local;
+
+    /* the slots of the host are the same in the zone and in the process */
+
+    peers = host->peers;
+    local = host->local;
+
+    ngx_http_upstream_rr_peers_lock(peers);
+
+    /* the addresses that are gone free their slots */
+
+    for (i = 0; i < local->number; i++) {
+        peer = &peers->peer[i];
+
+        if (local->peer[i].host != host) {
+            continue;
+        }
+
+        sin = (struct sockaddr_in *) peer->sockaddr;
+
+        if (sin->sin_addr.s_addr == INADDR_ANY) {
+            continue;
+        }
+
+        for (j = 0; j < naddrs; j++) {
+            if (addrs[j] == sin->sin_addr.s_addr) {
+                break;
+            }
+        }
+
+        if (j < naddrs) {
+            continue;
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, host->event.log, 0,
+                      "upstream server %V address %V removed",
+                      &host->name, &peer->name);
+
+        sin->sin_addr.s_addr = INADDR_ANY;
+
+        peer->name.len = ngx_sprintf(peer->name.data, "%V:%d",
+                                     &host->name, host->port)
+                         - peer->name.data;
+        peer->down = 1;
+        peer->fails = 0;
+    }
+
+    /* the new addresses take the free slots */
+
+    lost = 0;
+
+    for (j = 0; j < naddrs; j++) {
+
+        peer = NULL;
+
+        for (i = 0; i < local->number; i++) {
+
+            if (local->peer[i].host != host) {
+                continue;
+            }
+
+            sin = (struct sockaddr_in *) peers->peer[i].sockaddr;
+
+            if (sin->sin_addr.s_addr == addrs[j]) {
+                break;
+            }
+
+            if (peer == NULL && sin->sin_addr.s_addr == INADDR_ANY) {
+                peer = &peers->peer[i];
+            }
+        }
+
+        if (i < local->number) {
+            continue;
+        }
+
+        if (peer == NULL) {
+            lost++;
+            continue;
+        }
+
+        sin = (struct sockaddr_in *) peer->sockaddr;
+        sin->sin_addr.s_addr = addrs[j];
+
+        peer->name.len = ngx_sock_ntop(peer->sockaddr, peer->name.data,
+                                       host->name_size, 1);
+        peer->down = host->down;
+        peer->fails = 0;
+        peer->accessed = 0;
+
+        ngx_log_error(NGX_LOG_NOTICE, host->event.log, 0,
+                      "upstream server %V address %V added",
+                      &host->name, &peer->name);
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    if (lost) {
+        ngx_log_error(NGX_LOG_WARN, host->event.log, 0,
+                      "upstream server %V has %ui more addresses than "
+                      "its %ui slots", &host->name, lost, host->slots);
+    }
+}
+
+
 static ngx_int_t
 ngx_http_upstream_cmp_servers(const void *one, const void *two)
 {
@@ -225,8 +602,12 @@ ngx_http_upstream_init_round_robin_peer(ngx_http_request_t *r,
         r->upstream->peer.data = rrp;
     }
 
+    r->upstream->rr_data = rrp;
+
     rrp->peers = us->peer.data;//õIPַб
+    rrp->local = us->local_peers ? us->local_peers : us->peer.data;
     rrp->current = 0;
+    rrp->peer = NULL;
 
     if (rrp->peers->number <= 8 * sizeof(uintptr_t)) {
         rrp->tried = &rrp->data;
@@ -256,6 +637,34 @@ ngx_http_upstream_init_round_robin_peer(ngx_http_request_t *r,
 }
 
 
+/*
+ * a request that gets a peer again after waiting in the upstream queue
+ * starts with the state of the balancer as it was initialized
+ */
+
+void
+ngx_http_upstream_reset_round_robin_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_uint_t                         n;
+    ngx_http_upstream_rr_peer_data_t  *rrp;
+
+    rrp = r->upstream->rr_data;
+
+    rrp->peers = us->peer.data;
+    rrp->local = us->local_peers ? us->local_peers : us->peer.data;
+    rrp->current = 0;
+    rrp->peer = NULL;
+
+    n = (rrp->peers->number + (8 * sizeof(uintptr_t) - 1))
+            / (8 * sizeof(uintptr_t));
+
+    ngx_memzero(rrp->tried, n * sizeof(uintptr_t));
+
+    r->upstream->peer.tries = rrp->peers->number;
+}
+
+
 ngx_int_t
 ngx_http_upstream_create_round_robin_peer(ngx_http_request_t *r,
     ngx_http_upstream_resolved_t *ur)
@@ -332,7 +741,9 @@ ngx_http_upstream_create_round_robin_peer(ngx_http_request_t *r,
     }
 
     rrp->peers = peers;
+    rrp->local = peers;
     rrp->current = 0;
+    rrp->peer = NULL;
 
     if (rrp->peers->number <= 8 * sizeof(uintptr_t)) {
         rrp->tried = &rrp->data;
@@ -378,7 +789,7 @@ ngx_http_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
 
     now = ngx_time();
 
-    /* ngx_lock_mutex(rrp->peers->mutex); */
+    ngx_http_upstream_rr_peers_lock(rrp->peers);
 
     if (rrp->peers->last_cached) {
 
@@ -387,7 +798,7 @@ ngx_http_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
         c = rrp->peers->cached[rrp->peers->last_cached];
         rrp->peers->last_cached--;
 
-        /* ngx_unlock_mutex(ppr->peers->mutex); */
+        ngx_http_upstream_rr_peers_unlock(rrp->peers);
 
 #if (NGX_THREADS)
         c->read->lock = c->read->own_lock;
@@ -406,6 +817,10 @@ ngx_http_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
     if (rrp->peers->single) {
         peer = &rrp->peers->peer[0];
 
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
+            goto failed;
+        }
+
     } else {
 
         /* there are several peers */
@@ -430,7 +845,10 @@ ngx_http_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
                 if (!(rrp->tried[n] & m)) {
                     peer = &rrp->peers->peer[rrp->current];
 
-                    if (!peer->down) {
+                    if (!peer->down && !peer->unhealthy
+                        && (peer->max_conns == 0
+                            || peer->conns < peer->max_conns))
+                    {
 
                         if (peer->max_fails == 0
                             || peer->fails < peer->max_fails)
@@ -446,6 +864,7 @@ ngx_http_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
                         peer->current_weight = 0;
 
                     } else {
+                        peer->current_weight = 0;
                         rrp->tried[n] |= m;
                     }
 
@@ -478,7 +897,10 @@ ngx_http_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
 
                     peer = &rrp->peers->peer[rrp->current];
 
-                    if (!peer->down) {
+                    if (!peer->down && !peer->unhealthy
+                        && (peer->max_conns == 0
+                            || peer->conns < peer->max_conns))
+                    {
 
                         if (peer->max_fails == 0
                             || peer->fails < peer->max_fails)
@@ -494,6 +916,7 @@ ngx_http_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
                         peer->current_weight = 0;
 
                     } else {
+                        peer->current_weight = 0;
                         rrp->tried[n] |= m;
                     }
 
@@ -528,7 +951,10 @@ ngx_http_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
     pc->socklen = peer->socklen;
     pc->name = &peer->name;
 
-    /* ngx_unlock_mutex(rrp->peers->mutex); */
+    peer->conns++;
+    rrp->peer = peer;
+
+    ngx_http_upstream_rr_peers_unlock(rrp->peers);
 
     if (pc->tries == 1 && rrp->peers->next) {
         pc->tries += rrp->peers->next->number;
@@ -547,11 +973,12 @@ failed:
 
     if (peers->next) {
 
-        /* ngx_unlock_mutex(peers->mutex); */
+        ngx_http_upstream_rr_peers_unlock(peers);
 
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0, "backup servers");
 
         rrp->peers = peers->next;
+        rrp->local = rrp->local->next;
         pc->tries = rrp->peers->number;
 
         n = rrp->peers->number / (8 * sizeof(uintptr_t)) + 1;
@@ -565,7 +992,7 @@ failed:
             return rc;
         }
 
-        /* ngx_lock_mutex(peers->mutex); */
+        ngx_http_upstream_rr_peers_lock(peers);
     }
 
     /* all peers failed, mark them as live for quick recovery */
@@ -574,7 +1001,7 @@ failed:
         peers->peer[i].fails = 0;
     }
 
-    /* ngx_unlock_mutex(peers->mutex); */
+    ngx_http_upstream_rr_peers_unlock(peers);
 
     pc->name = peers->name;
 
@@ -643,6 +1070,16 @@ ngx_http_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "free rr peer %ui %ui", pc->tries, state);
 
+    if (rrp->peer) {
+        ngx_http_upstream_rr_peers_lock(rrp->peers);
+
+        rrp->peer->conns--;
+
+        ngx_http_upstream_rr_peers_unlock(rrp->peers);
+
+        rrp->peer = NULL;
+    }
+
     if (state == 0 && pc->tries == 0) {
         return;
     }
@@ -659,7 +1096,7 @@ ngx_http_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
 
         peer = &rrp->peers->peer[rrp->current];
 
-        /* ngx_lock_mutex(rrp->peers->mutex); */
+        ngx_http_upstream_rr_peers_lock(rrp->peers);
 
         peer->fails++;
         peer->accessed = now;
@@ -676,7 +1113,7 @@ ngx_http_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
             peer->current_weight = 0;
         }
 
-        /* ngx_unlock_mutex(rrp->peers->mutex); */
+        ngx_http_upstream_rr_peers_unlock(rrp->peers);
     }
 
     rrp->current++;
@@ -701,11 +1138,20 @@ ngx_http_upstream_set_round_robin_peer_session(ngx_peer_connection_t *pc,
 {
     ngx_http_upstream_rr_peer_data_t  *rrp = data;
 
-    ngx_int_t                     rc;
-    ngx_ssl_session_t            *ssl_session;
-    ngx_http_upstream_rr_peer_t  *peer;
+    ngx_int_t                      rc;
+    ngx_ssl_session_t             *ssl_session;
+    ngx_http_upstream_rr_peer_t   *peer;
 
-    peer = &rrp->peers->peer[rrp->current];
+    /*
+     * the sessions are local to a process, even if the peers are shared;
+     * the spare slots of a zone keep no sessions
+     */
+
+    if (rrp->current >= rrp->local->number) {
+        return NGX_OK;
+    }
+
+    peer = &rrp->local->peer[rrp->current];
 
     /* TODO: threads only mutex */
     /* ngx_lock_mutex(rrp->peers->mutex); */
@@ -730,8 +1176,12 @@ ngx_http_upstream_save_round_robin_peer_session(ngx_peer_connection_t *pc,
 {
     ngx_http_upstream_rr_peer_data_t  *rrp = data;
 
-    ngx_ssl_session_t            *old_ssl_session, *ssl_session;
-    ngx_http_upstream_rr_peer_t  *peer;
+    ngx_ssl_session_t             *old_ssl_session, *ssl_session;
+    ngx_http_upstream_rr_peer_t   *peer;
+
+    if (rrp->current >= rrp->local->number) {
+        return;
+    }
 
     ssl_session = ngx_ssl_get_session(pc->connection);
 
@@ -742,7 +1192,7 @@ ngx_http_upstream_save_round_robin_peer_session(ngx_peer_connection_t *pc,
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "save session: %p:%d", ssl_session, ssl_session->references);
 
-    peer = &rrp->peers->peer[rrp->current];
+    peer = &rrp->local->peer[rrp->current];
 
     /* TODO: threads only mutex */
     /* ngx_lock_mutex(rrp->peers->mutex); */
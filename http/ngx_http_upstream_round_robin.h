@@ -12,6 +12,29 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
+
+typedef struct ngx_http_upstream_rr_peers_s  ngx_http_upstream_rr_peers_t;
+
+
+/* a server name that is resolved at run time */
+
+typedef struct {
+    ngx_str_t                       name;
+    in_port_t                       port;
+    ngx_uint_t                      down;
+    ngx_uint_t                      slots;
+    size_t                          name_size;
+
+    /* the peers with the slots, and their process-local original */
+    ngx_http_upstream_rr_peers_t   *peers;
+    ngx_http_upstream_rr_peers_t   *local;
+
+    ngx_resolver_t                 *resolver;
+    ngx_msec_t                      resolver_timeout;
+
+    ngx_event_t                     event;
+} ngx_http_upstream_rr_host_t;
+
 //ýṹÿľIPһһӦ
 typedef struct {
     struct sockaddr                *sockaddr;//һӵIPַ
@@ -27,26 +50,52 @@ typedef struct {
     ngx_uint_t                      max_fails;
     time_t                          fail_timeout;
 
+    ngx_uint_t                      conns;
+    ngx_uint_t                      max_conns;
+
+    /* the peak EWMA of the response time, in microseconds */
+    ngx_uint_t                      ewma;
+    ngx_msec_t                      ewma_stamp;
+
+    /* the state of the active health checks */
+    ngx_msec_t                      checked;
+    ngx_msec_t                      check_latency;
+    ngx_uint_t                      check_fails;
+    ngx_uint_t                      check_passes;
+    ngx_uint_t                      unhealthy;     /* unsigned  unhealthy:1; */
+
     ngx_uint_t                      down;          /* unsigned  down:1; */
 
+    /* set by the upstream_conf API */
+    ngx_uint_t                      drain;         /* unsigned  drain:1; */
+    ngx_uint_t                      empty;         /* unsigned  empty:1; */
+
+    /* local to a process, NULL in a zone */
+    ngx_http_upstream_rr_host_t    *host;
+
 #if (NGX_HTTP_SSL)
     ngx_ssl_session_t              *ssl_session;   /* local to a process */
 #endif
 } ngx_http_upstream_rr_peer_t;
 
 
-typedef struct ngx_http_upstream_rr_peers_s  ngx_http_upstream_rr_peers_t;
 //IPַб
 struct ngx_http_upstream_rr_peers_s {
     ngx_uint_t                      single;        /* unsigned  single:1; */
     ngx_uint_t                      number;//peerĳ
     ngx_uint_t                      last_cached;
 
- /* ngx_mutex_t                    *mutex; */
+    ngx_slab_pool_t                *shpool;
     ngx_connection_t              **cached;
 
     ngx_str_t                      *name;
 
+    ngx_http_upstream_rr_peers_t   *zone_next;
+
+    /* the changes made by the upstream_conf API, and the last one saved */
+    ngx_uint_t                      changes;
+    ngx_uint_t                      saved;
+
     ngx_http_upstream_rr_peers_t   *next;//backupIPб
 
     ngx_http_upstream_rr_peer_t     peer[1];//backupIPб
@@ -55,16 +104,35 @@ struct ngx_http_upstream_rr_peers_s {
 //Ǹؾʹõݽṹ
 typedef struct {
     ngx_http_upstream_rr_peers_t   *peers;//IPַб
+    ngx_http_upstream_rr_peers_t   *local;         /* local to a process */
     ngx_uint_t                      current;//round robin㷨
+    ngx_http_upstream_rr_peer_t    *peer;          /* the connected peer */
     uintptr_t                      *tried;//bit
     uintptr_t                       data;
 } ngx_http_upstream_rr_peer_data_t;
 
 
+#define ngx_http_upstream_rr_peers_lock(peers)                                \
+                                                                              \
+    if (peers->shpool) {                                                      \
+        ngx_shmtx_lock(&peers->shpool->mutex);                                \
+    }
+
+#define ngx_http_upstream_rr_peers_unlock(peers)                              \
+                                                                              \
+    if (peers->shpool) {                                                      \
+        ngx_shmtx_unlock(&peers->shpool->mutex);                              \
+    }
+
+
 ngx_int_t ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
     ngx_http_upstream_srv_conf_t *us);
 ngx_int_t ngx_http_upstream_init_round_robin_peer(ngx_http_request_t *r,
     ngx_http_upstream_srv_conf_t *us);
+ngx_int_t ngx_http_upstream_init_round_robin_resolve(ngx_cycle_t *cycle,
+    ngx_http_upstream_srv_conf_t *us);
+void ngx_http_upstream_reset_round_robin_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
 ngx_int_t ngx_http_upstream_create_round_robin_peer(ngx_http_request_t *r,
     ngx_http_upstream_resolved_t *ur);
 ngx_int_t ngx_http_upstream_get_round_robin_peer(ngx_peer_connection_t *pc,
@@ -0,0 +1,3692 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+/* settings fields */
+#define NGX_HTTP_V2_HEADER_TABLE_SIZE_SETTING    0x1
+#define NGX_HTTP_V2_ENABLE_PUSH_SETTING          0x2
+#define NGX_HTTP_V2_MAX_STREAMS_SETTING          0x3
+#define NGX_HTTP_V2_INIT_WINDOW_SIZE_SETTING     0x4
+#define NGX_HTTP_V2_MAX_FRAME_SIZE_SETTING       0x5
+
+#define NGX_HTTP_V2_SETTINGS_PARAM_SIZE          6
+
+/* the largest payload of the frames sent by ngx_http_v2_get_frame() */
+#define NGX_HTTP_V2_CONTROL_PAYLOAD              (3 * 6)
+
+#define NGX_HTTP_V2_RST_STREAM_SIZE              4
+#define NGX_HTTP_V2_PRIORITY_SIZE                5
+#define NGX_HTTP_V2_PING_SIZE                    8
+#define NGX_HTTP_V2_GOAWAY_SIZE                  8
+#define NGX_HTTP_V2_WINDOW_UPDATE_SIZE           4
+
+#define NGX_HTTP_V2_INDEX_SIZE                   64
+
+#define ngx_http_v2_index(sid)  (((sid) >> 1) & (NGX_HTTP_V2_INDEX_SIZE - 1))
+
+
+typedef ngx_int_t (*ngx_http_v2_state_pt)(ngx_http_v2_connection_t *h2c,
+    u_char *pos, size_t size, ngx_uint_t flags, ngx_uint_t sid);
+
+
+typedef struct {
+    ngx_http_v2_out_frame_t          frame;
+    ngx_chain_t                      chain;
+    ngx_buf_t                        buf;
+    u_char                           data[NGX_HTTP_V2_FRAME_HEADER_SIZE
+                                          + NGX_HTTP_V2_CONTROL_PAYLOAD];
+} ngx_http_v2_control_frame_t;
+
+
+typedef struct {
+    ngx_http_v2_out_frame_t          frame;
+    ngx_chain_t                      chain[2];
+    ngx_buf_t                        buf[2];
+    u_char                           header[NGX_HTTP_V2_FRAME_HEADER_SIZE];
+} ngx_http_v2_data_frame_t;
+
+
+static void ngx_http_v2_read_handler(ngx_event_t *rev);
+static void ngx_http_v2_write_handler(ngx_event_t *wev);
+static void ngx_http_v2_handle_connection(ngx_http_v2_connection_t *h2c);
+static void ngx_http_v2_handle_connection_handler(ngx_event_t *rev);
+static void ngx_http_v2_finalize_connection(ngx_http_v2_connection_t *h2c,
+    ngx_uint_t status);
+static void ngx_http_v2_pool_cleanup(void *data);
+
+static ngx_int_t ngx_http_v2_process_input(ngx_http_v2_connection_t *h2c);
+static ngx_int_t ngx_http_v2_state_data(ngx_http_v2_connection_t *h2c,
+    u_char *pos, size_t size, ngx_uint_t flags, ngx_uint_t sid);
+static ngx_int_t ngx_http_v2_state_headers(ngx_http_v2_connection_t *h2c,
+    u_char *pos, size_t size, ngx_uint_t flags, ngx_uint_t sid);
+static ngx_int_t ngx_http_v2_state_priority(ngx_http_v2_connection_t *h2c,
+    u_char *pos, size_t size, ngx_uint_t flags, ngx_uint_t sid);
+static ngx_int_t ngx_http_v2_state_rst_stream(ngx_http_v2_connection_t *h2c,
+    u_char *pos, size_t size, ngx_uint_t flags, ngx_uint_t sid);
+static ngx_int_t ngx_http_v2_state_settings(ngx_http_v2_connection_t *h2c,
+    u_char *pos, size_t size, ngx_uint_t flags, ngx_uint_t sid);
+static ngx_int_t ngx_http_v2_state_push_promise(
+    ngx_http_v2_connection_t *h2c, u_char *pos, size_t size, ngx_uint_t flags,
+    ngx_uint_t sid);
+static ngx_int_t ngx_http_v2_state_ping(ngx_http_v2_connection_t *h2c,
+    u_char *pos, size_t size, ngx_uint_t flags, ngx_uint_t sid);
+static ngx_int_t ngx_http_v2_state_goaway(ngx_http_v2_connection_t *h2c,
+    u_char *pos, size_t size, ngx_uint_t flags, ngx_uint_t sid);
+static ngx_int_t ngx_http_v2_state_window_update(
+    ngx_http_v2_connection_t *h2c, u_char *pos, size_t size, ngx_uint_t flags,
+    ngx_uint_t sid);
+static ngx_int_t ngx_http_v2_state_continuation(
+    ngx_http_v2_connection_t *h2c, u_char *pos, size_t size, ngx_uint_t flags,
+    ngx_uint_t sid);
+static ngx_int_t ngx_http_v2_header_block(ngx_http_v2_connection_t *h2c,
+    u_char *pos, size_t size, ngx_uint_t flags);
+static ngx_int_t ngx_http_v2_header_complete(ngx_http_v2_connection_t *h2c);
+static ngx_int_t ngx_http_v2_skip_header_block(ngx_http_v2_connection_t *h2c);
+static ngx_int_t ngx_http_v2_decode_header_block(
+    ngx_http_v2_connection_t *h2c, ngx_pool_t *pool, ngx_array_t *headers);
+static ngx_int_t ngx_http_v2_parse_int(u_char **pos, u_char *end,
+    ngx_uint_t prefix);
+static ngx_int_t ngx_http_v2_parse_string(ngx_http_v2_connection_t *h2c,
+    u_char **pos, u_char *end, ngx_pool_t *pool, ngx_str_t *s);
+static ngx_int_t ngx_http_v2_copy_string(ngx_pool_t *pool, ngx_str_t *s);
+static ngx_int_t ngx_http_v2_connection_error(ngx_http_v2_connection_t *h2c,
+    ngx_uint_t status);
+static ngx_int_t ngx_http_v2_terminate_stream(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_stream_t *stream, ngx_uint_t status);
+
+static ngx_http_v2_stream_t *ngx_http_v2_create_stream(
+    ngx_http_v2_connection_t *h2c);
+static ngx_http_v2_stream_t *ngx_http_v2_get_stream(
+    ngx_http_v2_connection_t *h2c, ngx_uint_t sid);
+static void ngx_http_v2_set_dependency(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_stream_t *stream, ngx_uint_t depend, ngx_uint_t exclusive);
+static void ngx_http_v2_remove_dependency(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_stream_t *stream);
+static void ngx_http_v2_node_rank(ngx_http_v2_stream_t *node);
+static void ngx_http_v2_run_request(ngx_http_v2_stream_t *stream,
+    ngx_array_t *headers);
+static ngx_int_t ngx_http_v2_validate_header(ngx_http_v2_header_t *h);
+static ngx_int_t ngx_http_v2_construct_request_line(ngx_http_request_t *r,
+    ngx_str_t *method, ngx_str_t *path);
+static ngx_int_t ngx_http_v2_process_header(ngx_http_request_t *r,
+    ngx_str_t *name, ngx_str_t *value);
+static void ngx_http_v2_read_unknown_body_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_v2_set_content_length(ngx_http_request_t *r);
+static void ngx_http_v2_wake(ngx_event_t *ev);
+static void ngx_http_v2_close_stream_handler(ngx_event_t *ev);
+static void ngx_http_v2_drop_frames(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_stream_t *stream);
+
+static ssize_t ngx_http_v2_recv(ngx_connection_t *fc, u_char *buf,
+    size_t size);
+static ssize_t ngx_http_v2_send(ngx_connection_t *fc, u_char *buf,
+    size_t size);
+static ngx_chain_t *ngx_http_v2_send_chain(ngx_connection_t *fc,
+    ngx_chain_t *in, off_t limit);
+
+static ngx_http_v2_out_frame_t *ngx_http_v2_get_frame(
+    ngx_http_v2_connection_t *h2c, size_t length, ngx_uint_t type,
+    ngx_uint_t flags, ngx_uint_t sid);
+static ngx_http_v2_out_frame_t *ngx_http_v2_get_data_frame(
+    ngx_http_v2_stream_t *stream, ngx_buf_t *b, u_char *pos, size_t len,
+    ngx_uint_t fin);
+static ngx_int_t ngx_http_v2_send_settings(ngx_http_v2_connection_t *h2c);
+static ngx_int_t ngx_http_v2_send_window_update(ngx_http_v2_connection_t *h2c,
+    ngx_uint_t sid, size_t window);
+static ngx_int_t ngx_http_v2_send_rst_stream(ngx_http_v2_connection_t *h2c,
+    ngx_uint_t sid, ngx_uint_t status);
+static ngx_int_t ngx_http_v2_send_goaway(ngx_http_v2_connection_t *h2c,
+    ngx_uint_t status);
+static ngx_int_t ngx_http_v2_control_frame_handler(
+    ngx_http_v2_connection_t *h2c, ngx_http_v2_out_frame_t *frame);
+static ngx_int_t ngx_http_v2_data_frame_handler(
+    ngx_http_v2_connection_t *h2c, ngx_http_v2_out_frame_t *frame);
+static void ngx_http_v2_handle_frame(ngx_http_v2_stream_t *stream,
+    ngx_http_v2_out_frame_t *frame);
+
+static void *ngx_http_v2_create_srv_conf(ngx_conf_t *cf);
+static char *ngx_http_v2_merge_srv_conf(ngx_conf_t *cf, void *parent,
+    void *child);
+static char *ngx_http_v2_recv_buffer_size(ngx_conf_t *cf, void *post,
+    void *data);
+static char *ngx_http_v2_preread_size(ngx_conf_t *cf, void *post, void *data);
+static char *ngx_http_v2_chunk_size(ngx_conf_t *cf, void *post, void *data);
+
+
+static ngx_conf_post_t  ngx_http_v2_recv_buffer_size_post =
+    { ngx_http_v2_recv_buffer_size };
+static ngx_conf_post_t  ngx_http_v2_preread_size_post =
+    { ngx_http_v2_preread_size };
+static ngx_conf_post_t  ngx_http_v2_chunk_size_post =
+    { ngx_http_v2_chunk_size };
+
+
+static ngx_command_t  ngx_http_v2_commands[] = {
+
+    { ngx_string("http2_recv_buffer_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_v2_srv_conf_t, recv_buffer_size),
+      &ngx_http_v2_recv_buffer_size_post },
+
+    { ngx_string("http2_max_concurrent_streams"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_v2_srv_conf_t, concurrent_streams),
+      NULL },
+
+    { ngx_string("http2_max_field_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_v2_srv_conf_t, max_field_size),
+      NULL },
+
+    { ngx_string("http2_max_header_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_v2_srv_conf_t, max_header_size),
+      NULL },
+
+    { ngx_string("http2_body_preread_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_v2_srv_conf_t, preread_size),
+      &ngx_http_v2_preread_size_post },
+
+    { ngx_string("http2_chunk_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_v2_srv_conf_t, chunk_size),
+      &ngx_http_v2_chunk_size_post },
+
+    { ngx_string("http2_recv_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_v2_srv_conf_t, recv_timeout),
+      NULL },
+
+    { ngx_string("http2_idle_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_v2_srv_conf_t, idle_timeout),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_v2_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_v2_create_srv_conf,           /* create server configuration */
+    ngx_http_v2_merge_srv_conf,            /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_v2_module = {
+    NGX_MODULE_V1,
+    &ngx_http_v2_module_ctx,               /* module context */
+    ngx_http_v2_commands,                  /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_http_v2_state_pt  ngx_http_v2_frame_states[] = {
+    ngx_http_v2_state_data,
+    ngx_http_v2_state_headers,
+    ngx_http_v2_state_priority,
+    ngx_http_v2_state_rst_stream,
+    ngx_http_v2_state_settings,
+    ngx_http_v2_state_push_promise,
+    ngx_http_v2_state_ping,
+    ngx_http_v2_state_goaway,
+    ngx_http_v2_state_window_update,
+    ngx_http_v2_state_continuation
+};
+
+#define NGX_HTTP_V2_FRAME_STATES                                              \
+    (sizeof(ngx_http_v2_frame_states) / sizeof(ngx_http_v2_state_pt))
+
+
+void
+ngx_http_v2_init(ngx_event_t *rev)
+{
+    size_t                     size;
+    ngx_buf_t                 *b;
+    ngx_connection_t          *c;
+    ngx_pool_cleanup_t        *cln;
+    ngx_http_request_t        *r;
+    ngx_http_log_ctx_t        *ctx;
+    ngx_http_v2_srv_conf_t    *h2scf;
+    ngx_http_core_loc_conf_t  *clcf;
+    ngx_http_v2_connection_t  *h2c;
+
+    c = rev->data;
+
+    /* the request of ngx_http_init_request() only holds the configuration */
+    r = c->data;
+
+    c->log->action = "processing HTTP/2 connection";
+
+    h2c = ngx_pcalloc(c->pool, sizeof(ngx_http_v2_connection_t));
+    if (h2c == NULL) {
+        ngx_http_close_connection(c);
+        return;
+    }
+
+    h2c->streams_index = ngx_pcalloc(c->pool, NGX_HTTP_V2_INDEX_SIZE
+                                              * sizeof(ngx_http_v2_stream_t *));
+    if (h2c->streams_index == NULL) {
+        ngx_http_close_connection(c);
+        return;
+    }
+
+    cln = ngx_pool_cleanup_add(c->pool, 0);
+    if (cln == NULL) {
+        ngx_http_close_connection(c);
+        return;
+    }
+
+    cln->handler = ngx_http_v2_pool_cleanup;
+    cln->data = h2c;
+
+    h2c->connection = c;
+    h2c->http_connection = r->http_connection;
+
+    h2c->main_conf = r->main_conf;
+    h2c->srv_conf = r->srv_conf;
+    h2c->loc_conf = r->loc_conf;
+    h2c->virtual_names = r->virtual_names;
+
+    h2c->send_window = NGX_HTTP_V2_DEFAULT_WINDOW;
+    h2c->recv_window = NGX_HTTP_V2_DEFAULT_WINDOW;
+    h2c->init_window = NGX_HTTP_V2_DEFAULT_WINDOW;
+    h2c->frame_size = NGX_HTTP_V2_DEFAULT_FRAME_SIZE;
+
+    h2c->hpack.max = NGX_HTTP_V2_TABLE_SIZE;
+
+    ngx_queue_init(&h2c->waiting);
+    ngx_queue_init(&h2c->dependencies);
+
+    if (r->pool) {
+
+        /*
+         * the request was created before ALPN selected HTTP/2, or
+         * the preface was read as a request line without ALPN
+         */
+
+#if (NGX_STAT_STUB)
+        if (r->stat_reading) {
+            (void) ngx_atomic_fetch_add(ngx_stat_reading, -1);
+            r->stat_reading = 0;
+        }
+#endif
+
+        b = r->header_in;
+
+        if (b && b->last != b->start) {
+            h2scf = ngx_http_get_module_srv_conf(h2c, ngx_http_v2_module);
+
+            size = b->last - b->start;
+
+            if (size > h2scf->recv_buffer_size) {
+                ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                              "client sent too long HTTP/2 preface");
+                ngx_destroy_pool(r->pool);
+                ngx_http_close_connection(c);
+                return;
+            }
+
+            h2c->buffer = ngx_alloc(h2scf->recv_buffer_size, c->log);
+            if (h2c->buffer == NULL) {
+                ngx_destroy_pool(r->pool);
+                ngx_http_close_connection(c);
+                return;
+            }
+
+            h2c->pos = h2c->buffer;
+            h2c->last = ngx_cpymem(h2c->buffer, b->start, size);
+
+            b->pos = b->start;
+            b->last = b->start;
+        }
+
+        ngx_destroy_pool(r->pool);
+        r->pool = NULL;
+    }
+
+    clcf = ngx_http_get_module_loc_conf(h2c, ngx_http_core_module);
+
+    c->log->file = clcf->error_log->file;
+    if (!(c->log->log_level & NGX_LOG_DEBUG_CONNECTION)) {
+        c->log->log_level = clcf->error_log->log_level;
+    }
+
+    ctx = c->log->data;
+    ctx->request = NULL;
+    ctx->current_request = NULL;
+
+    c->data = h2c;
+
+    rev->handler = ngx_http_v2_read_handler;
+    c->write->handler = ngx_http_v2_write_handler;
+
+    if (ngx_http_v2_send_settings(h2c) != NGX_OK) {
+        ngx_http_close_connection(c);
+        return;
+    }
+
+    if (h2c->last != h2c->pos) {
+        h2c->blocked = 1;
+
+        if (ngx_http_v2_process_input(h2c) != NGX_OK) {
+            return;
+        }
+
+        h2c->blocked = 0;
+
+        if (h2c->pos == h2c->last) {
+            h2c->pos = h2c->buffer;
+            h2c->last = h2c->buffer;
+
+        } else if (h2c->pos != h2c->buffer) {
+            h2c->last = ngx_movemem(h2c->buffer, h2c->pos,
+                                    h2c->last - h2c->pos);
+            h2c->pos = h2c->buffer;
+        }
+    }
+
+    ngx_http_v2_read_handler(rev);
+}
+
+
+static void
+ngx_http_v2_read_handler(ngx_event_t *rev)
+{
+    size_t                     size;
+    ssize_t                    n;
+    ngx_connection_t          *c;
+    ngx_http_v2_srv_conf_t    *h2scf;
+    ngx_http_v2_connection_t  *h2c;
+
+    c = rev->data;
+    h2c = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http2 read handler");
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT, "client timed out");
+        c->timedout = 1;
+        ngx_http_v2_finalize_connection(h2c, NGX_HTTP_V2_NO_ERROR);
+        return;
+    }
+
+    if (c->close) {
+        ngx_http_v2_finalize_connection(h2c, NGX_HTTP_V2_NO_ERROR);
+        return;
+    }
+
+    ngx_reusable_connection(c, 0);
+
+    h2scf = ngx_http_get_module_srv_conf(h2c, ngx_http_v2_module);
+
+    if (h2c->buffer == NULL) {
+        h2c->buffer = ngx_alloc(h2scf->recv_buffer_size, c->log);
+        if (h2c->buffer == NULL) {
+            ngx_http_v2_finalize_connection(h2c, NGX_HTTP_V2_INTERNAL_ERROR);
+            return;
+        }
+
+        h2c->pos = h2c->buffer;
+        h2c->last = h2c->buffer;
+    }
+
+    h2c->blocked = 1;
+
+    do {
+        size = h2c->buffer + h2scf->recv_buffer_size - h2c->last;
+
+        n = c->recv(c, h2c->last, size);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == 0 || n == NGX_ERROR) {
+
+            if (n == 0) {
+                ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                              "client closed HTTP/2 connection");
+            }
+
+            c->error = 1;
+            ngx_http_v2_finalize_connection(h2c, 0);
+            return;
+        }
+
+        h2c->last += n;
+
+        if (ngx_http_v2_process_input(h2c) != NGX_OK) {
+            return;
+        }
+
+        if (h2c->pos == h2c->last) {
+            h2c->pos = h2c->buffer;
+            h2c->last = h2c->buffer;
+
+        } else if (h2c->pos != h2c->buffer) {
+            h2c->last = ngx_movemem(h2c->buffer, h2c->pos,
+                                    h2c->last - h2c->pos);
+            h2c->pos = h2c->buffer;
+        }
+
+    } while (rev->ready);
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_http_v2_finalize_connection(h2c, NGX_HTTP_V2_INTERNAL_ERROR);
+        return;
+    }
+
+    if (ngx_http_v2_send_output_queue(h2c) == NGX_ERROR) {
+        ngx_http_v2_finalize_connection(h2c, 0);
+        return;
+    }
+
+    h2c->blocked = 0;
+
+    if (h2c->processing) {
+        if (rev->timer_set) {
+            ngx_del_timer(rev);
+        }
+
+        return;
+    }
+
+    ngx_http_v2_handle_connection(h2c);
+}
+
+
+static void
+ngx_http_v2_write_handler(ngx_event_t *wev)
+{
+    ngx_connection_t          *c;
+    ngx_http_v2_connection_t  *h2c;
+
+    c = wev->data;
+    h2c = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http2 write handler");
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT, "client timed out");
+        c->timedout = 1;
+        c->error = 1;
+        ngx_http_v2_finalize_connection(h2c, 0);
+        return;
+    }
+
+    h2c->blocked = 1;
+
+    if (ngx_http_v2_send_output_queue(h2c) == NGX_ERROR) {
+        ngx_http_v2_finalize_connection(h2c, 0);
+        return;
+    }
+
+    h2c->blocked = 0;
+
+    if (h2c->processing) {
+        return;
+    }
+
+    ngx_http_v2_handle_connection(h2c);
+}
+
+
+static void
+ngx_http_v2_handle_connection(ngx_http_v2_connection_t *h2c)
+{
+    ngx_connection_t        *c;
+    ngx_http_v2_srv_conf_t  *h2scf;
+
+    c = h2c->connection;
+
+    if (c->error) {
+        ngx_http_v2_finalize_connection(h2c, 0);
+        return;
+    }
+
+    if (h2c->last_out) {
+        /* the write handler comes back here when the queue is sent */
+        return;
+    }
+
+    if (h2c->goaway) {
+        ngx_http_close_connection(c);
+        return;
+    }
+
+    h2scf = ngx_http_get_module_srv_conf(h2c, ngx_http_v2_module);
+
+    if (h2c->pos != h2c->last || h2c->hblock_sid) {
+        ngx_add_timer(c->read, h2scf->recv_timeout);
+        return;
+    }
+
+    /* an idle connection keeps neither buffer */
+
+    if (h2c->buffer) {
+        ngx_free(h2c->buffer);
+        h2c->buffer = NULL;
+        h2c->pos = NULL;
+        h2c->last = NULL;
+    }
+
+    if (h2c->hblock) {
+        ngx_free(h2c->hblock);
+        h2c->hblock = NULL;
+    }
+
+    ngx_reusable_connection(c, 1);
+
+    ngx_add_timer(c->read, h2scf->idle_timeout);
+}
+
+
+static void
+ngx_http_v2_handle_connection_handler(ngx_event_t *rev)
+{
+    ngx_connection_t          *c;
+    ngx_http_v2_connection_t  *h2c;
+
+    c = rev->data;
+    h2c = c->data;
+
+    rev->handler = ngx_http_v2_read_handler;
+
+    if (c->error) {
+        ngx_http_v2_finalize_connection(h2c, 0);
+        return;
+    }
+
+    if (h2c->processing || h2c->blocked) {
+        return;
+    }
+
+    if (rev->ready) {
+        ngx_http_v2_read_handler(rev);
+        return;
+    }
+
+    if (ngx_http_v2_send_output_queue(h2c) == NGX_ERROR) {
+        ngx_http_v2_finalize_connection(h2c, 0);
+        return;
+    }
+
+    ngx_http_v2_handle_connection(h2c);
+}
+
+
+static void
+ngx_http_v2_finalize_connection(ngx_http_v2_connection_t *h2c,
+    ngx_uint_t status)
+{
+    ngx_uint_t             i;
+    ngx_event_t           *ev;
+    ngx_connection_t      *c, *fc;
+    ngx_http_v2_stream_t  *stream;
+
+    c = h2c->connection;
+
+    if (!c->error && !h2c->goaway) {
+        h2c->goaway = 1;
+
+        if (ngx_http_v2_send_goaway(h2c, status) == NGX_OK) {
+            (void) ngx_http_v2_send_output_queue(h2c);
+        }
+    }
+
+    c->error = 1;
+
+    c->read->handler = ngx_http_empty_handler;
+    c->write->handler = ngx_http_empty_handler;
+
+    h2c->last_out = NULL;
+
+    for (i = 0; i < NGX_HTTP_V2_INDEX_SIZE; i++) {
+
+        for (stream = h2c->streams_index[i]; stream; stream = stream->index) {
+
+            fc = stream->request->connection;
+            fc->error = 1;
+
+            if (stream->queued) {
+                stream->queued = 0;
+                ev = fc->write;
+
+            } else {
+                ev = fc->read;
+                ev->eof = 1;
+            }
+
+            ev->active = 0;
+            ev->ready = 1;
+
+            ngx_post_event(ev, &ngx_posted_events);
+        }
+    }
+
+    if (h2c->processing) {
+
+        /* the last closed stream calls ngx_http_v2_handle_connection_handler */
+
+        return;
+    }
+
+    ngx_http_close_connection(c);
+}
+
+
+static void
+ngx_http_v2_pool_cleanup(void *data)
+{
+    ngx_http_v2_connection_t  *h2c = data;
+
+    if (h2c->buffer) {
+        ngx_free(h2c->buffer);
+        h2c->buffer = NULL;
+    }
+
+    if (h2c->hblock) {
+        ngx_free(h2c->hblock);
+        h2c->hblock = NULL;
+    }
+
+    ngx_http_v2_table_cleanup(h2c);
+}
+
+
+static ngx_int_t
+ngx_http_v2_process_input(ngx_http_v2_connection_t *h2c)
+{
+    u_char      *p;
+    size_t       size, length;
+    ngx_uint_t   type, flags, sid;
+
+    if (!h2c->preface) {
+        size = ngx_min((size_t) (h2c->last - h2c->pos),
+                       sizeof(NGX_HTTP_V2_PREFACE) - 1);
+
+        if (ngx_memcmp(h2c->pos, NGX_HTTP_V2_PREFACE, size) != 0) {
+            ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                          "client sent invalid HTTP/2 connection preface");
+
+            return ngx_http_v2_connection_error(h2c,
+                                                NGX_HTTP_V2_PROTOCOL_ERROR);
+        }
+
+        if (size < sizeof(NGX_HTTP_V2_PREFACE) - 1) {
+            return NGX_OK;
+        }
+
+        h2c->pos += size;
+        h2c->preface = 1;
+    }
+
+    while ((size_t) (h2c->last - h2c->pos) >= NGX_HTTP_V2_FRAME_HEADER_SIZE) {
+
+        p = h2c->pos;
+
+        length = p[0] << 16 | p[1] << 8 | p[2];
+        type = p[3];
+        flags = p[4];
+        sid = ngx_http_v2_parse_uint32(&p[5]) & 0x7fffffff;
+
+        if (length > NGX_HTTP_V2_DEFAULT_FRAME_SIZE) {
+            ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                          "client sent too large frame: %uz", length);
+
+            return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_SIZE_ERROR);
+        }
+
+        if ((size_t) (h2c->last - p) < NGX_HTTP_V2_FRAME_HEADER_SIZE + length)
+        {
+            break;
+        }
+
+        h2c->pos = p + NGX_HTTP_V2_FRAME_HEADER_SIZE + length;
+
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                       "http2 frame type:%ui flags:%ui sid:%ui len:%uz",
+                       type, flags, sid, length);
+
+        if (h2c->hblock_sid && type != NGX_HTTP_V2_CONTINUATION_FRAME) {
+            ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                          "client sent frame type %ui inside header block",
+                          type);
+
+            return ngx_http_v2_connection_error(h2c,
+                                                NGX_HTTP_V2_PROTOCOL_ERROR);
+        }
+
+        if (type >= NGX_HTTP_V2_FRAME_STATES) {
+            /* unknown frames are ignored */
+            continue;
+        }
+
+        if (ngx_http_v2_frame_states[type](h2c,
+                                           p + NGX_HTTP_V2_FRAME_HEADER_SIZE,
+                                           length, flags, sid)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        if (h2c->connection->error) {
+            ngx_http_v2_finalize_connection(h2c, 0);
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_state_data(ngx_http_v2_connection_t *h2c, u_char *pos,
+    size_t size, ngx_uint_t flags, ngx_uint_t sid)
+{
+    size_t                   length, padding;
+    ngx_buf_t               *b;
+    ngx_http_v2_stream_t    *stream;
+    ngx_http_v2_srv_conf_t  *h2scf;
+
+    length = size;
+
+    if (flags & NGX_HTTP_V2_PADDED_FLAG) {
+        padding = size ? *pos : 0;
+
+        if (padding >= size) {
+            ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                          "client sent DATA frame with incorrect padding");
+
+            return ngx_http_v2_connection_error(h2c,
+                                                NGX_HTTP_V2_PROTOCOL_ERROR);
+        }
+
+        pos++;
+        size -= padding + 1;
+    }
+
+    if (sid == 0) {
+        ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                      "client sent DATA frame with incorrect identifier");
+
+        return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_PROTOCOL_ERROR);
+    }
+
+    if (length > h2c->recv_window) {
+        ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                      "client violated connection flow control");
+
+        return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_FLOW_CTRL_ERROR);
+    }
+
+    h2c->recv_window -= length;
+
+    if (h2c->recv_window < NGX_HTTP_V2_MAX_WINDOW / 4) {
+
+        if (ngx_http_v2_send_window_update(h2c, 0, NGX_HTTP_V2_MAX_WINDOW
+                                                   - h2c->recv_window)
+            != NGX_OK)
+        {
+            return ngx_http_v2_connection_error(h2c,
+                                                NGX_HTTP_V2_INTERNAL_ERROR);
+        }
+
+        h2c->recv_window = NGX_HTTP_V2_MAX_WINDOW;
+    }
+
+    stream = ngx_http_v2_get_stream(h2c, sid);
+
+    if (stream == NULL) {
+
+        if (sid > h2c->last_sid) {
+            ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                          "client sent DATA frame for idle stream %ui", sid);
+
+            return ngx_http_v2_connection_error(h2c,
+                                                NGX_HTTP_V2_PROTOCOL_ERROR);
+        }
+
+        /* the stream is already closed */
+
+        return NGX_OK;
+    }
+
+    if (stream->in_closed) {
+        ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                      "client sent DATA frame for half-closed stream %ui",
+                      sid);
+
+        return ngx_http_v2_terminate_stream(h2c, stream,
+                                            NGX_HTTP_V2_STREAM_CLOSED);
+    }
+
+    if (length > stream->recv_window) {
+        ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                      "client violated flow control for stream %ui", sid);
+
+        return ngx_http_v2_terminate_stream(h2c, stream,
+                                            NGX_HTTP_V2_FLOW_CTRL_ERROR);
+    }
+
+    stream->recv_window -= length;
+
+    if (flags & NGX_HTTP_V2_END_STREAM_FLAG) {
+        stream->in_closed = 1;
+    }
+
+    if (stream->skip_data) {
+
+        if (!stream->in_closed && length) {
+            stream->recv_window += length;
+
+            if (ngx_http_v2_send_window_update(h2c, sid, length) != NGX_OK) {
+                return ngx_http_v2_connection_error(h2c,
+                                                 NGX_HTTP_V2_INTERNAL_ERROR);
+            }
+        }
+
+        return NGX_OK;
+    }
+
+    if (size) {
+        b = stream->preread;
+
+        if (b == NULL) {
+            h2scf = ngx_http_get_module_srv_conf(h2c, ngx_http_v2_module);
+
+            b = ngx_create_temp_buf(stream->request->pool,
+                                    h2scf->preread_size);
+            if (b == NULL) {
+                return ngx_http_v2_terminate_stream(h2c, stream,
+                                                 NGX_HTTP_V2_INTERNAL_ERROR);
+            }
+
+            stream->preread = b;
+        }
+
+        /* the stream window never exceeds the free space of the buffer */
+
+        b->last = ngx_cpymem(b->last, pos, size);
+    }
+
+    ngx_http_v2_wake(stream->request->connection->read);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_state_headers(ngx_http_v2_connection_t *h2c, u_char *pos,
+    size_t size, ngx_uint_t flags, ngx_uint_t sid)
+{
+    size_t      padding;
+    ngx_uint_t  depend;
+
+    padding = 0;
+
+    if (flags & NGX_HTTP_V2_PADDED_FLAG) {
+        if (size == 0) {
+            goto size_error;
+        }
+
+        padding = *pos++;
+        size--;
+    }
+
+    h2c->hblock_priority = 0;
+    h2c->hblock_exclusive = 0;
+    h2c->hblock_depend = 0;
+    h2c->hblock_weight = NGX_HTTP_V2_DEFAULT_WEIGHT;
+
+    if (flags & NGX_HTTP_V2_PRIORITY_FLAG) {
+        if (size < NGX_HTTP_V2_PRIORITY_SIZE) {
+            goto size_error;
+        }
+
+        depend = ngx_http_v2_parse_uint32(pos);
+
+        h2c->hblock_priority = 1;
+        h2c->hblock_exclusive = depend >> 31;
+        h2c->hblock_depend = depend & 0x7fffffff;
+        h2c->hblock_weight = pos[4] + 1;
+
+        pos += NGX_HTTP_V2_PRIORITY_SIZE;
+        size -= NGX_HTTP_V2_PRIORITY_SIZE;
+    }
+
+    if (padding > size) {
+        goto size_error;
+    }
+
+    size -= padding;
+
+    if (sid % 2 == 0 || h2c->hblock_depend == sid) {
+        ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                      "client sent HEADERS frame with incorrect identifier");
+
+        return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_PROTOCOL_ERROR);
+    }
+
+    h2c->hblock_new = 0;
+
+    if (sid > h2c->last_sid) {
+        h2c->last_sid = sid;
+        h2c->hblock_new = 1;
+    }
+
+    h2c->hblock_sid = sid;
+    h2c->hblock_flags = flags;
+    h2c->hblock_len = 0;
+
+    return ngx_http_v2_header_block(h2c, pos, size, flags);
+
+size_error:
+
+    ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                  "client sent HEADERS frame with incorrect length");
+
+    return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_PROTOCOL_ERROR);
+}
+
+
+static ngx_int_t
+ngx_http_v2_state_continuation(ngx_http_v2_connection_t *h2c, u_char *pos,
+    size_t size, ngx_uint_t flags, ngx_uint_t sid)
+{
+    if (h2c->hblock_sid == 0 || sid != h2c->hblock_sid) {
+        ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                      "client sent unexpected CONTINUATION frame");
+
+        return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_PROTOCOL_ERROR);
+    }
+
+    return ngx_http_v2_header_block(h2c, pos, size, flags);
+}
+
+
+static ngx_int_t
+ngx_http_v2_header_block(ngx_http_v2_connection_t *h2c, u_char *pos,
+    size_t size, ngx_uint_t flags)
+{
+    ngx_http_v2_srv_conf_t  *h2scf;
+
+    h2scf = ngx_http_get_module_srv_conf(h2c, ngx_http_v2_module);
+
+    if (h2c->hblock_len + size > h2scf->max_header_size) {
+        ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                      "client exceeded http2_max_header_size limit");
+
+        return ngx_http_v2_connection_error(h2c,
+                                            NGX_HTTP_V2_ENHANCE_YOUR_CALM);
+    }
+
+    if (h2c->hblock == NULL) {
+        h2c->hblock = ngx_alloc(h2scf->max_header_size, h2c->connection->log);
+        if (h2c->hblock == NULL) {
+            return ngx_http_v2_connection_error(h2c,
+                                                NGX_HTTP_V2_INTERNAL_ERROR);
+        }
+    }
+
+    ngx_memcpy(h2c->hblock + h2c->hblock_len, pos, size);
+    h2c->hblock_len += size;
+
+    if (!(flags & NGX_HTTP_V2_END_HEADERS_FLAG)) {
+        return NGX_OK;
+    }
+
+    return ngx_http_v2_header_complete(h2c);
+}
+
+
+static ngx_int_t
+ngx_http_v2_header_complete(ngx_http_v2_connection_t *h2c)
+{
+    ngx_int_t                rc;
+    ngx_uint_t               sid;
+    ngx_array_t             *headers;
+    ngx_http_request_t      *r;
+    ngx_http_v2_stream_t    *stream;
+    ngx_http_v2_srv_conf_t  *h2scf;
+
+    sid = h2c->hblock_sid;
+    h2c->hblock_sid = 0;
+
+    stream = ngx_http_v2_get_stream(h2c, sid);
+
+    if (stream) {
+
+        /* trailers are decoded to keep the table in sync and ignored */
+
+        if (ngx_http_v2_skip_header_block(h2c) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (stream->in_closed
+            || !(h2c->hblock_flags & NGX_HTTP_V2_END_STREAM_FLAG))
+        {
+            ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                          "client sent unexpected HEADERS frame "
+                          "for stream %ui", sid);
+
+            return ngx_http_v2_terminate_stream(h2c, stream,
+                                                NGX_HTTP_V2_PROTOCOL_ERROR);
+        }
+
+        stream->in_closed = 1;
+
+        ngx_http_v2_wake(stream->request->connection->read);
+
+        return NGX_OK;
+    }
+
+    if (!h2c->hblock_new) {
+        if (ngx_http_v2_skip_header_block(h2c) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_http_v2_send_rst_stream(h2c, sid, NGX_HTTP_V2_STREAM_CLOSED)
+            != NGX_OK)
+        {
+            return ngx_http_v2_connection_error(h2c,
+                                                NGX_HTTP_V2_INTERNAL_ERROR);
+        }
+
+        return NGX_OK;
+    }
+
+    h2scf = ngx_http_get_module_srv_conf(h2c, ngx_http_v2_module);
+
+    if (h2c->goaway || h2c->processing >= h2scf->concurrent_streams) {
+        ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                      "concurrent streams exceeded %ui", h2c->processing);
+
+        if (ngx_http_v2_skip_header_block(h2c) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_http_v2_send_rst_stream(h2c, sid, NGX_HTTP_V2_REFUSED_STREAM)
+            != NGX_OK)
+        {
+            return ngx_http_v2_connection_error(h2c,
+                                                NGX_HTTP_V2_INTERNAL_ERROR);
+        }
+
+        return NGX_OK;
+    }
+
+    stream = ngx_http_v2_create_stream(h2c);
+    if (stream == NULL) {
+        return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_INTERNAL_ERROR);
+    }
+
+    stream->id = sid;
+    stream->index = h2c->streams_index[ngx_http_v2_index(sid)];
+    h2c->streams_index[ngx_http_v2_index(sid)] = stream;
+
+    if (h2c->hblock_priority) {
+        stream->weight = h2c->hblock_weight;
+        ngx_http_v2_set_dependency(h2c, stream, h2c->hblock_depend,
+                                   h2c->hblock_exclusive);
+    }
+
+    if (h2c->hblock_flags & NGX_HTTP_V2_END_STREAM_FLAG) {
+        stream->in_closed = 1;
+    }
+
+    r = stream->request;
+    r->request_length = h2c->hblock_len;
+
+    headers = ngx_array_create(r->pool, 16, sizeof(ngx_http_v2_header_t));
+    if (headers == NULL) {
+        return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_INTERNAL_ERROR);
+    }
+
+    rc = ngx_http_v2_decode_header_block(h2c, r->pool, headers);
+
+    if (rc == NGX_DECLINED) {
+        return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_COMP_ERROR);
+    }
+
+    if (rc != NGX_OK) {
+        return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_INTERNAL_ERROR);
+    }
+
+    ngx_http_v2_run_request(stream, headers);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_skip_header_block(ngx_http_v2_connection_t *h2c)
+{
+    ngx_int_t    rc;
+    ngx_pool_t  *pool;
+
+    pool = ngx_create_pool(1024, h2c->connection->log);
+    if (pool == NULL) {
+        return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_INTERNAL_ERROR);
+    }
+
+    rc = ngx_http_v2_decode_header_block(h2c, pool, NULL);
+
+    ngx_destroy_pool(pool);
+
+    if (rc == NGX_DECLINED) {
+        return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_COMP_ERROR);
+    }
+
+    if (rc != NGX_OK) {
+        return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_INTERNAL_ERROR);
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * decodes the collected header block into the "headers" array,
+ * the strings taken from the table are copied as later fields may evict them
+ */
+
+static ngx_int_t
+ngx_http_v2_decode_header_block(ngx_http_v2_connection_t *h2c,
+    ngx_pool_t *pool, ngx_array_t *headers)
+{
+    u_char                *p, *end;
+    ngx_int_t              n, rc;
+    ngx_str_t              name, value;
+    ngx_uint_t             size_update, indexed;
+    ngx_http_v2_header_t  *header;
+
+    p = h2c->hblock;
+    end = p + h2c->hblock_len;
+
+    size_update = 1;
+
+    while (p < end) {
+
+        if (*p & 0x80) {
+
+            /* indexed header field */
+
+            n = ngx_http_v2_parse_int(&p, end, 7);
+
+            if (n <= 0
+                || ngx_http_v2_get_indexed_header(h2c, n, 0, &name, &value)
+                   != NGX_OK)
+            {
+                goto failed;
+            }
+
+            if (headers
+                && (ngx_http_v2_copy_string(pool, &name) != NGX_OK
+                    || ngx_http_v2_copy_string(pool, &value) != NGX_OK))
+            {
+                return NGX_ERROR;
+            }
+
+        } else if ((*p & 0xe0) == 0x20) {
+
+            /* dynamic table size update */
+
+            if (!size_update) {
+                goto failed;
+            }
+
+            n = ngx_http_v2_parse_int(&p, end, 5);
+
+            if (n < 0 || ngx_http_v2_table_size(h2c, n) != NGX_OK) {
+                goto failed;
+            }
+
+            continue;
+
+        } else {
+
+            /* literal header field with or without incremental indexing */
+
+            indexed = (*p & 0x40) ? 1 : 0;
+
+            n = ngx_http_v2_parse_int(&p, end, indexed ? 6 : 4);
+
+            if (n < 0) {
+                goto failed;
+            }
+
+            if (n) {
+                if (ngx_http_v2_get_indexed_header(h2c, n, 1, &name, NULL)
+                    != NGX_OK)
+                {
+                    goto failed;
+                }
+
+                if (ngx_http_v2_copy_string(pool, &name) != NGX_OK) {
+                    return NGX_ERROR;
+                }
+
+            } else {
+                rc = ngx_http_v2_parse_string(h2c, &p, end, pool, &name);
+
+                if (rc != NGX_OK) {
+                    return rc;
+                }
+            }
+
+            rc = ngx_http_v2_parse_string(h2c, &p, end, pool, &value);
+
+            if (rc != NGX_OK) {
+                return rc;
+            }
+
+            if (indexed
+                && ngx_http_v2_add_header(h2c, &name, &value) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+        }
+
+        size_update = 0;
+
+        if (headers == NULL) {
+            continue;
+        }
+
+        header = ngx_array_push(headers);
+        if (header == NULL) {
+            return NGX_ERROR;
+        }
+
+        header->name = name;
+        header->value = value;
+    }
+
+    return NGX_OK;
+
+failed:
+
+    ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                  "client sent invalid header block");
+
+    return NGX_DECLINED;
+}
+
+
+static ngx_int_t
+ngx_http_v2_parse_int(u_char **pos, u_char *end, ngx_uint_t prefix)
+{
+    u_char      *p;
+    ngx_uint_t   value, octet, shift;
+
+    p = *pos;
+
+    prefix = (1 << prefix) - 1;
+    value = *p++ & prefix;
+
+    if (value != prefix) {
+        *pos = p;
+        return value;
+    }
+
+    /* the values used by HTTP/2 fit into four octets */
+
+    for (shift = 0; shift < 28; shift += 7) {
+
+        if (p == end) {
+            return NGX_ERROR;
+        }
+
+        octet = *p++;
+        value += (octet & 0x7f) << shift;
+
+        if (octet < 128) {
+            *pos = p;
+            return value;
+        }
+    }
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_v2_parse_string(ngx_http_v2_connection_t *h2c, u_char **pos,
+    u_char *end, ngx_pool_t *pool, ngx_str_t *s)
+{
+    u_char      *p;
+    ngx_int_t    len;
+    ngx_uint_t   huff;
+
+    p = *pos;
+
+    if (p == end) {
+        goto failed;
+    }
+
+    huff = *p & 0x80;
+
+    len = ngx_http_v2_parse_int(&p, end, 7);
+
+    if (len < 0 || (size_t) len > (size_t) (end - p)) {
+        goto failed;
+    }
+
+    if (huff) {
+
+        /* the shortest code is 5 bits long */
+
+        s->data = ngx_pnalloc(pool, len * 8 / 5 + 1);
+        if (s->data == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_http_v2_huff_decode(p, len, s->data, &s->len,
+                                    h2c->connection->log)
+            != NGX_OK)
+        {
+            goto failed;
+        }
+
+    } else {
+        s->data = ngx_pnalloc(pool, len + 1);
+        if (s->data == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(s->data, p, len);
+        s->len = len;
+    }
+
+    s->data[s->len] = '\0';
+
+    *pos = p + len;
+
+    return NGX_OK;
+
+failed:
+
+    ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                  "client sent invalid header string");
+
+    return NGX_DECLINED;
+}
+
+
+static ngx_int_t
+ngx_http_v2_copy_string(ngx_pool_t *pool, ngx_str_t *s)
+{
+    u_char  *p;
+
+    p = ngx_pnalloc(pool, s->len + 1);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(p, s->data, s->len);
+    p[s->len] = '\0';
+
+    s->data = p;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_state_priority(ngx_http_v2_connection_t *h2c, u_char *pos,
+    size_t size, ngx_uint_t flags, ngx_uint_t sid)
+{
+    ngx_uint_t             depend, exclusive;
+    ngx_http_v2_stream_t  *stream;
+
+    if (size != NGX_HTTP_V2_PRIORITY_SIZE || sid == 0) {
+        ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                      "client sent incorrect PRIORITY frame");
+
+        return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_PROTOCOL_ERROR);
+    }
+
+    depend = ngx_http_v2_parse_uint32(pos);
+    exclusive = depend >> 31;
+    depend &= 0x7fffffff;
+
+    stream = ngx_http_v2_get_stream(h2c, sid);
+
+    /* the priority of idle and closed streams is not kept */
+
+    if (stream == NULL) {
+        return NGX_OK;
+    }
+
+    if (depend == sid) {
+        ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                      "client sent PRIORITY frame for stream %ui "
+                      "with incorrect dependency", sid);
+
+        return ngx_http_v2_terminate_stream(h2c, stream,
+                                            NGX_HTTP_V2_PROTOCOL_ERROR);
+    }
+
+    stream->weight = pos[4] + 1;
+
+    ngx_http_v2_set_dependency(h2c, stream, depend, exclusive);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_state_rst_stream(ngx_http_v2_connection_t *h2c, u_char *pos,
+    size_t size, ngx_uint_t flags, ngx_uint_t sid)
+{
+    ngx_uint_t             status;
+    ngx_connection_t      *fc;
+    ngx_http_v2_stream_t  *stream;
+
+    if (size != NGX_HTTP_V2_RST_STREAM_SIZE || sid == 0 || sid > h2c->last_sid)
+    {
+        ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                      "client sent incorrect RST_STREAM frame");
+
+        return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_PROTOCOL_ERROR);
+    }
+
+    stream = ngx_http_v2_get_stream(h2c, sid);
+
+    if (stream == NULL) {
+        return NGX_OK;
+    }
+
+    status = ngx_http_v2_parse_uint32(pos);
+
+    fc = stream->request->connection;
+
+    switch (status) {
+
+    case NGX_HTTP_V2_CANCEL:
+        ngx_log_error(NGX_LOG_INFO, fc->log, 0,
+                      "client canceled stream %ui", sid);
+        break;
+
+    case NGX_HTTP_V2_INTERNAL_ERROR:
+        ngx_log_error(NGX_LOG_INFO, fc->log, 0,
+                      "client terminated stream %ui due to internal error",
+                      sid);
+        break;
+
+    default:
+        ngx_log_error(NGX_LOG_INFO, fc->log, 0,
+                      "client terminated stream %ui with status %ui",
+                      sid, status);
+        break;
+    }
+
+    stream->rst_sent = 1;
+    stream->in_closed = 1;
+    stream->out_closed = 1;
+
+    fc->error = 1;
+
+    ngx_http_v2_wake(fc->read);
+    ngx_http_v2_wake(fc->write);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_state_settings(ngx_http_v2_connection_t *h2c, u_char *pos,
+    size_t size, ngx_uint_t flags, ngx_uint_t sid)
+{
+    u_char                   *end;
+    ssize_t                   delta;
+    ngx_uint_t                i, id, value;
+    ngx_http_v2_stream_t     *stream;
+    ngx_http_v2_out_frame_t  *frame;
+
+    if (sid) {
+        ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                      "client sent SETTINGS frame with incorrect identifier");
+
+        return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_PROTOCOL_ERROR);
+    }
+
+    if (flags & NGX_HTTP_V2_ACK_FLAG) {
+
+        if (size) {
+            goto size_error;
+        }
+
+        h2c->settings_ack = 1;
+
+        return NGX_OK;
+    }
+
+    if (size % NGX_HTTP_V2_SETTINGS_PARAM_SIZE) {
+        goto size_error;
+    }
+
+    for (end = pos + size; pos < end; pos += NGX_HTTP_V2_SETTINGS_PARAM_SIZE) {
+
+        id = ngx_http_v2_parse_uint16(pos);
+        value = ngx_http_v2_parse_uint32(&pos[2]);
+
+        switch (id) {
+
+        case NGX_HTTP_V2_INIT_WINDOW_SIZE_SETTING:
+
+            if (value > NGX_HTTP_V2_MAX_WINDOW) {
+                ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                              "client sent SETTINGS frame with incorrect "
+                              "INITIAL_WINDOW_SIZE value %ui", value);
+
+                return ngx_http_v2_connection_error(h2c,
+                                                  NGX_HTTP_V2_FLOW_CTRL_ERROR);
+            }
+
+            delta = (ssize_t) value - (ssize_t) h2c->init_window;
+            h2c->init_window = value;
+
+            for (i = 0; i < NGX_HTTP_V2_INDEX_SIZE; i++) {
+                for (stream = h2c->streams_index[i];
+                     stream;
+                     stream = stream->index)
+                {
+                    stream->send_window += delta;
+
+                    if (stream->exhausted && stream->send_window > 0) {
+                        stream->exhausted = 0;
+                        ngx_http_v2_wake(stream->request->connection->write);
+                    }
+                }
+            }
+
+            break;
+
+        case NGX_HTTP_V2_MAX_FRAME_SIZE_SETTING:
+
+            if (value < NGX_HTTP_V2_DEFAULT_FRAME_SIZE
+                || value > NGX_HTTP_V2_MAX_FRAME_SIZE)
+            {
+                ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                              "client sent SETTINGS frame with incorrect "
+                              "MAX_FRAME_SIZE value %ui", value);
+
+                return ngx_http_v2_connection_error(h2c,
+                                                   NGX_HTTP_V2_PROTOCOL_ERROR);
+            }
+
+            h2c->frame_size = value;
+            break;
+
+        case NGX_HTTP_V2_ENABLE_PUSH_SETTING:
+
+            if (value > 1) {
+                ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                              "client sent SETTINGS frame with incorrect "
+                              "ENABLE_PUSH value %ui", value);
+
+                return ngx_http_v2_connection_error(h2c,
+                                                   NGX_HTTP_V2_PROTOCOL_ERROR);
+            }
+
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    frame = ngx_http_v2_get_frame(h2c, 0, NGX_HTTP_V2_SETTINGS_FRAME,
+                                  NGX_HTTP_V2_ACK_FLAG, 0);
+    if (frame == NULL) {
+        return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_INTERNAL_ERROR);
+    }
+
+    ngx_http_v2_queue_frame(h2c, frame);
+
+    return NGX_OK;
+
+size_error:
+
+    ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                  "client sent SETTINGS frame with incorrect length %uz",
+                  size);
+
+    return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_SIZE_ERROR);
+}
+
+
+static ngx_int_t
+ngx_http_v2_state_push_promise(ngx_http_v2_connection_t *h2c, u_char *pos,
+    size_t size, ngx_uint_t flags, ngx_uint_t sid)
+{
+    ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                  "client sent PUSH_PROMISE frame");
+
+    return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_PROTOCOL_ERROR);
+}
+
+
+static ngx_int_t
+ngx_http_v2_state_ping(ngx_http_v2_connection_t *h2c, u_char *pos,
+    size_t size, ngx_uint_t flags, ngx_uint_t sid)
+{
+    ngx_buf_t                *b;
+    ngx_http_v2_out_frame_t  *frame;
+
+    if (size != NGX_HTTP_V2_PING_SIZE || sid) {
+        ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                      "client sent incorrect PING frame");
+
+        return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_PROTOCOL_ERROR);
+    }
+
+    if (flags & NGX_HTTP_V2_ACK_FLAG) {
+        return NGX_OK;
+    }
+
+    frame = ngx_http_v2_get_frame(h2c, NGX_HTTP_V2_PING_SIZE,
+                                  NGX_HTTP_V2_PING_FRAME,
+                                  NGX_HTTP_V2_ACK_FLAG, 0);
+    if (frame == NULL) {
+        return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_INTERNAL_ERROR);
+    }
+
+    b = frame->first->buf;
+    b->last = ngx_cpymem(b->last, pos, NGX_HTTP_V2_PING_SIZE);
+
+    ngx_http_v2_queue_frame(h2c, frame);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_state_goaway(ngx_http_v2_connection_t *h2c, u_char *pos,
+    size_t size, ngx_uint_t flags, ngx_uint_t sid)
+{
+    if (size < NGX_HTTP_V2_GOAWAY_SIZE || sid) {
+        ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                      "client sent incorrect GOAWAY frame");
+
+        return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_PROTOCOL_ERROR);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 GOAWAY last sid:%ui error:%ui",
+                   (ngx_uint_t) ngx_http_v2_parse_uint32(pos) & 0x7fffffff,
+                   (ngx_uint_t) ngx_http_v2_parse_uint32(&pos[4]));
+
+    /* the open streams are completed, no new ones are accepted */
+
+    h2c->goaway = 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_state_window_update(ngx_http_v2_connection_t *h2c, u_char *pos,
+    size_t size, ngx_uint_t flags, ngx_uint_t sid)
+{
+    size_t                 window;
+    ngx_queue_t           *q;
+    ngx_http_v2_stream_t  *stream;
+
+    if (size != NGX_HTTP_V2_WINDOW_UPDATE_SIZE) {
+        ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                      "client sent WINDOW_UPDATE frame "
+                      "with incorrect length %uz", size);
+
+        return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_SIZE_ERROR);
+    }
+
+    window = ngx_http_v2_parse_uint32(pos) & 0x7fffffff;
+
+    if (sid) {
+        stream = ngx_http_v2_get_stream(h2c, sid);
+
+        if (stream == NULL) {
+            return NGX_OK;
+        }
+
+        if (window == 0) {
+            ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                          "client sent WINDOW_UPDATE frame "
+                          "with zero increment for stream %ui", sid);
+
+            return ngx_http_v2_terminate_stream(h2c, stream,
+                                                NGX_HTTP_V2_PROTOCOL_ERROR);
+        }
+
+        if (stream->send_window + (ssize_t) window
+            > (ssize_t) NGX_HTTP_V2_MAX_WINDOW)
+        {
+            ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                          "client violated flow control for stream %ui", sid);
+
+            return ngx_http_v2_terminate_stream(h2c, stream,
+                                                NGX_HTTP_V2_FLOW_CTRL_ERROR);
+        }
+
+        stream->send_window += window;
+
+        if (stream->exhausted && stream->send_window > 0) {
+            stream->exhausted = 0;
+            ngx_http_v2_wake(stream->request->connection->write);
+        }
+
+        return NGX_OK;
+    }
+
+    if (window == 0) {
+        ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                      "client sent WINDOW_UPDATE frame with zero increment");
+
+        return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_PROTOCOL_ERROR);
+    }
+
+    if (window > NGX_HTTP_V2_MAX_WINDOW - h2c->send_window) {
+        ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                      "client violated connection flow control");
+
+        return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_FLOW_CTRL_ERROR);
+    }
+
+    h2c->send_window += window;
+
+    while (!ngx_queue_empty(&h2c->waiting)) {
+        q = ngx_queue_head(&h2c->waiting);
+        ngx_queue_remove(q);
+
+        stream = ngx_queue_data(q, ngx_http_v2_stream_t, waiting);
+        stream->in_waiting = 0;
+
+        if (!stream->exhausted) {
+            ngx_http_v2_wake(stream->request->connection->write);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_connection_error(ngx_http_v2_connection_t *h2c,
+    ngx_uint_t status)
+{
+    ngx_http_v2_finalize_connection(h2c, status);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_v2_terminate_stream(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_stream_t *stream, ngx_uint_t status)
+{
+    ngx_connection_t  *fc;
+
+    if (stream->rst_sent) {
+        return NGX_OK;
+    }
+
+    if (ngx_http_v2_send_rst_stream(h2c, stream->id, status) != NGX_OK) {
+        return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_INTERNAL_ERROR);
+    }
+
+    stream->rst_sent = 1;
+    stream->in_closed = 1;
+    stream->out_closed = 1;
+
+    fc = stream->request->connection;
+    fc->error = 1;
+
+    ngx_http_v2_wake(fc->read);
+    ngx_http_v2_wake(fc->write);
+
+    return NGX_OK;
+}
+
+
+static ngx_http_v2_stream_t *
+ngx_http_v2_create_stream(ngx_http_v2_connection_t *h2c)
+{
+    ngx_log_t                 *log;
+    ngx_pool_t                *pool;
+    ngx_time_t                *tp;
+    ngx_event_t               *rev, *wev;
+    ngx_connection_t          *c, *fc;
+    ngx_http_request_t        *r;
+    ngx_http_log_ctx_t        *ctx;
+    ngx_http_v2_stream_t      *stream;
+    ngx_http_v2_srv_conf_t    *h2scf;
+    ngx_http_core_srv_conf_t  *cscf;
+    ngx_http_core_main_conf_t *cmcf;
+
+    c = h2c->connection;
+
+    fc = h2c->free_fake_connections;
+
+    if (fc) {
+        h2c->free_fake_connections = fc->data;
+
+        rev = fc->read;
+        wev = fc->write;
+
+    } else {
+        fc = ngx_palloc(c->pool, sizeof(ngx_connection_t));
+        rev = ngx_palloc(c->pool, sizeof(ngx_event_t));
+        wev = ngx_palloc(c->pool, sizeof(ngx_event_t));
+
+        if (fc == NULL || rev == NULL || wev == NULL) {
+            return NULL;
+        }
+    }
+
+    cscf = ngx_http_get_module_srv_conf(h2c, ngx_http_core_module);
+
+    pool = ngx_create_pool(cscf->request_pool_size, c->log);
+    if (pool == NULL) {
+        goto failed;
+    }
+
+    log = ngx_palloc(pool, sizeof(ngx_log_t));
+    ctx = ngx_palloc(pool, sizeof(ngx_http_log_ctx_t));
+    r = ngx_pcalloc(pool, sizeof(ngx_http_request_t));
+    stream = ngx_pcalloc(pool, sizeof(ngx_http_v2_stream_t));
+
+    if (log == NULL || ctx == NULL || r == NULL || stream == NULL) {
+        goto failed;
+    }
+
+    *log = *c->log;
+    log->data = ctx;
+
+    ctx->connection = fc;
+    ctx->request = r;
+    ctx->current_request = r;
+
+    /* the fake connection of the stream */
+
+    ngx_memcpy(fc, c, sizeof(ngx_connection_t));
+
+    fc->data = r;
+    fc->read = rev;
+    fc->write = wev;
+    fc->log = log;
+    fc->pool = pool;
+    fc->buffer = NULL;
+    fc->sent = 0;
+    fc->buffered = 0;
+    fc->error = 0;
+    fc->timedout = 0;
+    fc->destroyed = 0;
+    fc->close = 0;
+    fc->idle = 0;
+    fc->reusable = 0;
+    fc->sendfile = 0;
+    fc->need_last_buf = 1;
+
+    fc->recv = ngx_http_v2_recv;
+    fc->send = ngx_http_v2_send;
+    fc->recv_chain = NULL;
+    fc->send_chain = ngx_http_v2_send_chain;
+
+    /*
+     * the events are never passed to the event module, the ready and active
+     * flags keep ngx_handle_read_event() and ngx_handle_write_event() away
+     */
+
+    ngx_memzero(rev, sizeof(ngx_event_t));
+
+    rev->data = fc;
+    rev->ready = 1;
+    rev->index = NGX_INVALID_INDEX;
+    rev->handler = ngx_http_v2_close_stream_handler;
+    rev->log = log;
+
+    *wev = *rev;
+    wev->write = 1;
+
+    r->signature = NGX_HTTP_MODULE;
+    r->connection = fc;
+    r->http_connection = h2c->http_connection;
+    r->stream = stream;
+    r->pool = pool;
+
+    r->main_conf = h2c->main_conf;
+    r->srv_conf = h2c->srv_conf;
+    r->loc_conf = h2c->loc_conf;
+    r->virtual_names = h2c->virtual_names;
+
+    if (ngx_list_init(&r->headers_out.headers, pool, 20,
+                      sizeof(ngx_table_elt_t))
+        != NGX_OK
+        || ngx_list_init(&r->headers_in.headers, pool, 20,
+                         sizeof(ngx_table_elt_t))
+           != NGX_OK
+        || ngx_array_init(&r->headers_in.cookies, pool, 2,
+                          sizeof(ngx_table_elt_t *))
+           != NGX_OK)
+    {
+        goto failed;
+    }
+
+    r->ctx = ngx_pcalloc(pool, sizeof(void *) * ngx_http_max_module);
+    if (r->ctx == NULL) {
+        goto failed;
+    }
+
+    cmcf = ngx_http_get_module_main_conf(r, ngx_http_core_module);
+
+    r->variables = ngx_pcalloc(pool, cmcf->variables.nelts
+                                     * sizeof(ngx_http_variable_value_t));
+    if (r->variables == NULL) {
+        goto failed;
+    }
+
+    r->main = r;
+    r->count = 1;
+
+    tp = ngx_timeofday();
+    r->start_sec = tp->sec;
+    r->start_msec = tp->msec;
+
+    r->method = NGX_HTTP_UNKNOWN;
+
+    r->headers_in.content_length_n = -1;
+    r->headers_in.keep_alive_n = -1;
+    r->headers_out.content_length_n = -1;
+    r->headers_out.last_modified_time = -1;
+
+    r->uri_changes = NGX_HTTP_MAX_URI_CHANGES + 1;
+    r->subrequests = NGX_HTTP_MAX_SUBREQUESTS + 1;
+
+    r->http_state = NGX_HTTP_READING_REQUEST_STATE;
+
+    r->log_handler = ngx_http_log_error_handler;
+
+    h2scf = ngx_http_get_module_srv_conf(h2c, ngx_http_v2_module);
+
+    stream->request = r;
+    stream->connection = h2c;
+    stream->send_window = h2c->init_window;
+    stream->recv_window = h2scf->preread_size;
+    stream->weight = NGX_HTTP_V2_DEFAULT_WEIGHT;
+
+    ngx_queue_init(&stream->children);
+    ngx_queue_insert_tail(&h2c->dependencies, &stream->queue);
+    ngx_http_v2_node_rank(stream);
+
+    h2c->processing++;
+
+#if (NGX_STAT_STUB)
+    (void) ngx_atomic_fetch_add(ngx_stat_reading, 1);
+    r->stat_reading = 1;
+    (void) ngx_atomic_fetch_add(ngx_stat_requests, 1);
+#endif
+
+    return stream;
+
+failed:
+
+    if (pool) {
+        ngx_destroy_pool(pool);
+    }
+
+    fc->data = h2c->free_fake_connections;
+    fc->read = rev;
+    fc->write = wev;
+    h2c->free_fake_connections = fc;
+
+    return NULL;
+}
+
+
+static ngx_http_v2_stream_t *
+ngx_http_v2_get_stream(ngx_http_v2_connection_t *h2c, ngx_uint_t sid)
+{
+    ngx_http_v2_stream_t  *stream;
+
+    stream = h2c->streams_index[ngx_http_v2_index(sid)];
+
+    while (stream) {
+        if (stream->id == sid) {
+            return stream;
+        }
+
+        stream = stream->index;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_http_v2_set_dependency(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_stream_t *stream, ngx_uint_t depend, ngx_uint_t exclusive)
+{
+    ngx_queue_t           *q, *siblings;
+    ngx_http_v2_stream_t  *parent, *node, *child;
+
+    parent = depend ? ngx_http_v2_get_stream(h2c, depend) : NULL;
+
+    if (parent) {
+
+        /* a stream that depends on its own child takes the child's place */
+
+        for (node = parent->parent; node; node = node->parent) {
+
+            if (node != stream) {
+                continue;
+            }
+
+            ngx_queue_remove(&parent->queue);
+            parent->parent = stream->parent;
+
+            siblings = stream->parent ? &stream->parent->children
+                                      : &h2c->dependencies;
+            ngx_queue_insert_tail(siblings, &parent->queue);
+
+            break;
+        }
+    }
+
+    ngx_queue_remove(&stream->queue);
+
+    siblings = parent ? &parent->children : &h2c->dependencies;
+
+    if (exclusive) {
+        while (!ngx_queue_empty(siblings)) {
+            q = ngx_queue_head(siblings);
+            ngx_queue_remove(q);
+
+            child = ngx_queue_data(q, ngx_http_v2_stream_t, queue);
+            child->parent = stream;
+
+            ngx_queue_insert_tail(&stream->children, q);
+        }
+    }
+
+    stream->parent = parent;
+    ngx_queue_insert_tail(siblings, &stream->queue);
+
+    for (q = ngx_queue_head(&h2c->dependencies);
+         q != ngx_queue_sentinel(&h2c->dependencies);
+         q = ngx_queue_next(q))
+    {
+        ngx_http_v2_node_rank(ngx_queue_data(q, ngx_http_v2_stream_t, queue));
+    }
+}
+
+
+static void
+ngx_http_v2_remove_dependency(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_stream_t *stream)
+{
+    ngx_queue_t           *q, *siblings;
+    ngx_http_v2_stream_t  *child;
+
+    siblings = stream->parent ? &stream->parent->children
+                              : &h2c->dependencies;
+
+    while (!ngx_queue_empty(&stream->children)) {
+        q = ngx_queue_head(&stream->children);
+        ngx_queue_remove(q);
+
+        child = ngx_queue_data(q, ngx_http_v2_stream_t, queue);
+        child->parent = stream->parent;
+
+        ngx_queue_insert_tail(siblings, q);
+
+        ngx_http_v2_node_rank(child);
+    }
+
+    ngx_queue_remove(&stream->queue);
+}
+
+
+/* the depth and the share of the parent's weight define the send order */
+
+static void
+ngx_http_v2_node_rank(ngx_http_v2_stream_t *node)
+{
+    ngx_queue_t  *q;
+
+    if (node->parent) {
+        node->rank = node->parent->rank + 1;
+        node->rel_weight = node->parent->rel_weight
+                           * node->weight / NGX_HTTP_V2_MAX_WEIGHT;
+
+    } else {
+        node->rank = 1;
+        node->rel_weight = (float) node->weight / NGX_HTTP_V2_MAX_WEIGHT;
+    }
+
+    for (q = ngx_queue_head(&node->children);
+         q != ngx_queue_sentinel(&node->children);
+         q = ngx_queue_next(q))
+    {
+        ngx_http_v2_node_rank(ngx_queue_data(q, ngx_http_v2_stream_t, queue));
+    }
+}
+
+
+static void
+ngx_http_v2_run_request(ngx_http_v2_stream_t *stream, ngx_array_t *headers)
+{
+    u_char                    *p;
+    size_t                     size, len;
+    ngx_str_t                 *s, method, path, scheme, authority, name,
+                               cookie;
+    ngx_uint_t                 i, regular, cookies;
+    ngx_connection_t          *fc;
+    ngx_http_request_t        *r;
+    ngx_http_v2_header_t      *h;
+    ngx_http_v2_srv_conf_t    *h2scf;
+
+    r = stream->request;
+    fc = r->connection;
+
+    h2scf = ngx_http_get_module_srv_conf(r, ngx_http_v2_module);
+
+    ngx_str_null(&method);
+    ngx_str_null(&path);
+    ngx_str_null(&scheme);
+    ngx_str_null(&authority);
+
+    size = 0;
+    regular = 0;
+
+    h = headers->elts;
+
+    for (i = 0; i < headers->nelts; i++) {
+
+        if (ngx_http_v2_validate_header(&h[i]) != NGX_OK) {
+            goto invalid;
+        }
+
+        size += h[i].name.len + h[i].value.len + NGX_HTTP_V2_TABLE_ENTRY_SIZE;
+
+        if (h[i].name.len + h[i].value.len > h2scf->max_field_size
+            || size > h2scf->max_header_size)
+        {
+            ngx_log_error(NGX_LOG_INFO, fc->log, 0,
+                          "client sent too large header field");
+
+            ngx_http_finalize_request(r, NGX_HTTP_REQUEST_HEADER_TOO_LARGE);
+            return;
+        }
+
+        if (h[i].name.data[0] != ':') {
+            regular = 1;
+            continue;
+        }
+
+        if (regular) {
+            goto invalid;
+        }
+
+        if (h[i].name.len == sizeof(":method") - 1
+            && ngx_strncmp(h[i].name.data, ":method", h[i].name.len) == 0)
+        {
+            s = &method;
+
+        } else if (h[i].name.len == sizeof(":path") - 1
+                   && ngx_strncmp(h[i].name.data, ":path", h[i].name.len) == 0)
+        {
+            s = &path;
+
+        } else if (h[i].name.len == sizeof(":scheme") - 1
+                   && ngx_strncmp(h[i].name.data, ":scheme", h[i].name.len)
+                      == 0)
+        {
+            s = &scheme;
+
+        } else if (h[i].name.len == sizeof(":authority") - 1
+                   && ngx_strncmp(h[i].name.data, ":authority",
+                                  h[i].name.len)
+                      == 0)
+        {
+            s = &authority;
+
+        } else {
+            goto invalid;
+        }
+
+        if (s->data) {
+            goto invalid;
+        }
+
+        *s = h[i].value;
+    }
+
+    if (method.len == 0 || path.len == 0 || scheme.len == 0) {
+        ngx_log_error(NGX_LOG_INFO, fc->log, 0,
+                      "client sent no :method, :path or :scheme");
+
+        ngx_http_finalize_request(r, NGX_HTTP_BAD_REQUEST);
+        return;
+    }
+
+    if (ngx_http_v2_construct_request_line(r, &method, &path) != NGX_OK) {
+        return;
+    }
+
+    if (authority.len) {
+        ngx_str_set(&name, "host");
+
+        if (ngx_http_v2_process_header(r, &name, &authority) != NGX_OK) {
+            return;
+        }
+    }
+
+    len = 0;
+    cookies = 0;
+
+    for (i = 0; i < headers->nelts; i++) {
+
+        if (h[i].name.data[0] == ':') {
+            continue;
+        }
+
+        if (h[i].name.len == sizeof("cookie") - 1
+            && ngx_strncmp(h[i].name.data, "cookie", h[i].name.len) == 0)
+        {
+            len += (cookies++ ? sizeof("; ") - 1 : 0) + h[i].value.len;
+            continue;
+        }
+
+        if (ngx_http_v2_process_header(r, &h[i].name, &h[i].value) != NGX_OK) {
+            return;
+        }
+    }
+
+    /* the crumbs of the cookie are joined back, RFC 7540, 8.1.2.5 */
+
+    if (cookies) {
+        cookie.data = ngx_pnalloc(r->pool, len + 1);
+        if (cookie.data == NULL) {
+            ngx_http_v2_close_stream(r->stream, NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+        p = cookie.data;
+
+        for (i = 0; i < headers->nelts; i++) {
+
+            if (h[i].name.len != sizeof("cookie") - 1
+                || ngx_strncmp(h[i].name.data, "cookie", h[i].name.len) != 0)
+            {
+                continue;
+            }
+
+            if (p != cookie.data) {
+                *p++ = ';';
+                *p++ = ' ';
+            }
+
+            p = ngx_cpymem(p, h[i].value.data, h[i].value.len);
+        }
+
+        *p = '\0';
+        cookie.len = len;
+
+        ngx_str_set(&name, "cookie");
+
+        if (ngx_http_v2_process_header(r, &name, &cookie) != NGX_OK) {
+            return;
+        }
+    }
+
+    if (stream->in_closed && r->headers_in.content_length == NULL) {
+        r->headers_in.content_length_n = 0;
+    }
+
+    r->http_state = NGX_HTTP_PROCESS_REQUEST_STATE;
+
+    if (ngx_http_process_request_header(r) != NGX_OK) {
+        return;
+    }
+
+    ngx_http_process_request(r);
+
+    return;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_INFO, fc->log, 0,
+                  "client sent invalid header: \"%V\"", &h[i].name);
+
+    ngx_http_finalize_request(r, NGX_HTTP_BAD_REQUEST);
+}
+
+
+/*
+ * the decoded fields are copied as is into the HTTP/1.x requests
+ * to the upstreams, so the bytes that end or split a header line
+ * are rejected, RFC 7540, 8.1.2
+ */
+
+static ngx_int_t
+ngx_http_v2_validate_header(ngx_http_v2_header_t *h)
+{
+    u_char  *p, *last;
+
+    if (h->name.len == 0) {
+        return NGX_ERROR;
+    }
+
+    last = h->name.data + h->name.len;
+
+    for (p = h->name.data; p < last; p++) {
+
+        if ((*p >= 'A' && *p <= 'Z') || *p <= 0x20 || *p == 0x7f) {
+            return NGX_ERROR;
+        }
+
+        if (*p == ':' && p != h->name.data) {
+            return NGX_ERROR;
+        }
+    }
+
+    last = h->value.data + h->value.len;
+
+    for (p = h->value.data; p < last; p++) {
+
+        if (*p == '\0' || *p == CR || *p == LF) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_construct_request_line(ngx_http_request_t *r, ngx_str_t *method,
+    ngx_str_t *path)
+{
+    u_char     *p;
+    size_t      len;
+    ngx_int_t   rc;
+    ngx_buf_t  *b;
+
+    static const u_char ending[] = " HTTP/2.0" CRLF;
+
+    for (p = path->data; p < path->data + path->len; p++) {
+        if (*p <= 0x20 || *p == 0x7f) {
+            goto invalid;
+        }
+    }
+
+    if (path->data[0] != '/'
+        && !(path->len == 1 && path->data[0] == '*'))
+    {
+        goto invalid;
+    }
+
+    len = method->len + 1 + path->len + sizeof(ending) - 1;
+
+    b = ngx_create_temp_buf(r->pool, len);
+    if (b == NULL) {
+        ngx_http_v2_close_stream(r->stream, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(b->last, method->data, method->len);
+    *p++ = ' ';
+    p = ngx_cpymem(p, path->data, path->len);
+    b->last = ngx_cpymem(p, ending, sizeof(ending) - 1);
+
+    r->header_in = b;
+
+    rc = ngx_http_parse_request_line(r, b);
+
+    if (rc != NGX_OK || r->http_version != NGX_HTTP_VERSION_20) {
+        goto invalid;
+    }
+
+    r->request_line.len = r->request_end - r->request_start;
+    r->request_line.data = r->request_start;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http2 request line: \"%V\"", &r->request_line);
+
+    return ngx_http_process_request_uri(r);
+
+invalid:
+
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                  "client sent invalid :method or :path");
+
+    ngx_http_finalize_request(r, NGX_HTTP_BAD_REQUEST);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_v2_process_header(ngx_http_request_t *r, ngx_str_t *name,
+    ngx_str_t *value)
+{
+    ngx_table_elt_t            *h;
+    ngx_http_header_t          *hh;
+    ngx_http_core_main_conf_t  *cmcf;
+
+    /* the connection specific headers are not allowed, RFC 7540, 8.1.2.2 */
+
+    if ((name->len == sizeof("connection") - 1
+         && ngx_strncmp(name->data, "connection", name->len) == 0)
+        || (name->len == sizeof("keep-alive") - 1
+            && ngx_strncmp(name->data, "keep-alive", name->len) == 0)
+        || (name->len == sizeof("proxy-connection") - 1
+            && ngx_strncmp(name->data, "proxy-connection", name->len) == 0)
+        || (name->len == sizeof("transfer-encoding") - 1
+            && ngx_strncmp(name->data, "transfer-encoding", name->len) == 0)
+        || (name->len == sizeof("upgrade") - 1
+            && ngx_strncmp(name->data, "upgrade", name->len) == 0)
+        || (name->len == sizeof("te") - 1
+            && ngx_strncmp(name->data, "te", name->len) == 0
+            && (value->len != sizeof("trailers") - 1
+                || ngx_strncmp(value->data, "trailers", value->len) != 0)))
+    {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "client sent connection specific header: \"%V\"", name);
+
+        ngx_http_finalize_request(r, NGX_HTTP_BAD_REQUEST);
+        return NGX_ERROR;
+    }
+
+    h = ngx_list_push(&r->headers_in.headers);
+    if (h == NULL) {
+        ngx_http_v2_close_stream(r->stream, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return NGX_ERROR;
+    }
+
+    h->key = *name;
+    h->value = *value;
+    h->lowcase_key = name->data;
+    h->hash = ngx_hash_key(name->data, name->len);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http2 header: \"%V: %V\"", &h->key, &h->value);
+
+    cmcf = ngx_http_get_module_main_conf(r, ngx_http_core_module);
+
+    hh = ngx_hash_find(&cmcf->headers_in_hash, h->hash, h->lowcase_key,
+                       h->key.len);
+
+    if (hh && hh->handler(r, h, hh->offset) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_v2_read_request_body(ngx_http_request_t *r,
+    ngx_http_client_body_handler_pt post_handler)
+{
+    ngx_buf_t                 *b;
+    ngx_http_v2_stream_t      *stream;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    if (r->headers_in.content_length_n >= 0) {
+        return NGX_DECLINED;
+    }
+
+    stream = r->stream;
+    b = stream->preread;
+
+    /* the whole body without the length has been preread */
+
+    if (stream->in_closed) {
+        r->headers_in.content_length_n = b ? b->last - b->pos : 0;
+
+        if (ngx_http_v2_set_content_length(r) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        return NGX_DECLINED;
+    }
+
+    if (b && b->last == b->end) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "client intended to send body without length "
+                      "larger than http2_body_preread_size");
+
+        return NGX_HTTP_REQUEST_ENTITY_TOO_LARGE;
+    }
+
+    stream->post_handler = post_handler;
+    r->read_event_handler = ngx_http_v2_read_unknown_body_handler;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    ngx_add_timer(r->connection->read, clcf->client_body_timeout);
+
+    return NGX_AGAIN;
+}
+
+
+static void
+ngx_http_v2_read_unknown_body_handler(ngx_http_request_t *r)
+{
+    ngx_int_t              rc;
+    ngx_buf_t             *b;
+    ngx_connection_t      *fc;
+    ngx_http_v2_stream_t  *stream;
+
+    fc = r->connection;
+    stream = r->stream;
+
+    if (fc->read->timedout) {
+        fc->timedout = 1;
+        ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    if (fc->error) {
+        ngx_http_finalize_request(r, NGX_HTTP_BAD_REQUEST);
+        return;
+    }
+
+    if (!stream->in_closed) {
+        b = stream->preread;
+
+        if (b == NULL || b->last < b->end) {
+            return;
+        }
+
+        ngx_log_error(NGX_LOG_INFO, fc->log, 0,
+                      "client intended to send body without length "
+                      "larger than http2_body_preread_size");
+
+        ngx_http_finalize_request(r, NGX_HTTP_REQUEST_ENTITY_TOO_LARGE);
+        return;
+    }
+
+    if (fc->read->timer_set) {
+        ngx_del_timer(fc->read);
+    }
+
+    r->main->count--;
+
+    rc = ngx_http_read_client_request_body(r, stream->post_handler);
+
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+        ngx_http_finalize_request(r, rc);
+    }
+}
+
+
+/*
+ * a body sent without "Content-Length" is passed on to upstreams with
+ * the header, HTTP/1.0 servers cannot find the end of it otherwise
+ */
+
+static ngx_int_t
+ngx_http_v2_set_content_length(ngx_http_request_t *r)
+{
+    ngx_table_elt_t  *h;
+
+    h = ngx_list_push(&r->headers_in.headers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    h->value.data = ngx_pnalloc(r->pool, NGX_OFF_T_LEN);
+    if (h->value.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    h->value.len = ngx_sprintf(h->value.data, "%O",
+                               r->headers_in.content_length_n)
+                   - h->value.data;
+
+    ngx_str_set(&h->key, "Content-Length");
+    h->lowcase_key = (u_char *) "content-length";
+    h->hash = ngx_hash_key(h->lowcase_key, h->key.len);
+
+    r->headers_in.content_length = h;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_v2_wake(ngx_event_t *ev)
+{
+    ev->active = 0;
+    ev->ready = 1;
+
+    ngx_post_event(ev, &ngx_posted_events);
+}
+
+
+void
+ngx_http_v2_close_stream(ngx_http_v2_stream_t *stream, ngx_int_t rc)
+{
+    ngx_event_t               *ev;
+    ngx_connection_t          *fc;
+    ngx_http_v2_stream_t     **index;
+    ngx_http_v2_connection_t  *h2c;
+
+    h2c = stream->connection;
+    fc = stream->request->connection;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 close stream %ui, queued %ui",
+                   stream->id, stream->queued);
+
+    if (stream->queued) {
+
+        if (fc->error || !stream->out_closed) {
+            ngx_http_v2_drop_frames(h2c, stream);
+        }
+
+        if (stream->queued) {
+            fc->read->handler = ngx_http_v2_close_stream_handler;
+            fc->write->handler = ngx_http_v2_close_stream_handler;
+            return;
+        }
+    }
+
+    if (!stream->rst_sent && !h2c->connection->error) {
+
+        if (!stream->out_closed) {
+            if (ngx_http_v2_send_rst_stream(h2c, stream->id,
+                                            NGX_HTTP_V2_INTERNAL_ERROR)
+                != NGX_OK)
+            {
+                h2c->connection->error = 1;
+            }
+
+        } else if (!stream->in_closed) {
+
+            /* the response is complete, the rest of the body is not needed */
+
+            if (ngx_http_v2_send_rst_stream(h2c, stream->id,
+                                            NGX_HTTP_V2_NO_ERROR)
+                != NGX_OK)
+            {
+                h2c->connection->error = 1;
+            }
+        }
+    }
+
+    for (index = &h2c->streams_index[ngx_http_v2_index(stream->id)];
+         *index;
+         index = &(*index)->index)
+    {
+        if (*index == stream) {
+            *index = stream->index;
+            break;
+        }
+    }
+
+    ngx_http_v2_remove_dependency(h2c, stream);
+
+    if (stream->in_waiting) {
+        ngx_queue_remove(&stream->waiting);
+    }
+
+    ev = fc->read;
+
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+
+    if (ev->prev) {
+        ngx_delete_posted_event(ev);
+    }
+
+    ev = fc->write;
+
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+
+    if (ev->prev) {
+        ngx_delete_posted_event(ev);
+    }
+
+    ngx_http_free_request(stream->request, rc);
+
+    fc->data = h2c->free_fake_connections;
+    h2c->free_fake_connections = fc;
+
+    h2c->processing--;
+
+    if (h2c->processing || h2c->blocked) {
+        return;
+    }
+
+    ev = h2c->connection->read;
+
+    ev->handler = ngx_http_v2_handle_connection_handler;
+    ngx_post_event(ev, &ngx_posted_events);
+}
+
+
+static void
+ngx_http_v2_close_stream_handler(ngx_event_t *ev)
+{
+    ngx_connection_t    *fc;
+    ngx_http_request_t  *r;
+
+    fc = ev->data;
+    r = fc->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                   "http2 close stream handler");
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, fc->log, NGX_ETIMEDOUT, "client timed out");
+
+        fc->timedout = 1;
+
+        ngx_http_v2_close_stream(r->main->stream, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    ngx_http_v2_close_stream(r->main->stream, 0);
+}
+
+
+/* drops the frames of the stream that have not started to be sent */
+
+static void
+ngx_http_v2_drop_frames(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_stream_t *stream)
+{
+    ngx_http_v2_out_frame_t  *frame, **out;
+
+    out = &h2c->last_out;
+
+    while (*out) {
+        frame = *out;
+
+        if (frame->stream == stream && !frame->blocked) {
+            *out = frame->next;
+            stream->queued--;
+            continue;
+        }
+
+        out = &frame->next;
+    }
+}
+
+
+static ssize_t
+ngx_http_v2_recv(ngx_connection_t *fc, u_char *buf, size_t size)
+{
+    size_t                     n, window;
+    ngx_buf_t                 *b;
+    ngx_http_request_t        *r;
+    ngx_http_v2_stream_t      *stream;
+    ngx_http_v2_connection_t  *h2c;
+
+    r = fc->data;
+    stream = r->main->stream;
+    h2c = stream->connection;
+
+    if (fc->error) {
+        return NGX_ERROR;
+    }
+
+    b = stream->preread;
+
+    if (b == NULL || b->pos == b->last) {
+
+        if (stream->in_closed) {
+            fc->read->eof = 1;
+            return 0;
+        }
+
+        fc->read->active = 1;
+        fc->read->ready = 0;
+
+        return NGX_AGAIN;
+    }
+
+    n = ngx_min(size, (size_t) (b->last - b->pos));
+
+    ngx_memcpy(buf, b->pos, n);
+    b->pos += n;
+
+    if (b->pos != b->last) {
+        return n;
+    }
+
+    b->pos = b->start;
+    b->last = b->start;
+
+    if (stream->in_closed) {
+        return n;
+    }
+
+    /* the whole buffer is free again */
+
+    window = (b->end - b->start) - stream->recv_window;
+
+    if (window == 0) {
+        return n;
+    }
+
+    stream->recv_window += window;
+
+    if (ngx_http_v2_send_window_update(h2c, stream->id, window) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (!h2c->blocked && ngx_http_v2_send_output_queue(h2c) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    return n;
+}
+
+
+static ssize_t
+ngx_http_v2_send(ngx_connection_t *fc, u_char *buf, size_t size)
+{
+    ngx_log_error(NGX_LOG_ALERT, fc->log, 0,
+                  "unexpected plain send on HTTP/2 stream");
+
+    return NGX_ERROR;
+}
+
+
+static ngx_chain_t *
+ngx_http_v2_send_chain(ngx_connection_t *fc, ngx_chain_t *in, off_t limit)
+{
+    off_t                      size, n;
+    u_char                    *pos;
+    ngx_buf_t                 *b;
+    ngx_uint_t                 fin;
+    ngx_http_request_t        *r;
+    ngx_http_v2_stream_t      *stream;
+    ngx_http_v2_srv_conf_t    *h2scf;
+    ngx_http_v2_out_frame_t   *frame;
+    ngx_http_v2_connection_t  *h2c;
+
+    r = fc->data;
+    stream = r->main->stream;
+    h2c = stream->connection;
+
+    if (fc->error) {
+        return NGX_CHAIN_ERROR;
+    }
+
+    h2scf = ngx_http_get_module_srv_conf(h2c, ngx_http_v2_module);
+
+    while (in) {
+        b = in->buf;
+
+        if (stream->out_closed) {
+
+            /* for example, the body of a HEAD response */
+
+            if (ngx_buf_in_memory(b)) {
+                b->pos = b->last;
+
+            } else {
+                b->file_pos = b->file_last;
+            }
+
+            in = in->next;
+            continue;
+        }
+
+        if (!ngx_buf_in_memory(b) && !ngx_buf_special(b)) {
+            ngx_log_error(NGX_LOG_ALERT, fc->log, 0,
+                          "file buf in HTTP/2 output chain");
+            return NGX_CHAIN_ERROR;
+        }
+
+        pos = (stream->framed == b) ? stream->framed_pos : b->pos;
+        size = ngx_buf_in_memory(b) ? b->last - pos : 0;
+        fin = b->last_buf;
+
+        if (size == 0) {
+
+            if (!fin) {
+                in = in->next;
+                continue;
+            }
+
+            n = 0;
+
+        } else {
+
+            if (stream->send_window <= 0) {
+                stream->exhausted = 1;
+                break;
+            }
+
+            if (h2c->send_window == 0) {
+                if (!stream->in_waiting) {
+                    ngx_queue_insert_tail(&h2c->waiting, &stream->waiting);
+                    stream->in_waiting = 1;
+                }
+
+                break;
+            }
+
+            n = ngx_min(size, (off_t) h2c->frame_size);
+            n = ngx_min(n, (off_t) h2scf->chunk_size);
+            n = ngx_min(n, (off_t) stream->send_window);
+            n = ngx_min(n, (off_t) h2c->send_window);
+
+            if (limit) {
+                n = ngx_min(n, limit);
+            }
+
+            if (n < size) {
+                fin = 0;
+            }
+        }
+
+        frame = ngx_http_v2_get_data_frame(stream, b, pos, (size_t) n, fin);
+        if (frame == NULL) {
+            return NGX_CHAIN_ERROR;
+        }
+
+        ngx_http_v2_queue_frame(h2c, frame);
+        stream->queued++;
+
+        stream->send_window -= (size_t) n;
+        h2c->send_window -= (size_t) n;
+
+        if (fin) {
+            stream->out_closed = 1;
+        }
+
+        if (n < size) {
+            stream->framed = b;
+            stream->framed_pos = pos + n;
+
+        } else {
+            stream->framed = NULL;
+            in = in->next;
+        }
+
+        if (limit) {
+            limit -= n;
+
+            if (limit == 0) {
+                break;
+            }
+        }
+    }
+
+    if (in && (stream->exhausted || stream->in_waiting)) {
+        fc->write->active = 1;
+        fc->write->ready = 0;
+    }
+
+    if (stream->queued) {
+        fc->buffered |= NGX_HTTP_V2_BUFFERED;
+    }
+
+    if (!h2c->blocked && ngx_http_v2_send_output_queue(h2c) == NGX_ERROR) {
+        fc->error = 1;
+        return NGX_CHAIN_ERROR;
+    }
+
+    if (stream->queued == 0) {
+        fc->buffered &= ~NGX_HTTP_V2_BUFFERED;
+    }
+
+    return in;
+}
+
+
+static ngx_http_v2_out_frame_t *
+ngx_http_v2_get_data_frame(ngx_http_v2_stream_t *stream, ngx_buf_t *b,
+    u_char *pos, size_t len, ngx_uint_t fin)
+{
+    u_char                    *p;
+    ngx_buf_t                 *hb, *db;
+    ngx_http_v2_out_frame_t   *frame;
+    ngx_http_v2_data_frame_t  *df;
+
+    frame = stream->free_frames;
+
+    if (frame) {
+        stream->free_frames = frame->next;
+        df = (ngx_http_v2_data_frame_t *) frame;
+
+    } else {
+        df = ngx_palloc(stream->request->pool,
+                        sizeof(ngx_http_v2_data_frame_t));
+        if (df == NULL) {
+            return NULL;
+        }
+
+        frame = &df->frame;
+    }
+
+    hb = &df->buf[0];
+    ngx_memzero(hb, sizeof(ngx_buf_t));
+
+    hb->start = df->header;
+    hb->end = df->header + NGX_HTTP_V2_FRAME_HEADER_SIZE;
+    hb->pos = hb->start;
+    hb->temporary = 1;
+
+    p = ngx_http_v2_write_len_and_type(hb->pos, len,
+                                       NGX_HTTP_V2_DATA_FRAME);
+    *p++ = fin ? NGX_HTTP_V2_END_STREAM_FLAG : NGX_HTTP_V2_NO_FLAG;
+    hb->last = ngx_http_v2_write_sid(p, stream->id);
+
+    df->chain[0].buf = hb;
+    df->chain[0].next = NULL;
+
+    frame->first = &df->chain[0];
+    frame->last = &df->chain[0];
+
+    db = &df->buf[1];
+    ngx_memzero(db, sizeof(ngx_buf_t));
+
+    if (len) {
+
+        /* the data are sent from the original buffer */
+
+        db->start = pos;
+        db->pos = pos;
+        db->last = pos + len;
+        db->end = db->last;
+        db->temporary = 1;
+        db->shadow = b;
+
+        df->chain[0].next = &df->chain[1];
+        df->chain[1].buf = db;
+        df->chain[1].next = NULL;
+
+        frame->last = &df->chain[1];
+    }
+
+    frame->next = NULL;
+    frame->handler = ngx_http_v2_data_frame_handler;
+    frame->stream = stream;
+    frame->length = len;
+    frame->blocked = 0;
+    frame->fin = fin;
+
+    return frame;
+}
+
+
+/*
+ * the control frames go ahead of the stream frames waiting in the queue,
+ * the stream frames are ordered by the dependency rank and weight;
+ * "last_out" is in the reverse order, its head is sent last
+ */
+
+void
+ngx_http_v2_queue_frame(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_out_frame_t *frame)
+{
+    ngx_http_v2_out_frame_t  **out;
+
+    for (out = &h2c->last_out; *out; out = &(*out)->next) {
+
+        if ((*out)->blocked || (*out)->stream == NULL) {
+            break;
+        }
+
+        if (frame->stream == NULL) {
+            continue;
+        }
+
+        if ((*out)->stream == frame->stream
+            || (*out)->stream->rank < frame->stream->rank
+            || ((*out)->stream->rank == frame->stream->rank
+                && (*out)->stream->rel_weight >= frame->stream->rel_weight))
+        {
+            break;
+        }
+    }
+
+    frame->next = *out;
+    *out = frame;
+}
+
+
+ngx_int_t
+ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c)
+{
+    int                        tcp_nodelay;
+    ngx_chain_t               *cl;
+    ngx_event_t               *wev;
+    ngx_connection_t          *c;
+    ngx_http_core_loc_conf_t  *clcf;
+    ngx_http_v2_out_frame_t   *out, *frame, *fn;
+
+    c = h2c->connection;
+
+    if (c->error) {
+        return NGX_ERROR;
+    }
+
+    wev = c->write;
+
+    if (!wev->ready) {
+        return NGX_OK;
+    }
+
+    if (h2c->last_out == NULL && !c->buffered) {
+        return NGX_OK;
+    }
+
+    if (h2c->last_out) {
+
+        /*
+         * the queued frames go out now: without the flag an SSL connection
+         * keeps a short tail, e.g. a WINDOW_UPDATE, in its write buffer
+         */
+
+        h2c->last_out->last->buf->flush = 1;
+    }
+
+    cl = NULL;
+    out = NULL;
+
+    for (frame = h2c->last_out; frame; frame = fn) {
+        frame->last->next = cl;
+        cl = frame->first;
+
+        fn = frame->next;
+        frame->next = out;
+        out = frame;
+    }
+
+    clcf = ngx_http_get_module_loc_conf(h2c, ngx_http_core_module);
+
+    if (clcf->tcp_nodelay && c->tcp_nodelay == NGX_TCP_NODELAY_UNSET) {
+        tcp_nodelay = 1;
+
+        if (setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY,
+                       (const void *) &tcp_nodelay, sizeof(int))
+            == -1)
+        {
+            ngx_connection_error(c, ngx_socket_errno,
+                                 "setsockopt(TCP_NODELAY) failed");
+            goto error;
+        }
+
+        c->tcp_nodelay = NGX_TCP_NODELAY_SET;
+    }
+
+    cl = c->send_chain(c, cl, 0);
+
+    if (cl == NGX_CHAIN_ERROR) {
+        goto error;
+    }
+
+    if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+        goto error;
+    }
+
+    if (cl) {
+        ngx_add_timer(wev, clcf->send_timeout);
+
+    } else if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+
+    for ( /* void */ ; out; out = fn) {
+        fn = out->next;
+
+        if (out->handler(h2c, out) != NGX_OK) {
+            out->blocked = 1;
+            break;
+        }
+    }
+
+    frame = NULL;
+
+    for ( /* void */ ; out; out = fn) {
+        fn = out->next;
+        out->next = frame;
+        frame = out;
+    }
+
+    h2c->last_out = frame;
+
+    return NGX_OK;
+
+error:
+
+    c->error = 1;
+
+    if (!h2c->blocked) {
+        ngx_post_event(wev, &ngx_posted_events);
+    }
+
+    return NGX_ERROR;
+}
+
+
+static ngx_http_v2_out_frame_t *
+ngx_http_v2_get_frame(ngx_http_v2_connection_t *h2c, size_t length,
+    ngx_uint_t type, ngx_uint_t flags, ngx_uint_t sid)
+{
+    u_char                       *p;
+    ngx_buf_t                    *b;
+    ngx_http_v2_out_frame_t      *frame;
+    ngx_http_v2_control_frame_t  *cf;
+
+    frame = h2c->free_frames;
+
+    if (frame) {
+        h2c->free_frames = frame->next;
+        cf = (ngx_http_v2_control_frame_t *) frame;
+
+    } else {
+        cf = ngx_palloc(h2c->connection->pool,
+                        sizeof(ngx_http_v2_control_frame_t));
+        if (cf == NULL) {
+            return NULL;
+        }
+
+        frame = &cf->frame;
+    }
+
+    b = &cf->buf;
+    ngx_memzero(b, sizeof(ngx_buf_t));
+
+    b->start = cf->data;
+    b->end = cf->data + sizeof(cf->data);
+    b->pos = b->start;
+    b->temporary = 1;
+
+    p = ngx_http_v2_write_len_and_type(b->pos, length, type);
+    *p++ = (u_char) flags;
+    b->last = ngx_http_v2_write_sid(p, sid);
+
+    cf->chain.buf = b;
+    cf->chain.next = NULL;
+
+    frame->next = NULL;
+    frame->first = &cf->chain;
+    frame->last = &cf->chain;
+    frame->handler = ngx_http_v2_control_frame_handler;
+    frame->stream = NULL;
+    frame->length = length;
+    frame->blocked = 0;
+    frame->fin = 0;
+
+    return frame;
+}
+
+
+static ngx_int_t
+ngx_http_v2_send_settings(ngx_http_v2_connection_t *h2c)
+{
+    u_char                   *p;
+    ngx_buf_t                *b;
+    ngx_http_v2_srv_conf_t   *h2scf;
+    ngx_http_v2_out_frame_t  *frame;
+
+    frame = ngx_http_v2_get_frame(h2c, 3 * NGX_HTTP_V2_SETTINGS_PARAM_SIZE,
+                                  NGX_HTTP_V2_SETTINGS_FRAME,
+                                  NGX_HTTP_V2_NO_FLAG, 0);
+    if (frame == NULL) {
+        return NGX_ERROR;
+    }
+
+    h2scf = ngx_http_get_module_srv_conf(h2c, ngx_http_v2_module);
+
+    b = frame->first->buf;
+    p = b->last;
+
+    p = ngx_http_v2_write_uint16(p, NGX_HTTP_V2_MAX_STREAMS_SETTING);
+    p = ngx_http_v2_write_uint32(p, h2scf->concurrent_streams);
+
+    p = ngx_http_v2_write_uint16(p, NGX_HTTP_V2_INIT_WINDOW_SIZE_SETTING);
+    p = ngx_http_v2_write_uint32(p, h2scf->preread_size);
+
+    p = ngx_http_v2_write_uint16(p, NGX_HTTP_V2_MAX_FRAME_SIZE_SETTING);
+    p = ngx_http_v2_write_uint32(p, NGX_HTTP_V2_DEFAULT_FRAME_SIZE);
+
+    b->last = p;
+
+    ngx_http_v2_queue_frame(h2c, frame);
+
+    /* the connection window is not a limit, the stream windows are */
+
+    if (ngx_http_v2_send_window_update(h2c, 0, NGX_HTTP_V2_MAX_WINDOW
+                                               - NGX_HTTP_V2_DEFAULT_WINDOW)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    h2c->recv_window = NGX_HTTP_V2_MAX_WINDOW;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_send_window_update(ngx_http_v2_connection_t *h2c, ngx_uint_t sid,
+    size_t window)
+{
+    ngx_buf_t                *b;
+    ngx_http_v2_out_frame_t  *frame;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 send WINDOW_UPDATE sid:%ui window:%uz",
+                   sid, window);
+
+    frame = ngx_http_v2_get_frame(h2c, NGX_HTTP_V2_WINDOW_UPDATE_SIZE,
+                                  NGX_HTTP_V2_WINDOW_UPDATE_FRAME,
+                                  NGX_HTTP_V2_NO_FLAG, sid);
+    if (frame == NULL) {
+        return NGX_ERROR;
+    }
+
+    b = frame->first->buf;
+    b->last = ngx_http_v2_write_uint32(b->last, window);
+
+    ngx_http_v2_queue_frame(h2c, frame);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_send_rst_stream(ngx_http_v2_connection_t *h2c, ngx_uint_t sid,
+    ngx_uint_t status)
+{
+    ngx_buf_t                *b;
+    ngx_http_v2_out_frame_t  *frame;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 send RST_STREAM sid:%ui status:%ui",
+                   sid, status);
+
+    frame = ngx_http_v2_get_frame(h2c, NGX_HTTP_V2_RST_STREAM_SIZE,
+                                  NGX_HTTP_V2_RST_STREAM_FRAME,
+                                  NGX_HTTP_V2_NO_FLAG, sid);
+    if (frame == NULL) {
+        return NGX_ERROR;
+    }
+
+    b = frame->first->buf;
+    b->last = ngx_http_v2_write_uint32(b->last, status);
+
+    ngx_http_v2_queue_frame(h2c, frame);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_send_goaway(ngx_http_v2_connection_t *h2c, ngx_uint_t status)
+{
+    ngx_buf_t                *b;
+    ngx_http_v2_out_frame_t  *frame;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 send GOAWAY last sid:%ui status:%ui",
+                   h2c->last_sid, status);
+
+    frame = ngx_http_v2_get_frame(h2c, NGX_HTTP_V2_GOAWAY_SIZE,
+                                  NGX_HTTP_V2_GOAWAY_FRAME,
+                                  NGX_HTTP_V2_NO_FLAG, 0);
+    if (frame == NULL) {
+        return NGX_ERROR;
+    }
+
+    b = frame->first->buf;
+    b->last = ngx_http_v2_write_uint32(b->last, h2c->last_sid);
+    b->last = ngx_http_v2_write_uint32(b->last, status);
+
+    ngx_http_v2_queue_frame(h2c, frame);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_control_frame_handler(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_out_frame_t *frame)
+{
+    ngx_buf_t  *b;
+
+    b = frame->first->buf;
+
+    if (b->pos != b->last) {
+        return NGX_AGAIN;
+    }
+
+    frame->next = h2c->free_frames;
+    h2c->free_frames = frame;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_data_frame_handler(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_out_frame_t *frame)
+{
+    ngx_buf_t                 *hb, *db;
+    ngx_http_v2_stream_t      *stream;
+    ngx_http_v2_data_frame_t  *df;
+
+    df = (ngx_http_v2_data_frame_t *) frame;
+
+    hb = &df->buf[0];
+    db = &df->buf[1];
+
+    if (ngx_buf_size(hb)) {
+        return NGX_AGAIN;
+    }
+
+    if (frame->length) {
+
+        if (ngx_buf_size(db)) {
+            return NGX_AGAIN;
+        }
+
+        db->shadow->pos = db->last;
+    }
+
+    stream = frame->stream;
+
+    ngx_http_v2_handle_frame(stream, frame);
+
+    frame->next = stream->free_frames;
+    stream->free_frames = frame;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_v2_frame_handler(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_out_frame_t *frame)
+{
+    ngx_chain_t  *cl;
+
+    for (cl = frame->first; /* void */ ; cl = cl->next) {
+
+        if (ngx_buf_size(cl->buf)) {
+            return NGX_AGAIN;
+        }
+
+        if (cl == frame->last) {
+            break;
+        }
+    }
+
+    ngx_http_v2_handle_frame(frame->stream, frame);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_v2_handle_frame(ngx_http_v2_stream_t *stream,
+    ngx_http_v2_out_frame_t *frame)
+{
+    ngx_connection_t  *fc;
+
+    fc = stream->request->connection;
+
+    fc->sent += NGX_HTTP_V2_FRAME_HEADER_SIZE + frame->length;
+
+    stream->queued--;
+
+    /*
+     * the NGX_HTTP_V2_BUFFERED bit is cleared by ngx_http_v2_send_chain(),
+     * ngx_http_writer() would call the empty output chain an error otherwise
+     */
+
+    ngx_http_v2_wake(fc->write);
+}
+
+
+static void *
+ngx_http_v2_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_http_v2_srv_conf_t  *h2scf;
+
+    h2scf = ngx_pcalloc(cf->pool, sizeof(ngx_http_v2_srv_conf_t));
+    if (h2scf == NULL) {
+        return NULL;
+    }
+
+    h2scf->recv_buffer_size = NGX_CONF_UNSET_SIZE;
+    h2scf->concurrent_streams = NGX_CONF_UNSET_UINT;
+    h2scf->max_field_size = NGX_CONF_UNSET_SIZE;
+    h2scf->max_header_size = NGX_CONF_UNSET_SIZE;
+    h2scf->preread_size = NGX_CONF_UNSET_SIZE;
+    h2scf->chunk_size = NGX_CONF_UNSET_SIZE;
+    h2scf->recv_timeout = NGX_CONF_UNSET_MSEC;
+    h2scf->idle_timeout = NGX_CONF_UNSET_MSEC;
+
+    return h2scf;
+}
+
+
+static char *
+ngx_http_v2_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_v2_srv_conf_t *prev = parent;
+    ngx_http_v2_srv_conf_t *conf = child;
+
+    ngx_conf_merge_size_value(conf->recv_buffer_size, prev->recv_buffer_size,
+                              32 * 1024);
+    ngx_conf_merge_uint_value(conf->concurrent_streams,
+                              prev->concurrent_streams, 128);
+    ngx_conf_merge_size_value(conf->max_field_size, prev->max_field_size,
+                              4096);
+    ngx_conf_merge_size_value(conf->max_header_size, prev->max_header_size,
+                              16384);
+    ngx_conf_merge_size_value(conf->preread_size, prev->preread_size,
+                              65536);
+    ngx_conf_merge_size_value(conf->chunk_size, prev->chunk_size, 8 * 1024);
+    ngx_conf_merge_msec_value(conf->recv_timeout, prev->recv_timeout, 30000);
+    ngx_conf_merge_msec_value(conf->idle_timeout, prev->idle_timeout, 180000);
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_v2_recv_buffer_size(ngx_conf_t *cf, void *post, void *data)
+{
+    size_t *sp = data;
+
+    if (*sp < NGX_HTTP_V2_FRAME_HEADER_SIZE + NGX_HTTP_V2_DEFAULT_FRAME_SIZE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "the buffer size must be no less than %uz",
+                           (size_t) NGX_HTTP_V2_FRAME_HEADER_SIZE
+                           + NGX_HTTP_V2_DEFAULT_FRAME_SIZE);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_v2_preread_size(ngx_conf_t *cf, void *post, void *data)
+{
+    size_t *sp = data;
+
+    if (*sp == 0 || *sp > NGX_HTTP_V2_MAX_WINDOW) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "the preread size must be between 1 and %uz",
+                           (size_t) NGX_HTTP_V2_MAX_WINDOW);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_v2_chunk_size(ngx_conf_t *cf, void *post, void *data)
+{
+    size_t *sp = data;
+
+    if (*sp == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "the http2 chunk size cannot be zero");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
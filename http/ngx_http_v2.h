@@ -0,0 +1,262 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_HTTP_V2_H_INCLUDED_
+#define _NGX_HTTP_V2_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_V2_ALPN_ADVERTISE       "\x02h2"
+
+#define NGX_HTTP_V2_PREFACE              "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define NGX_HTTP_V2_PREFACE_START        "PRI * HTTP/2.0\r\n"
+
+#define NGX_HTTP_V2_FRAME_HEADER_SIZE    9
+#define NGX_HTTP_V2_DEFAULT_FRAME_SIZE   (1 << 14)
+#define NGX_HTTP_V2_MAX_FRAME_SIZE       ((1 << 24) - 1)
+
+#define NGX_HTTP_V2_MAX_WINDOW           ((1U << 31) - 1)
+#define NGX_HTTP_V2_DEFAULT_WINDOW       65535
+
+#define NGX_HTTP_V2_TABLE_SIZE           4096
+#define NGX_HTTP_V2_TABLE_ENTRY_SIZE     32
+
+#define NGX_HTTP_V2_DEFAULT_WEIGHT       16
+#define NGX_HTTP_V2_MAX_WEIGHT           256
+
+/* frame types */
+#define NGX_HTTP_V2_DATA_FRAME           0x0
+#define NGX_HTTP_V2_HEADERS_FRAME        0x1
+#define NGX_HTTP_V2_PRIORITY_FRAME       0x2
+#define NGX_HTTP_V2_RST_STREAM_FRAME     0x3
+#define NGX_HTTP_V2_SETTINGS_FRAME       0x4
+#define NGX_HTTP_V2_PUSH_PROMISE_FRAME   0x5
+#define NGX_HTTP_V2_PING_FRAME           0x6
+#define NGX_HTTP_V2_GOAWAY_FRAME         0x7
+#define NGX_HTTP_V2_WINDOW_UPDATE_FRAME  0x8
+#define NGX_HTTP_V2_CONTINUATION_FRAME   0x9
+
+/* frame flags */
+#define NGX_HTTP_V2_NO_FLAG              0x00
+#define NGX_HTTP_V2_ACK_FLAG             0x01
+#define NGX_HTTP_V2_END_STREAM_FLAG      0x01
+#define NGX_HTTP_V2_END_HEADERS_FLAG     0x04
+#define NGX_HTTP_V2_PADDED_FLAG          0x08
+#define NGX_HTTP_V2_PRIORITY_FLAG        0x20
+
+/* errors */
+#define NGX_HTTP_V2_NO_ERROR             0x0
+#define NGX_HTTP_V2_PROTOCOL_ERROR       0x1
+#define NGX_HTTP_V2_INTERNAL_ERROR       0x2
+#define NGX_HTTP_V2_FLOW_CTRL_ERROR      0x3
+#define NGX_HTTP_V2_SETTINGS_TIMEOUT     0x4
+#define NGX_HTTP_V2_STREAM_CLOSED        0x5
+#define NGX_HTTP_V2_SIZE_ERROR           0x6
+#define NGX_HTTP_V2_REFUSED_STREAM       0x7
+#define NGX_HTTP_V2_CANCEL               0x8
+#define NGX_HTTP_V2_COMP_ERROR           0x9
+#define NGX_HTTP_V2_CONNECT_ERROR        0xa
+#define NGX_HTTP_V2_ENHANCE_YOUR_CALM    0xb
+#define NGX_HTTP_V2_INADEQUATE_SECURITY  0xc
+#define NGX_HTTP_V2_HTTP_1_1_REQUIRED    0xd
+
+/* the bit of c->buffered of a stream fake connection */
+#define NGX_HTTP_V2_BUFFERED             0x02
+
+
+typedef struct ngx_http_v2_connection_s   ngx_http_v2_connection_t;
+typedef struct ngx_http_v2_out_frame_s    ngx_http_v2_out_frame_t;
+
+
+typedef ngx_int_t (*ngx_http_v2_frame_handler_pt)(
+    ngx_http_v2_connection_t *h2c, ngx_http_v2_out_frame_t *frame);
+
+
+typedef struct {
+    size_t                           recv_buffer_size;
+    ngx_uint_t                       concurrent_streams;
+    size_t                           max_field_size;
+    size_t                           max_header_size;
+    size_t                           preread_size;
+    size_t                           chunk_size;
+    ngx_msec_t                       recv_timeout;
+    ngx_msec_t                       idle_timeout;
+} ngx_http_v2_srv_conf_t;
+
+
+typedef struct {
+    ngx_str_t                        name;
+    ngx_str_t                        value;
+} ngx_http_v2_header_t;
+
+
+typedef struct {
+    ngx_http_v2_header_t           **entries;
+    ngx_uint_t                       allocated;
+    ngx_uint_t                       added;
+    ngx_uint_t                       deleted;
+    size_t                           size;
+    size_t                           max;
+} ngx_http_v2_hpack_t;
+
+
+struct ngx_http_v2_connection_s {
+    ngx_connection_t                *connection;
+    ngx_http_connection_t           *http_connection;
+
+    /* the configuration of the default or the SNI matched server */
+    void                           **main_conf;
+    void                           **srv_conf;
+    void                           **loc_conf;
+
+    ngx_http_virtual_names_t        *virtual_names;
+
+    ngx_uint_t                       processing;
+
+    size_t                           send_window;
+    size_t                           recv_window;
+    size_t                           init_window;
+
+    size_t                           frame_size;
+
+    ngx_queue_t                      waiting;
+
+    ngx_http_v2_stream_t           **streams_index;
+    ngx_queue_t                      dependencies;
+
+    ngx_http_v2_out_frame_t         *last_out;
+    ngx_http_v2_out_frame_t         *free_frames;
+    ngx_connection_t                *free_fake_connections;
+
+    ngx_http_v2_hpack_t              hpack;
+
+    u_char                          *buffer;
+    u_char                          *pos;
+    u_char                          *last;
+
+    /* the header block being collected from HEADERS and CONTINUATION */
+    u_char                          *hblock;
+    size_t                           hblock_len;
+    ngx_uint_t                       hblock_sid;
+    ngx_uint_t                       hblock_flags;
+    ngx_uint_t                       hblock_depend;
+    ngx_uint_t                       hblock_weight;
+    unsigned                         hblock_exclusive:1;
+    unsigned                         hblock_priority:1;
+    unsigned                         hblock_new:1;
+
+    ngx_uint_t                       last_sid;
+
+    unsigned                         preface:1;
+    unsigned                         settings_ack:1;
+    unsigned                         blocked:1;
+    unsigned                         goaway:1;
+};
+
+
+struct ngx_http_v2_stream_s {
+    ngx_http_request_t              *request;
+    ngx_http_v2_connection_t        *connection;
+
+    ngx_uint_t                       id;
+    ngx_http_v2_stream_t            *index;
+
+    /* the dependency tree, the root streams are on h2c->dependencies */
+    ngx_http_v2_stream_t            *parent;
+    ngx_queue_t                      children;
+    ngx_queue_t                      queue;
+    ngx_uint_t                       weight;
+    ngx_uint_t                       rank;
+    float                            rel_weight;
+
+    ssize_t                          send_window;
+    size_t                           recv_window;
+
+    ngx_buf_t                       *preread;
+    ngx_http_client_body_handler_pt  post_handler;
+
+    ngx_uint_t                       queued;
+    ngx_http_v2_out_frame_t         *free_frames;
+
+    /* the buffer partially cut into DATA frames by ngx_http_v2_send_chain() */
+    ngx_buf_t                       *framed;
+    u_char                          *framed_pos;
+
+    /* streams waiting for the connection window */
+    ngx_queue_t                      waiting;
+
+    unsigned                         in_closed:1;
+    unsigned                         out_closed:1;
+    unsigned                         skip_data:1;
+    unsigned                         exhausted:1;
+    unsigned                         in_waiting:1;
+    unsigned                         rst_sent:1;
+};
+
+
+struct ngx_http_v2_out_frame_s {
+    ngx_http_v2_out_frame_t         *next;
+    ngx_chain_t                     *first;
+    ngx_chain_t                     *last;
+    ngx_http_v2_frame_handler_pt     handler;
+
+    ngx_http_v2_stream_t            *stream;
+    size_t                           length;
+
+    unsigned                         blocked:1;
+    unsigned                         fin:1;
+};
+
+
+void ngx_http_v2_init(ngx_event_t *rev);
+
+ngx_int_t ngx_http_v2_read_request_body(ngx_http_request_t *r,
+    ngx_http_client_body_handler_pt post_handler);
+
+void ngx_http_v2_close_stream(ngx_http_v2_stream_t *stream, ngx_int_t rc);
+
+void ngx_http_v2_queue_frame(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_out_frame_t *frame);
+ngx_int_t ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c);
+ngx_int_t ngx_http_v2_frame_handler(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_out_frame_t *frame);
+
+ngx_int_t ngx_http_v2_get_indexed_header(ngx_http_v2_connection_t *h2c,
+    ngx_uint_t index, ngx_uint_t name_only, ngx_str_t *name,
+    ngx_str_t *value);
+ngx_int_t ngx_http_v2_add_header(ngx_http_v2_connection_t *h2c,
+    ngx_str_t *name, ngx_str_t *value);
+ngx_int_t ngx_http_v2_table_size(ngx_http_v2_connection_t *h2c, size_t size);
+void ngx_http_v2_table_cleanup(void *data);
+
+ngx_int_t ngx_http_v2_huff_decode(u_char *src, size_t len, u_char *dst,
+    size_t *size, ngx_log_t *log);
+
+
+#define ngx_http_v2_parse_uint16(p)  ((p)[0] << 8 | (p)[1])
+#define ngx_http_v2_parse_uint32(p)                                           \
+    ((uint32_t) (p)[0] << 24 | (p)[1] << 16 | (p)[2] << 8 | (p)[3])
+
+#define ngx_http_v2_write_uint16(p, s)                                        \
+    ((p)[0] = (u_char) ((s) >> 8), (p)[1] = (u_char) (s), (p) + 2)
+#define ngx_http_v2_write_uint32(p, s)                                        \
+    ((p)[0] = (u_char) ((s) >> 24), (p)[1] = (u_char) ((s) >> 16),           \
+     (p)[2] = (u_char) ((s) >> 8), (p)[3] = (u_char) (s), (p) + 4)
+
+#define ngx_http_v2_write_len_and_type(p, l, t)                               \
+    ngx_http_v2_write_uint32(p, (l) << 8 | (t))
+
+#define ngx_http_v2_write_sid  ngx_http_v2_write_uint32
+
+
+extern ngx_module_t  ngx_http_v2_module;
+
+
+#endif /* _NGX_HTTP_V2_H_INCLUDED_ */
@@ -0,0 +1,639 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <nginx.h>
+
+
+/* the indices of the static table, RFC 7541, Appendix A */
+#define NGX_HTTP_V2_STATUS_INDEX          8
+#define NGX_HTTP_V2_STATUS_200_INDEX      8
+#define NGX_HTTP_V2_STATUS_204_INDEX      9
+#define NGX_HTTP_V2_STATUS_206_INDEX      10
+#define NGX_HTTP_V2_STATUS_304_INDEX      11
+#define NGX_HTTP_V2_STATUS_400_INDEX      12
+#define NGX_HTTP_V2_STATUS_404_INDEX      13
+#define NGX_HTTP_V2_STATUS_500_INDEX      14
+
+#define NGX_HTTP_V2_CONTENT_LENGTH_INDEX  28
+#define NGX_HTTP_V2_CONTENT_TYPE_INDEX    31
+#define NGX_HTTP_V2_DATE_INDEX            33
+#define NGX_HTTP_V2_LAST_MODIFIED_INDEX   44
+#define NGX_HTTP_V2_LOCATION_INDEX        46
+#define NGX_HTTP_V2_SERVER_INDEX          54
+#define NGX_HTTP_V2_VARY_INDEX            59
+
+/* the octets of an integer with a prefix that are enough for a field */
+#define NGX_HTTP_V2_INT_OCTETS            4
+
+/* a literal field without indexing with an indexed name */
+#define NGX_HTTP_V2_INDEXED_NAME_LEN      2
+
+
+static u_char *ngx_http_v2_write_int(u_char *pos, ngx_uint_t prefix,
+    ngx_uint_t value);
+static u_char *ngx_http_v2_write_field(u_char *pos, ngx_uint_t index,
+    u_char *value, size_t len);
+static ngx_int_t ngx_http_v2_filter_init(ngx_conf_t *cf);
+
+
+static ngx_http_module_t  ngx_http_v2_filter_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_v2_filter_init,               /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_v2_filter_module = {
+    NGX_MODULE_V1,
+    &ngx_http_v2_filter_module_ctx,        /* module context */
+    NULL,                                  /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
+
+
+static ngx_int_t
+ngx_http_v2_header_filter(ngx_http_request_t *r)
+{
+    u_char                    *p, *block, *end, *start;
+    size_t                     len, size, rest;
+    ngx_str_t                  host, *charset;
+    ngx_buf_t                 *b;
+    ngx_uint_t                 status, index, i, port, type, flags;
+    ngx_chain_t               *cl;
+    ngx_list_part_t           *part;
+    ngx_table_elt_t           *header;
+    ngx_connection_t          *fc;
+    ngx_http_v2_stream_t      *stream;
+    ngx_http_v2_out_frame_t   *frame;
+    ngx_http_v2_connection_t  *h2c;
+    ngx_http_core_loc_conf_t  *clcf;
+    ngx_http_core_srv_conf_t  *cscf;
+    struct sockaddr_in        *sin;
+#if (NGX_HAVE_INET6)
+    struct sockaddr_in6       *sin6;
+#endif
+    u_char                     addr[NGX_SOCKADDR_STRLEN];
+    u_char                     tmp[NGX_OFF_T_LEN
+                                   + sizeof("Mon, 28 Sep 1970 06:00:00 GMT")];
+
+    if (r->stream == NULL) {
+        return ngx_http_next_header_filter(r);
+    }
+
+    if (r->header_sent) {
+        return NGX_OK;
+    }
+
+    r->header_sent = 1;
+
+    fc = r->connection;
+
+    if (fc->error) {
+        return NGX_ERROR;
+    }
+
+    stream = r->stream;
+    h2c = stream->connection;
+
+    if (r->method == NGX_HTTP_HEAD) {
+        r->header_only = 1;
+    }
+
+    status = r->headers_out.status;
+
+    switch (status) {
+
+    case NGX_HTTP_OK:
+        index = NGX_HTTP_V2_STATUS_200_INDEX;
+        break;
+
+    case NGX_HTTP_NO_CONTENT:
+        r->header_only = 1;
+
+        ngx_str_null(&r->headers_out.content_type);
+
+        r->headers_out.content_length = NULL;
+        r->headers_out.content_length_n = -1;
+
+        r->headers_out.last_modified_time = -1;
+        r->headers_out.last_modified = NULL;
+
+        index = NGX_HTTP_V2_STATUS_204_INDEX;
+        break;
+
+    case NGX_HTTP_PARTIAL_CONTENT:
+        index = NGX_HTTP_V2_STATUS_206_INDEX;
+        break;
+
+    case NGX_HTTP_NOT_MODIFIED:
+        r->header_only = 1;
+        index = NGX_HTTP_V2_STATUS_304_INDEX;
+        break;
+
+    default:
+        r->headers_out.last_modified_time = -1;
+        r->headers_out.last_modified = NULL;
+
+        switch (status) {
+
+        case NGX_HTTP_BAD_REQUEST:
+            index = NGX_HTTP_V2_STATUS_400_INDEX;
+            break;
+
+        case NGX_HTTP_NOT_FOUND:
+            index = NGX_HTTP_V2_STATUS_404_INDEX;
+            break;
+
+        case NGX_HTTP_INTERNAL_SERVER_ERROR:
+            index = NGX_HTTP_V2_STATUS_500_INDEX;
+            break;
+
+        default:
+            index = 0;
+        }
+    }
+
+    len = index ? 1 : NGX_HTTP_V2_INDEXED_NAME_LEN + 1 + NGX_INT_T_LEN;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (r->headers_out.server == NULL) {
+        len += NGX_HTTP_V2_INDEXED_NAME_LEN + 1
+               + (clcf->server_tokens ? sizeof(NGINX_VER) - 1
+                                      : sizeof("nginx") - 1);
+    }
+
+    if (r->headers_out.date == NULL) {
+        len += NGX_HTTP_V2_INDEXED_NAME_LEN + 1 + ngx_cached_http_time.len;
+    }
+
+    charset = NULL;
+
+    if (r->headers_out.content_type.len) {
+        len += NGX_HTTP_V2_INDEXED_NAME_LEN + NGX_HTTP_V2_INT_OCTETS
+               + r->headers_out.content_type.len;
+
+        if (r->headers_out.content_type_len == r->headers_out.content_type.len
+            && r->headers_out.charset.len)
+        {
+            charset = &r->headers_out.charset;
+            len += sizeof("; charset=") - 1 + charset->len;
+        }
+    }
+
+    if (r->headers_out.content_length == NULL
+        && r->headers_out.content_length_n >= 0)
+    {
+        len += NGX_HTTP_V2_INDEXED_NAME_LEN + 1 + NGX_OFF_T_LEN;
+    }
+
+    if (r->headers_out.last_modified == NULL
+        && r->headers_out.last_modified_time != -1)
+    {
+        len += NGX_HTTP_V2_INDEXED_NAME_LEN + 1
+               + sizeof("Mon, 28 Sep 1970 06:00:00 GMT") - 1;
+    }
+
+    if (r->headers_out.location
+        && r->headers_out.location->value.len
+        && r->headers_out.location->value.data[0] == '/')
+    {
+        r->headers_out.location->hash = 0;
+
+        if (clcf->server_name_in_redirect) {
+            cscf = ngx_http_get_module_srv_conf(r, ngx_http_core_module);
+            host = cscf->server_name;
+
+        } else if (r->headers_in.server.len) {
+            host = r->headers_in.server;
+
+        } else {
+            host.len = NGX_SOCKADDR_STRLEN;
+            host.data = addr;
+
+            if (ngx_connection_local_sockaddr(fc, &host, 0) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+
+        switch (fc->local_sockaddr->sa_family) {
+
+#if (NGX_HAVE_INET6)
+        case AF_INET6:
+            sin6 = (struct sockaddr_in6 *) fc->local_sockaddr;
+            port = ntohs(sin6->sin6_port);
+            break;
+#endif
+#if (NGX_HAVE_UNIX_DOMAIN)
+        case AF_UNIX:
+            port = 0;
+            break;
+#endif
+        default: /* AF_INET */
+            sin = (struct sockaddr_in *) fc->local_sockaddr;
+            port = ntohs(sin->sin_port);
+            break;
+        }
+
+        if (clcf->port_in_redirect) {
+
+#if (NGX_HTTP_SSL)
+            if (fc->ssl)
+                port = (port == 443) ? 0 : port;
+            else
+#endif
+                port = (port == 80) ? 0 : port;
+
+        } else {
+            port = 0;
+        }
+
+        len += NGX_HTTP_V2_INDEXED_NAME_LEN + NGX_HTTP_V2_INT_OCTETS
+               + sizeof("https://") - 1 + host.len + sizeof(":65535") - 1
+               + r->headers_out.location->value.len;
+
+    } else {
+        ngx_str_null(&host);
+        port = 0;
+    }
+
+#if (NGX_HTTP_GZIP)
+    if (r->gzip_vary) {
+        if (clcf->gzip_vary) {
+            len += NGX_HTTP_V2_INDEXED_NAME_LEN + 1
+                   + sizeof("Accept-Encoding") - 1;
+
+        } else {
+            r->gzip_vary = 0;
+        }
+    }
+#endif
+
+    part = &r->headers_out.headers.part;
+    header = part->elts;
+
+    for (i = 0; /* void */; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            header = part->elts;
+            i = 0;
+        }
+
+        if (header[i].hash == 0) {
+            continue;
+        }
+
+        len += 1 + NGX_HTTP_V2_INT_OCTETS + header[i].key.len
+               + NGX_HTTP_V2_INT_OCTETS + header[i].value.len;
+    }
+
+    block = ngx_pnalloc(r->pool, len);
+    if (block == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = block;
+
+    if (index) {
+        *p++ = (u_char) (0x80 | index);
+
+    } else {
+        start = ngx_sprintf(tmp, "%03ui", status);
+        p = ngx_http_v2_write_field(p, NGX_HTTP_V2_STATUS_INDEX, tmp,
+                                    start - tmp);
+    }
+
+    if (r->headers_out.server == NULL) {
+        if (clcf->server_tokens) {
+            p = ngx_http_v2_write_field(p, NGX_HTTP_V2_SERVER_INDEX,
+                                        (u_char *) NGINX_VER,
+                                        sizeof(NGINX_VER) - 1);
+
+        } else {
+            p = ngx_http_v2_write_field(p, NGX_HTTP_V2_SERVER_INDEX,
+                                        (u_char *) "nginx",
+                                        sizeof("nginx") - 1);
+        }
+    }
+
+    if (r->headers_out.date == NULL) {
+        p = ngx_http_v2_write_field(p, NGX_HTTP_V2_DATE_INDEX,
+                                    ngx_cached_http_time.data,
+                                    ngx_cached_http_time.len);
+    }
+
+    if (r->headers_out.content_type.len) {
+        size = r->headers_out.content_type.len;
+
+        if (charset) {
+            size += sizeof("; charset=") - 1 + charset->len;
+        }
+
+        *p = 0;
+        p = ngx_http_v2_write_int(p, 0x0f, NGX_HTTP_V2_CONTENT_TYPE_INDEX);
+        *p = 0;
+        p = ngx_http_v2_write_int(p, 0x7f, size);
+
+        start = p;
+
+        p = ngx_cpymem(p, r->headers_out.content_type.data,
+                       r->headers_out.content_type.len);
+
+        if (charset) {
+            p = ngx_cpymem(p, "; charset=", sizeof("; charset=") - 1);
+            p = ngx_cpymem(p, charset->data, charset->len);
+
+            /* update r->headers_out.content_type for possible logging */
+
+            r->headers_out.content_type.len = p - start;
+            r->headers_out.content_type.data = start;
+        }
+    }
+
+    if (r->headers_out.content_length == NULL
+        && r->headers_out.content_length_n >= 0)
+    {
+        start = ngx_sprintf(tmp, "%O", r->headers_out.content_length_n);
+        p = ngx_http_v2_write_field(p, NGX_HTTP_V2_CONTENT_LENGTH_INDEX,
+                                    tmp, start - tmp);
+    }
+
+    if (r->headers_out.last_modified == NULL
+        && r->headers_out.last_modified_time != -1)
+    {
+        start = ngx_http_time(tmp, r->headers_out.last_modified_time);
+        p = ngx_http_v2_write_field(p, NGX_HTTP_V2_LAST_MODIFIED_INDEX,
+                                    tmp, start - tmp);
+    }
+
+    if (host.data) {
+        size = sizeof("http://") - 1 + host.len
+               + r->headers_out.location->value.len;
+
+#if (NGX_HTTP_SSL)
+        if (fc->ssl) {
+            size++;
+        }
+#endif
+
+        if (port) {
+            end = ngx_sprintf(tmp, ":%ui", port);
+            size += end - tmp;
+
+        } else {
+            end = tmp;
+        }
+
+        *p = 0;
+        p = ngx_http_v2_write_int(p, 0x0f, NGX_HTTP_V2_LOCATION_INDEX);
+        *p = 0;
+        p = ngx_http_v2_write_int(p, 0x7f, size);
+
+        start = p;
+
+        p = ngx_cpymem(p, "http", sizeof("http") - 1);
+
+#if (NGX_HTTP_SSL)
+        if (fc->ssl) {
+            *p++ = 's';
+        }
+#endif
+
+        *p++ = ':'; *p++ = '/'; *p++ = '/';
+        p = ngx_copy(p, host.data, host.len);
+        p = ngx_copy(p, tmp, end - tmp);
+        p = ngx_copy(p, r->headers_out.location->value.data,
+                     r->headers_out.location->value.len);
+
+        /* update r->headers_out.location->value for possible logging */
+
+        r->headers_out.location->value.len = p - start;
+        r->headers_out.location->value.data = start;
+        ngx_str_set(&r->headers_out.location->key, "Location");
+    }
+
+#if (NGX_HTTP_GZIP)
+    if (r->gzip_vary) {
+        p = ngx_http_v2_write_field(p, NGX_HTTP_V2_VARY_INDEX,
+                                    (u_char *) "Accept-Encoding",
+                                    sizeof("Accept-Encoding") - 1);
+    }
+#endif
+
+    part = &r->headers_out.headers.part;
+    header = part->elts;
+
+    for (i = 0; /* void */; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            header = part->elts;
+            i = 0;
+        }
+
+        if (header[i].hash == 0) {
+            continue;
+        }
+
+        /* the connection specific headers are not sent, RFC 7540, 8.1.2.2 */
+
+        if ((header[i].key.len == sizeof("Connection") - 1
+             && ngx_strncasecmp(header[i].key.data, (u_char *) "Connection",
+                                sizeof("Connection") - 1) == 0)
+            || (header[i].key.len == sizeof("Keep-Alive") - 1
+                && ngx_strncasecmp(header[i].key.data, (u_char *) "Keep-Alive",
+                                   sizeof("Keep-Alive") - 1) == 0)
+            || (header[i].key.len == sizeof("Proxy-Connection") - 1
+                && ngx_strncasecmp(header[i].key.data,
+                                   (u_char *) "Proxy-Connection",
+                                   sizeof("Proxy-Connection") - 1) == 0)
+            || (header[i].key.len == sizeof("Transfer-Encoding") - 1
+                && ngx_strncasecmp(header[i].key.data,
+                                   (u_char *) "Transfer-Encoding",
+                                   sizeof("Transfer-Encoding") - 1) == 0)
+            || (header[i].key.len == sizeof("Upgrade") - 1
+                && ngx_strncasecmp(header[i].key.data, (u_char *) "Upgrade",
+                                   sizeof("Upgrade") - 1) == 0))
+        {
+            continue;
+        }
+
+        /* a literal field without indexing with a lowercased new name */
+
+        *p++ = 0;
+
+        *p = 0;
+        p = ngx_http_v2_write_int(p, 0x7f, header[i].key.len);
+
+        ngx_strlow(p, header[i].key.data, header[i].key.len);
+        p += header[i].key.len;
+
+        *p = 0;
+        p = ngx_http_v2_write_int(p, 0x7f, header[i].value.len);
+        p = ngx_copy(p, header[i].value.data, header[i].value.len);
+    }
+
+    len = p - block;
+
+    r->header_size = len;
+
+    /* the block is cut into a HEADERS frame and CONTINUATION frames */
+
+    b = ngx_create_temp_buf(r->pool, len + (len / h2c->frame_size + 1)
+                                           * NGX_HTTP_V2_FRAME_HEADER_SIZE);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    type = NGX_HTTP_V2_HEADERS_FRAME;
+    flags = r->header_only ? NGX_HTTP_V2_END_STREAM_FLAG : NGX_HTTP_V2_NO_FLAG;
+
+    start = block;
+
+    for ( ;; ) {
+        rest = p - start;
+        size = ngx_min(rest, h2c->frame_size);
+
+        if (size == rest) {
+            flags |= NGX_HTTP_V2_END_HEADERS_FLAG;
+        }
+
+        b->last = ngx_http_v2_write_len_and_type(b->last, size, type);
+        *b->last++ = (u_char) flags;
+        b->last = ngx_http_v2_write_sid(b->last, stream->id);
+
+        b->last = ngx_cpymem(b->last, start, size);
+        start += size;
+
+        if (start == p) {
+            break;
+        }
+
+        type = NGX_HTTP_V2_CONTINUATION_FRAME;
+        flags = NGX_HTTP_V2_NO_FLAG;
+    }
+
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    cl->buf = b;
+    cl->next = NULL;
+
+    frame = ngx_palloc(r->pool, sizeof(ngx_http_v2_out_frame_t));
+    if (frame == NULL) {
+        return NGX_ERROR;
+    }
+
+    frame->next = NULL;
+    frame->first = cl;
+    frame->last = cl;
+    frame->handler = ngx_http_v2_frame_handler;
+    frame->stream = stream;
+    frame->length = b->last - b->pos - NGX_HTTP_V2_FRAME_HEADER_SIZE;
+    frame->blocked = 0;
+    frame->fin = r->header_only;
+
+    ngx_http_v2_queue_frame(h2c, frame);
+
+    stream->queued++;
+    fc->buffered |= NGX_HTTP_V2_BUFFERED;
+
+    if (r->header_only) {
+        stream->out_closed = 1;
+    }
+
+    if (!h2c->blocked && ngx_http_v2_send_output_queue(h2c) == NGX_ERROR) {
+        fc->error = 1;
+        return NGX_ERROR;
+    }
+
+    if (stream->queued == 0) {
+        fc->buffered &= ~NGX_HTTP_V2_BUFFERED;
+    }
+
+    return NGX_OK;
+}
+
+
+static u_char *
+ngx_http_v2_write_int(u_char *pos, ngx_uint_t prefix, ngx_uint_t value)
+{
+    if (value < prefix) {
+        *pos++ |= value;
+        return pos;
+    }
+
+    *pos++ |= prefix;
+    value -= prefix;
+
+    while (value >= 128) {
+        *pos++ = value % 128 + 128;
+        value /= 128;
+    }
+
+    *pos++ = (u_char) value;
+
+    return pos;
+}
+
+
+/* writes a literal field without indexing with an indexed name */
+
+static u_char *
+ngx_http_v2_write_field(u_char *pos, ngx_uint_t index, u_char *value,
+    size_t len)
+{
+    *pos = 0;
+    pos = ngx_http_v2_write_int(pos, 0x0f, index);
+
+    *pos = 0;
+    pos = ngx_http_v2_write_int(pos, 0x7f, len);
+
+    return ngx_cpymem(pos, value, len);
+}
+
+
+static ngx_int_t
+ngx_http_v2_filter_init(ngx_conf_t *cf)
+{
+    ngx_http_next_header_filter = ngx_http_top_header_filter;
+    ngx_http_top_header_filter = ngx_http_v2_header_filter;
+
+    return NGX_OK;
+}
@@ -0,0 +1,378 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_V2_STATIC_TABLE_ENTRIES                                      \
+    (sizeof(ngx_http_v2_static_table)                                         \
+     / sizeof(ngx_http_v2_header_t))
+
+#define NGX_HTTP_V2_HUFF_MAX_LEN         30
+
+
+static void ngx_http_v2_table_evict(ngx_http_v2_connection_t *h2c,
+    size_t size);
+
+
+static ngx_http_v2_header_t  ngx_http_v2_static_table[] = {
+    { ngx_string(":authority"), ngx_string("") },
+    { ngx_string(":method"), ngx_string("GET") },
+    { ngx_string(":method"), ngx_string("POST") },
+    { ngx_string(":path"), ngx_string("/") },
+    { ngx_string(":path"), ngx_string("/index.html") },
+    { ngx_string(":scheme"), ngx_string("http") },
+    { ngx_string(":scheme"), ngx_string("https") },
+    { ngx_string(":status"), ngx_string("200") },
+    { ngx_string(":status"), ngx_string("204") },
+    { ngx_string(":status"), ngx_string("206") },
+    { ngx_string(":status"), ngx_string("304") },
+    { ngx_string(":status"), ngx_string("400") },
+    { ngx_string(":status"), ngx_string("404") },
+    { ngx_string(":status"), ngx_string("500") },
+    { ngx_string("accept-charset"), ngx_string("") },
+    { ngx_string("accept-encoding"), ngx_string("gzip, deflate") },
+    { ngx_string("accept-language"), ngx_string("") },
+    { ngx_string("accept-ranges"), ngx_string("") },
+    { ngx_string("accept"), ngx_string("") },
+    { ngx_string("access-control-allow-origin"), ngx_string("") },
+    { ngx_string("age"), ngx_string("") },
+    { ngx_string("allow"), ngx_string("") },
+    { ngx_string("authorization"), ngx_string("") },
+    { ngx_string("cache-control"), ngx_string("") },
+    { ngx_string("content-disposition"), ngx_string("") },
+    { ngx_string("content-encoding"), ngx_string("") },
+    { ngx_string("content-language"), ngx_string("") },
+    { ngx_string("content-length"), ngx_string("") },
+    { ngx_string("content-location"), ngx_string("") },
+    { ngx_string("content-range"), ngx_string("") },
+    { ngx_string("content-type"), ngx_string("") },
+    { ngx_string("cookie"), ngx_string("") },
+    { ngx_string("date"), ngx_string("") },
+    { ngx_string("etag"), ngx_string("") },
+    { ngx_string("expect"), ngx_string("") },
+    { ngx_string("expires"), ngx_string("") },
+    { ngx_string("from"), ngx_string("") },
+    { ngx_string("host"), ngx_string("") },
+    { ngx_string("if-match"), ngx_string("") },
+    { ngx_string("if-modified-since"), ngx_string("") },
+    { ngx_string("if-none-match"), ngx_string("") },
+    { ngx_string("if-range"), ngx_string("") },
+    { ngx_string("if-unmodified-since"), ngx_string("") },
+    { ngx_string("last-modified"), ngx_string("") },
+    { ngx_string("link"), ngx_string("") },
+    { ngx_string("location"), ngx_string("") },
+    { ngx_string("max-forwards"), ngx_string("") },
+    { ngx_string("proxy-authenticate"), ngx_string("") },
+    { ngx_string("proxy-authorization"), ngx_string("") },
+    { ngx_string("range"), ngx_string("") },
+    { ngx_string("referer"), ngx_string("") },
+    { ngx_string("refresh"), ngx_string("") },
+    { ngx_string("retry-after"), ngx_string("") },
+    { ngx_string("server"), ngx_string("") },
+    { ngx_string("set-cookie"), ngx_string("") },
+    { ngx_string("strict-transport-security"), ngx_string("") },
+    { ngx_string("transfer-encoding"), ngx_string("") },
+    { ngx_string("user-agent"), ngx_string("") },
+    { ngx_string("vary"), ngx_string("") },
+    { ngx_string("via"), ngx_string("") },
+    { ngx_string("www-authenticate"), ngx_string("") },
+};
+
+
+/*
+ * the Huffman code of RFC 7541 is canonical: the codes of the same length
+ * are consecutive numbers ordered by the symbol, so a code is decoded
+ * by the first code and the number of the codes of its length
+ */
+
+static const uint32_t  ngx_http_v2_huff_first[] = {
+             0,          0,          0,          0,          0,          0,
+            20,         92,        248,          0,       1016,       2042,
+          4090,       8184,      16380,      32764,          0,          0,
+             0,     524272,    1048550,    2097116,    4194258,    8388568,
+      16777194,   33554412,   67108832,  134217694,  268435426,          0,
+    1073741820
+};
+
+static const u_char  ngx_http_v2_huff_count[] = {
+      0,   0,   0,   0,   0,  10,  26,  32,   6,   0,   5,   3,
+      2,   6,   2,   3,   0,   0,   0,   3,   8,  13,  26,  29,
+     12,   4,  15,  19,  29,   0,   4
+};
+
+static const uint16_t  ngx_http_v2_huff_offset[] = {
+      0,   0,   0,   0,   0,   0,  10,  36,  68,   0,  74,  79,
+     82,  84,  90,  92,   0,   0,   0,  95,  98, 106, 119, 145,
+    174, 186, 190, 205, 224,   0, 253
+};
+
+static const uint16_t  ngx_http_v2_huff_symbols[] = {
+     48,  49,  50,  97,  99, 101, 105, 111, 115, 116,  32,  37,
+     45,  46,  47,  51,  52,  53,  54,  55,  56,  57,  61,  65,
+     95,  98, 100, 102, 103, 104, 108, 109, 110, 112, 114, 117,
+     58,  66,  67,  68,  69,  70,  71,  72,  73,  74,  75,  76,
+     77,  78,  79,  80,  81,  82,  83,  84,  85,  86,  87,  89,
+    106, 107, 113, 118, 119, 120, 121, 122,  38,  42,  44,  59,
+     88,  90,  33,  34,  40,  41,  63,  39,  43, 124,  35,  62,
+      0,  36,  64,  91,  93, 126,  94, 125,  60,  96, 123,  92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161,
+    167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+    132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170,
+    173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233,   1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150,
+    151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182,
+    183, 188, 191, 197, 231, 239,   9, 142, 144, 145, 148, 159,
+    171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243,
+    255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245,
+    246, 247, 248, 250, 251, 252, 253, 254,   2,   3,   4,   5,
+      6,   7,   8,  11,  12,  14,  15,  16,  17,  18,  19,  20,
+     21,  23,  24,  25,  26,  27,  28,  29,  30,  31, 127, 220,
+    249,  10,  13,  22, 256
+};
+
+
+ngx_int_t
+ngx_http_v2_get_indexed_header(ngx_http_v2_connection_t *h2c,
+    ngx_uint_t index, ngx_uint_t name_only, ngx_str_t *name, ngx_str_t *value)
+{
+    ngx_http_v2_header_t  *entry;
+
+    if (index == 0) {
+        goto invalid;
+    }
+
+    index--;
+
+    if (index < NGX_HTTP_V2_STATIC_TABLE_ENTRIES) {
+        entry = &ngx_http_v2_static_table[index];
+
+    } else {
+        index -= NGX_HTTP_V2_STATIC_TABLE_ENTRIES;
+
+        if (index >= h2c->hpack.added - h2c->hpack.deleted) {
+            goto invalid;
+        }
+
+        /* the most recently added entry has the lowest index */
+
+        entry = h2c->hpack.entries[(h2c->hpack.added - index - 1)
+                                   % h2c->hpack.allocated];
+    }
+
+    *name = entry->name;
+
+    if (!name_only) {
+        *value = entry->value;
+    }
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                  "client sent out of bound hpack table index: %ui", index);
+
+    return NGX_ERROR;
+}
+
+
+ngx_int_t
+ngx_http_v2_add_header(ngx_http_v2_connection_t *h2c, ngx_str_t *name,
+    ngx_str_t *value)
+{
+    size_t                  size;
+    ngx_uint_t              i;
+    ngx_http_v2_header_t   *entry;
+    ngx_http_v2_hpack_t    *hpack;
+
+    hpack = &h2c->hpack;
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 table add: \"%V: %V\" size:%uz/%uz",
+                   name, value, hpack->size, hpack->max);
+
+    size = name->len + value->len + NGX_HTTP_V2_TABLE_ENTRY_SIZE;
+
+    if (size > hpack->max) {
+
+        /* an entry larger than the table empties it and is not added */
+
+        ngx_http_v2_table_evict(h2c, hpack->max);
+        return NGX_OK;
+    }
+
+    if (hpack->entries == NULL) {
+        hpack->allocated = NGX_HTTP_V2_TABLE_SIZE
+                           / NGX_HTTP_V2_TABLE_ENTRY_SIZE;
+
+        hpack->entries = ngx_alloc(sizeof(ngx_http_v2_header_t *)
+                                   * hpack->allocated, h2c->connection->log);
+        if (hpack->entries == NULL) {
+            return NGX_ERROR;
+        }
+
+        for (i = 0; i < hpack->allocated; i++) {
+            hpack->entries[i] = NULL;
+        }
+    }
+
+    ngx_http_v2_table_evict(h2c, size);
+
+    entry = ngx_alloc(sizeof(ngx_http_v2_header_t) + name->len + value->len,
+                      h2c->connection->log);
+    if (entry == NULL) {
+        return NGX_ERROR;
+    }
+
+    entry->name.len = name->len;
+    entry->name.data = (u_char *) entry + sizeof(ngx_http_v2_header_t);
+    ngx_memcpy(entry->name.data, name->data, name->len);
+
+    entry->value.len = value->len;
+    entry->value.data = entry->name.data + name->len;
+    ngx_memcpy(entry->value.data, value->data, value->len);
+
+    hpack->entries[hpack->added++ % hpack->allocated] = entry;
+    hpack->size += size;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_v2_table_size(ngx_http_v2_connection_t *h2c, size_t size)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 table resize: %uz", size);
+
+    if (size > NGX_HTTP_V2_TABLE_SIZE) {
+        ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                      "client sent invalid table size update: %uz", size);
+
+        return NGX_ERROR;
+    }
+
+    h2c->hpack.max = size;
+
+    ngx_http_v2_table_evict(h2c, 0);
+
+    return NGX_OK;
+}
+
+
+/* evicts the oldest entries until "size" bytes fit into the table */
+
+static void
+ngx_http_v2_table_evict(ngx_http_v2_connection_t *h2c, size_t size)
+{
+    ngx_http_v2_header_t  **entryp;
+    ngx_http_v2_hpack_t    *hpack;
+
+    hpack = &h2c->hpack;
+
+    while (hpack->added != hpack->deleted
+           && hpack->size + size > hpack->max)
+    {
+        entryp = &hpack->entries[hpack->deleted++ % hpack->allocated];
+
+        hpack->size -= (*entryp)->name.len + (*entryp)->value.len
+                       + NGX_HTTP_V2_TABLE_ENTRY_SIZE;
+
+        ngx_free(*entryp);
+        *entryp = NULL;
+    }
+}
+
+
+void
+ngx_http_v2_table_cleanup(void *data)
+{
+    ngx_http_v2_connection_t *h2c = data;
+
+    ngx_uint_t  i;
+
+    if (h2c->hpack.entries == NULL) {
+        return;
+    }
+
+    for (i = 0; i < h2c->hpack.allocated; i++) {
+        if (h2c->hpack.entries[i]) {
+            ngx_free(h2c->hpack.entries[i]);
+        }
+    }
+
+    ngx_free(h2c->hpack.entries);
+    h2c->hpack.entries = NULL;
+}
+
+
+ngx_int_t
+ngx_http_v2_huff_decode(u_char *src, size_t len, u_char *dst, size_t *size,
+    ngx_log_t *log)
+{
+    u_char      *p, *end, ch;
+    uint32_t     code;
+    ngx_uint_t   bits, bit, sym;
+
+    p = dst;
+    end = src + len;
+
+    code = 0;
+    bits = 0;
+
+    while (src < end) {
+        ch = *src++;
+
+        for (bit = 0; bit < 8; bit++) {
+            code = (code << 1) | ((ch >> (7 - bit)) & 1);
+            bits++;
+
+            if (code - ngx_http_v2_huff_first[bits]
+                < ngx_http_v2_huff_count[bits])
+            {
+                sym = ngx_http_v2_huff_symbols[ngx_http_v2_huff_offset[bits]
+                                               + code
+                                               - ngx_http_v2_huff_first[bits]];
+
+                if (sym == 256) {
+                    goto invalid;
+                }
+
+                *p++ = (u_char) sym;
+
+                code = 0;
+                bits = 0;
+
+                continue;
+            }
+
+            if (bits == NGX_HTTP_V2_HUFF_MAX_LEN) {
+                goto invalid;
+            }
+        }
+    }
+
+    /* the padding is shorter than 8 bits and is the prefix of EOS */
+
+    if (bits > 7 || code != (1U << bits) - 1) {
+        goto invalid;
+    }
+
+    *size = p - dst;
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_INFO, log, 0,
+                  "client sent invalid huffman encoded string");
+
+    return NGX_ERROR;
+}
@@ -55,6 +55,11 @@
 #endif
 
 
+#ifndef NGX_HTTP_V2
+#define NGX_HTTP_V2  1
+#endif
+
+
 #ifndef NGX_HTTP_PROXY
 #define NGX_HTTP_PROXY  1
 #endif
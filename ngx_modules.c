@@ -7,6 +7,9 @@
 extern ngx_module_t  ngx_core_module;
 extern ngx_module_t  ngx_errlog_module;
 extern ngx_module_t  ngx_conf_module;
+#if (NGX_THREADS)
+extern ngx_module_t  ngx_thread_pool_module;
+#endif
 extern ngx_module_t  ngx_events_module;
 extern ngx_module_t  ngx_event_core_module;
 extern ngx_module_t  ngx_iocp_module;
@@ -29,16 +32,26 @@ extern ngx_module_t  ngx_http_split_clients_module;
 extern ngx_module_t  ngx_http_referer_module;
 extern ngx_module_t  ngx_http_rewrite_module;
 extern ngx_module_t  ngx_http_ssl_module;
+extern ngx_module_t  ngx_http_v2_module;
 extern ngx_module_t  ngx_http_proxy_module;
 extern ngx_module_t  ngx_http_fastcgi_module;
 extern ngx_module_t  ngx_http_uwsgi_module;
 extern ngx_module_t  ngx_http_scgi_module;
 extern ngx_module_t  ngx_http_memcached_module;
 extern ngx_module_t  ngx_http_empty_gif_module;
+extern ngx_module_t  ngx_http_cache_purge_module;
 extern ngx_module_t  ngx_http_browser_module;
 extern ngx_module_t  ngx_http_upstream_ip_hash_module;
+extern ngx_module_t  ngx_http_upstream_least_conn_module;
+extern ngx_module_t  ngx_http_upstream_ewma_module;
+extern ngx_module_t  ngx_http_upstream_hash_module;
+extern ngx_module_t  ngx_http_upstream_zone_module;
+extern ngx_module_t  ngx_http_upstream_check_module;
+extern ngx_module_t  ngx_http_upstream_conf_module;
+extern ngx_module_t  ngx_http_upstream_keepalive_module;
 extern ngx_module_t  ngx_http_write_filter_module;
 extern ngx_module_t  ngx_http_header_filter_module;
+extern ngx_module_t  ngx_http_v2_filter_module;
 extern ngx_module_t  ngx_http_chunked_filter_module;
 extern ngx_module_t  ngx_http_range_header_filter_module;
 extern ngx_module_t  ngx_http_gzip_filter_module;
@@ -50,11 +63,15 @@ extern ngx_module_t  ngx_http_headers_filter_module;
 extern ngx_module_t  ngx_http_copy_filter_module;
 extern ngx_module_t  ngx_http_range_body_filter_module;
 extern ngx_module_t  ngx_http_not_modified_filter_module;
+extern ngx_module_t  ngx_http_slice_filter_module;
 
 ngx_module_t *ngx_modules[] = {
     &ngx_core_module,
     &ngx_errlog_module,
     &ngx_conf_module,
+#if (NGX_THREADS)
+    &ngx_thread_pool_module,
+#endif
     &ngx_events_module,
     &ngx_event_core_module,
     &ngx_iocp_module,
@@ -77,16 +94,26 @@ ngx_module_t *ngx_modules[] = {
     &ngx_http_referer_module,
     &ngx_http_rewrite_module,
     &ngx_http_ssl_module,
+    &ngx_http_v2_module,
     &ngx_http_proxy_module,
     &ngx_http_fastcgi_module,
     &ngx_http_uwsgi_module,
     &ngx_http_scgi_module,
     &ngx_http_memcached_module,
     &ngx_http_empty_gif_module,
+    &ngx_http_cache_purge_module,
     &ngx_http_browser_module,
     &ngx_http_upstream_ip_hash_module,
+    &ngx_http_upstream_least_conn_module,
+    &ngx_http_upstream_ewma_module,
+    &ngx_http_upstream_hash_module,
+    &ngx_http_upstream_zone_module,
+    &ngx_http_upstream_check_module,
+    &ngx_http_upstream_conf_module,
+    &ngx_http_upstream_keepalive_module,
     &ngx_http_write_filter_module,
     &ngx_http_header_filter_module,
+    &ngx_http_v2_filter_module,
     &ngx_http_chunked_filter_module,
     &ngx_http_range_header_filter_module,
     &ngx_http_gzip_filter_module,
@@ -98,6 +125,7 @@ ngx_module_t *ngx_modules[] = {
     &ngx_http_copy_filter_module,
     &ngx_http_range_body_filter_module,
     &ngx_http_not_modified_filter_module,
+    &ngx_http_slice_filter_module,
     NULL
 };
 
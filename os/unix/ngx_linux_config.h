@@ -101,6 +101,11 @@ typedef struct iocb  ngx_aiocb_t;
 #endif
 
 
+#if defined SPLICE_F_MOVE && !defined NGX_HAVE_SPLICE
+#define NGX_HAVE_SPLICE  1
+#endif
+
+
 #ifndef NGX_HAVE_SO_SNDLOWAT
 /* setsockopt(SO_SNDLOWAT) returns ENOPROTOOPT */
 #define NGX_HAVE_SO_SNDLOWAT         0
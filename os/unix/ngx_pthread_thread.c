@@ -275,3 +275,114 @@ ngx_cond_signal(ngx_cond_t *cv)
 
     return NGX_OK;
 }
+
+
+ngx_int_t
+ngx_thread_mutex_create(ngx_thread_mutex_t *mtx, ngx_log_t *log)
+{
+    int  err;
+
+    err = pthread_mutex_init(mtx, NULL);
+
+    if (err != 0) {
+        ngx_log_error(NGX_LOG_ALERT, log, err, "pthread_mutex_init() failed");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_thread_mutex_destroy(ngx_thread_mutex_t *mtx)
+{
+    (void) pthread_mutex_destroy(mtx);
+}
+
+
+/*
+ * the semaphores are made of a mutex and a condition variable,
+ * as the unnamed POSIX semaphores are not supported everywhere
+ */
+
+ngx_int_t
+ngx_thread_sem_create(ngx_thread_sem_t *sem, ngx_log_t *log)
+{
+    int  err;
+
+    sem->count = 0;
+
+    err = pthread_mutex_init(&sem->mutex, NULL);
+
+    if (err != 0) {
+        ngx_log_error(NGX_LOG_ALERT, log, err, "pthread_mutex_init() failed");
+        return NGX_ERROR;
+    }
+
+    err = pthread_cond_init(&sem->cond, NULL);
+
+    if (err != 0) {
+        ngx_log_error(NGX_LOG_ALERT, log, err, "pthread_cond_init() failed");
+        (void) pthread_mutex_destroy(&sem->mutex);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_thread_sem_destroy(ngx_thread_sem_t *sem)
+{
+    (void) pthread_cond_destroy(&sem->cond);
+    (void) pthread_mutex_destroy(&sem->mutex);
+}
+
+
+ngx_int_t
+ngx_thread_sem_wait(ngx_thread_sem_t *sem, ngx_log_t *log)
+{
+    int  err;
+
+    (void) pthread_mutex_lock(&sem->mutex);
+
+    while (sem->count == 0) {
+        err = pthread_cond_wait(&sem->cond, &sem->mutex);
+
+        if (err != 0) {
+            (void) pthread_mutex_unlock(&sem->mutex);
+
+            ngx_log_error(NGX_LOG_ALERT, log, err,
+                          "pthread_cond_wait() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    sem->count--;
+
+    (void) pthread_mutex_unlock(&sem->mutex);
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_thread_sem_post(ngx_thread_sem_t *sem, ngx_log_t *log)
+{
+    int  err;
+
+    (void) pthread_mutex_lock(&sem->mutex);
+
+    sem->count++;
+
+    err = pthread_cond_signal(&sem->cond);
+
+    (void) pthread_mutex_unlock(&sem->mutex);
+
+    if (err != 0) {
+        ngx_log_error(NGX_LOG_ALERT, log, err, "pthread_cond_signal() failed");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
@@ -69,6 +69,28 @@ ngx_int_t ngx_mutex_trylock(ngx_mutex_t *m);
 void ngx_mutex_lock(ngx_mutex_t *m);
 void ngx_mutex_unlock(ngx_mutex_t *m);
 
+
+/* the real locks and semaphores used by the thread pools */
+
+typedef pthread_mutex_t              ngx_thread_mutex_t;
+
+typedef struct {
+    pthread_mutex_t   mutex;
+    pthread_cond_t    cond;
+    ngx_uint_t        count;
+} ngx_thread_sem_t;
+
+
+ngx_int_t ngx_thread_mutex_create(ngx_thread_mutex_t *mtx, ngx_log_t *log);
+void ngx_thread_mutex_destroy(ngx_thread_mutex_t *mtx);
+#define ngx_thread_mutex_lock(mtx)    (void) pthread_mutex_lock(mtx)
+#define ngx_thread_mutex_unlock(mtx)  (void) pthread_mutex_unlock(mtx)
+
+ngx_int_t ngx_thread_sem_create(ngx_thread_sem_t *sem, ngx_log_t *log);
+void ngx_thread_sem_destroy(ngx_thread_sem_t *sem);
+ngx_int_t ngx_thread_sem_wait(ngx_thread_sem_t *sem, ngx_log_t *log);
+ngx_int_t ngx_thread_sem_post(ngx_thread_sem_t *sem, ngx_log_t *log);
+
 #endif
 
 
@@ -96,3 +96,71 @@ ngx_mutex_unlock(ngx_mutex_t *m) {
 }
 
 /**/
+
+
+ngx_int_t
+ngx_thread_mutex_create(ngx_thread_mutex_t *mtx, ngx_log_t *log)
+{
+    if (InitializeCriticalSectionAndSpinCount(mtx, 4000) == 0) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      "InitializeCriticalSectionAndSpinCount() failed");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_thread_mutex_destroy(ngx_thread_mutex_t *mtx)
+{
+    DeleteCriticalSection(mtx);
+}
+
+
+ngx_int_t
+ngx_thread_sem_create(ngx_thread_sem_t *sem, ngx_log_t *log)
+{
+    *sem = CreateSemaphore(NULL, 0, LONG_MAX, NULL);
+
+    if (*sem == NULL) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      "CreateSemaphore() failed");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_thread_sem_destroy(ngx_thread_sem_t *sem)
+{
+    CloseHandle(*sem);
+}
+
+
+ngx_int_t
+ngx_thread_sem_wait(ngx_thread_sem_t *sem, ngx_log_t *log)
+{
+    if (WaitForSingleObject(*sem, INFINITE) != WAIT_OBJECT_0) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      "WaitForSingleObject() failed");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_thread_sem_post(ngx_thread_sem_t *sem, ngx_log_t *log)
+{
+    if (ReleaseSemaphore(*sem, 1, NULL) == 0) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      "ReleaseSemaphore() failed");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
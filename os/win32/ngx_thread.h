@@ -52,6 +52,23 @@ void ngx_mutex_unlock(ngx_mutex_t *m);
 /**/
 
 
+/* the real locks and semaphores used by the thread pools */
+
+typedef CRITICAL_SECTION  ngx_thread_mutex_t;
+typedef HANDLE            ngx_thread_sem_t;
+
+
+ngx_int_t ngx_thread_mutex_create(ngx_thread_mutex_t *mtx, ngx_log_t *log);
+void ngx_thread_mutex_destroy(ngx_thread_mutex_t *mtx);
+#define ngx_thread_mutex_lock        EnterCriticalSection
+#define ngx_thread_mutex_unlock      LeaveCriticalSection
+
+ngx_int_t ngx_thread_sem_create(ngx_thread_sem_t *sem, ngx_log_t *log);
+void ngx_thread_sem_destroy(ngx_thread_sem_t *sem);
+ngx_int_t ngx_thread_sem_wait(ngx_thread_sem_t *sem, ngx_log_t *log);
+ngx_int_t ngx_thread_sem_post(ngx_thread_sem_t *sem, ngx_log_t *log);
+
+
 extern ngx_int_t  ngx_threads_n;
 
 